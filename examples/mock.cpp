@@ -72,7 +72,7 @@ ProxyConnector<BUFFER, NetProvider>::customHandler() {
                 int size = createMessage(sync, 85, &data);
                 sendEncodedToClient(size);
             }
-            
+            skipLastDecodedMessage(message.size);
         } else {
             std::abort();
         }
@@ -0,0 +1,242 @@
+#include "../src/Client/ProxyConnector.hpp"
+#include "../src/Buffer/Buffer.hpp"
+
+#include <csignal>
+#include <iostream>
+
+using Buf_t = tnt::Buffer<16 * 1024>;
+
+struct KeyTuple  {
+    uint64_t key;
+
+	static constexpr auto mpp = std::make_tuple(&KeyTuple::key);
+};
+
+/**
+ * Shard SELECTs by the first key part and SQL statements on table USERS
+ * by its column ID, other requests go to instance 0.
+ */
+struct SelectShardSpec {
+    static constexpr size_t BUCKET_COUNT = 1024;
+
+    template<class BUFFER>
+    static std::optional<uint64_t> shardKey(Message<BUFFER> &message) {
+        if (message.header.code != Iproto::SELECT || !message.body.keys)
+            return std::nullopt;
+        KeyTuple key_tuple;
+        if (!message.body.keys->decode(key_tuple))
+            return std::nullopt;
+        return key_tuple.key;
+    }
+
+    static std::optional<std::string> shardColumn(const std::string &table) {
+        if (table == "USERS")
+            return "ID";
+        return std::nullopt;
+    }
+};
+
+/** Calls of these functions are sent to all instances, arrays are merged. */
+struct ScanAllSpec {
+    using Reducer = ConcatReducer;
+
+    static bool isFanOut(const std::string &function_name) {
+        return function_name == "scan" || function_name == "find_by_name";
+    }
+};
+
+/** Counters are summed up over all instances. */
+struct CountAllSpec {
+    using Reducer = SumReducer<uint64_t>;
+
+    static bool isFanOut(const std::string &function_name) {
+        return function_name == "count";
+    }
+};
+
+/** Writes to the event log are applied by batch_apply() in batches. */
+struct EventLogBatchSpec {
+    static constexpr size_t BATCH_MAX = 128;
+    static constexpr const char *FUNCTION = "batch_apply";
+
+    static bool isBatched(uint32_t space_id) {
+        return space_id == 513;
+    }
+};
+
+/**
+ * Nightly exports read whole spaces: their traffic is spliced to the
+ * first instance once it accepts AUTH, bypassing routing.
+ */
+struct ExportTunnelSpec {
+    static constexpr int INSTANCE = 0;
+
+    static bool isTunneled(const std::string &user) {
+        return user == "exporter";
+    }
+};
+
+/** Answer PINGs right in the proxy. */
+struct PingStage {
+    template<class Proxy, class BUFFER>
+    StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+                       PipelineContext &ctx) {
+        if (!ctx.from_client || message.header.code != Iproto::PING)
+            return STAGE_NEXT;
+        int size = proxy.createMessage(message.header.sync, 0);
+        proxy.sendEncodedToClient(size);
+        proxy.skipLastDecodedMessage(message.size);
+        return STAGE_DONE;
+    }
+};
+
+/**
+ * Shard router (of SQL statements too) controlled by CALLs of the
+ * resharding tool:
+ * proxy_move_bucket(bucket, instance) starts migration of a bucket,
+ * proxy_finish_moves() switches buckets once their data is copied and
+ * proxy_reshard_stats() returns progress as
+ * {moving, moved, dual writes, dual write errors, reads fallen back}.
+ */
+struct ReshardRouter : SqlShardRouter<SelectShardSpec> {
+    using Base = SqlShardRouter<SelectShardSpec>;
+
+    template<class Proxy, class BUFFER>
+    StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+                       PipelineContext &ctx) {
+        if (!ctx.from_client || message.header.code != Iproto::CALL ||
+            !message.body.function_name ||
+            message.body.function_name->rfind("proxy_", 0) != 0)
+            return Base::handle(proxy, message, ctx);
+        const std::string &func = *message.body.function_name;
+        std::vector<size_t> result;
+        if (func == "proxy_move_bucket") {
+            std::tuple<size_t, int> args;
+            if (!message.body.tuple || !message.body.tuple->decode(args) ||
+                std::get<0>(args) >= BUCKET_COUNT)
+                return STAGE_ERR;
+            result.push_back(startMove(std::get<0>(args),
+                                       std::get<1>(args)) == 0);
+        } else if (func == "proxy_finish_moves") {
+            finishMoves();
+        } else if (func == "proxy_reshard_stats") {
+            result = {movingCount(), moved_count, dual_write_count,
+                      dual_write_errors, fallback_count};
+        } else {
+            return Base::handle(proxy, message, ctx);
+        }
+        int size = proxy.createMessage(message.header.sync, 0, &result);
+        proxy.sendEncodedToClient(size);
+        proxy.skipLastDecodedMessage(message.size);
+        return STAGE_DONE;
+    }
+};
+
+/**
+ * Space 520 of events keyed by timestamp is split by year: 2024 and older
+ * are on the first instance, newer on the second, so that scans of recent
+ * events never touch the archive.
+ */
+struct EventRanges : RangeRouter {
+    EventRanges() {
+        setRanges(520, {1735689600}, {0, 1});
+    }
+};
+
+/** Mobile gateways get only id and name of users, not whole profiles. */
+struct MobileProjection : ProjectionStage {
+    MobileProjection() {
+        addRule({512, std::nullopt, "mobile", {0, 1}});
+    }
+};
+
+/**
+ * Space 530 of currency rates is a dictionary read on every request: the
+ * proxy replicates it from the first instance and answers lookups by code
+ * from memory. User "replicator" needs the replication role.
+ */
+struct RatesCache : ReplicaCache {
+    RatesCache() {
+        setMaster({.address = "127.0.0.1", .service = "3301",
+                   .user = "replicator", .passwd = "replicator"});
+        addSpace(530);
+    }
+};
+
+static volatile sig_atomic_t slow_log_requested = 0;
+static ProxyConnector<Buf_t> *running_proxy = nullptr;
+
+/** Print slow requests once SIGUSR1 is received. */
+struct SlowLogStage {
+    template<class Proxy, class BUFFER>
+    StageStatus handle(Proxy &proxy, Message<BUFFER> &,
+                       PipelineContext &) {
+        if (slow_log_requested) {
+            slow_log_requested = 0;
+            proxy.tracer_.dump(std::cerr);
+        }
+        return STAGE_NEXT;
+    }
+};
+
+int main() {
+    /* Messages are written by a background thread off the event loop. */
+    gLogger.startAsync();
+
+    std::vector<ConnectOptions> opts;
+    opts.push_back({.address = "127.0.0.1", .service = "3301", .is_tnt = true});
+    opts.push_back({.address = "127.0.0.1", .service = "3302", .is_tnt = true});
+
+    const std::string addr = "127.0.0.1";
+    uint16_t port = 3304;
+
+    ProxyOptions proxy_opts;
+    proxy_opts.listen_backlog = 4096;
+    proxy_opts.accept_batch = 256;
+    proxy_opts.edge_triggered = true;
+    /* Large SELECT results are streamed instead of being buffered. */
+    proxy_opts.cut_through_size = 1024 * 1024;
+    /* TLS records are encrypted by the kernel if it is supported. */
+    proxy_opts.ktls = true;
+    /* Batch jobs pipelining lots of requests don't stall API clients. */
+    proxy_opts.fair_quantum = 32;
+    proxy_opts.user_weights = {{"api", 4}};
+    /* Trace 1% of requests, keep breakdown of those slower than 5 ms. */
+    proxy_opts.trace_sample_rate = 100;
+    proxy_opts.slow_request_usec = 5000;
+    signal(SIGUSR1, [](int) { slow_log_requested = 1; });
+    /*
+     * No more than 8 CALLs and 16 other requests of ETL jobs are run by
+     * an instance at once, so that PINGs and SELECTs are not queued
+     * behind them.
+     */
+    proxy_opts.qos_in_flight = {0, 8, 16};
+    proxy_opts.qos_type_class = {{Iproto::CALL, 1}};
+    proxy_opts.qos_user_class = {{"etl", 2}};
+
+    ProxyConnector<Buf_t> proxy(opts, addr, port, proxy_opts);
+    /* Application servers on the same host connect via unix socket. */
+    proxy.addListener("/tmp/tntcxx-proxy.sock", "unix");
+    proxy.addListener("::1", "3304");
+#ifdef TNTCXX_ENABLE_SSL
+    /* Remote clients use TLS. */
+    proxy.addListener({.address = "0.0.0.0", .service = "3305",
+                       .transport = STREAM_SSL,
+                       .ssl_cert_file = "proxy.crt",
+                       .ssl_key_file = "proxy.key"});
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+    /* Edge proxies of other datacenters tunnel their clients here. */
+    proxy.addListener({.address = "0.0.0.0", .service = "3306",
+                       .compress_level = 1});
+#endif
+    Pipeline<SlowLogStage, TunnelStage<ExportTunnelSpec>, PingStage,
+             RatesCache, FanOutStage<ScanAllSpec>, FanOutStage<CountAllSpec>,
+             EventRanges, ReshardRouter, BatchWriteStage<EventLogBatchSpec>,
+             MobileProjection, ForwardStage> router;
+
+    /* Ctrl+C makes start() return, so that unix socket is removed. */
+    running_proxy = &proxy;
+    signal(SIGINT, [](int) { running_proxy->stop(); });
+    proxy.start(router);
+}
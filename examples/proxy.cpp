@@ -40,13 +40,11 @@ ProxyConnector<BUFFER, NetProvider>::customHandler() {
             }
             auto &strm = connect(0);
             sendDecodedToStream(strm, message.size);
-            skipLastDecodedMessage(message.size);
             
         } else {
             LOG_ERROR("Message size : ", message.size);
             LOG_ERROR("Header: req: ", message.header.code, ", sync: ", message.header.sync, ", schema: ", message.header.schema_id.value());
             sendDecodedToClient(message.size);
-            skipLastDecodedMessage(message.size);
         }
     }
 }
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/**
+ * Replay of client traffic recorded by the proxy (see
+ * ProxyOptions::capture) against a proxy or Tarantool instance:
+ *
+ * ./replay <capture file> <address> <port> [speed|max] [user] [password]
+ *
+ * Requests of each captured client are sent via a connection of its own,
+ * keeping their relative timing (speed 1 by default, 2 is twice as fast)
+ * or as fast as possible (max). AUTH requests are skipped: their scramble
+ * is bound to the salt of the original greeting, so pass credentials to
+ * authenticate replayed connections instead.
+ */
+#include "../src/Client/Connector.hpp"
+#include "../src/Client/TrafficCapture.hpp"
+#include "../src/Buffer/Buffer.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+
+using Buf_t = tnt::Buffer<16 * 1024>;
+using Net_t = DefaultNetProvider<Buf_t>;
+using Clock_t = std::chrono::steady_clock;
+
+/** Requests sent but not answered yet in max speed mode. */
+static constexpr size_t MAX_IN_FLIGHT = 1024;
+/** Give up on responses after this many milliseconds of silence. */
+static constexpr int DRAIN_TIMEOUT = 1000;
+
+struct ReplayClient {
+	ReplayClient(Connector<Buf_t, Net_t> &connector) : conn(connector) {}
+
+	Connection<Buf_t, Net_t> conn;
+	/** Captured bytes not assembled into whole requests yet. */
+	Buf_t input;
+	bool connected = false;
+};
+
+struct ReplayStats {
+	size_t sent = 0;
+	size_t skipped = 0;
+	size_t received = 0;
+	size_t errors = 0;
+};
+
+/** Count and forget responses received by all clients. */
+static void
+collectResponses(std::map<uint32_t, ReplayClient> &clients, ReplayStats &stats)
+{
+	for (auto &c : clients) {
+		ReplayClient &client = c.second;
+		if (!client.connected)
+			continue;
+		if (client.conn.hasError()) {
+			std::cerr << "Client " << c.first << ": " <<
+				  client.conn.getError().msg << std::endl;
+			client.connected = false;
+			++stats.errors;
+			continue;
+		}
+		stats.received += client.conn.getFutureCount();
+		client.conn.flush();
+	}
+}
+
+/** Send all whole requests captured from @a client. */
+static void
+sendRequests(ReplayClient &client, ReplayStats &stats)
+{
+	Buf_t &input = client.input;
+	while (true) {
+		size_t size;
+		bool is_auth;
+		{
+			MessageDecoder<Buf_t> dec(input);
+			if (!input.has(input.begin(), MP_RESPONSE_SIZE))
+				return;
+			int body_size = dec.decodeMessageSize();
+			if (body_size < 0) {
+				std::cerr << "Malformed request" << std::endl;
+				client.connected = false;
+				return;
+			}
+			size = MP_RESPONSE_SIZE + body_size;
+			if (!input.has(input.begin(), size))
+				return;
+			Message<Buf_t> request;
+			if (dec.decodeHeader(request) != 0) {
+				client.connected = false;
+				return;
+			}
+			is_auth = request.header.code == Iproto::AUTH;
+			if (!is_auth) {
+				struct iovec iov[IOVEC_MAX_SIZE];
+				auto begin = input.begin();
+				size_t iov_cnt = input.getIOV(begin, begin + size,
+							      iov, IOVEC_MAX_SIZE);
+				std::string data;
+				data.reserve(size);
+				for (size_t i = 0; i < iov_cnt; ++i)
+					data.append((const char *) iov[i].iov_base,
+						    iov[i].iov_len);
+				client.conn.sendRaw(data.data(), data.size());
+			}
+		}
+		input.dropFront(size);
+		if (is_auth)
+			++stats.skipped;
+		else
+			++stats.sent;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 4) {
+		std::cerr << "Usage: " << argv[0] << " <capture file> " <<
+			  "<address> <port> [speed|max] [user] [password]" <<
+			  std::endl;
+		return 1;
+	}
+	double speed = 1;
+	if (argc > 4 && std::string(argv[4]) != "max") {
+		speed = std::atof(argv[4]);
+		if (speed <= 0) {
+			std::cerr << "Speed must be positive" << std::endl;
+			return 1;
+		}
+	} else if (argc > 4) {
+		speed = 0;
+	}
+	ConnectOptions opts{.address = argv[2], .service = argv[3]};
+	if (argc > 5)
+		opts.user = argv[5];
+	if (argc > 6)
+		opts.passwd = argv[6];
+
+	CaptureReader reader;
+	if (reader.open(argv[1]) != 0)
+		return 1;
+	if (reader.header().dropped != 0)
+		std::cerr << "Capture misses " << reader.header().dropped <<
+			  " frames" << std::endl;
+
+	Connector<Buf_t, Net_t> connector;
+	std::map<uint32_t, ReplayClient> clients;
+	ReplayStats stats;
+	Clock_t::time_point start = Clock_t::now();
+	CaptureFrame frame;
+	while (reader.next(frame)) {
+		if (frame.direction != CAPTURE_FROM_CLIENT)
+			continue;
+		if (speed > 0) {
+			auto due = start + std::chrono::nanoseconds(
+				(uint64_t) (frame.timestamp / speed));
+			for (auto now = Clock_t::now(); now < due;
+			     now = Clock_t::now()) {
+				auto left = std::chrono::duration_cast<
+					std::chrono::milliseconds>(due - now);
+				if (connector.poll(std::max(1, (int) left.count())) != 0)
+					return 1;
+				collectResponses(clients, stats);
+			}
+		}
+		auto [itr, is_new] = clients.try_emplace(frame.conn_id, connector);
+		ReplayClient &client = itr->second;
+		if (is_new) {
+			client.connected = connector.connect(client.conn, opts) == 0;
+			if (!client.connected)
+				++stats.errors;
+		}
+		if (!client.connected)
+			continue;
+		client.input.write({frame.data, frame.size});
+		sendRequests(client, stats);
+		while (speed == 0 && stats.sent - stats.received > MAX_IN_FLIGHT) {
+			if (connector.poll(1) != 0)
+				return 1;
+			collectResponses(clients, stats);
+		}
+	}
+	/* Wait for the rest of responses. */
+	Clock_t::time_point last_response = Clock_t::now();
+	while (stats.received < stats.sent &&
+	       Clock_t::now() - last_response <
+	       std::chrono::milliseconds(DRAIN_TIMEOUT)) {
+		size_t received = stats.received;
+		if (connector.poll(1) != 0)
+			return 1;
+		collectResponses(clients, stats);
+		if (stats.received != received)
+			last_response = Clock_t::now();
+	}
+	std::chrono::duration<double> elapsed = Clock_t::now() - start;
+	std::cout << "Clients: " << clients.size() <<
+		  ", requests sent: " << stats.sent <<
+		  ", responses: " << stats.received <<
+		  ", AUTH skipped: " << stats.skipped <<
+		  ", failed clients: " << stats.errors << std::endl;
+	std::cout << "Elapsed " << elapsed.count() << " s, " <<
+		  (size_t) (stats.sent / elapsed.count()) << " RPS" << std::endl;
+	return 0;
+}
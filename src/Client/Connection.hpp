@@ -177,6 +177,11 @@ public:
 	template <class T>
 	rid_t call(const std::string &func, const T &args);
 	rid_t ping();
+	/**
+	 * Send requests encoded elsewhere (e.g. replayed from traffic
+	 * capture). Responses are matched by syncs of the requests.
+	 */
+	void sendRaw(const char *data, size_t size);
 	
 	/**
 	 * Execute the SQL statement contained in the 'statement' parameter.
@@ -653,6 +658,14 @@ Connection<BUFFER, NetProvider>::ping()
 	return RequestEncoder<BUFFER>::getSync();
 }
 
+template<class BUFFER, class NetProvider>
+void
+Connection<BUFFER, NetProvider>::sendRaw(const char *data, size_t size)
+{
+	impl->outBuf.write({data, size});
+	impl->connector.readyToSend(*this);
+}
+
 template<class BUFFER, class NetProvider>
 template <class T>
 rid_t
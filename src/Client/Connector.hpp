@@ -82,6 +82,12 @@ public:
 		      size_t feature_count, int timeout = 0);
 	////////////////////////////Service interfaces//////////////////////////
 	std::optional<Connection<BUFFER, NetProvider>> waitAny(int timeout = 0);
+	/**
+	 * Send pending requests and decode responses of all connections
+	 * received within @a timeout milliseconds (must be positive).
+	 * Return 0 on success, -1 if polling failed.
+	 */
+	int poll(int timeout);
 	void readyToDecode(const Connection<BUFFER, NetProvider> &conn);
 	void readyToSend(const Connection<BUFFER, NetProvider> &conn);
 	void finishSend(const Connection<BUFFER, NetProvider> &conn);
@@ -279,6 +285,25 @@ Connector<BUFFER, NetProvider>::waitAny(int timeout)
 	return conn;
 }
 
+template<class BUFFER, class NetProvider>
+int
+Connector<BUFFER, NetProvider>::poll(int timeout)
+{
+	assert(timeout > 0);
+	if (m_NetProvider.wait(timeout) != 0)
+		return -1;
+	for (auto itr = m_ReadyToDecode.begin(); itr != m_ReadyToDecode.end();) {
+		Connection<BUFFER, NetProvider> conn = *itr;
+		if (connectionDecodeResponses(conn, static_cast<Message<BUFFER>*>(nullptr)) != 0)
+			conn.setError("Failed to decode response");
+		if (!hasDataToDecode(conn) || conn.hasError())
+			itr = m_ReadyToDecode.erase(itr);
+		else
+			++itr;
+	}
+	return 0;
+}
+
 template<class BUFFER, class NetProvider>
 int
 Connector<BUFFER, NetProvider>::waitCount(Connection<BUFFER, NetProvider> &conn,
@@ -41,18 +41,25 @@
 #include <cstring>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "Connection.hpp"
 
 template<class BUFFER, class NetProvider>
 class Connector;
 
-template<class BUFFER, class Stream>
+/**
+ * EDGE_TRIGGERED enables EPOLLET: a socket is drained until EAGAIN, but
+ * no more than RECV_BUDGET reads per wakeup. Sockets that still have
+ * data are kept on ready list and read on the next wait() without
+ * waiting for a new epoll event.
+ */
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED = false>
 class EpollNetProvider {
 public:
 	using Buffer_t = BUFFER;
 	using Stream_t = Stream;
-	using NetProvider_t = EpollNetProvider<BUFFER, Stream>;
+	using NetProvider_t = EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>;
 	using Conn_t = Connection<BUFFER, NetProvider_t >;
 	using Connector_t = Connector<BUFFER, NetProvider_t >;
 	EpollNetProvider(Connector_t &connector);
@@ -65,12 +72,17 @@ public:
 private:
 	static constexpr int TIMEOUT_INFINITY = -1;
 	static constexpr size_t EPOLL_EVENTS_MAX = 128;
+	/** Max number of reads from one socket per wakeup. */
+	static constexpr size_t RECV_BUDGET = 16;
+	static constexpr uint32_t EPOLL_MODE = EDGE_TRIGGERED ? (uint32_t) EPOLLET : 0;
 
 	//return 0 if all data from buffer was processed (sent or read);
 	//return -1 in case of errors;
 	//return 1 in case socket is blocked.
 	int send(Conn_t &conn);
 	int recv(Conn_t &conn);
+	/** Read socket until it blocks or budget is spent. */
+	int recvReady(Conn_t &conn);
 
 	void setPollSetting(Conn_t &conn, int setting);
 	void registerEpoll(Conn_t &conn);
@@ -78,10 +90,12 @@ private:
 	/** <socket : connection> map. Contains both ready to read/send connections */
 	Connector_t &m_Connector;
 	int m_EpollFd;
+	/** Connections which spent read budget but may have more data. */
+	std::vector<Conn_t> m_ReadyToRecv;
 };
 
-template<class BUFFER, class Stream>
-EpollNetProvider<BUFFER, Stream>::EpollNetProvider(Connector_t &connector) :
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::EpollNetProvider(Connector_t &connector) :
 	m_Connector(connector)
 {
 	m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
@@ -91,21 +105,21 @@ EpollNetProvider<BUFFER, Stream>::EpollNetProvider(Connector_t &connector) :
 	}
 }
 
-template<class BUFFER, class Stream>
-EpollNetProvider<BUFFER, Stream>::~EpollNetProvider()
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::~EpollNetProvider()
 {
 	::close(m_EpollFd);
 	m_EpollFd = -1;
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 void
-EpollNetProvider<BUFFER, Stream>::registerEpoll(Conn_t &conn)
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::registerEpoll(Conn_t &conn)
 {
 	/* Configure epoll with new socket. */
 	assert(m_EpollFd >= 0);
 	struct epoll_event event;
-	event.events = EPOLLIN;
+	event.events = EPOLLIN | EPOLL_MODE;
 	event.data.ptr = conn.getImpl();
 	if (epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, conn.get_strm().get_fd(),
 		      &event) != 0) {
@@ -116,11 +130,11 @@ EpollNetProvider<BUFFER, Stream>::registerEpoll(Conn_t &conn)
 	}
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 void
-EpollNetProvider<BUFFER, Stream>::setPollSetting(Conn_t &conn, int setting) {
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::setPollSetting(Conn_t &conn, int setting) {
 	struct epoll_event event;
-	event.events = setting;
+	event.events = setting | EPOLL_MODE;
 	event.data.ptr = conn.getImpl();
 	if (epoll_ctl(m_EpollFd, EPOLL_CTL_MOD, conn.get_strm().get_fd(),
 		      &event) != 0) {
@@ -131,9 +145,9 @@ EpollNetProvider<BUFFER, Stream>::setPollSetting(Conn_t &conn, int setting) {
 	}
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 int
-EpollNetProvider<BUFFER, Stream>::connect(Conn_t &conn,
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::connect(Conn_t &conn,
 					  const ConnectOptions &opts)
 {
 	auto &strm = conn.get_strm();
@@ -148,9 +162,9 @@ EpollNetProvider<BUFFER, Stream>::connect(Conn_t &conn,
 	return 0;
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 void
-EpollNetProvider<BUFFER, Stream>::close(Stream_t& strm)
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::close(Stream_t& strm)
 {
 	int was_fd = strm.get_fd();
 	assert(was_fd >= 0);
@@ -181,9 +195,9 @@ EpollNetProvider<BUFFER, Stream>::close(Stream_t& strm)
 	epoll_ctl(m_EpollFd, EPOLL_CTL_DEL, was_fd, nullptr);
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 int
-EpollNetProvider<BUFFER, Stream>::recv(Conn_t &conn)
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::recv(Conn_t &conn)
 {
 	auto &buf = conn.getInBuf();
 	auto itr = buf.template end<true>();
@@ -226,9 +240,26 @@ EpollNetProvider<BUFFER, Stream>::recv(Conn_t &conn)
 	return 0;
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
+int
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::recvReady(Conn_t &conn)
+{
+	size_t budget = EDGE_TRIGGERED ? RECV_BUDGET : 1;
+	for (size_t i = 0; i < budget; ++i) {
+		if (recv(conn) < 0)
+			return -1;
+		if (conn.get_strm().has_status(SS_NEED_EVENT_FOR_READ))
+			return 0;
+	}
+	/* There will be no new edge for data already in socket. */
+	if constexpr (EDGE_TRIGGERED)
+		m_ReadyToRecv.push_back(conn);
+	return 0;
+}
+
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 int
-EpollNetProvider<BUFFER, Stream>::send(Conn_t &conn)
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::send(Conn_t &conn)
 {
 	while (hasDataToSend(conn)) {
 		struct iovec iov[IOVEC_MAX_SIZE];
@@ -254,9 +285,9 @@ EpollNetProvider<BUFFER, Stream>::send(Conn_t &conn)
 	return 0;
 }
 
-template<class BUFFER, class Stream>
+template<class BUFFER, class Stream, bool EDGE_TRIGGERED>
 int
-EpollNetProvider<BUFFER, Stream>::wait(int timeout)
+EpollNetProvider<BUFFER, Stream, EDGE_TRIGGERED>::wait(int timeout)
 {
 	assert(timeout >= 0);
 	if (timeout == 0)
@@ -270,6 +301,12 @@ EpollNetProvider<BUFFER, Stream>::wait(int timeout)
 		conn = m_Connector.m_ReadyToSend.erase(conn);
 	}
 
+	/* Don't block if some sockets are known to have data. */
+	std::vector<Conn_t> ready;
+	ready.swap(m_ReadyToRecv);
+	if (!ready.empty())
+		timeout = 0;
+
 	/* Firstly poll connections to point out if there's data to read. */
 	struct epoll_event events[EPOLL_EVENTS_MAX];
 	int event_cnt = epoll_wait(m_EpollFd, events, EPOLL_EVENTS_MAX, timeout);
@@ -294,7 +331,7 @@ EpollNetProvider<BUFFER, Stream>::wait(int timeout)
 			 * Once we read all bytes from socket connection
 			 * becomes ready to decode.
 			 */
-			int rc = recv(conn);
+			int rc = recvReady(conn);
 			if (rc < 0)
 				return -1;
 			if (hasDataToDecode(conn))
@@ -320,5 +357,14 @@ EpollNetProvider<BUFFER, Stream>::wait(int timeout)
 			}
 		}
 	}
+	for (auto &conn : ready) {
+		/* Connection could be closed meanwhile. */
+		if (conn.get_strm().get_fd() < 0)
+			continue;
+		if (recvReady(conn) < 0)
+			return -1;
+		if (hasDataToDecode(conn))
+			m_Connector.readyToDecode(conn);
+	}
 	return 0;
 }
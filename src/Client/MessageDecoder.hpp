@@ -59,6 +59,8 @@ public:
 	MessageDecoder& operator = (const MessageDecoder& decoder) = delete;
 
 	int decodeMessage(Message<BUFFER> &response);
+	/** Decode only header, body is left as is. */
+	int decodeHeader(Message<BUFFER> &response);
 	int decodeMessageSize();
 	void reset(iterator_t<BUFFER> &itr);
 
@@ -94,6 +96,17 @@ MessageDecoder<BUFFER>::decodeMessage(Message<BUFFER> &response)
 	return 0;
 }
 
+template<class BUFFER>
+int
+MessageDecoder<BUFFER>::decodeHeader(Message<BUFFER> &response)
+{
+	if (!mpp::decode(it, response.header)) {
+		LOG_ERROR("Failed to decode header");
+		return -1;
+	}
+	return 0;
+}
+
 template<class BUFFER>
 void
 MessageDecoder<BUFFER>::reset(iterator_t<BUFFER> &itr)
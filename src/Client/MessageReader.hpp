@@ -44,12 +44,21 @@ struct Header {
 	int sync;
 	std::optional<int> schema_id;
 	std::optional<int> stream_id;
+	/* Rows of replication stream. */
+	std::optional<uint32_t> replica_id;
+	std::optional<uint64_t> lsn;
+	std::optional<uint64_t> tsn;
+	std::optional<uint32_t> flags;
 
 	static constexpr auto mpp = std::make_tuple(
 		std::make_pair(Iproto::REQUEST_TYPE, &Header::code),
 		std::make_pair(Iproto::SYNC, &Header::sync),
 		std::make_pair(Iproto::SCHEMA_VERSION, &Header::schema_id),
-		std::make_pair(Iproto::STREAM_ID, &Header::stream_id)
+		std::make_pair(Iproto::STREAM_ID, &Header::stream_id),
+		std::make_pair(Iproto::REPLICA_ID, &Header::replica_id),
+		std::make_pair(Iproto::LSN, &Header::lsn),
+		std::make_pair(Iproto::TSN, &Header::tsn),
+		std::make_pair(Iproto::FLAGS, &Header::flags)
 	);
 };
 
@@ -108,7 +117,8 @@ struct Data {
 	{
 		it_t itr = iters.first;
 		bool ok = mpp::decode(itr, tuples);
-		assert(itr == iters.second);
+		/* Iterator is left anywhere if decoding fails. */
+		assert(!ok || itr == iters.second);
 		return ok;
 	}
 
@@ -170,6 +180,11 @@ struct Body {
     std::optional<uint32_t> iterator;
     std::optional<Data<BUFFER>> keys;
     std::optional<Data<BUFFER>> tuple;
+    std::optional<std::string> function_name;
+    std::optional<std::string> user_name;
+	std::optional<std::string> sql_text;
+	std::optional<Data<BUFFER>> sql_bind;
+	std::optional<Data<BUFFER>> vclock;
 
 	static constexpr auto mpp = std::make_tuple(
 		// Response
@@ -188,7 +203,12 @@ struct Body {
         std::make_pair(Iproto::OFFSET, &Body<BUFFER>::offset),
         std::make_pair(Iproto::ITERATOR, &Body<BUFFER>::iterator),
         std::make_pair(Iproto::KEY, &Body<BUFFER>::keys),
-        std::make_pair(Iproto::TUPLE, &Body<BUFFER>::tuple)
+        std::make_pair(Iproto::TUPLE, &Body<BUFFER>::tuple),
+        std::make_pair(Iproto::FUNCTION_NAME, &Body<BUFFER>::function_name),
+        std::make_pair(Iproto::USER_NAME, &Body<BUFFER>::user_name),
+		std::make_pair(Iproto::SQL_TEXT, &Body<BUFFER>::sql_text),
+		std::make_pair(Iproto::SQL_BIND, &Body<BUFFER>::sql_bind),
+		std::make_pair(Iproto::VCLOCK, &Body<BUFFER>::vclock)
 	);
 };
 
@@ -197,6 +217,11 @@ struct Message {
 	Header header;
 	Body<BUFFER> body;
 	int size;
+	/**
+	 * Only header is decoded, the rest of message is not received yet
+	 * (see ProxyOptions::cut_through_size).
+	 */
+	bool streamed = false;
 };
 
 struct Greeting {
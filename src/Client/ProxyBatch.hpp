@@ -0,0 +1,300 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "ProxyFanOut.hpp"
+#include "ProxyPipeline.hpp"
+#include "RequestEncoder.hpp"
+#include "../Utils/Logger.hpp"
+
+/**
+ * Stage aggregating single-tuple writes of a client into one CALL of a
+ * batch-apply function on the instance. Spec must provide:
+ *
+ * static constexpr size_t BATCH_MAX;     // max requests in one call
+ * static constexpr const char *FUNCTION; // name of batch-apply function
+ * static bool isBatched(uint32_t space_id);
+ *
+ * INSERTs and REPLACEs of the same space pipelined by a client (i.e.
+ * decoded from the same read) are collected until BATCH_MAX of them are
+ * collected, a request of another kind, space or instance arrives, or all
+ * received requests are handled; then they are sent as
+ *
+ * FUNCTION(space_id, "insert" | "replace", {tuple, ...})
+ *
+ * The function must return an array with a result per tuple: the tuple
+ * written or an error message. Each client gets its own response, with
+ * its sync. If the call fails as a whole, every client gets its error.
+ * In Lua:
+ *
+ * function batch_apply(space_id, op, tuples)
+ *     local space = box.space[space_id]
+ *     local res = {}
+ *     box.begin()
+ *     for i, tuple in ipairs(tuples) do
+ *         local ok, r = pcall(space[op], space, tuple)
+ *         res[i] = ok and r or tostring(r)
+ *     end
+ *     box.commit()
+ *     return res
+ * end
+ *
+ * Writes routed by previous stages (see PipelineContext::instance) go to
+ * that instance, the rest to the first one. The stage must precede
+ * ForwardStage, which handles everything it does not batch.
+ */
+template<class Spec>
+class BatchWriteStage {
+public:
+	static constexpr size_t BATCH_MAX = Spec::BATCH_MAX;
+	static_assert(BATCH_MAX > 0, "Batch must hold at least one request");
+	/** Code of errors returned by the batch-apply function (ER_PROC_LUA). */
+	static constexpr uint32_t BATCH_ERRCODE = 32;
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+	/** Send the batch collected from the current client. */
+	template<class Proxy>
+	void flush(Proxy &proxy);
+
+	/** Number of batch calls waiting for responses. */
+	size_t pendingCount() const { return m_Pending.size(); }
+	/** Forget requests of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	/** Number of calls sent. */
+	size_t call_count = 0;
+	/** Number of requests sent in calls. */
+	size_t batched_count = 0;
+	/** Number of requests failed (as part of a failed call or alone). */
+	size_t error_count = 0;
+
+private:
+	struct Batch {
+		int client_fd = -1;
+		int code = 0;
+		uint32_t space_id = 0;
+		int instance = 0;
+		int schema_id = 0;
+		/** Encoded tuples, one after another. */
+		std::string tuples;
+		std::vector<int> syncs;
+	};
+
+	template<class Proxy, class BUFFER>
+	StageStatus collect(Proxy &proxy, Message<BUFFER> &msg);
+	/** Reply @a msg error to all requests of @a syncs. */
+	template<class Proxy>
+	void replyError(Proxy &proxy, const std::vector<int> &syncs,
+			int schema_id, uint32_t errcode, const std::string &msg);
+
+	/** Batch of the current client, empty between receivers. */
+	Batch m_Batch;
+	/** Syncs of requests in calls in flight by (client fd, call sync). */
+	std::map<std::pair<int, int>, std::vector<int>> m_Pending;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+template<class Spec>
+void
+BatchWriteStage<Spec>::disconnected(int client_fd)
+{
+	internal::eraseClient(m_Pending, client_fd);
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+BatchWriteStage<Spec>::handle(Proxy &proxy, Message<BUFFER> &msg,
+			      PipelineContext &ctx)
+{
+	if (!ctx.from_client)
+		return collect(proxy, msg);
+	int code = msg.header.code;
+	bool is_batched = (code == Iproto::INSERT || code == Iproto::REPLACE) &&
+			  msg.body.space_id && msg.body.tuple &&
+			  Spec::isBatched(*msg.body.space_id);
+	int instance = ctx.instance < 0 ? 0 : ctx.instance;
+	if (!m_Batch.syncs.empty() &&
+	    (!is_batched || code != m_Batch.code ||
+	     *msg.body.space_id != m_Batch.space_id ||
+	     instance != m_Batch.instance)) {
+		/* Requests of a client are sent in order. */
+		flush(proxy);
+	}
+	if (!is_batched)
+		return STAGE_NEXT;
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (m_Pending.count(key) != 0) {
+		LOG_ERROR("Batch call with sync ", msg.header.sync,
+			  " is already in flight");
+		return STAGE_ERR;
+	}
+	if (m_Batch.syncs.empty()) {
+		m_Batch.client_fd = proxy.getClientFd();
+		m_Batch.code = code;
+		m_Batch.space_id = *msg.body.space_id;
+		m_Batch.instance = instance;
+		m_Batch.schema_id = msg.header.schema_id.value_or(0);
+	}
+	auto &tuple = *msg.body.tuple;
+	internal::appendRaw(m_Batch.tuples, tuple.iters.first,
+			    tuple.iters.second);
+	m_Batch.syncs.push_back(msg.header.sync);
+	proxy.skipLastDecodedMessage(msg.size);
+	if (m_Batch.syncs.size() == BATCH_MAX)
+		flush(proxy);
+	return STAGE_DONE;
+}
+
+template<class Spec>
+template<class Proxy>
+void
+BatchWriteStage<Spec>::flush(Proxy &proxy)
+{
+	if (m_Batch.syncs.empty())
+		return;
+	assert(m_Batch.client_fd == proxy.getClientFd());
+	Batch batch = std::move(m_Batch);
+	m_Batch = Batch{};
+
+	std::string tuples;
+	internal::appendArrayHeader(tuples, batch.syncs.size());
+	tuples += batch.tuples;
+	const char *op = batch.code == Iproto::INSERT ? "insert" : "replace";
+	/* Sync of the first request is free until it is replied. */
+	int call_sync = batch.syncs.front();
+	typename Proxy::Buffer_t buf;
+	{
+		RequestEncoder<typename Proxy::Buffer_t> enc(buf);
+		enc.encodeCall(call_sync, Spec::FUNCTION,
+			       std::make_tuple(batch.space_id, op,
+					       mpp::as_raw(tuples)));
+	}
+	auto &strm = proxy.connect(batch.instance);
+	if (strm.get_fd() < 0 || proxy.sendBufferToStream(strm, buf) != 0) {
+		LOG_ERROR("Failed to send batch of ", batch.syncs.size(),
+			  " requests to instance ", batch.instance);
+		replyError(proxy, batch.syncs, batch.schema_id, BATCH_ERRCODE,
+			   "Failed to send batch to instance");
+		return;
+	}
+	call_count++;
+	batched_count += batch.syncs.size();
+	m_Pending.emplace(std::make_pair(batch.client_fd, call_sync),
+			  std::move(batch.syncs));
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+BatchWriteStage<Spec>::collect(Proxy &proxy, Message<BUFFER> &msg)
+{
+	auto it = m_Pending.find(std::make_pair(proxy.getClientFd(),
+						msg.header.sync));
+	if (it == m_Pending.end())
+		return STAGE_NEXT;
+	std::vector<int> syncs = std::move(it->second);
+	m_Pending.erase(it);
+	int schema_id = msg.header.schema_id.value_or(0);
+	if (msg.streamed) {
+		LOG_ERROR("Response to batch call is too large");
+		proxy.skipLastDecodedMessage(msg.size);
+		replyError(proxy, syncs, schema_id, BATCH_ERRCODE,
+			   "Response to batch is too large");
+		return STAGE_DONE;
+	}
+	if (msg.header.code != Iproto::OK) {
+		std::string err = "Batch call failed";
+		uint32_t errcode = msg.header.code & ~Iproto::TYPE_ERROR;
+		if (msg.body.error_stack && !msg.body.error_stack->empty())
+			err = (*msg.body.error_stack)[0].msg;
+		replyError(proxy, syncs, schema_id, errcode, err);
+		proxy.skipLastDecodedMessage(msg.size);
+		return STAGE_DONE;
+	}
+	/* CALL returns [results]. */
+	std::vector<Data<BUFFER>> ret;
+	std::vector<Data<BUFFER>> results;
+	if (!msg.body.data || !msg.body.data->decode(ret) || ret.empty() ||
+	    !ret[0].decode(results) || results.size() != syncs.size()) {
+		LOG_ERROR("Batch function returned malformed result");
+		replyError(proxy, syncs, schema_id, BATCH_ERRCODE,
+			   "Batch function returned malformed result");
+		proxy.skipLastDecodedMessage(msg.size);
+		return STAGE_DONE;
+	}
+	/* Responses are sent at once. */
+	int size = 0;
+	std::string tuple;
+	for (size_t i = 0; i < syncs.size(); ++i) {
+		std::string err;
+		if (results[i].decode(err)) {
+			error_count++;
+			size += proxy.createError(syncs[i], schema_id,
+						  BATCH_ERRCODE, err);
+			continue;
+		}
+		tuple.clear();
+		internal::appendArrayHeader(tuple, 1);
+		internal::appendRaw(tuple, results[i].iters.first,
+				    results[i].iters.second);
+		auto data = mpp::as_raw(tuple);
+		size += proxy.createMessage(syncs[i], schema_id, &data);
+	}
+	proxy.skipLastDecodedMessage(msg.size);
+	proxy.sendEncodedToClient(size);
+	return STAGE_DONE;
+}
+
+template<class Spec>
+template<class Proxy>
+void
+BatchWriteStage<Spec>::replyError(Proxy &proxy, const std::vector<int> &syncs,
+				  int schema_id, uint32_t errcode,
+				  const std::string &msg)
+{
+	int size = 0;
+	for (int sync : syncs)
+		size += proxy.createError(sync, schema_id, errcode, msg);
+	error_count += syncs.size();
+	proxy.sendEncodedToClient(size);
+}
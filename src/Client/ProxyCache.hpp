@@ -0,0 +1,738 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "MessageDecoder.hpp"
+#include "ProxyFanOut.hpp"
+#include "ProxyPipeline.hpp"
+#include "ProxyReplica.hpp"
+#include "ProxyTrace.hpp"
+#include "RequestEncoder.hpp"
+#include "UnixPlainStream.hpp"
+#include "../Utils/Logger.hpp"
+
+/**
+ * Stage answering SELECTs of reference spaces (configs, dictionaries)
+ * from memory of the proxy, without a round trip to the backend.
+ *
+ * The proxy is an anonymous replica of the master: it fetches a snapshot
+ * of the cached spaces (FETCH_SNAPSHOT), then SUBSCRIBEs to the rows
+ * written after it and keeps tuples in a hash index by primary key. The
+ * stream is read with client traffic, no more often than once per poll
+ * interval, and is acknowledged after each read. Rows of a transaction
+ * are applied once its last row comes, so readers never see a half of
+ * it. If the connection breaks, the cache resubscribes from its vclock
+ * and fetches a new snapshot if the master refuses that.
+ *
+ * A SELECT is answered by the cache if the stream is live and the master
+ * was heard of within the stale interval, the request is not in a stream
+ * (transaction) and looks up the full primary key with EQ or REQ. Rows
+ * updated by UPDATE or UPSERT are not applied but forgotten, so reads of
+ * such a key go to the next stage until the key is replaced or deleted;
+ * a change of a space by a secondary key makes the cache give up the
+ * space until the next snapshot. Other requests are left to next stages.
+ *
+ * The cache is eventually consistent: a client may read its own write
+ * from the backend and then an older tuple from the cache. The master
+ * drops replicas which don't acknowledge heartbeats, so an idle proxy
+ * reconnects with the next traffic. The user of the master needs the
+ * replication role. Only plain transport is supported, and connection
+ * establishment blocks the event loop for up to connect_timeout.
+ */
+class ReplicaCache {
+public:
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/** Replicate from @a master, authenticating as its user if set. */
+	void setMaster(const ConnectOptions &master);
+	/** Cache space @a space_id, its primary key is @a key_fields. */
+	void addSpace(uint32_t space_id, std::vector<uint32_t> key_fields = {0});
+	/**
+	 * Read rows every @a poll_usec at most, answer while the master was
+	 * heard of within @a stale_usec, reconnect after @a retry_usec.
+	 */
+	void setIntervals(uint64_t poll_usec, uint64_t stale_usec,
+			  uint64_t retry_usec);
+	/** True if the snapshot is fetched and rows are streamed. */
+	bool isLive() const { return m_State == LIVE; }
+	/** Number of tuples of space @a space_id in the cache. */
+	size_t tupleCount(uint32_t space_id) const;
+	/** Vclock of the master the cache has caught up with. */
+	const Vclock &vclock() const { return m_Vclock; }
+
+	/** Number of SELECTs answered by the cache. */
+	size_t hit_count = 0;
+	/** Number of SELECTs of cached spaces left to next stages. */
+	size_t miss_count = 0;
+	/** Number of rows of cached spaces applied. */
+	size_t row_count = 0;
+	/** Number of connections to the master. */
+	size_t connect_count = 0;
+
+	/** Rows are read in chunks, at most MAX_READ bytes per poll. */
+	static constexpr size_t READ_CHUNK = 16 * 1024;
+	static constexpr size_t MAX_READ = 1024 * 1024;
+
+private:
+	enum State {
+		DISCONNECTED,
+		GREETING,
+		AUTHENTICATING,
+		FETCHING,
+		SUBSCRIBING,
+		LIVE
+	};
+
+	struct Space {
+		std::vector<uint32_t> key_fields;
+		/* Raw tuples by canonical primary key. */
+		std::unordered_map<std::string, std::string> tuples;
+		/* Keys updated since the last full tuple. */
+		std::unordered_set<std::string> unknown;
+		/* Changed by a key the cache can't follow. */
+		bool untracked = false;
+	};
+
+	/** Change of a cached space, decoded from a row. */
+	struct Row {
+		int code;
+		uint32_t space_id;
+		std::string key;
+		std::string tuple;
+		bool untracked = false;
+	};
+
+	/** Append MsgPack scalar @a raw to @a key, equal values match. */
+	static void appendKeyPart(std::string &key, const std::string &raw);
+	template<class BUFFER>
+	static bool appendKeyPart(std::string &key, Data<BUFFER> &part);
+	/** Canonical key of @a parts of @a space, false if they don't fit. */
+	template<class BUFFER>
+	static bool makeKey(const Space &space,
+			    std::vector<Data<BUFFER>> &parts, std::string &key);
+	template<class BUFFER>
+	static bool makeTupleKey(const Space &space, Data<BUFFER> &tuple,
+				 std::string &key);
+	static std::string makeUuid();
+
+	template<class BUFFER>
+	void poll(uint64_t now);
+	void connect(uint64_t now);
+	void disconnect(uint64_t now, const char *what);
+	/** Read available data of the stream, return -1 on error. */
+	int receive();
+	template<class BUFFER>
+	void process(uint64_t now);
+	/** Handle message of the master, return -1 on protocol error. */
+	template<class BUFFER>
+	int handleMessage(Message<BUFFER> &msg);
+	template<class BUFFER>
+	int handleRow(Message<BUFFER> &msg);
+	void apply(const Row &row);
+	template<class BUFFER>
+	bool decodeVclock(Message<BUFFER> &msg);
+	/** Send request made by @a encode to the master. */
+	template<class BUFFER, class ENCODE>
+	int send(ENCODE encode);
+	template<class BUFFER>
+	int startFetch();
+	template<class BUFFER>
+	int subscribe();
+	/** Answer SELECT from the cache, false if it can't. */
+	template<class Proxy, class BUFFER>
+	bool lookup(Proxy &proxy, Message<BUFFER> &msg, const Space &space);
+
+	std::optional<ConnectOptions> m_Master;
+	std::unordered_map<uint32_t, Space> m_Spaces;
+	State m_State = DISCONNECTED;
+	UnixPlainStream m_Stream;
+	std::string m_Uuid = makeUuid();
+	/* Received data not decoded yet. */
+	std::string m_Input;
+	/* Rows of the transaction in progress. */
+	std::vector<Row> m_Txn;
+	Vclock m_Vclock;
+	/* The snapshot is fetched, SUBSCRIBE can continue from m_Vclock. */
+	bool m_IsSynced = false;
+	/* Number of vclocks received in response to FETCH_SNAPSHOT. */
+	int m_FetchVclocks = 0;
+	uint64_t m_PollNsec = 1000 * 1000;
+	uint64_t m_StaleNsec = 5000ull * 1000 * 1000;
+	uint64_t m_RetryNsec = 1000ull * 1000 * 1000;
+	uint64_t m_PolledAt = 0;
+	uint64_t m_HeardAt = 0;
+	uint64_t m_FailedAt = 0;
+	std::string m_Result;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline void
+ReplicaCache::setMaster(const ConnectOptions &master)
+{
+	if (m_State != DISCONNECTED)
+		m_Stream.close();
+	m_Master = master;
+	m_State = DISCONNECTED;
+	m_IsSynced = false;
+	m_FailedAt = 0;
+}
+
+inline void
+ReplicaCache::addSpace(uint32_t space_id, std::vector<uint32_t> key_fields)
+{
+	m_Spaces[space_id].key_fields = std::move(key_fields);
+	/* Tuples of the space come with the next snapshot. */
+	m_IsSynced = false;
+}
+
+inline void
+ReplicaCache::setIntervals(uint64_t poll_usec, uint64_t stale_usec,
+			   uint64_t retry_usec)
+{
+	m_PollNsec = poll_usec * 1000;
+	m_StaleNsec = stale_usec * 1000;
+	m_RetryNsec = retry_usec * 1000;
+}
+
+inline size_t
+ReplicaCache::tupleCount(uint32_t space_id) const
+{
+	auto it = m_Spaces.find(space_id);
+	return it != m_Spaces.end() ? it->second.tuples.size() : 0;
+}
+
+inline void
+ReplicaCache::appendKeyPart(std::string &key, const std::string &raw)
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(raw.data());
+	uint8_t type = p[0];
+	bool is_uint = type <= 0x7f || (type >= 0xcc && type <= 0xcf);
+	bool is_int = type >= 0xe0 || (type >= 0xd0 && type <= 0xd3);
+	if (is_uint || is_int) {
+		/* Integers are matched by value, whatever their width. */
+		uint64_t value = type;
+		if (type >= 0xe0) {
+			value = static_cast<uint64_t>(static_cast<int8_t>(type));
+		} else if (type > 0x7f) {
+			size_t len = size_t{1} << (type & 0x3);
+			value = 0;
+			for (size_t i = 1; i <= len; ++i)
+				value = (value << 8) | p[i];
+			if (is_int && len < 8) {
+				unsigned shift = 64 - 8 * len;
+				value = static_cast<uint64_t>(
+					static_cast<int64_t>(value << shift) >>
+					shift);
+			}
+		}
+		bool is_negative = is_int && static_cast<int64_t>(value) < 0;
+		key.push_back(is_negative ? 'i' : 'u');
+		key.append(reinterpret_cast<const char *>(&value),
+			   sizeof(value));
+		return;
+	}
+	size_t header = 0;
+	if (type >= 0xa0 && type <= 0xbf)
+		header = 1;
+	else if (type >= 0xd9 && type <= 0xdb)
+		header = 1 + (size_t{1} << (type - 0xd9));
+	/* Parts are length-prefixed, so that keys can't collide. */
+	uint32_t len = raw.size() - header;
+	key.push_back(header != 0 ? 's' : 'r');
+	key.append(reinterpret_cast<const char *>(&len), sizeof(len));
+	key.append(raw, header, len);
+}
+
+template<class BUFFER>
+bool
+ReplicaCache::appendKeyPart(std::string &key, Data<BUFFER> &part)
+{
+	std::string raw;
+	internal::appendRaw(raw, part.iters.first, part.iters.second);
+	if (raw.empty())
+		return false;
+	appendKeyPart(key, raw);
+	return true;
+}
+
+template<class BUFFER>
+bool
+ReplicaCache::makeKey(const Space &space, std::vector<Data<BUFFER>> &parts,
+		      std::string &key)
+{
+	if (parts.size() != space.key_fields.size())
+		return false;
+	key.clear();
+	for (auto &part : parts) {
+		if (!appendKeyPart(key, part))
+			return false;
+	}
+	return true;
+}
+
+template<class BUFFER>
+bool
+ReplicaCache::makeTupleKey(const Space &space, Data<BUFFER> &tuple,
+			   std::string &key)
+{
+	std::vector<Data<BUFFER>> fields;
+	if (!tuple.decode(fields))
+		return false;
+	key.clear();
+	for (uint32_t field : space.key_fields) {
+		if (field >= fields.size() ||
+		    !appendKeyPart(key, fields[field]))
+			return false;
+	}
+	return true;
+}
+
+inline std::string
+ReplicaCache::makeUuid()
+{
+	/* Random UUID (version 4), the master takes it as id of replica. */
+	std::random_device random;
+	uint8_t bytes[16];
+	for (uint8_t &byte : bytes)
+		byte = static_cast<uint8_t>(random());
+	bytes[6] = (bytes[6] & 0x0f) | 0x40;
+	bytes[8] = (bytes[8] & 0x3f) | 0x80;
+	static const char digits[] = "0123456789abcdef";
+	std::string uuid;
+	for (size_t i = 0; i < sizeof(bytes); ++i) {
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			uuid.push_back('-');
+		uuid.push_back(digits[bytes[i] >> 4]);
+		uuid.push_back(digits[bytes[i] & 0xf]);
+	}
+	return uuid;
+}
+
+inline void
+ReplicaCache::connect(uint64_t now)
+{
+	connect_count++;
+	m_Input.clear();
+	m_Txn.clear();
+	if (m_Stream.connect(*m_Master) != 0) {
+		disconnect(now, "can't connect");
+		return;
+	}
+	m_State = GREETING;
+	m_HeardAt = now;
+}
+
+inline void
+ReplicaCache::disconnect(uint64_t now, const char *what)
+{
+	LOG_ERROR("Replication from ", m_Master->address, ":",
+		  m_Master->service, " failed: ", what);
+	m_Stream.close();
+	m_State = DISCONNECTED;
+	m_FailedAt = now;
+}
+
+inline int
+ReplicaCache::receive()
+{
+	char chunk[READ_CHUNK];
+	size_t total = 0;
+	while (total < MAX_READ) {
+		struct iovec iov = {chunk, sizeof(chunk)};
+		ssize_t rcvd = m_Stream.recv(&iov, 1);
+		if (rcvd < 0)
+			return -1;
+		if (rcvd == 0)
+			break;
+		m_Input.append(chunk, rcvd);
+		total += rcvd;
+	}
+	return 0;
+}
+
+template<class BUFFER, class ENCODE>
+int
+ReplicaCache::send(ENCODE encode)
+{
+	BUFFER buf;
+	size_t size;
+	{
+		RequestEncoder<BUFFER> enc(buf);
+		size = encode(enc);
+	}
+	std::string req(size, '\0');
+	auto itr = buf.begin();
+	itr.get({req.data(), size});
+	/* Requests are small, a socket not taking them is stuck. */
+	size_t sent = 0;
+	while (sent < size) {
+		struct iovec iov = {req.data() + sent, size - sent};
+		ssize_t rc = m_Stream.send(&iov, 1);
+		if (rc <= 0)
+			return -1;
+		sent += rc;
+	}
+	return 0;
+}
+
+template<class BUFFER>
+int
+ReplicaCache::startFetch()
+{
+	m_IsSynced = false;
+	m_FetchVclocks = 0;
+	m_State = FETCHING;
+	return send<BUFFER>([](RequestEncoder<BUFFER> &enc) {
+		return enc.encodeFetchSnapshot();
+	});
+}
+
+template<class BUFFER>
+int
+ReplicaCache::subscribe()
+{
+	m_State = SUBSCRIBING;
+	return send<BUFFER>([this](RequestEncoder<BUFFER> &enc) {
+		return enc.encodeSubscribe(m_Uuid, m_Vclock, true);
+	});
+}
+
+template<class BUFFER>
+bool
+ReplicaCache::decodeVclock(Message<BUFFER> &msg)
+{
+	Vclock vclock;
+	if (!msg.body.vclock.has_value() || !msg.body.vclock->decode(vclock))
+		return false;
+	/* Component 0 counts local writes, which are not replicated. */
+	vclock.erase(0);
+	m_Vclock = std::move(vclock);
+	return true;
+}
+
+inline void
+ReplicaCache::apply(const Row &row)
+{
+	Space &space = m_Spaces[row.space_id];
+	row_count++;
+	if (row.untracked) {
+		if (!space.untracked)
+			LOG_WARNING("Space ", row.space_id, " is changed by "
+				    "a key the cache can't follow");
+		space.untracked = true;
+		return;
+	}
+	switch (row.code) {
+	case Iproto::INSERT:
+	case Iproto::REPLACE:
+		space.tuples[row.key] = row.tuple;
+		space.unknown.erase(row.key);
+		break;
+	case Iproto::DELETE:
+		space.tuples.erase(row.key);
+		space.unknown.erase(row.key);
+		break;
+	default:
+		space.tuples.erase(row.key);
+		space.unknown.insert(row.key);
+		break;
+	}
+}
+
+template<class BUFFER>
+int
+ReplicaCache::handleRow(Message<BUFFER> &msg)
+{
+	int code = msg.header.code;
+	if (msg.header.replica_id.has_value() && msg.header.lsn.has_value() &&
+	    *msg.header.replica_id != 0)
+		m_Vclock[*msg.header.replica_id] = *msg.header.lsn;
+	if (code != Iproto::INSERT && code != Iproto::REPLACE &&
+	    code != Iproto::DELETE && code != Iproto::UPDATE &&
+	    code != Iproto::UPSERT)
+		return 0;
+	if (!msg.body.space_id.has_value())
+		return -1;
+	auto space = m_Spaces.find(*msg.body.space_id);
+	/* Transaction ends with the row having commit flag or no TSN. */
+	bool is_commit = !msg.header.tsn.has_value() ||
+			 (msg.header.flags.value_or(0) & Iproto::FLAG_COMMIT);
+	if (space != m_Spaces.end()) {
+		Row row;
+		row.code = code;
+		row.space_id = space->first;
+		bool by_key = code == Iproto::DELETE || code == Iproto::UPDATE;
+		if (by_key) {
+			std::vector<Data<BUFFER>> parts;
+			row.untracked = msg.body.index_id.value_or(0) != 0 ||
+				!msg.body.keys.has_value() ||
+				!msg.body.keys->decode(parts) ||
+				!makeKey(space->second, parts, row.key);
+		} else {
+			row.untracked = !msg.body.tuple.has_value() ||
+				!makeTupleKey(space->second, *msg.body.tuple,
+					      row.key);
+		}
+		if (!row.untracked && code != Iproto::UPSERT && !by_key)
+			internal::appendRaw(row.tuple, msg.body.tuple->iters.first,
+					    msg.body.tuple->iters.second);
+		if (m_State == FETCHING)
+			apply(row);
+		else
+			m_Txn.push_back(std::move(row));
+	}
+	if (is_commit) {
+		for (const Row &row : m_Txn)
+			apply(row);
+		m_Txn.clear();
+	}
+	return 0;
+}
+
+template<class BUFFER>
+int
+ReplicaCache::handleMessage(Message<BUFFER> &msg)
+{
+	if (msg.header.code & Iproto::TYPE_ERROR) {
+		std::string error = "unknown error";
+		if (msg.body.error_stack.has_value() &&
+		    !msg.body.error_stack->empty())
+			error = msg.body.error_stack->front().msg;
+		LOG_ERROR("Master responded with error: ", error);
+		/* Rows after the vclock may be gone, start from scratch. */
+		if (m_State == SUBSCRIBING)
+			m_IsSynced = false;
+		return -1;
+	}
+	switch (m_State) {
+	case AUTHENTICATING:
+		if (msg.header.code != Iproto::OK)
+			return -1;
+		return m_IsSynced ? subscribe<BUFFER>() : startFetch<BUFFER>();
+	case FETCHING:
+		if (msg.header.code != Iproto::OK)
+			return handleRow(msg);
+		if (!decodeVclock(msg))
+			return -1;
+		/* The snapshot is between the vclocks of start and end. */
+		if (++m_FetchVclocks == 1) {
+			for (auto &space : m_Spaces) {
+				space.second.tuples.clear();
+				space.second.unknown.clear();
+				space.second.untracked = false;
+			}
+			return 0;
+		}
+		m_IsSynced = true;
+		return subscribe<BUFFER>();
+	case SUBSCRIBING:
+		if (msg.header.code != Iproto::OK)
+			return -1;
+		m_State = LIVE;
+		LOG_INFO("Replication from ", m_Master->address, ":",
+			 m_Master->service, " is live");
+		return 0;
+	case LIVE:
+		/* OK is a heartbeat of the master. */
+		return msg.header.code != Iproto::OK ? handleRow(msg) : 0;
+	default:
+		return -1;
+	}
+}
+
+template<class BUFFER>
+void
+ReplicaCache::process(uint64_t now)
+{
+	size_t pos = 0;
+	if (m_State == GREETING) {
+		if (m_Input.size() < Iproto::GREETING_SIZE)
+			return;
+		Greeting greeting;
+		if (parseGreeting(std::string_view(m_Input.data(),
+						   Iproto::GREETING_SIZE),
+				  greeting) != 0) {
+			disconnect(now, "bad greeting");
+			return;
+		}
+		pos = Iproto::GREETING_SIZE;
+		int rc;
+		if (!m_Master->user.empty()) {
+			m_State = AUTHENTICATING;
+			rc = send<BUFFER>([&](RequestEncoder<BUFFER> &enc) {
+				return enc.encodeAuth(m_Master->user,
+						      m_Master->passwd,
+						      greeting);
+			});
+		} else {
+			rc = m_IsSynced ? subscribe<BUFFER>() :
+					  startFetch<BUFFER>();
+		}
+		if (rc != 0) {
+			disconnect(now, "can't send request");
+			return;
+		}
+	}
+	/* Whole messages are decoded at once. */
+	size_t end = pos;
+	while (m_Input.size() - end >= MP_RESPONSE_SIZE) {
+		if (static_cast<uint8_t>(m_Input[end]) != 0xce) {
+			disconnect(now, "bad message size");
+			return;
+		}
+		uint32_t size;
+		memcpy(&size, m_Input.data() + end + 1, sizeof(size));
+		size = __builtin_bswap32(size);
+		if (m_Input.size() - end - MP_RESPONSE_SIZE < size)
+			break;
+		end += MP_RESPONSE_SIZE + size;
+	}
+	if (end > pos) {
+		m_HeardAt = now;
+		BUFFER buf;
+		buf.write({m_Input.data() + pos, end - pos});
+		auto itr = buf.begin();
+		for (size_t offset = pos; offset < end;) {
+			uint32_t size;
+			memcpy(&size, m_Input.data() + offset + 1, sizeof(size));
+			size = MP_RESPONSE_SIZE + __builtin_bswap32(size);
+			auto next = itr + size;
+			Message<BUFFER> msg;
+			/* Heartbeats and acks may have no body. */
+			auto body = itr + MP_RESPONSE_SIZE;
+			bool ok = mpp::decode(body, msg.header) &&
+				  (body == next || mpp::decode(body, msg.body));
+			if (!ok || handleMessage(msg) != 0) {
+				disconnect(now, ok ? "bad response" :
+					       "can't decode message");
+				return;
+			}
+			itr = next;
+			offset += size;
+		}
+		if (m_State == LIVE &&
+		    send<BUFFER>([this](RequestEncoder<BUFFER> &enc) {
+			    return enc.encodeVclock(m_Vclock);
+		    }) != 0) {
+			disconnect(now, "can't acknowledge rows");
+			return;
+		}
+	}
+	m_Input.erase(0, end);
+}
+
+template<class BUFFER>
+void
+ReplicaCache::poll(uint64_t now)
+{
+	if (m_State == DISCONNECTED) {
+		if (m_FailedAt != 0 && now - m_FailedAt < m_RetryNsec)
+			return;
+		connect(now);
+		if (m_State == DISCONNECTED)
+			return;
+	}
+	if (receive() != 0) {
+		disconnect(now, "connection is lost");
+		return;
+	}
+	process<BUFFER>(now);
+}
+
+template<class Proxy, class BUFFER>
+bool
+ReplicaCache::lookup(Proxy &proxy, Message<BUFFER> &msg, const Space &space)
+{
+	auto iterator = msg.body.iterator.value_or(EQ);
+	if (space.untracked || msg.header.stream_id.has_value() ||
+	    msg.body.index_id.value_or(0) != 0 ||
+	    (iterator != EQ && iterator != REQ) ||
+	    msg.body.offset.value_or(0) != 0 || !msg.body.keys.has_value())
+		return false;
+	std::vector<Data<BUFFER>> parts;
+	std::string key;
+	if (!msg.body.keys->decode(parts) || !makeKey(space, parts, key) ||
+	    space.unknown.count(key) != 0)
+		return false;
+	auto tuple = space.tuples.find(key);
+	bool found = tuple != space.tuples.end() &&
+		     msg.body.limit.value_or(UINT32_MAX) != 0;
+	m_Result.clear();
+	internal::appendArrayHeader(m_Result, found ? 1 : 0);
+	if (found)
+		m_Result += tuple->second;
+	auto data = mpp::as_raw(m_Result);
+	int size = proxy.createMessage(msg.header.sync, 0, &data);
+	proxy.sendEncodedToClient(size);
+	proxy.skipLastDecodedMessage(msg.size);
+	return true;
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+ReplicaCache::handle(Proxy &proxy, Message<BUFFER> &msg,
+		     PipelineContext &ctx)
+{
+	if (!ctx.from_client || !m_Master.has_value())
+		return STAGE_NEXT;
+	uint64_t now = ProxyTracer::now();
+	if (now - m_PolledAt >= m_PollNsec) {
+		m_PolledAt = now;
+		poll<typename Proxy::Buffer_t>(now);
+	}
+	if (msg.streamed || msg.header.code != Iproto::SELECT ||
+	    !msg.body.space_id.has_value())
+		return STAGE_NEXT;
+	auto space = m_Spaces.find(*msg.body.space_id);
+	if (space == m_Spaces.end())
+		return STAGE_NEXT;
+	if (m_State != LIVE || now - m_HeardAt >= m_StaleNsec ||
+	    !lookup(proxy, msg, space->second)) {
+		miss_count++;
+		return STAGE_NEXT;
+	}
+	hit_count++;
+	return STAGE_DONE;
+}
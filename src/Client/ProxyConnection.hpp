@@ -32,16 +32,25 @@
 
 #include "MessageDecoder.hpp"
 #include "RequestEncoder.hpp"
+#include "ProxyTrace.hpp"
 
 #include "Stream.hpp"
 #include "../Utils/Logger.hpp"
 
 #include <sys/uio.h> //iovec
+#include <memory>
 #include <string>
 #include <unordered_map> //futures
 
 static constexpr size_t CONN_READAHEAD = 64 * 1024;
+/** First read of idle connection goes to stack, not to a fresh buffer. */
+static constexpr size_t CONN_FIRST_READ = 4 * 1024;
 static constexpr size_t IOVEC_MAX_SIZE = 32;
+/**
+ * Bytes of streamed message to be received before decoding its header:
+ * header of iproto message is much smaller.
+ */
+static constexpr size_t CONN_HEADER_MAX = 128;
 
 struct ConnectionError {
 	ConnectionError(const std::string &msg, int errno_ = 0) :
@@ -60,6 +69,42 @@ class ProxyConnector;
 template<class BUFFER, class NetProvider>
 class ProxyConnection;
 
+/**
+ * Input buffer of connection together with its decoder. Like
+ * ProxyEncodeState, it exists only while connection has data in flight,
+ * so idle connections do not pin buffer blocks.
+ */
+template<class BUFFER>
+struct ProxyDecodeState
+{
+	ProxyDecodeState() : dec(buf), endDecoded(buf.begin()) {}
+	ProxyDecodeState(const ProxyDecodeState&) = delete;
+	ProxyDecodeState& operator = (const ProxyDecodeState&) = delete;
+
+	BUFFER buf;
+	MessageDecoder<BUFFER> dec;
+	/* Iterator separating decoded and raw data in input buffer. */
+	typename BUFFER::iterator endDecoded;
+	/*
+	 * Bytes in the beginning of buffer which are already sent or
+	 * skipped. Decoded message may hold iterators to them, so they
+	 * are dropped only when the message is destroyed.
+	 */
+	size_t sent = 0;
+};
+
+/** Output buffer of connection together with its encoder. */
+template<class BUFFER>
+struct ProxyEncodeState
+{
+	ProxyEncodeState() : enc(buf) {}
+	ProxyEncodeState(const ProxyEncodeState&) = delete;
+	ProxyEncodeState& operator = (const ProxyEncodeState&) = delete;
+
+	BUFFER buf;
+	RequestEncoder<BUFFER> enc;
+};
+
 template<class BUFFER, class NetProvider>
 struct ProxyConnectionImpl
 {
@@ -77,28 +122,140 @@ public:
     void ref();
 	void unref();
 
+	/** Input and output states, created on first use. */
+	ProxyDecodeState<BUFFER> &decoding();
+	ProxyEncodeState<BUFFER> &encoding();
+	/**
+	 * Return buffers that have no data to the pool. Must not be called
+	 * while decoded messages (i.e. iterators to the buffer) are alive.
+	 */
+	void releaseIdleBuffers();
+	/**
+	 * Drop sent data from input buffer. Must not be called while
+	 * decoded messages are alive too.
+	 */
+	void dropSentDecodedData();
+	/**
+	 * Make input of @a strm the current one. Data of other streams which
+	 * is not processed yet (part of a message, requests left for the
+	 * next turn or held) is parked, so that it is never decoded with
+	 * data of @a strm. Must not be called while decoded messages are
+	 * alive.
+	 */
+	void selectInput(const typename NetProvider::Stream_t *strm);
+
 	ProxyConnector<BUFFER, NetProvider> &connector;
-	BUFFER decBuffer;
-	BUFFER encBuffer;
-	MessageDecoder<BUFFER> dec;
-	RequestEncoder<BUFFER> enc;
-	/* Iterator separating decoded and raw data in input buffer. */
-	iterator endDecoded;
+	std::unique_ptr<ProxyDecodeState<BUFFER>> decState;
+	/** Stream decState belongs to and parked inputs of the others. */
+	const typename NetProvider::Stream_t *decOwner = nullptr;
+	std::map<const typename NetProvider::Stream_t *,
+		 std::unique_ptr<ProxyDecodeState<BUFFER>>> parkedDecStates;
+	std::unique_ptr<ProxyEncodeState<BUFFER>> encState;
+	/** Bytes held by both buffers, see ProxyMemoryGovernor. */
+	size_t bufferedBytes = 0;
 	/* Network layer of the connection. */
 	typename NetProvider::Stream_t client_strm;
 	std::map<int, typename NetProvider::Stream_t> instance_index_to_strm;
+	/** Greeting of the first connected instance is sent to client. */
+	bool greetingDelivered = false;
+	/**
+	 * Fair scheduling of client requests (see ProxyOptions::fair_quantum):
+	 * credit left in the current turn (negative if the last request
+	 * overdrew it), share of the client and whether decoded requests
+	 * are left for the next turn.
+	 */
+	ssize_t deficit = 0;
+	unsigned weight = 1;
+	bool throttled = false;
+	/** User of the last AUTH request of the client. */
+	std::string user = "guest";
+	/** Id of client in traffic capture, see ProxyOptions::capture. */
+	uint32_t id = 0;
+	/** Time of the last receipt, only if tracing is enabled. */
+	uint64_t recvTime = 0;
+	/** Traced requests waiting for response, by sync. */
+	std::map<uint32_t, RequestTrace> traces;
+	/**
+	 * Priority scheduling (see ProxyOptions::qos_in_flight): class of
+	 * the client, if any, whether its next request is held until its
+	 * class has a free slot, the slot handed over to the held request
+	 * and (instance, class) of requests in flight, by sync.
+	 */
+	std::optional<unsigned> qosClass;
+	bool held = false;
+	std::optional<std::pair<int, unsigned>> qosGrant;
+	std::multimap<uint32_t, std::pair<int, unsigned>> qosInFlight;
     //Several connection wrappers may point to the same implementation.
 	//It is useful to store connection objects in stl containers for example.
-	ssize_t refs;
+	ssize_t refs = 0;
 	//Members below can be default-initialized.
 	std::optional<ConnectionError> error;
 };
 
 template<class BUFFER, class NetProvider>
 ProxyConnectionImpl<BUFFER, NetProvider>::ProxyConnectionImpl(ProxyConnector<BUFFER, NetProvider> &conn) :
-	connector(conn), decBuffer(), encBuffer(),
-    dec(decBuffer), enc(encBuffer), endDecoded(decBuffer.begin())
+	connector(conn)
+{
+}
+
+template<class BUFFER, class NetProvider>
+ProxyDecodeState<BUFFER> &
+ProxyConnectionImpl<BUFFER, NetProvider>::decoding()
+{
+	if (decState == nullptr)
+		decState = std::make_unique<ProxyDecodeState<BUFFER>>();
+	return *decState;
+}
+
+template<class BUFFER, class NetProvider>
+ProxyEncodeState<BUFFER> &
+ProxyConnectionImpl<BUFFER, NetProvider>::encoding()
+{
+	if (encState == nullptr)
+		encState = std::make_unique<ProxyEncodeState<BUFFER>>();
+	return *encState;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnectionImpl<BUFFER, NetProvider>::releaseIdleBuffers()
 {
+	dropSentDecodedData();
+	if (decState != nullptr && decState->buf.empty())
+		decState.reset();
+	if (encState != nullptr && encState->buf.empty())
+		encState.reset();
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnectionImpl<BUFFER, NetProvider>::dropSentDecodedData()
+{
+	//dropBack()/dropFront() interfaces require number of bytes be greater
+	//than zero so let's check it first.
+	if (decState == nullptr || decState->sent == 0)
+		return;
+	decState->buf.dropFront(decState->sent);
+	hasReleasedData(this, decState->sent);
+	decState->sent = 0;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnectionImpl<BUFFER, NetProvider>::selectInput(const typename NetProvider::Stream_t *strm)
+{
+	if (decOwner == strm)
+		return;
+	dropSentDecodedData();
+	if (decState != nullptr && !decState->buf.empty())
+		parkedDecStates[decOwner] = std::move(decState);
+	decState.reset();
+	auto parked = parkedDecStates.find(strm);
+	if (parked != parkedDecStates.end()) {
+		decState = std::move(parked->second);
+		parkedDecStates.erase(parked);
+	}
+	decOwner = strm;
 }
 
 template<class BUFFER, class NetProvider>
@@ -196,6 +353,10 @@ public:
 	friend
 	void hasNotRecvBytes(ProxyConnection<B, N> &conn, size_t bytes);
 
+	template<class B, class N>
+	friend
+	void hasBufferedData(ProxyConnection<B, N> &conn, size_t bytes);
+
 	template<class B, class N>
 	friend
 	bool hasDecodedDataToSend(ProxyConnection<B, N> &conn);
@@ -211,7 +372,8 @@ public:
 	template<class B, class N>
 	friend
 	enum DecodeStatus processMessage(ProxyConnection<B, N> &conn,
-					  Message<B> *result);
+					  Message<B> *result,
+					  size_t cut_through_size);
 
 private:
 	ProxyConnectionImpl<BUFFER, NetProvider> *impl;
@@ -290,25 +452,39 @@ template<class BUFFER, class NetProvider>
 BUFFER&
 ProxyConnection<BUFFER, NetProvider>::getDecBuf()
 {
-	return impl->decBuffer;
+	return impl->decoding().buf;
 }
 
 template<class BUFFER, class NetProvider>
 BUFFER&
 ProxyConnection<BUFFER, NetProvider>::getEncBuf()
 {
-	return impl->encBuffer;
+	return impl->encoding().buf;
+}
+
+template<class BUFFER, class NetProvider>
+void
+hasBufferedData(ProxyConnection<BUFFER, NetProvider> &conn, size_t bytes)
+{
+	conn.impl->bufferedBytes += bytes;
+	conn.impl->connector.memory_.add(bytes);
+}
+
+template<class BUFFER, class NetProvider>
+void
+hasReleasedData(ProxyConnectionImpl<BUFFER, NetProvider> *impl, size_t bytes)
+{
+	assert(bytes <= impl->bufferedBytes);
+	impl->bufferedBytes -= bytes;
+	impl->connector.memory_.sub(bytes);
 }
 
 template<class BUFFER, class NetProvider>
 void
 hasSentDecodedData(ProxyConnection<BUFFER, NetProvider> &conn, size_t bytes)
 {
-	//dropBack()/dropFront() interfaces require number of bytes be greater
-	//than zero so let's check it first.
-	if (bytes > 0) {
-		conn.impl->decBuffer.dropFront(bytes);
-    }
+	/* See ProxyDecodeState::sent. */
+	conn.impl->decoding().sent += bytes;
 }
 
 template<class BUFFER, class NetProvider>
@@ -318,7 +494,8 @@ hasSentEncodedData(ProxyConnection<BUFFER, NetProvider> &conn, size_t bytes)
 	//dropBack()/dropFront() interfaces require number of bytes be greater
 	//than zero so let's check it first.
 	if (bytes > 0) {
-		conn.impl->encBuffer.dropFront(bytes);
+		conn.impl->encoding().buf.dropFront(bytes);
+		hasReleasedData(conn.impl, bytes);
     }
 }
 
@@ -326,62 +503,88 @@ template<class BUFFER, class NetProvider>
 void
 hasNotRecvBytes(ProxyConnection<BUFFER, NetProvider> &conn, size_t bytes)
 {
-	conn.impl->decBuffer.dropBack(bytes);
+	if (bytes > 0)
+		conn.impl->decoding().buf.dropBack(bytes);
 }
 
 template<class BUFFER, class NetProvider>
 bool
 hasDecodedDataToSend(ProxyConnection<BUFFER, NetProvider> &conn)
 {
-	return !conn.impl->decBuffer.empty();
+	auto *state = conn.impl->decState.get();
+	return state != nullptr &&
+	       state->buf.has(state->buf.template begin<true>(), state->sent + 1);
 }
 
 template<class BUFFER, class NetProvider>
 bool
 hasEncodedDataToSend(ProxyConnection<BUFFER, NetProvider> &conn)
 {
-	return !conn.impl->encBuffer.empty();
+	return conn.impl->encState != nullptr &&
+	       !conn.impl->encState->buf.empty();
 }
 
 template<class BUFFER, class NetProvider>
 bool
 hasDataToDecode(ProxyConnection<BUFFER, NetProvider> &conn)
 {
-	assert(conn.impl->endDecoded < conn.impl->decBuffer.end() ||
-	       conn.impl->endDecoded == conn.impl->decBuffer.end());
-	return conn.impl->endDecoded != conn.impl->decBuffer.end();
+	auto *state = conn.impl->decState.get();
+	if (state == nullptr)
+		return false;
+	assert(state->endDecoded < state->buf.end() ||
+	       state->endDecoded == state->buf.end());
+	return state->endDecoded != state->buf.end();
 }
 
+/**
+ * Decode the next message. If the message is not received whole but is
+ * not smaller than @a cut_through_size (if it is not zero), decode only
+ * its header and mark it as streamed; all received bytes are considered
+ * decoded then.
+ */
 template<class BUFFER, class NetProvider>
 DecodeStatus
 processMessage(ProxyConnection<BUFFER, NetProvider> &conn,
-		Message<BUFFER> *result)
+		Message<BUFFER> *result, size_t cut_through_size)
 {
-	if (! conn.impl->decBuffer.has(conn.impl->endDecoded, MP_RESPONSE_SIZE)) {
+	auto &state = conn.impl->decoding();
+	if (! state.buf.has(state.endDecoded, MP_RESPONSE_SIZE)) {
 		return DECODE_NEEDMORE;
     }
 
 	Message<BUFFER> message;
-	message.size = conn.impl->dec.decodeMessageSize();
+	message.size = state.dec.decodeMessageSize();
 	if (message.size < 0) {
 		LOG_ERROR("Failed to decode message size");
         return DECODE_ERR;
 	}
 	message.size += MP_RESPONSE_SIZE;
-	if (! conn.impl->decBuffer.has(conn.impl->endDecoded, message.size)) {
-        conn.impl->dec.reset(conn.impl->endDecoded);
-		return DECODE_NEEDMORE;
+	if (! state.buf.has(state.endDecoded, message.size)) {
+		if (cut_through_size == 0 ||
+		    (size_t) message.size < cut_through_size ||
+		    !state.buf.has(state.endDecoded,
+				   MP_RESPONSE_SIZE + CONN_HEADER_MAX)) {
+			state.dec.reset(state.endDecoded);
+			return DECODE_NEEDMORE;
+		}
+		if (state.dec.decodeHeader(message) != 0)
+			return DECODE_ERR;
+		message.streamed = true;
+		*result = std::move(message);
+		state.endDecoded += state.buf.end() - state.endDecoded;
+		state.dec.reset(state.endDecoded);
+		return DECODE_SUCC;
 	}
-	if (conn.impl->dec.decodeMessage(message) != 0) {
+	if (state.dec.decodeMessage(message) != 0) {
 		LOG_ERROR("Failed to decode message");
-		conn.impl->endDecoded += message.size;
+		state.endDecoded += message.size;
 		return DECODE_ERR;
 	}
 
     *result = std::move(message);
 
-    conn.impl->endDecoded += message.size;
-    conn.impl->dec.reset(conn.impl->endDecoded);
+    state.endDecoded += message.size;
+    state.dec.reset(state.endDecoded);
 
 	return DECODE_SUCC;
 }
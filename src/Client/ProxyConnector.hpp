@@ -29,24 +29,50 @@
  * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
  * SUCH DAMAGE.
  */
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <list>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
 
 #include "ProxyConnection.hpp"
+#include "ProxyBatch.hpp"
+#include "ProxyCache.hpp"
+#include "ProxyFanOut.hpp"
+#include "ProxyMemory.hpp"
+#include "ProxyOptions.hpp"
+#include "ProxyPipeline.hpp"
+#include "ProxyProjection.hpp"
+#include "ProxyQos.hpp"
+#include "ProxyRange.hpp"
+#include "ProxyReplica.hpp"
+#include "ProxySql.hpp"
+#include "ProxyTunnel.hpp"
 
 #ifdef TNTCXX_ENABLE_SSL
 #include "UnixSSLStream.hpp"
 #else
 #include "UnixPlainStream.hpp"
 #endif
+#ifdef TNTCXX_ENABLE_ZLIB
+#include "UnixZlibStream.hpp"
+#endif
 
 #include "../Utils/Timer.hpp"
 
 #include <set>
 
 #ifdef TNTCXX_ENABLE_SSL
-using DefaultStream = UnixSSLStream;
+using DefaultTransportStream = UnixSSLStream;
+#else
+using DefaultTransportStream = UnixPlainStream;
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+using DefaultStream = UnixZlibStream<DefaultTransportStream>;
 #else
-using DefaultStream = UnixPlainStream;
+using DefaultStream = DefaultTransportStream;
 #endif
 
 /**
@@ -66,17 +92,87 @@ template<class BUFFER, class NetProvider = DefaultNetProvider<BUFFER>>
 class ProxyConnector
 {
 public:
-	ProxyConnector(const std::vector<ConnectOptions>& opts, const std::string &listen_addr, uint16_t &listen_port);
+	using Buffer_t = BUFFER;
+	ProxyConnector(const std::vector<ConnectOptions>& opts, const std::string &listen_addr, uint16_t &listen_port,
+		       const ProxyOptions &proxy_opts = {});
+	/** Proxy without listeners: they must be added via addListener(). */
+	explicit ProxyConnector(const std::vector<ConnectOptions>& opts,
+				const ProxyOptions &proxy_opts = {});
 	~ProxyConnector();
 	ProxyConnector(const ProxyConnector& connector) = delete;
 	ProxyConnector& operator = (const ProxyConnector& connector) = delete;
 	//////////////////////////////Main API//////////////////////////////////
 	/**
-     * Start the proxy server.
-     * Returns 0 on success, -1 on error.
-     */
-    void start();
+	 * Start the proxy server. Received messages are passed to
+	 * customHandler() which must be defined by user.
+	 */
+	void start();
+	/**
+	 * Add endpoint to listen on. Address and service are resolved as
+	 * for ConnectOptions: empty service (or "unix") means that
+	 * @a address is a path to unix domain socket, otherwise it is an
+	 * IPv4 or IPv6 address. Must be called before start().
+	 */
+	void addListener(const std::string &address, const std::string &service);
+	/**
+	 * The same, with all options of @a endpoint. If its transport is
+	 * STREAM_SSL, TLS of clients is terminated by the proxy using
+	 * certificate and key of @a endpoint; clients are verified if CA
+	 * is set. If its compress_level is set, traffic of clients is
+	 * compressed (see UnixZlibStream), e.g. a tunnel from another proxy
+	 * connecting to this one with the same option. Connections to
+	 * instances are not affected.
+	 */
+	void addListener(const ConnectOptions &endpoint);
+	/**
+	 * Accept clients on already listening socket @a fd as well. The
+	 * descriptor is duplicated, so the same socket may be passed to
+	 * proxies running in several threads (see
+	 * ProxyOptions::exclusive_accept). Must be called before start().
+	 */
+	int addListenerFd(int fd);
+	/**
+	 * Create non-blocking socket listening on @a endpoint.
+	 * Return its descriptor, -1 on error.
+	 */
+	static int bindListener(const ConnectOptions &endpoint,
+				int backlog = ProxyOptions::DEFAULT_LISTEN_BACKLOG);
+	/**
+	 * Start the proxy server. Received messages are passed to @a handler,
+	 * which is invoked as handler(proxy) (see Pipeline). Return once
+	 * stop() is called.
+	 */
+	template<class Handler>
+	void start(Handler &handler);
 	void acceptConnections();
+	template<class Handler>
+	void acceptConnections(Handler &handler);
+	/**
+	 * Bind all listening sockets. Return 0 on success, -1 on error.
+	 * Called by start(); the proxy embedded into another event loop
+	 * calls it once and then calls poll().
+	 */
+	int listen();
+	/**
+	 * Process events ready within @a timeout ms (-1 waits for them)
+	 * passing received messages to @a handler, then return number of
+	 * events. Return -1 if the proxy is stopped or polling failed.
+	 */
+	template<class Handler>
+	int poll(Handler &handler, int timeout = 0);
+	/** Descriptor which is readable when poll() has events to process. */
+	int getPollFd() const;
+	/**
+	 * Milliseconds the event loop may wait for getPollFd() before
+	 * calling poll() anyway, -1 if there is no limit.
+	 */
+	int getPollTimeout() const;
+	/**
+	 * Make start() or poll() return as soon as possible. Safe to call
+	 * from a stage, another thread or a signal handler.
+	 */
+	void stop();
+	bool isStopped() const { return stopped_; }
 
 	void customHandler();
 	void setCurrentReceiver(ProxyConnection<BUFFER, NetProvider> *conn, typename NetProvider::Stream_t *recv_strm);
@@ -87,16 +183,56 @@ public:
 	typename NetProvider::Stream_t& connect(int instance_index);
 	int sendDecodedToStream(typename NetProvider::Stream_t &strm, int size);
 	int sendDecodedToClient(int size);
+	/**
+	 * Send copy of the last decoded message to @a strm. The message
+	 * stays in the buffer, so it may be sent to several instances and
+	 * must be skipped afterwards.
+	 */
+	int copyDecodedToStream(typename NetProvider::Stream_t &strm, int size);
+	/**
+	 * Append raw bytes of the last decoded message to @a out, e.g. to
+	 * send it again later with sendBufferToStream().
+	 */
+	void copyDecodedMessage(std::string &out, int size);
 	void skipLastDecodedMessage(int size);
 
 	int sendEncodedToStream(typename NetProvider::Stream_t &strm, int size);
+	/** Send whole @a buf, e.g. request encoded by a stage. */
+	int sendBufferToStream(typename NetProvider::Stream_t &strm, BUFFER &buf);
 	int sendEncodedToClient(int size);
 	void skipLastEncodedMessage(int size);
+	/**
+	 * Pass all further traffic between the current client and
+	 * instance stream @a strm in kernel via splice(2), the proxy
+	 * doesn't see it any more: e.g. bulk transfers of a user after
+	 * AUTH. Data received but not passed yet is sent first. Streams
+	 * must be neither encrypted nor compressed and traffic capture
+	 * must be off. Return 0 on success, -1 if the connection is not
+	 * changed.
+	 */
+	int startTunnel(typename NetProvider::Stream_t &strm);
 
 	bool isClientFirstRequest();
 	bool isConnectedToInstance(int intance_id);
 	std::vector<int> getConnectedInstances();
 	bool isRecvFromClient();
+	/** Index of instance the current message is from, -1 for client. */
+	int getRecvInstance();
+	/**
+	 * Set weight of the current client in fair scheduling, e.g. by
+	 * its address or first request. Weight must be positive.
+	 */
+	void setClientWeight(unsigned weight);
+	/**
+	 * Set priority class of requests of the current client which
+	 * are not classified by function, space or type (see
+	 * ProxyOptions::qos_in_flight).
+	 */
+	void setClientClass(unsigned cls);
+	/** Descriptor of client socket of the current connection. */
+	int getClientFd();
+	/** User the current client is authenticated as. */
+	const std::string &getClientUser();
 	bool isGreetingExpected();
 	int deliverDecodedGreeting();
 
@@ -108,74 +244,334 @@ public:
 	int createMessage(int sync, int schema_id);
 	template <class T>
 	int createMessage(int sync, int schema_id, const T *data = nullptr);
+	/** Encode error response to client, return its size. */
+	int createError(int sync, int schema_id, uint32_t errcode,
+			const std::string &msg);
 	
 	std::vector<ConnectOptions> opts_;
+	ProxyOptions proxy_opts_;
+	/** Accounting of memory held by connection buffers. */
+	ProxyMemoryGovernor memory_;
+	/** Sampled requests, see ProxyOptions::trace_sample_rate. */
+	ProxyTracer tracer_;
+	/** Priority classes, see ProxyOptions::qos_in_flight. */
+	ProxyQos qos_;
+	/** Bytes and whole messages passed by tunnels, see startTunnel(). */
+	size_t tunnel_bytes = 0;
+	size_t tunnel_frames = 0;
+
+	/**
+	 * Client of @a conn is closed: release slots of its requests in
+	 * flight and forget it is waiting for one.
+	 */
+	void releaseQos(ProxyConnection<BUFFER, NetProvider> &conn);
 
 private:
+	/** True if last decoded message of @a size is not received whole. */
+	bool isStreamed(int size);
+	/**
+	 * Start trace of sampled request @a message or find the trace of
+	 * request @a message responds to.
+	 */
+	void traceMessage(Message<BUFFER> &message, bool from_client);
+	/** Traced message has been passed to @a strm. */
+	void traceSent(typename NetProvider::Stream_t &strm);
+	/** Forget trace of the last message: it is dropped. */
+	void traceSkipped();
+	/** Index of instance @a strm of the current connection is to. */
+	int instanceOf(typename NetProvider::Stream_t &strm);
+	/**
+	 * Account the last decoded request sent to @a strm in its class.
+	 * Return false if the class has no free slot on the instance: the
+	 * request is returned to the input buffer and the client is held
+	 * until a request of the class completes.
+	 */
+	bool acquireQos(typename NetProvider::Stream_t &strm, int size);
+	/**
+	 * Request of class @a cls to @a instance is completed: hand its
+	 * slot over to the first held client, if any.
+	 */
+	void releaseQosSlot(int instance, unsigned cls);
+
+	/** Trace of the last decoded message, null if it is not traced. */
+	RequestTrace *current_trace_ = nullptr;
+	/** Sync and class of the last decoded request, if QoS is enabled. */
+	std::optional<std::pair<uint32_t, unsigned>> current_qos_;
+	/** Clients held by (instance, class), in order of arrival. */
+	std::map<std::pair<int, unsigned>,
+		 std::deque<ProxyConnection<BUFFER, NetProvider> *>> qos_waiters_;
+
 	NetProvider m_NetProvider_;
 	ProxyConnection<BUFFER, NetProvider> *current_conn;
 	typename NetProvider::Stream_t *current_strm;
 
-	std::string listen_addr_;
-	uint16_t listen_port_;
+	/** Set by stop(), lock-free so that it is signal-safe. */
+	std::atomic<bool> stopped_{false};
+	std::vector<ConnectOptions> listen_opts_;
+	/** Descriptors passed to addListenerFd(). */
+	std::vector<int> listen_fds_;
+#ifdef TNTCXX_ENABLE_SSL
+	/** Contexts of TLS listeners; list keeps their addresses stable. */
+	std::list<SSLContext> tls_ctxs_;
+#endif
 	static constexpr int MAX_OPEN_CONNECTIONS = 128;
 };
 
 template<class BUFFER, class NetProvider>
 ProxyConnector<BUFFER, NetProvider>::ProxyConnector(const std::vector<ConnectOptions>& opts,
 												    const std::string &listen_addr,
-													uint16_t &listen_port) :
-										opts_(opts), m_NetProvider_(*this), 
-								 		listen_addr_(listen_addr), listen_port_(listen_port)
+													uint16_t &listen_port,
+													const ProxyOptions &proxy_opts) :
+										opts_(opts), proxy_opts_(proxy_opts), m_NetProvider_(*this)
 {
+	memory_.setLimits(proxy_opts.memory_soft_limit, proxy_opts.memory_hard_limit);
+	tracer_.configure(proxy_opts.trace_sample_rate,
+			  proxy_opts.slow_request_usec, proxy_opts.slow_log_size);
+	qos_.configure(proxy_opts);
+	addListener(listen_addr, std::to_string(listen_port));
+}
+
+template<class BUFFER, class NetProvider>
+ProxyConnector<BUFFER, NetProvider>::ProxyConnector(const std::vector<ConnectOptions>& opts,
+						    const ProxyOptions &proxy_opts) :
+	opts_(opts), proxy_opts_(proxy_opts), m_NetProvider_(*this)
+{
+	memory_.setLimits(proxy_opts.memory_soft_limit, proxy_opts.memory_hard_limit);
+	tracer_.configure(proxy_opts.trace_sample_rate,
+			  proxy_opts.slow_request_usec, proxy_opts.slow_log_size);
+	qos_.configure(proxy_opts);
 }
 
 template<class BUFFER, class NetProvider>
 ProxyConnector<BUFFER, NetProvider>::~ProxyConnector()
 {
+	for (int fd : listen_fds_)
+		::close(fd);
+	for (auto &endpoint : listen_opts_) {
+		if (endpoint.service.empty() || endpoint.service == "unix")
+			::unlink(endpoint.address.c_str());
+	}
 }
 
 template<class BUFFER, class NetProvider>
-void ProxyConnector<BUFFER, NetProvider>::start()
+void
+ProxyConnector<BUFFER, NetProvider>::addListener(const std::string &address,
+						 const std::string &service)
+{
+	ConnectOptions endpoint;
+	endpoint.address = address;
+	endpoint.service = service;
+	addListener(endpoint);
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::addListener(const ConnectOptions &endpoint)
 {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-		LOG_ERROR("Socket creation failed", strerror(errno));
-        return;
-    }
+	listen_opts_.push_back(endpoint);
+}
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-		LOG_ERROR("Setsockopt failed", strerror(errno));
-        return;
-    }
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::addListenerFd(int fd)
+{
+	int own_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (own_fd < 0) {
+		LOG_ERROR("Failed to duplicate listening socket: ", strerror(errno));
+		return -1;
+	}
+	/* Accept loop relies on EAGAIN when the queue is drained. */
+	int flags = fcntl(own_fd, F_GETFL);
+	if (flags < 0 || fcntl(own_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		LOG_ERROR("Failed to make listening socket non-blocking: ",
+			  strerror(errno));
+		::close(own_fd);
+		return -1;
+	}
+	listen_fds_.push_back(own_fd);
+	return 0;
+}
+
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::bindListener(const ConnectOptions &endpoint,
+						  int backlog)
+{
+	bool is_unix = endpoint.service.empty() || endpoint.service == "unix";
+	AddrInfo addr_info(endpoint.address, endpoint.service);
+	if (addr_info.last_rc() != 0) {
+		LOG_ERROR("Failed to resolve ", endpoint.address, ":",
+			  endpoint.service, ": ", addr_info.last_error());
+		return -1;
+	}
+	if (is_unix) {
+		/* Remove socket file left by previous run. */
+		struct stat st;
+		if (stat(endpoint.address.c_str(), &st) == 0 &&
+		    S_ISSOCK(st.st_mode))
+			::unlink(endpoint.address.c_str());
+	}
+	for (auto &inf : addr_info) {
+		int server_fd = socket(inf.ai_family,
+				       inf.ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				       inf.ai_protocol);
+		if (server_fd < 0) {
+			LOG_ERROR("Socket creation failed: ", strerror(errno));
+			continue;
+		}
+		int opt = 1;
+		if (!is_unix && setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR,
+					   &opt, sizeof(opt)) < 0) {
+			LOG_ERROR("Setsockopt failed: ", strerror(errno));
+			::close(server_fd);
+			continue;
+		}
+		/* Let "::" and "0.0.0.0" listen on the same port. */
+		if (inf.ai_family == AF_INET6 &&
+		    setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY,
+			       &opt, sizeof(opt)) < 0) {
+			LOG_ERROR("Setsockopt failed: ", strerror(errno));
+			::close(server_fd);
+			continue;
+		}
+		if (bind(server_fd, inf.ai_addr, inf.ai_addrlen) < 0) {
+			LOG_ERROR("Bind to ", endpoint.address, ":",
+				  endpoint.service, " failed: ", strerror(errno));
+			::close(server_fd);
+			continue;
+		}
+		if (::listen(server_fd, backlog) < 0) {
+			LOG_ERROR("Listen failed: ", strerror(errno));
+			::close(server_fd);
+			continue;
+		}
+		return server_fd;
+	}
+	return -1;
+}
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(listen_addr_.c_str());
-    addr.sin_port = htons(listen_port_);
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::listen()
+{
+	if (listen_opts_.empty() && listen_fds_.empty()) {
+		LOG_ERROR("No endpoints to listen on");
+		return -1;
+	}
+	for (auto &endpoint : listen_opts_) {
+#ifdef TNTCXX_ENABLE_SSL
+		SSL_CTX *tls_ctx = nullptr;
+		if (endpoint.transport == STREAM_SSL) {
+			SSLContext &ctx = tls_ctxs_.emplace_back();
+			if (ctx.create_server(endpoint, proxy_opts_.ktls,
+					      proxy_opts_.tls_session_cache_size) != 0) {
+				LOG_ERROR("Failed to create TLS context for ",
+					  endpoint, ": ", ctx.get_last_error());
+				return -1;
+			}
+			tls_ctx = ctx;
+		}
+#else
+		if (endpoint.transport != STREAM_PLAIN) {
+			LOG_ERROR("TLS listeners are unsupported in this build, "
+				  "consider enabling it with -DTNTCXX_ENABLE_SSL");
+			return -1;
+		}
+#endif
+#ifndef TNTCXX_ENABLE_ZLIB
+		if (endpoint.compress_level != 0) {
+			LOG_ERROR("Compressed listeners are unsupported in this "
+				  "build, consider enabling it with "
+				  "-DTNTCXX_ENABLE_ZLIB");
+			return -1;
+		}
+#endif
+		int server_fd = bindListener(endpoint, proxy_opts_.listen_backlog);
+		if (server_fd < 0)
+			return -1;
+#ifdef TNTCXX_ENABLE_SSL
+		m_NetProvider_.AddServerFd(server_fd, tls_ctx);
+#else
+		m_NetProvider_.AddServerFd(server_fd);
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+		if (endpoint.compress_level != 0)
+			m_NetProvider_.CompressServerFd(server_fd,
+							endpoint.compress_level);
+#endif
+		LOG_INFO("Listening on ", endpoint);
+	}
+	for (int fd : listen_fds_)
+		m_NetProvider_.AddServerFd(fd);
+	listen_fds_.clear();
+	return 0;
+}
 
-    if (bind(server_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
-		LOG_ERROR("Bind failed", strerror(errno));
-        return;
-    }
+template<class BUFFER, class NetProvider>
+void ProxyConnector<BUFFER, NetProvider>::start()
+{
+	if (listen() != 0)
+		return;
+	acceptConnections();
+}
 
-    if (listen(server_fd, 128) < 0) {
-		LOG_ERROR("Listen failed", strerror(errno));
-        return;
-    }
-	m_NetProvider_.SetServerFd(server_fd);
-    acceptConnections();
+template<class BUFFER, class NetProvider>
+template<class Handler>
+void ProxyConnector<BUFFER, NetProvider>::start(Handler &handler)
+{
+	if (listen() != 0)
+		return;
+	acceptConnections(handler);
 }
 
 template<class BUFFER, class NetProvider>
 void ProxyConnector<BUFFER, NetProvider>::acceptConnections()
 {
-	LOG_INFO("Server started on: ", listen_addr_, ":", listen_port_);
-    while (true) {
+	LOG_INFO("Server started");
+	while (!stopped_) {
 		m_NetProvider_.Wait();
-    }
+	}
+	LOG_INFO("Server stopped");
+}
+
+template<class BUFFER, class NetProvider>
+template<class Handler>
+void ProxyConnector<BUFFER, NetProvider>::acceptConnections(Handler &handler)
+{
+	LOG_INFO("Server started");
+	while (!stopped_) {
+		m_NetProvider_.Wait(handler);
+	}
+	LOG_INFO("Server stopped");
+}
+
+template<class BUFFER, class NetProvider>
+template<class Handler>
+int ProxyConnector<BUFFER, NetProvider>::poll(Handler &handler, int timeout)
+{
+	if (stopped_)
+		return -1;
+	int rc = m_NetProvider_.Poll(handler, timeout);
+	return stopped_ ? -1 : rc;
+}
+
+template<class BUFFER, class NetProvider>
+int ProxyConnector<BUFFER, NetProvider>::getPollFd() const
+{
+	return m_NetProvider_.m_AllEpollFd;
+}
+
+template<class BUFFER, class NetProvider>
+int ProxyConnector<BUFFER, NetProvider>::getPollTimeout() const
+{
+	return m_NetProvider_.PollTimeout();
+}
+
+template<class BUFFER, class NetProvider>
+void ProxyConnector<BUFFER, NetProvider>::stop()
+{
+	stopped_ = true;
+	m_NetProvider_.Wakeup();
 }
 
 template<class BUFFER, class NetProvider>
@@ -189,9 +585,28 @@ template<class BUFFER, class NetProvider>
 std::optional<Message<BUFFER>>
 ProxyConnector<BUFFER, NetProvider>::getNextDecodedMessage()
 {
+	/* Previous message is destroyed, data it points to can be dropped. */
+	auto *impl = current_conn->getImpl();
+	impl->dropSentDecodedData();
+	current_trace_ = nullptr;
+	current_qos_.reset();
 	if (hasDataToDecode(*current_conn)) {
+		bool from_client = isRecvFromClient();
+		/* Held request is decoded again once it gets a slot. */
+		if (from_client && impl->held)
+			return std::nullopt;
+		bool is_fair = from_client && proxy_opts_.fair_quantum != 0;
+		if (is_fair && impl->deficit <= 0) {
+			/* The rest waits for the next turn of the client. */
+			impl->throttled = true;
+			return std::nullopt;
+		}
         Message<BUFFER> message;
-		DecodeStatus rc = processMessage(*current_conn, &message);
+		/* Requests must be received whole to be routed. */
+		size_t cut_through_size = from_client ? 0 :
+					  proxy_opts_.cut_through_size;
+		DecodeStatus rc = processMessage(*current_conn, &message,
+						 cut_through_size);
 		if (rc == DECODE_ERR)
 			return std::nullopt;
 
@@ -199,6 +614,40 @@ ProxyConnector<BUFFER, NetProvider>::getNextDecodedMessage()
 			return std::nullopt;
 		assert(rc == DECODE_SUCC);
 
+		if (is_fair)
+			impl->deficit -= proxy_opts_.fair_by_bytes ? message.size : 1;
+		if (from_client && message.header.code == Iproto::AUTH &&
+		    message.body.user_name.has_value()) {
+			impl->user = *message.body.user_name;
+			auto weight = proxy_opts_.user_weights.find(
+				*message.body.user_name);
+			if (weight != proxy_opts_.user_weights.end())
+				impl->weight = weight->second;
+			auto cls = qos_.classOfUser(*message.body.user_name);
+			if (cls.has_value())
+				impl->qosClass = cls;
+		}
+		if (qos_.enabled() && from_client) {
+			unsigned cls = qos_.classify(message.header.code,
+						     message.body.space_id,
+						     message.body.function_name,
+						     impl->qosClass);
+			current_qos_.emplace(message.header.sync, cls);
+		} else if (qos_.enabled() && !impl->qosInFlight.empty()) {
+			auto range = impl->qosInFlight.equal_range(
+				message.header.sync);
+			int instance = instanceOf(*current_strm);
+			/* Responses of copies of the request are not counted. */
+			for (auto it = range.first; it != range.second; ++it) {
+				if (it->second.first != instance)
+					continue;
+				releaseQosSlot(instance, it->second.second);
+				impl->qosInFlight.erase(it);
+				break;
+			}
+		}
+		if (tracer_.enabled())
+			traceMessage(message, from_client);
 		return message;
 	}
 	return std::nullopt;
@@ -209,7 +658,22 @@ int
 ProxyConnector<BUFFER, NetProvider>::sendDecodedToStream(typename NetProvider::Stream_t &strm, int size)
 {
 	assert(strm.get_fd() > 0);
-	return m_NetProvider_.sendDec(*current_conn, strm, size);
+	if (isStreamed(size)) {
+		/* Only responses are streamed, and only to client. */
+		assert(&strm == &current_conn->get_client_strm());
+		int rc = m_NetProvider_.startCutThrough(*current_conn,
+							*current_strm, size,
+							true);
+		if (rc >= 0 && current_trace_ != nullptr)
+			traceSent(strm);
+		return rc;
+	}
+	if (current_qos_.has_value() && !acquireQos(strm, size))
+		return 0;
+	int rc = m_NetProvider_.sendDec(*current_conn, strm, size);
+	if (rc >= 0 && current_trace_ != nullptr)
+		traceSent(strm);
+	return rc;
 }
 
 template<class BUFFER, class NetProvider>
@@ -219,9 +683,56 @@ ProxyConnector<BUFFER, NetProvider>::sendDecodedToClient(int size)
 	return sendDecodedToStream(current_conn->get_client_strm(), size);
 }
 
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::copyDecodedToStream(typename NetProvider::Stream_t &strm, int size)
+{
+	assert(strm.get_fd() > 0);
+	int rc = m_NetProvider_.sendDec(*current_conn, strm, size, false);
+	if (rc >= 0 && current_trace_ != nullptr)
+		traceSent(strm);
+	return rc;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::copyDecodedMessage(std::string &out, int size)
+{
+	assert(!isStreamed(size));
+	auto &state = current_conn->getImpl()->decoding();
+	size_t decoded = state.endDecoded - state.buf.template begin<true>();
+	auto start = state.buf.template begin<true>() + (decoded - size);
+	size_t old_size = out.size();
+	out.resize(old_size + size);
+	start.get({out.data() + old_size, (size_t) size});
+}
+
 template<class BUFFER, class NetProvider>
 void
 ProxyConnector<BUFFER, NetProvider>::skipLastDecodedMessage(int size)
+{
+	if (current_trace_ != nullptr && isRecvFromClient())
+		traceSkipped();
+	if (isStreamed(size)) {
+		m_NetProvider_.startCutThrough(*current_conn, *current_strm,
+					       size, false);
+		return;
+	}
+	hasSentDecodedData(*current_conn, size);
+}
+
+template<class BUFFER, class NetProvider>
+bool
+ProxyConnector<BUFFER, NetProvider>::isStreamed(int size)
+{
+	auto &buf = current_conn->getDecBuf();
+	auto start = buf.template begin<true>() + current_conn->getImpl()->decoding().sent;
+	return (size_t) (buf.template end<true>() - start) < (size_t) size;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::skipLastEncodedMessage(int size)
 {
 	hasSentEncodedData(*current_conn, size);
 }
@@ -231,7 +742,22 @@ int
 ProxyConnector<BUFFER, NetProvider>::sendEncodedToStream(typename NetProvider::Stream_t &strm, int size)
 {
 	assert(strm.get_fd() > 0);
-	return m_NetProvider_.sendEnc(*current_conn, strm, size);
+	int rc = m_NetProvider_.sendEnc(*current_conn, strm, size);
+	if (rc >= 0 && current_trace_ != nullptr)
+		traceSent(strm);
+	return rc;
+}
+
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::sendBufferToStream(typename NetProvider::Stream_t &strm,
+							BUFFER &buf)
+{
+	assert(strm.get_fd() > 0);
+	int rc = m_NetProvider_.sendBuf(*current_conn, strm, buf);
+	if (rc >= 0 && current_trace_ != nullptr)
+		traceSent(strm);
+	return rc;
 }
 
 template<class BUFFER, class NetProvider>
@@ -249,13 +775,189 @@ ProxyConnector<BUFFER, NetProvider>::connect(int instance_index)
 	assert(instance_index >= 0);
 	auto it = current_conn->getImpl()->instance_index_to_strm.find(instance_index);
 	bool is_new_strm = it == current_conn->getImpl()->instance_index_to_strm.end();
-	if (is_new_strm) {
+	if (current_trace_ != nullptr &&
+	    current_trace_->at[TRACE_ROUTED] == 0) {
+		current_trace_->at[TRACE_ROUTED] = ProxyTracer::now();
+		current_trace_->instance = instance_index;
+	}
+	if (is_new_strm || it->second.get_fd() < 0) {
 		auto &strm = m_NetProvider_.connect(*current_conn, instance_index);
 		return strm;
 	}
 	return it->second;
 }
 
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::traceMessage(Message<BUFFER> &message,
+						  bool from_client)
+{
+	auto *impl = current_conn->getImpl();
+	uint32_t sync = message.header.sync;
+	if (!from_client) {
+		auto it = impl->traces.find(sync);
+		if (it == impl->traces.end())
+			return;
+		current_trace_ = &it->second;
+		/* The first response of several instances is traced. */
+		if (current_trace_->at[TRACE_RESPONSE] == 0)
+			current_trace_->at[TRACE_RESPONSE] = impl->recvTime;
+		return;
+	}
+	if (!tracer_.sample())
+		return;
+	RequestTrace &trace = impl->traces[sync];
+	trace = RequestTrace{};
+	trace.code = message.header.code;
+	trace.sync = sync;
+	trace.space_id = message.body.space_id;
+	trace.at[TRACE_RECV] = impl->recvTime;
+	trace.at[TRACE_DECODED] = ProxyTracer::now();
+	current_trace_ = &trace;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::traceSent(typename NetProvider::Stream_t &strm)
+{
+	RequestTrace &trace = *current_trace_;
+	uint64_t now = ProxyTracer::now();
+	if (&strm == &current_conn->get_client_strm()) {
+		trace.at[TRACE_REPLIED] = now;
+		tracer_.finish(trace);
+		current_conn->getImpl()->traces.erase(trace.sync);
+		current_trace_ = nullptr;
+		return;
+	}
+	if (trace.at[TRACE_SENT] != 0)
+		return;
+	trace.at[TRACE_SENT] = now;
+	if (trace.at[TRACE_ROUTED] != 0)
+		return;
+	/* Stream of instance is taken bypassing connect(). */
+	trace.at[TRACE_ROUTED] = now;
+	trace.instance = instanceOf(strm);
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::traceSkipped()
+{
+	current_conn->getImpl()->traces.erase(current_trace_->sync);
+	current_trace_ = nullptr;
+}
+
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::instanceOf(typename NetProvider::Stream_t &strm)
+{
+	for (auto &s : current_conn->getImpl()->instance_index_to_strm) {
+		if (&s.second == &strm)
+			return s.first;
+	}
+	return -1;
+}
+
+template<class BUFFER, class NetProvider>
+bool
+ProxyConnector<BUFFER, NetProvider>::acquireQos(typename NetProvider::Stream_t &strm,
+						int size)
+{
+	if (&strm == &current_conn->get_client_strm())
+		return true;
+	auto *impl = current_conn->getImpl();
+	auto [sync, cls] = *current_qos_;
+	int instance = instanceOf(strm);
+	current_qos_.reset();
+	if (impl->qosGrant.has_value()) {
+		auto grant = *impl->qosGrant;
+		impl->qosGrant.reset();
+		if (grant == std::make_pair(instance, cls)) {
+			impl->qosInFlight.emplace(sync, grant);
+			return true;
+		}
+		/* The request was routed elsewhere since it was held. */
+		releaseQosSlot(grant.first, grant.second);
+	}
+	if (qos_.tryAcquire(instance, cls)) {
+		impl->qosInFlight.emplace(sync, std::make_pair(instance, cls));
+		return true;
+	}
+	qos_.held_count++;
+	auto &state = impl->decoding();
+	size_t decoded = state.endDecoded - state.buf.begin();
+	auto start = state.buf.begin() + (decoded - size);
+	state.endDecoded = start;
+	state.dec.reset(state.endDecoded);
+	if (proxy_opts_.fair_quantum != 0)
+		impl->deficit += proxy_opts_.fair_by_bytes ? size : 1;
+	if (current_trace_ != nullptr)
+		traceSkipped();
+	impl->held = true;
+	qos_waiters_[std::make_pair(instance, cls)].push_back(current_conn);
+	return false;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::releaseQosSlot(int instance, unsigned cls)
+{
+	auto waiters = qos_waiters_.find(std::make_pair(instance, cls));
+	if (waiters == qos_waiters_.end() || waiters->second.empty()) {
+		qos_.release(instance, cls);
+		return;
+	}
+	/* The slot stays taken, so the client can't be overtaken. */
+	auto *conn = waiters->second.front();
+	waiters->second.pop_front();
+	if (waiters->second.empty())
+		qos_waiters_.erase(waiters);
+	conn->getImpl()->qosGrant.emplace(instance, cls);
+	m_NetProvider_.resumeHeld(*conn);
+}
+
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::startTunnel(typename NetProvider::Stream_t &strm)
+{
+	/* Spliced bytes never reach the proxy. */
+	if (proxy_opts_.capture != nullptr) {
+		LOG_ERROR("Tunnels can't be used with traffic capture");
+		return -1;
+	}
+	if (m_NetProvider_.startTunnel(*current_conn, *current_strm, strm) != 0)
+		return -1;
+	/* Responses of requests in flight are not seen either. */
+	releaseQos(*current_conn);
+	return 0;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::releaseQos(ProxyConnection<BUFFER, NetProvider> &conn)
+{
+	auto *impl = conn.getImpl();
+	for (auto it = qos_waiters_.begin(); it != qos_waiters_.end();) {
+		auto &queue = it->second;
+		queue.erase(std::remove(queue.begin(), queue.end(), &conn),
+			    queue.end());
+		if (queue.empty())
+			it = qos_waiters_.erase(it);
+		else
+			++it;
+	}
+	auto in_flight = std::move(impl->qosInFlight);
+	impl->qosInFlight.clear();
+	for (auto &slot : in_flight)
+		releaseQosSlot(slot.second.first, slot.second.second);
+	if (impl->qosGrant.has_value()) {
+		auto grant = *impl->qosGrant;
+		impl->qosGrant.reset();
+		releaseQosSlot(grant.first, grant.second);
+	}
+	impl->held = false;
+}
+
 template<class BUFFER, class NetProvider>
 bool
 ProxyConnector<BUFFER, NetProvider>::isRecvFromClient()
@@ -263,6 +965,44 @@ ProxyConnector<BUFFER, NetProvider>::isRecvFromClient()
 	return current_conn->get_client_strm().get_fd() == current_strm->get_fd();
 }
 
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::getRecvInstance()
+{
+	if (isRecvFromClient())
+		return -1;
+	return instanceOf(*current_strm);
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::setClientWeight(unsigned weight)
+{
+	assert(weight > 0);
+	current_conn->getImpl()->weight = weight;
+}
+
+template<class BUFFER, class NetProvider>
+void
+ProxyConnector<BUFFER, NetProvider>::setClientClass(unsigned cls)
+{
+	current_conn->getImpl()->qosClass = cls;
+}
+
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::getClientFd()
+{
+	return current_conn->get_client_strm().get_fd();
+}
+
+template<class BUFFER, class NetProvider>
+const std::string &
+ProxyConnector<BUFFER, NetProvider>::getClientUser()
+{
+	return current_conn->getImpl()->user;
+}
+
 template<class BUFFER, class NetProvider>
 bool
 ProxyConnector<BUFFER, NetProvider>::isClientFirstRequest()
@@ -301,7 +1041,8 @@ int
 ProxyConnector<BUFFER, NetProvider>::deliverEncodedGreeting(char (&greeting_buf)[N])
 {
 	assert(!hasEncodedDataToSend(*current_conn));
-	current_conn->getImpl()->encBuffer.write(greeting_buf);
+	current_conn->getImpl()->encoding().buf.write(greeting_buf);
+	hasBufferedData(*current_conn, N);
 	return m_NetProvider_.sendEnc(*current_conn, current_conn->get_client_strm());
 }
 
@@ -312,8 +1053,15 @@ ProxyConnector<BUFFER, NetProvider>::deliverDecodedGreeting()
 	auto it = m_NetProvider_.greeting_expected_on_fd.find(current_strm->get_fd());
 	m_NetProvider_.greeting_expected_on_fd.erase(it);
 
-	current_conn->getImpl()->endDecoded += Iproto::GREETING_SIZE;
-    current_conn->getImpl()->dec.reset(current_conn->getImpl()->endDecoded);
+	auto &state = current_conn->getImpl()->decoding();
+	state.endDecoded += Iproto::GREETING_SIZE;
+	state.dec.reset(state.endDecoded);
+	/* Client expects one greeting however many instances are used. */
+	if (current_conn->getImpl()->greetingDelivered) {
+		hasSentDecodedData(*current_conn, Iproto::GREETING_SIZE);
+		return 0;
+	}
+	current_conn->getImpl()->greetingDelivered = true;
 	return m_NetProvider_.sendDec(*current_conn, current_conn->get_client_strm(), Iproto::GREETING_SIZE);
 }
 
@@ -329,12 +1077,28 @@ template <class T>
 int
 ProxyConnector<BUFFER, NetProvider>::createMessage(int sync, int schema_id, const T *data)
 {
-	return current_conn->getImpl()->enc.encodeOk(sync, schema_id, data);
+	int size = current_conn->getImpl()->encoding().enc.encodeOk(sync, schema_id, data);
+	hasBufferedData(*current_conn, size);
+	return size;
 }
 
 template<class BUFFER, class NetProvider>
 int
 ProxyConnector<BUFFER, NetProvider>::createMessage(int sync, int schema_id)
 {
-	return current_conn->getImpl()->enc.encodeOk(sync, schema_id);
+	int size = current_conn->getImpl()->encoding().enc.encodeOk(sync, schema_id);
+	hasBufferedData(*current_conn, size);
+	return size;
+}
+
+template<class BUFFER, class NetProvider>
+int
+ProxyConnector<BUFFER, NetProvider>::createError(int sync, int schema_id,
+						 uint32_t errcode,
+						 const std::string &msg)
+{
+	int size = current_conn->getImpl()->encoding().enc.encodeError(
+		sync, schema_id, errcode, msg);
+	hasBufferedData(*current_conn, size);
+	return size;
 }
\ No newline at end of file
@@ -31,9 +31,12 @@
  */
 
 #include <sys/eventfd.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include <assert.h>
@@ -42,9 +45,24 @@
 #include <cstring>
 #include <string>
 #include <string_view>
+#include <algorithm>
+#include <deque>
+#include <list>
 #include <set>
+#include <type_traits>
+#include <vector>
 
 #include "ProxyConnection.hpp"
+#include "ProxyMemory.hpp"
+#include "ProxyPipeline.hpp"
+#include "TrafficCapture.hpp"
+
+#ifdef TNTCXX_ENABLE_SSL
+#include "UnixSSLStream.hpp"
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+#include "UnixZlibStream.hpp"
+#endif
 
 template<class BUFFER, class NetProvider>
 class ProxyConnector;
@@ -61,22 +79,113 @@ public:
 	~ProxyEpollNetProvider();
 	void close(Stream_t &strm);
 	void close(Conn_t &conn);
-	/** Proxy to sockets; polling using epoll. */
+	/**
+	 * Proxy to sockets; polling using epoll. Received data is passed
+	 * to connector's customHandler().
+	 */
 	void Wait();
-	void SetServerFd(int fd);
-	void AcceptNewClient();
+	/** The same, but received data is passed to handler(connector). */
+	template<class Handler>
+	void Wait(Handler &&handler);
+	/**
+	 * Process events which are ready or arrive within @a timeout ms
+	 * (-1 means no limit) and return their number, -1 on error.
+	 */
+	template<class Handler>
+	int Poll(Handler &&handler, int timeout);
+	/**
+	 * Milliseconds Poll() may be postponed while m_AllEpollFd is not
+	 * readable, -1 if there is no limit: e.g. sockets which spent read
+	 * budget have no new events but must be read.
+	 */
+	int PollTimeout() const;
+	/** Make blocked Poll() return, safe in signal handlers. */
+	void Wakeup();
+	/** Start accepting clients on listening socket @a fd. */
+	void AddServerFd(int fd);
+#ifdef TNTCXX_ENABLE_SSL
+	/**
+	 * The same, but TLS of accepted clients is terminated with
+	 * @a tls_ctx unless it is null. Stream_t must be UnixSSLStream.
+	 */
+	void AddServerFd(int fd, SSL_CTX *tls_ctx);
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+	/**
+	 * Compress traffic of clients accepted on listening socket @a fd
+	 * with @a level. Stream_t must be UnixZlibStream.
+	 */
+	void CompressServerFd(int fd, int level);
+#endif
+	void AcceptNewClient(Stream_t &server_strm);
 
 	int m_AllEpollFd;
+	/** Eventfd waking Poll() up, has null stream in epoll. */
+	int m_WakeupFd;
 
 	//return 0 if all data from buffer was processed (sent or read);
 	//return -1 in case of errors;
 	//return 1 in case socket is blocked.
 	Stream_t& connect(Conn_t &conn, int instance_index);
-	int sendDec(Conn_t &conn, Stream_t &strm, int size = -1);
+	/**
+	 * Send decoded data to @a strm. Unless @a consume is false, sent
+	 * bytes are dropped from the input buffer.
+	 */
+	int sendDec(Conn_t &conn, Stream_t &strm, int size = -1,
+		    bool consume = true);
 	int sendEnc(Conn_t &conn, Stream_t &strm, int size = -1);
+	/**
+	 * Send whole @a buf (e.g. request made by proxy) to @a strm.
+	 * Nothing is kept for resending, so partial send is an error.
+	 */
+	int sendBuf(Conn_t &conn, Stream_t &strm, BUFFER &buf);
 	int recv(Conn_t &conn, Stream_t &strm);
+	/**
+	 * Message of @a size bytes received from backend stream @a strm
+	 * is streamed: pass its received part to client (or drop it unless
+	 * @a forward is set) and the rest as it arrives.
+	 */
+	int startCutThrough(Conn_t &conn, Stream_t &strm, size_t size,
+			    bool forward);
+	/**
+	 * Turn @a conn into a tunnel between its client and instance stream
+	 * @a strm: bytes are moved from socket to socket with splice()
+	 * through a pipe per direction and are not received to buffers.
+	 * Data left undecoded in the input buffer (received from @a from)
+	 * and not sent to client yet goes ahead of spliced data. Both
+	 * streams must be plain. Return 0 on success, -1 on error, the
+	 * connection is not changed then.
+	 */
+	int startTunnel(Conn_t &conn, Stream_t &from, Stream_t &strm);
+	/**
+	 * Read @a strm and pass data to handler until socket blocks or
+	 * read budget is spent. Return 0 if socket is drained, 1 if it may
+	 * have more data, -1 if connection is closed.
+	 */
+	template<class Handler>
+	int readStream(Conn_t &conn, Stream_t &strm, Handler &handler);
 
-	void addToEpoll(Conn_t *conn, Stream_t &strm);
+	/** Stop reading from client, see ProxyMemoryGovernor. */
+	void pauseClient(Conn_t &conn);
+	/** Stop accepting new clients. */
+	void pauseAccept();
+	/** Resume reading from all paused clients and accepting. */
+	void resumeAll();
+	/** Send responses left in buffers of paused clients. */
+	void flushPaused();
+	/**
+	 * Request held by connector (see ProxyQos) got a slot: process
+	 * input of the client again, without waiting for an event.
+	 */
+	void resumeHeld(Conn_t &conn);
+	bool isPaused(Conn_t &conn, Stream_t &strm);
+	/**
+	 * Client of @a conn is writable: send the rest of streamed
+	 * responses and resume reading of backends.
+	 */
+	void flushBlocked(Conn_t &conn);
+
+	void addToEpoll(Conn_t *conn, Stream_t &strm, uint32_t events = EPOLLIN);
 
 	Connector_t &m_Connector;
 
@@ -86,11 +195,149 @@ public:
 	std::map<int, int> instance_id_to_active_connetions;
 
 private:
-	Stream_t server_strm_; 
+	/** Listening sockets; list keeps their addresses stable for epoll. */
+	std::list<Stream_t> server_strms_;
 	static constexpr int TIMEOUT_INFINITY = -1;
 	static constexpr size_t EPOLL_EVENTS_MAX = 128;
+	/**
+	 * While clients are paused, resume them after being idle for this
+	 * many milliseconds: e.g. incomplete requests of paused clients
+	 * can't be drained otherwise.
+	 */
+	static constexpr int PAUSE_RECHECK_TIMEOUT = 100;
 
 	std::list<ProxyConnection<BUFFER, ProxyEpollNetProvider>> conns_;
+	/** Edge-triggered sockets which spent read budget. */
+	std::deque<Stream_t *> ready_strms_;
+	/** Streams closed during current Wait(), their events are stale. */
+	std::set<Stream_t *> closed_strms_;
+	/** Descriptors of clients closed since the handler was told. */
+	std::vector<int> closed_clients_;
+	/**
+	 * Tell @a handler which clients are closed (see
+	 * Pipeline::disconnected()) before their descriptors are reused.
+	 */
+	template<class Handler>
+	void notifyClosed(Handler &handler);
+	/** Clients paused by memory governor. */
+	std::set<Conn_t *> paused_clients_;
+	bool accept_paused_ = false;
+	/** Buffers were released since the last trim of the pool. */
+	bool trim_pending_ = false;
+
+	/** State of backend stream sending a message in cut-through mode. */
+	struct CutThrough {
+		/** Bytes of the message not received yet. */
+		size_t remaining;
+		/** Pass the message to client or drop it. */
+		bool forward;
+	};
+	/**
+	 * Receive the next part of streamed message from @a strm.
+	 * Return the same as recv().
+	 */
+	int passThrough(Conn_t &conn, Stream_t &strm, CutThrough &state);
+	/**
+	 * Stop reading backends of @a conn until its client takes
+	 * everything sent to it.
+	 */
+	void blockOnClient(Conn_t &conn);
+	void setEvents(Conn_t &conn, Stream_t &strm, uint32_t events);
+	/**
+	 * Remember @a strm if it buffered sent data (see UnixZlibStream),
+	 * it is flushed by flushCompressed().
+	 */
+	void deferFlush(Stream_t &strm);
+	/**
+	 * Flush streams which buffered data during the loop iteration, so
+	 * everything sent to a compressed stream in one iteration makes
+	 * one batch. Blocked streams wait for EPOLLOUT.
+	 */
+	void flushCompressed();
+
+	/**
+	 * True if @a strm holds received data which epoll doesn't know
+	 * about (i.e. decrypted by OpenSSL or inflated by zlib but not
+	 * read yet).
+	 */
+	static bool hasPendingInput(Stream_t &strm);
+	/**
+	 * Pass @a size bytes of @a iov to traffic capture if @a strm
+	 * is client of @a conn and capture is enabled.
+	 */
+	void capture(Conn_t &conn, Stream_t &strm, CaptureDirection direction,
+		     const struct iovec *iov, size_t iov_cnt, size_t size);
+	/** Id of the last accepted client. */
+	uint32_t last_client_id_ = 0;
+
+#ifdef TNTCXX_ENABLE_SSL
+	/** Listening sockets terminating TLS. */
+	std::map<Stream_t *, SSL_CTX *> tls_listeners_;
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+	/** Compression levels of listening sockets of compressed clients. */
+	std::map<Stream_t *, int> zlib_listeners_;
+#endif
+
+	/** Max bytes received from streaming backend at once. */
+	static constexpr size_t CUT_THROUGH_CHUNK = 64 * 1024;
+	std::map<Stream_t *, CutThrough> cut_through_;
+
+	/**
+	 * One direction of a tunnel, from the stream it is keyed by to
+	 * @a to. Messages are spliced one by one: header of the next one
+	 * is peeked, so that messages are counted without copying bodies.
+	 */
+	struct Tunnel {
+		Stream_t *to = nullptr;
+		/** Read and write ends of the pipe. */
+		int pipe[2] = {-1, -1};
+		size_t pipe_size = 0;
+		/** Bytes spliced to the pipe but not to @a to yet. */
+		size_t in_pipe = 0;
+		/** @a to is full, the source isn't read until it is writable. */
+		bool blocked = false;
+		/** Header of the current message and bytes of it passed. */
+		char header[MP_RESPONSE_SIZE];
+		size_t header_len = 0;
+		/** Bytes of the current message body not passed yet. */
+		size_t body_left = 0;
+		/** Data doesn't look like iproto, messages are not counted. */
+		bool framed = true;
+	};
+	/** Pipes of tunnels are enlarged to this size if it is allowed. */
+	static constexpr size_t TUNNEL_PIPE_SIZE = 256 * 1024;
+	/** True if bytes of @a strm go to its socket as is. */
+	static bool isPlain(Stream_t &strm);
+	/**
+	 * Move data of @a strm to its peer. Return number of bytes moved,
+	 * 0 if the socket has no data or the peer is full, -1 if the
+	 * connection is closed or failed.
+	 */
+	int pumpTunnel(Conn_t &conn, Stream_t &strm, Tunnel &tunnel);
+	/** Splice the pipe to the peer. Return 0 or -1 on error. */
+	int drainTunnel(Conn_t &conn, Stream_t &strm, Tunnel &tunnel);
+	/** Put @a size bytes of @a buf from @a itr to the pipe. */
+	template<class BUF, class ITR>
+	int fillTunnel(Tunnel &tunnel, BUF &buf, ITR itr, size_t size);
+	/** Count @a size bytes passed, their header part is at @a data. */
+	void countTunnel(Tunnel &tunnel, const char *data, size_t size);
+	/**
+	 * @a strm got writable: resume the tunnel to it. Return -1 if the
+	 * connection is closed on error.
+	 */
+	int flushTunnel(Conn_t &conn, Stream_t &strm);
+	/** Subscribe @a strm for events its tunnels wait for. */
+	void setTunnelEvents(Conn_t &conn, Stream_t &strm);
+	void closeTunnel(Stream_t &strm);
+	/** Directions of tunnels by source stream. */
+	std::map<Stream_t *, Tunnel> tunnels_;
+	/** Connections whose client socket is full. */
+	std::set<Conn_t *> write_blocked_;
+	/** Streams holding data buffered by send(). */
+	std::set<Stream_t *> unflushed_;
+	/** Streams which flush is blocked, subscribed for EPOLLOUT. */
+	std::set<Stream_t *> flush_blocked_;
 };
 
 template<class BUFFER, class Stream>
@@ -102,22 +349,38 @@ ProxyEpollNetProvider<BUFFER, Stream>::ProxyEpollNetProvider(Connector_t &connec
 		LOG_ERROR("Failed to initialize client epoll: ", strerror(errno));
 		abort();
 	}
+	m_WakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	struct epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	if (m_WakeupFd == -1 ||
+	    epoll_ctl(m_AllEpollFd, EPOLL_CTL_ADD, m_WakeupFd, &event) != 0) {
+		LOG_ERROR("Failed to initialize wakeup eventfd: ",
+			  strerror(errno));
+		abort();
+	}
 }
 
 template<class BUFFER, class Stream>
 ProxyEpollNetProvider<BUFFER, Stream>::~ProxyEpollNetProvider()
 {
+	::close(m_WakeupFd);
+	m_WakeupFd = -1;
 	::close(m_AllEpollFd);
 	m_AllEpollFd = -1;
 }
 
 template<class BUFFER, class Stream>
 void
-ProxyEpollNetProvider<BUFFER, Stream>::addToEpoll(Conn_t *conn, Stream_t &strm)
+ProxyEpollNetProvider<BUFFER, Stream>::addToEpoll(Conn_t *conn, Stream_t &strm,
+						  uint32_t events)
 {
 	assert(m_AllEpollFd >= 0);
 	struct epoll_event event;
-	event.events = EPOLLIN;
+	event.events = events;
+	/* Listening sockets stay level-triggered to bound accept batches. */
+	if (conn != nullptr && m_Connector.proxy_opts_.edge_triggered)
+		event.events |= EPOLLET;
 	event.data.ptr = &strm;
 	strm_to_conn[&strm] = conn;
 
@@ -132,33 +395,100 @@ ProxyEpollNetProvider<BUFFER, Stream>::addToEpoll(Conn_t *conn, Stream_t &strm)
 
 template<class BUFFER, class Stream>
 void
-ProxyEpollNetProvider<BUFFER, Stream>::SetServerFd(int fd)
+ProxyEpollNetProvider<BUFFER, Stream>::AddServerFd(int fd)
 {
-	server_strm_.set_fd(fd);
-	addToEpoll(nullptr, server_strm_);
+	server_strms_.emplace_back();
+	server_strms_.back().set_fd(fd);
+	uint32_t events = EPOLLIN;
+	if (m_Connector.proxy_opts_.exclusive_accept)
+		events |= EPOLLEXCLUSIVE;
+	addToEpoll(nullptr, server_strms_.back(), events);
 }
 
+#ifdef TNTCXX_ENABLE_SSL
 template<class BUFFER, class Stream>
 void
-ProxyEpollNetProvider<BUFFER, Stream>::AcceptNewClient()
-{
-	// Accept
-	sockaddr_in client_addr;
-	socklen_t client_len = sizeof(client_addr);
-	int client_fd = accept(server_strm_.get_fd(), 
-							reinterpret_cast<sockaddr*>(&client_addr),
-							&client_len);
-	if (client_fd == -1) {
-		LOG_ERROR("Accept failed", strerror(errno));
-		// stop();
-		return;
+ProxyEpollNetProvider<BUFFER, Stream>::AddServerFd(int fd, SSL_CTX *tls_ctx)
+{
+	AddServerFd(fd);
+	if (tls_ctx != nullptr)
+		tls_listeners_[&server_strms_.back()] = tls_ctx;
+}
+#endif
+
+#ifdef TNTCXX_ENABLE_ZLIB
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::CompressServerFd(int fd, int level)
+{
+	for (auto &server_strm : server_strms_) {
+		if (server_strm.get_fd() == fd)
+			zlib_listeners_[&server_strm] = level;
 	}
+}
+#endif
 
-	new_clients.insert(client_fd);
-	// Add to Epoll
-	conns_.emplace_back(ProxyConnection<BUFFER, ProxyEpollNetProvider>(m_Connector));
-	conns_.back().get_client_strm().set_fd(client_fd);
-	addToEpoll(&conns_.back(), conns_.back().get_client_strm());
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::AcceptNewClient(Stream_t &server_strm)
+{
+	/*
+	 * Listening socket is level-triggered: clients left in the queue
+	 * after the budget is spent are accepted on the next iteration.
+	 */
+	size_t budget = m_Connector.proxy_opts_.accept_batch;
+	for (size_t i = 0; i < budget; ++i) {
+		int client_fd = accept4(server_strm.get_fd(), nullptr, nullptr,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* Queue is drained (or taken by another loop). */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			LOG_ERROR("Accept failed: ", strerror(errno));
+			return;
+		}
+
+		new_clients.insert(client_fd);
+		// Add to Epoll
+		conns_.emplace_back(ProxyConnection<BUFFER, ProxyEpollNetProvider>(m_Connector));
+		auto &client_strm = conns_.back().get_client_strm();
+		client_strm.set_fd(client_fd);
+		conns_.back().getImpl()->id = ++last_client_id_;
+#ifdef TNTCXX_ENABLE_SSL
+		auto tls = tls_listeners_.find(&server_strm);
+		if (tls != tls_listeners_.end()) {
+			int rc = -1;
+			/* Handshake is driven by reads of the client. */
+			if constexpr (std::is_base_of_v<UnixSSLStream, Stream_t>)
+				rc = client_strm.accept(client_fd, tls->second);
+			else
+				LOG_ERROR("TLS listener requires SSL stream");
+			if (rc != 0) {
+				new_clients.erase(client_fd);
+				conns_.pop_back();
+				continue;
+			}
+		}
+#endif
+#ifdef TNTCXX_ENABLE_ZLIB
+		auto zlib = zlib_listeners_.find(&server_strm);
+		if (zlib != zlib_listeners_.end()) {
+			int rc = -1;
+			if constexpr (is_zlib_stream_v<Stream_t>)
+				rc = client_strm.compress(zlib->second);
+			else
+				LOG_ERROR("Compressed listener requires zlib stream");
+			if (rc != 0) {
+				new_clients.erase(client_fd);
+				conns_.pop_back();
+				continue;
+			}
+		}
+#endif
+		addToEpoll(&conns_.back(), client_strm);
+	}
 }
 
 template<class BUFFER, class Stream>
@@ -169,23 +499,36 @@ ProxyEpollNetProvider<BUFFER, Stream>::close(Stream_t& strm)
 	assert(was_fd >= 0);
 	strm.close();
 #ifndef NDEBUG
-	struct sockaddr sa;
+	struct sockaddr_storage sa;
 	socklen_t sa_len = sizeof(sa);
-	if (getsockname(was_fd, &sa, &sa_len) != -1) {
+	if (getsockname(was_fd, (struct sockaddr *) &sa, &sa_len) != -1) {
 		char addr[120];
-		if (sa.sa_family == AF_INET) {
+		char host[INET6_ADDRSTRLEN];
+		if (sa.ss_family == AF_INET) {
 			struct sockaddr_in *sa_in = (struct sockaddr_in *) &sa;
-			snprintf(addr, 120, "%s:%d", inet_ntoa(sa_in->sin_addr),
+			inet_ntop(AF_INET, &sa_in->sin_addr, host, sizeof(host));
+			snprintf(addr, 120, "%s:%d", host,
 				 ntohs(sa_in->sin_port));
+		} else if (sa.ss_family == AF_INET6) {
+			struct sockaddr_in6 *sa_in6 = (struct sockaddr_in6 *) &sa;
+			inet_ntop(AF_INET6, &sa_in6->sin6_addr, host, sizeof(host));
+			snprintf(addr, 120, "[%s]:%d", host,
+				 ntohs(sa_in6->sin6_port));
 		} else {
 			struct sockaddr_un *sa_un = (struct sockaddr_un *) &sa;
-			snprintf(addr, 120, "%s", sa_un->sun_path);
+			snprintf(addr, 120, "%.*s", (int) sizeof(sa_un->sun_path),
+				 sa_un->sun_path);
 		}
 		LOG_DEBUG("Closed connection to socket ", was_fd,
 			  " corresponding to address ", addr);
 	}
 #endif
 	epoll_ctl(m_AllEpollFd, EPOLL_CTL_DEL, was_fd, nullptr);
+	closed_strms_.insert(&strm);
+	unflushed_.erase(&strm);
+	flush_blocked_.erase(&strm);
+	auto it = std::remove(ready_strms_.begin(), ready_strms_.end(), &strm);
+	ready_strms_.erase(it, ready_strms_.end());
 }
 
 template<class BUFFER, class Stream>
@@ -193,15 +536,28 @@ void
 ProxyEpollNetProvider<BUFFER, Stream>::close(Conn_t &conn)
 {
 	// stop streams
+	closed_clients_.push_back(conn.get_client_strm().get_fd());
+	closeTunnel(conn.get_client_strm());
 	close(conn.get_client_strm());
 	for (auto &c : conn.get_external_strms()) {
+		/* Instance wasn't reachable, see connect(). */
+		if (c.second.get_fd() < 0)
+			continue;
+		closeTunnel(c.second);
 		instance_id_to_active_connetions[c.first]--;
 
 		strm_to_conn.erase(&c.second);
 		greeting_expected_on_fd.erase(c.second.get_fd());
+		cut_through_.erase(&c.second);
 		close(c.second);
 	}
 
+	hasReleasedData(conn.getImpl(), conn.getImpl()->bufferedBytes);
+	paused_clients_.erase(&conn);
+	write_blocked_.erase(&conn);
+	m_Connector.releaseQos(conn);
+	trim_pending_ = true;
+
 	// remove from vector of connections
 	auto it = std::find(conns_.begin(), conns_.end(), conn);
     
@@ -214,6 +570,21 @@ template<class BUFFER, class Stream>
 int
 ProxyEpollNetProvider<BUFFER, Stream>::recv(Conn_t &conn, Stream_t &strm)
 {
+	if (conn.getImpl()->decState == nullptr) {
+		/*
+		 * Most wakeups of idle connections bring a single small
+		 * request: don't reserve readahead in a fresh buffer for it.
+		 */
+		char first[CONN_FIRST_READ];
+		struct iovec iov = {first, sizeof(first)};
+		ssize_t rcvd = strm.recv(&iov, 1);
+		if (rcvd > 0) {
+			capture(conn, strm, CAPTURE_FROM_CLIENT, &iov, 1, rcvd);
+			conn.getDecBuf().write({first, (size_t) rcvd});
+			hasBufferedData(conn, rcvd);
+		}
+		return rcvd;
+	}
 	// prepare buff
 	auto& buf = conn.getDecBuf();
 	auto itr = buf.template end<true>();
@@ -228,26 +599,461 @@ ProxyEpollNetProvider<BUFFER, Stream>::recv(Conn_t &conn, Stream_t &strm)
 		// peer shudown
 		return -1;
 	}
+	if (rcvd > 0) {
+		capture(conn, strm, CAPTURE_FROM_CLIENT, iov, iov_cnt, rcvd);
+		hasBufferedData(conn, rcvd);
+	}
+	return rcvd;
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::startCutThrough(Conn_t &conn, Stream_t &strm,
+						       size_t size, bool forward)
+{
+	assert(cut_through_.count(&strm) == 0);
+	auto &in = conn.getDecBuf();
+	/* Streamed message is the last one in the buffer. */
+	auto itr = in.template begin<true>() + conn.getImpl()->decoding().sent;
+	size_t received = in.template end<true>() - itr;
+	assert(received < size);
+	if (forward) {
+		auto &out = conn.getEncBuf();
+		struct iovec iov[IOVEC_MAX_SIZE];
+		size_t iov_cnt = in.getIOV(itr, iov, IOVEC_MAX_SIZE);
+		for (size_t i = 0; i < iov_cnt; ++i)
+			out.write({(const char *) iov[i].iov_base, iov[i].iov_len});
+		hasBufferedData(conn, received);
+	}
+	hasSentDecodedData(conn, received);
+	cut_through_[&strm] = CutThrough{size - received, forward};
+	if (!forward)
+		return 0;
+	int rc = sendEnc(conn, conn.get_client_strm());
+	if (rc == 0 && hasEncodedDataToSend(conn))
+		rc = 1;
+	if (rc > 0)
+		blockOnClient(conn);
+	return rc < 0 ? -1 : 0;
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::passThrough(Conn_t &conn, Stream_t &strm,
+						   CutThrough &state)
+{
+	bool forward = state.forward;
+	/* Resumed once client takes what it is already sent. */
+	if (forward && write_blocked_.count(&conn) != 0)
+		return 0;
+	size_t chunk = std::min(state.remaining, CUT_THROUGH_CHUNK);
+	ssize_t rcvd;
+	if (forward) {
+		/* Received bytes go right to the output buffer of client. */
+		auto &out = conn.getEncBuf();
+		auto itr = out.template end<true>();
+		out.write({chunk});
+		struct iovec iov[IOVEC_MAX_SIZE];
+		size_t iov_cnt = out.getIOV(itr, iov, IOVEC_MAX_SIZE);
+		rcvd = strm.recv(iov, iov_cnt);
+		size_t unused = chunk - (rcvd < 0 ? 0 : rcvd);
+		if (unused > 0)
+			out.dropBack(unused);
+		if (rcvd > 0)
+			hasBufferedData(conn, rcvd);
+	} else {
+		char skipped[CONN_FIRST_READ];
+		struct iovec iov = {skipped, std::min(chunk, sizeof(skipped))};
+		rcvd = strm.recv(&iov, 1);
+	}
+	if (rcvd <= 0)
+		return rcvd;
+	state.remaining -= rcvd;
+	if (state.remaining == 0)
+		cut_through_.erase(&strm);
+	if (!forward)
+		return rcvd;
+	int rc = sendEnc(conn, conn.get_client_strm());
+	if (rc < 0)
+		return -1;
+	if (hasEncodedDataToSend(conn))
+		blockOnClient(conn);
+	return rcvd;
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::startTunnel(Conn_t &conn, Stream_t &from,
+						   Stream_t &strm)
+{
+	Stream_t &client = conn.get_client_strm();
+	assert(&from == &client || &from == &strm);
+	if (!isPlain(client) || !isPlain(strm)) {
+		LOG_ERROR("Encrypted or compressed streams can't be tunneled");
+		return -1;
+	}
+	if (greeting_expected_on_fd.count(strm.get_fd()) != 0 ||
+	    cut_through_.count(&strm) != 0 || tunnels_.count(&client) != 0) {
+		LOG_ERROR("Tunnel can't be started: instance stream is busy");
+		return -1;
+	}
+	Tunnel &up = tunnels_[&client];
+	Tunnel &down = tunnels_[&strm];
+	up.to = &strm;
+	down.to = &client;
+	bool failed = false;
+	for (Tunnel *tunnel : {&up, &down}) {
+		if (pipe2(tunnel->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+			LOG_ERROR("Failed to create pipe: ", strerror(errno));
+			failed = true;
+			break;
+		}
+		/* The default size is kept if the limit is lower. */
+		fcntl(tunnel->pipe[1], F_SETPIPE_SZ, (int) TUNNEL_PIPE_SIZE);
+		int size = fcntl(tunnel->pipe[1], F_GETPIPE_SZ);
+		tunnel->pipe_size = size > 0 ? size : 0;
+	}
+	/* Data received but not passed yet goes first. */
+	size_t enc_size = 0;
+	if (hasEncodedDataToSend(conn)) {
+		auto &out = conn.getEncBuf();
+		enc_size = out.template end<true>() - out.template begin<true>();
+	}
+	size_t dec_size = 0;
+	auto *state = conn.getImpl()->decState.get();
+	if (state != nullptr) {
+		auto start = state->buf.template begin<true>() + state->sent;
+		dec_size = state->buf.template end<true>() - start;
+	}
+	/* Input of the other end, if any, is parked. */
+	Stream_t &other = &from == &client ? strm : client;
+	auto &parked_states = conn.getImpl()->parkedDecStates;
+	auto parked = parked_states.find(&other);
+	size_t parked_size = 0;
+	if (parked != parked_states.end()) {
+		auto &buf = parked->second->buf;
+		parked_size = buf.template end<true>() - buf.template begin<true>();
+	}
+	Tunnel &src = &from == &client ? up : down;
+	Tunnel &dst = &from == &client ? down : up;
+	size_t down_size = enc_size + (&src == &down ? dec_size : parked_size);
+	size_t up_size = &src == &up ? dec_size : parked_size;
+	if (!failed && (down_size > down.pipe_size || up_size > up.pipe_size)) {
+		LOG_ERROR("Tunnel can't be started: too much data pending");
+		failed = true;
+	}
+	if (failed) {
+		closeTunnel(client);
+		closeTunnel(strm);
+		return -1;
+	}
+	if (enc_size > 0) {
+		auto &out = conn.getEncBuf();
+		if (fillTunnel(down, out, out.template begin<true>(),
+			       enc_size) != 0)
+			return -1;
+		hasSentEncodedData(conn, enc_size);
+	}
+	if (dec_size > 0) {
+		auto start = state->buf.template begin<true>() + state->sent;
+		if (fillTunnel(src, state->buf, start, dec_size) != 0)
+			return -1;
+		hasSentDecodedData(conn, dec_size);
+		/* Nothing is decoded any more. */
+		state->endDecoded += state->buf.end() - state->endDecoded;
+		state->dec.reset(state->endDecoded);
+	}
+	if (parked_size > 0) {
+		auto &buf = parked->second->buf;
+		if (fillTunnel(dst, buf, buf.template begin<true>(),
+			       parked_size) != 0)
+			return -1;
+		hasReleasedData(conn.getImpl(), parked_size);
+		parked_states.erase(parked);
+	}
+	write_blocked_.erase(&conn);
+	/* Segments are relayed as they come: don't hold the tails. */
+	int one = 1;
+	setsockopt(client.get_fd(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(strm.get_fd(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setTunnelEvents(conn, client);
+	setTunnelEvents(conn, strm);
+	/* Pipes are drained without waiting for events. */
+	for (Stream_t *tunneled : {&client, &strm}) {
+		if (std::find(ready_strms_.begin(), ready_strms_.end(),
+			      tunneled) == ready_strms_.end())
+			ready_strms_.push_back(tunneled);
+	}
+	return 0;
+}
+
+template<class BUFFER, class Stream>
+template<class BUF, class ITR>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::fillTunnel(Tunnel &tunnel, BUF &buf,
+						  ITR itr, size_t size)
+{
+	while (size > 0) {
+		struct iovec iov[IOVEC_MAX_SIZE];
+		size_t iov_cnt = buf.getIOV(itr, itr + size, iov,
+					    IOVEC_MAX_SIZE);
+		ssize_t written = ::writev(tunnel.pipe[1], iov, iov_cnt);
+		if (written <= 0) {
+			LOG_ERROR("Failed to write to pipe: ", strerror(errno));
+			return -1;
+		}
+		size_t left = written;
+		for (size_t i = 0; i < iov_cnt && left > 0; ++i) {
+			size_t part = std::min(left, iov[i].iov_len);
+			countTunnel(tunnel, (const char *) iov[i].iov_base,
+				    part);
+			left -= part;
+		}
+		tunnel.in_pipe += written;
+		itr = itr + written;
+		size -= written;
+	}
+	return 0;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::countTunnel(Tunnel &tunnel,
+						   const char *data, size_t size)
+{
+	m_Connector.tunnel_bytes += size;
+	size_t pos = 0;
+	while (tunnel.framed && pos < size) {
+		if (tunnel.header_len < MP_RESPONSE_SIZE) {
+			size_t part = std::min(size - pos,
+					       MP_RESPONSE_SIZE - tunnel.header_len);
+			memcpy(tunnel.header + tunnel.header_len, data + pos,
+			       part);
+			tunnel.header_len += part;
+			pos += part;
+			if (tunnel.header_len < MP_RESPONSE_SIZE)
+				break;
+			if ((uint8_t) tunnel.header[0] != 0xce) {
+				tunnel.framed = false;
+				break;
+			}
+			uint32_t body_size;
+			memcpy(&body_size, tunnel.header + 1, sizeof(body_size));
+			tunnel.body_left = __builtin_bswap32(body_size);
+		}
+		size_t part = std::min(size - pos, tunnel.body_left);
+		tunnel.body_left -= part;
+		pos += part;
+		if (tunnel.body_left == 0) {
+			tunnel.header_len = 0;
+			m_Connector.tunnel_frames++;
+		}
+	}
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::pumpTunnel(Conn_t &conn, Stream_t &strm,
+						  Tunnel &tunnel)
+{
+	/* Resumed once the peer takes what is in the pipe. */
+	if (tunnel.blocked)
+		return 0;
+	if (drainTunnel(conn, strm, tunnel) != 0)
+		return -1;
+	if (tunnel.blocked)
+		return 0;
+	size_t want = tunnel.pipe_size;
+	char peeked[MP_RESPONSE_SIZE];
+	if (tunnel.framed && tunnel.body_left == 0) {
+		/* Only known bytes of the header are spliced. */
+		size_t need = MP_RESPONSE_SIZE - tunnel.header_len;
+		ssize_t rc = ::recv(strm.get_fd(), peeked, need,
+				    MSG_PEEK | MSG_DONTWAIT);
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (rc <= 0)
+			return -1;
+		want = rc;
+		if ((size_t) rc == need) {
+			/* The body follows the header in the same splice. */
+			char header[MP_RESPONSE_SIZE];
+			memcpy(header, tunnel.header, tunnel.header_len);
+			memcpy(header + tunnel.header_len, peeked, need);
+			uint32_t body_size;
+			memcpy(&body_size, header + 1, sizeof(body_size));
+			if ((uint8_t) header[0] == 0xce)
+				want += std::min<size_t>(
+					__builtin_bswap32(body_size),
+					tunnel.pipe_size - want);
+		}
+	} else if (tunnel.framed) {
+		want = std::min(want, tunnel.body_left);
+	}
+	ssize_t rcvd = splice(strm.get_fd(), nullptr, tunnel.pipe[1], nullptr,
+			      want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (rcvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (rcvd <= 0)
+		return -1;
+	tunnel.in_pipe += rcvd;
+	countTunnel(tunnel, peeked, rcvd);
+	if (drainTunnel(conn, strm, tunnel) != 0)
+		return -1;
 	return rcvd;
 }
 
 template<class BUFFER, class Stream>
 int
-ProxyEpollNetProvider<BUFFER, Stream>::sendDec(Conn_t &conn, Stream_t &strm, int size)
+ProxyEpollNetProvider<BUFFER, Stream>::drainTunnel(Conn_t &conn, Stream_t &strm,
+						   Tunnel &tunnel)
+{
+	while (tunnel.in_pipe > 0) {
+		ssize_t sent = splice(tunnel.pipe[0], nullptr,
+				      tunnel.to->get_fd(), nullptr,
+				      tunnel.in_pipe,
+				      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			tunnel.blocked = true;
+			setTunnelEvents(conn, strm);
+			setTunnelEvents(conn, *tunnel.to);
+			return 0;
+		}
+		if (sent <= 0)
+			return -1;
+		tunnel.in_pipe -= sent;
+	}
+	return 0;
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::flushTunnel(Conn_t &conn, Stream_t &strm)
+{
+	auto out = tunnels_.find(&strm);
+	if (out == tunnels_.end())
+		return 0;
+	Stream_t *peer = out->second.to;
+	Tunnel &in = tunnels_[peer];
+	if (!in.blocked)
+		return 0;
+	in.blocked = false;
+	if (drainTunnel(conn, *peer, in) != 0) {
+		close(conn);
+		return -1;
+	}
+	if (in.blocked)
+		return 0;
+	setTunnelEvents(conn, strm);
+	setTunnelEvents(conn, *peer);
+	/* The peer was not read while blocked. */
+	if (std::find(ready_strms_.begin(), ready_strms_.end(), peer) ==
+	    ready_strms_.end())
+		ready_strms_.push_back(peer);
+	return 0;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::setTunnelEvents(Conn_t &conn,
+						       Stream_t &strm)
+{
+	auto out = tunnels_.find(&strm);
+	if (out == tunnels_.end())
+		return;
+	uint32_t events = out->second.blocked ? 0 : (uint32_t) EPOLLIN;
+	auto in = tunnels_.find(out->second.to);
+	if (in != tunnels_.end() && in->second.blocked)
+		events |= EPOLLOUT;
+	setEvents(conn, strm, events);
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::closeTunnel(Stream_t &strm)
+{
+	auto tunnel = tunnels_.find(&strm);
+	if (tunnel == tunnels_.end())
+		return;
+	for (int fd : tunnel->second.pipe) {
+		if (fd >= 0)
+			::close(fd);
+	}
+	tunnels_.erase(tunnel);
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::setEvents(Conn_t &conn, Stream_t &strm,
+						 uint32_t events)
+{
+	bool is_client = &strm == &conn.get_client_strm();
+	if (is_client && paused_clients_.count(&conn) != 0)
+		events &= ~EPOLLIN;
+	if (is_client && write_blocked_.count(&conn) != 0)
+		events |= EPOLLOUT;
+	if (flush_blocked_.count(&strm) != 0)
+		events |= EPOLLOUT;
+	if (events != 0 && m_Connector.proxy_opts_.edge_triggered)
+		events |= EPOLLET;
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = &strm;
+	if (epoll_ctl(m_AllEpollFd, EPOLL_CTL_MOD, strm.get_fd(), &event) != 0)
+		LOG_ERROR("Failed to modify epoll events: ", strerror(errno));
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::blockOnClient(Conn_t &conn)
+{
+	if (!write_blocked_.insert(&conn).second)
+		return;
+	setEvents(conn, conn.get_client_strm(), EPOLLIN);
+	for (auto &c : conn.get_external_strms()) {
+		if (cut_through_.count(&c.second) != 0)
+			setEvents(conn, c.second, 0);
+	}
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::flushBlocked(Conn_t &conn)
+{
+	if (write_blocked_.count(&conn) == 0)
+		return;
+	if (sendEnc(conn, conn.get_client_strm()) < 0 ||
+	    hasEncodedDataToSend(conn))
+		return;
+	write_blocked_.erase(&conn);
+	conn.getImpl()->releaseIdleBuffers();
+	setEvents(conn, conn.get_client_strm(), EPOLLIN);
+	/* Re-arming reports data which arrived while blocked. */
+	for (auto &c : conn.get_external_strms()) {
+		if (cut_through_.count(&c.second) != 0)
+			setEvents(conn, c.second, EPOLLIN);
+	}
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::sendDec(Conn_t &conn, Stream_t &strm, int size,
+					       bool consume)
 {
 	if (hasDecodedDataToSend(conn)) {
 		// prepare buff
 		struct iovec iov[IOVEC_MAX_SIZE];
 		auto& buf = conn.getDecBuf();
+		/* Skip data sent but not dropped yet. */
+		auto start = buf.template begin<true>() + conn.getImpl()->decoding().sent;
 
 		size_t iov_cnt;
 		if (size != -1) {
-			auto end_of_req = buf.template begin<true>() + size;
-			iov_cnt = buf.getIOV(buf.template begin<true>(), end_of_req,
+			auto end_of_req = start + size;
+			iov_cnt = buf.getIOV(start, end_of_req,
 					    iov, IOVEC_MAX_SIZE);
 		} else {
-			iov_cnt = buf.getIOV(buf.template begin<true>(),
-				iov, IOVEC_MAX_SIZE);
+			iov_cnt = buf.getIOV(start, iov, IOVEC_MAX_SIZE);
 		}
 
 		// send
@@ -258,6 +1064,16 @@ ProxyEpollNetProvider<BUFFER, Stream>::sendDec(Conn_t &conn, Stream_t &strm, int
 			return -1;
 		} else if (sent == 0) {
 			return 1;
+		}
+		capture(conn, strm, CAPTURE_TO_CLIENT, iov, iov_cnt, sent);
+		deferFlush(strm);
+		if (!consume) {
+			/* The rest can't be resent: data is not dropped. */
+			if (size != -1 && sent < size) {
+				conn.setError("Failed to send copy of request",
+					      EAGAIN);
+				return -1;
+			}
 		} else {
 			hasSentDecodedData(conn, sent);
 		}
@@ -293,21 +1109,115 @@ ProxyEpollNetProvider<BUFFER, Stream>::sendEnc(Conn_t &conn, Stream_t &strm, int
 			return -1;
 		} else if (sent == 0) {
 			return 1;
-		} else {
-			hasSentEncodedData(conn, sent);
 		}
+		capture(conn, strm, CAPTURE_TO_CLIENT, iov, iov_cnt, sent);
+		deferFlush(strm);
+		hasSentEncodedData(conn, sent);
 	}
 	/* All data from connection has been successfully written. */
 	return 0;
 }
 
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::sendBuf(Conn_t &conn, Stream_t &strm,
+					       BUFFER &buf)
+{
+	struct iovec iov[IOVEC_MAX_SIZE];
+	size_t iov_cnt = buf.getIOV(buf.template begin<true>(), iov,
+				    IOVEC_MAX_SIZE);
+	size_t size = buf.template end<true>() - buf.template begin<true>();
+	ssize_t sent = strm.send(iov, iov_cnt);
+	if (sent < 0) {
+		conn.setError(std::string("Failed to send request: ") +
+			      strerror(errno), errno);
+		return -1;
+	}
+	if ((size_t) sent < size) {
+		conn.setError("Failed to send request made by proxy", EAGAIN);
+		return -1;
+	}
+	capture(conn, strm, CAPTURE_TO_CLIENT, iov, iov_cnt, sent);
+	deferFlush(strm);
+	return 0;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::deferFlush(Stream_t &strm)
+{
+#ifdef TNTCXX_ENABLE_ZLIB
+	if constexpr (is_zlib_stream_v<Stream_t>) {
+		if (strm.has_unflushed())
+			unflushed_.insert(&strm);
+	}
+#endif
+	(void) strm;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::flushCompressed()
+{
+#ifdef TNTCXX_ENABLE_ZLIB
+	if constexpr (is_zlib_stream_v<Stream_t>) {
+		std::set<Conn_t *> failed;
+		for (auto it = unflushed_.begin(); it != unflushed_.end();) {
+			Stream_t *strm = *it;
+			Conn_t *conn = strm_to_conn[strm];
+			int rc = strm->flush();
+			bool was_blocked = flush_blocked_.count(strm) != 0;
+			if (rc == 0) {
+				flush_blocked_.insert(strm);
+				++it;
+			} else {
+				flush_blocked_.erase(strm);
+				it = unflushed_.erase(it);
+			}
+			if (rc < 0) {
+				conn->setError(std::string("Failed to flush "
+							   "stream: ") +
+					       strerror(errno), errno);
+				failed.insert(conn);
+				continue;
+			}
+			if (was_blocked == (rc == 0))
+				continue;
+			uint32_t events = EPOLLIN;
+			/* Streaming backend waits for its client. */
+			if (cut_through_.count(strm) != 0 &&
+			    write_blocked_.count(conn) != 0)
+				events = 0;
+			setEvents(*conn, *strm, events);
+		}
+		for (Conn_t *conn : failed)
+			close(*conn);
+	}
+#endif
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::capture(Conn_t &conn, Stream_t &strm,
+					       CaptureDirection direction,
+					       const struct iovec *iov,
+					       size_t iov_cnt, size_t size)
+{
+	TrafficCapture *capture = m_Connector.proxy_opts_.capture;
+	if (capture == nullptr || &strm != &conn.get_client_strm())
+		return;
+	capture->record(direction, conn.getImpl()->id, iov, iov_cnt, size);
+}
+
 template<class BUFFER, class Stream>
 Stream&
 ProxyEpollNetProvider<BUFFER, Stream>::connect(Conn_t &conn, int instance_index)
 {
 	auto &strm = conn.getImpl()->instance_index_to_strm[instance_index];
 	if (strm.get_fd() > 0) return strm;
-	strm.connect(m_Connector.opts_[instance_index]);
+	/* Unreachable instance is left closed, it's retried next time. */
+	if (strm.connect(m_Connector.opts_[instance_index]) != 0)
+		return strm;
 	if (m_Connector.opts_[instance_index].is_tnt) {
 		greeting_expected_on_fd.insert(strm.get_fd());
 	}
@@ -320,35 +1230,339 @@ template<class BUFFER, class Stream>
 void
 ProxyEpollNetProvider<BUFFER, Stream>::Wait()
 {
+	Wait([](Connector_t &connector) { connector.customHandler(); });
+}
+
+template<class BUFFER, class Stream>
+template<class Handler>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::Wait(Handler &&handler)
+{
+	if (Poll(handler, TIMEOUT_INFINITY) < 0)
+		std::abort();
+}
+
+template<class BUFFER, class Stream>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::PollTimeout() const
+{
+	int idle_trim = m_Connector.proxy_opts_.idle_trim_timeout;
+	if (!ready_strms_.empty())
+		return 0;
+	if (!paused_clients_.empty() || accept_paused_)
+		return PAUSE_RECHECK_TIMEOUT;
+	if (trim_pending_ && idle_trim > 0)
+		return idle_trim;
+	return TIMEOUT_INFINITY;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::Wakeup()
+{
+	uint64_t one = 1;
+	ssize_t rc = ::write(m_WakeupFd, &one, sizeof(one));
+	/* Counter overflow means Poll() is going to wake up anyway. */
+	(void) rc;
+}
+
+template<class BUFFER, class Stream>
+template<class Handler>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::Poll(Handler &&handler, int timeout)
+{
+	/* Don't block if some sockets are known to have data. */
+	size_t ready_cnt = ready_strms_.size();
+	bool paused = !paused_clients_.empty() || accept_paused_;
+	int own_timeout = PollTimeout();
+	if (timeout == TIMEOUT_INFINITY ||
+	    (own_timeout != TIMEOUT_INFINITY && own_timeout < timeout))
+		timeout = own_timeout;
+	closed_strms_.clear();
+
 	struct epoll_event events[EPOLL_EVENTS_MAX];
-	int event_cnt = epoll_wait(m_AllEpollFd, events, EPOLL_EVENTS_MAX, TIMEOUT_INFINITY);
+	int event_cnt = epoll_wait(m_AllEpollFd, events, EPOLL_EVENTS_MAX, timeout);
 	if (event_cnt < 0) {
+		if (errno == EINTR)
+			return 0;
 		LOG_ERROR("Poll failed: ", strerror(errno));
-		std::abort();
+		return -1;
+	}
+	/* Idle for our own timeout, not just for the caller's one. */
+	if (event_cnt == 0 && timeout > 0 && timeout == own_timeout) {
+		if (paused) {
+			flushPaused();
+			/* Nothing else can free memory below the soft limit. */
+			if (!m_Connector.memory_.overHardLimit())
+				resumeAll();
+		} else {
+			m_Connector.memory_.trimmed_slabs +=
+				trimBufferPool<BUFFER>();
+			trim_pending_ = false;
+		}
+		flushCompressed();
+		return 0;
 	}
 	for (int i = 0; i < event_cnt; ++i) {
 		Stream_t *current_strm = (Stream_t *)events[i].data.ptr;
-		if (current_strm->get_fd() == server_strm_.get_fd()) {
-			AcceptNewClient();
-		} else {
-			Conn_t *conn = strm_to_conn[current_strm];
-			if ((events[i].events & EPOLLIN) != 0) {
-				int rc = recv(*conn, *current_strm);
-				if (rc < 0) {
-					close(*conn);
-					return;
-				}
-
-
-				m_Connector.setCurrentReceiver(conn, current_strm);
-				// send bytes to Callback
-				m_Connector.customHandler();
-				
-				auto it = new_clients.find(current_strm->get_fd());
-				if (it != new_clients.end()) {
-					new_clients.erase(current_strm->get_fd());
-				}
+		if (current_strm == nullptr) {
+			uint64_t count;
+			ssize_t rc = ::read(m_WakeupFd, &count, sizeof(count));
+			(void) rc;
+			continue;
+		}
+		if (closed_strms_.count(current_strm) != 0)
+			continue;
+		Conn_t *conn = strm_to_conn[current_strm];
+		if (conn != nullptr && (events[i].events & EPOLLOUT) != 0) {
+			flushBlocked(*conn);
+			if (flushTunnel(*conn, *current_strm) < 0)
+				continue;
+		}
+		if (conn == nullptr) {
+			/* Only listening sockets have no connection. */
+			notifyClosed(handler);
+			AcceptNewClient(*current_strm);
+		} else if (isPaused(*conn, *current_strm)) {
+			continue;
+		} else if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+			/* Already queued: it is read below. */
+			if (ready_cnt > 0 &&
+			    std::find(ready_strms_.begin(), ready_strms_.end(),
+				      current_strm) != ready_strms_.end())
+				continue;
+			if (readStream(*conn, *current_strm, handler) > 0)
+				ready_strms_.push_back(current_strm);
+		}
+	}
+	/* Closed streams are removed from the list by close(). */
+	for (size_t i = 0; i < ready_cnt && !ready_strms_.empty(); ++i) {
+		Stream_t *strm = ready_strms_.front();
+		ready_strms_.pop_front();
+		Conn_t *conn = strm_to_conn[strm];
+		/* Paused stream gets an event when it is resumed. */
+		if (isPaused(*conn, *strm))
+			continue;
+		if (readStream(*conn, *strm, handler) > 0)
+			ready_strms_.push_back(strm);
+	}
+	if (paused && m_Connector.memory_.canResume())
+		resumeAll();
+	flushCompressed();
+	notifyClosed(handler);
+	return event_cnt;
+}
+
+template<class BUFFER, class Stream>
+template<class Handler>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::notifyClosed(Handler &handler)
+{
+	/* Handlers which keep no state of clients ignore it. */
+	(void) handler;
+	if constexpr (internal::has_disconnected<Handler>::value) {
+		for (int fd : closed_clients_)
+			handler.disconnected(fd);
+	}
+	closed_clients_.clear();
+}
+
+template<class BUFFER, class Stream>
+template<class Handler>
+int
+ProxyEpollNetProvider<BUFFER, Stream>::readStream(Conn_t &conn, Stream_t &strm,
+						  Handler &handler)
+{
+	size_t budget = 1;
+	if (m_Connector.proxy_opts_.edge_triggered)
+		budget = m_Connector.proxy_opts_.read_budget;
+	auto *impl = conn.getImpl();
+	bool is_client = &strm == &conn.get_client_strm();
+	size_t quantum = m_Connector.proxy_opts_.fair_quantum;
+	if (is_client && quantum != 0) {
+		/* New turn: unused credit is lost, overdraft is not. */
+		impl->deficit = std::min<ssize_t>(impl->deficit, 0) +
+				quantum * impl->weight;
+	}
+	impl->selectInput(&strm);
+	for (size_t i = 0; i < budget; ++i) {
+		auto tunnel = tunnels_.find(&strm);
+		if (tunnel != tunnels_.end()) {
+			int rc = pumpTunnel(conn, strm, tunnel->second);
+			if (rc < 0) {
+				close(conn);
+				return -1;
+			}
+			if (rc == 0)
+				return 0;
+			continue;
+		}
+		auto cut_through = cut_through_.find(&strm);
+		if (cut_through != cut_through_.end()) {
+			int rc = passThrough(conn, strm, cut_through->second);
+			if (rc < 0) {
+				close(conn);
+				return -1;
+			}
+			if (rc == 0)
+				return 0;
+			continue;
+		}
+		/* Requests left from the last turn are processed first. */
+		if (!(is_client && impl->throttled)) {
+			int rc = recv(conn, strm);
+			if (rc < 0) {
+				close(conn);
+				return -1;
 			}
+			if (rc == 0)
+				return 0;
+			if (m_Connector.tracer_.enabled())
+				impl->recvTime = ProxyTracer::now();
+		}
+		/* Responses don't make the client ready to be read again. */
+		if (is_client)
+			impl->throttled = false;
+		m_Connector.setCurrentReceiver(&conn, &strm);
+		// send bytes to Callback
+		handler(m_Connector);
+		new_clients.erase(strm.get_fd());
+		conn.getImpl()->releaseIdleBuffers();
+		trim_pending_ = true;
+
+		auto &memory = m_Connector.memory_;
+		if (memory.overHardLimit() && !accept_paused_)
+			pauseAccept();
+		/* Backends are never paused: their responses free memory. */
+		if (is_client &&
+		    memory.shouldPause(impl->bufferedBytes, conns_.size())) {
+			pauseClient(conn);
+			return 0;
 		}
+		/* Served again once other ready streams had their turns. */
+		if (is_client && impl->throttled)
+			return 1;
+	}
+	/* In edge-triggered mode there is no new event for the rest. */
+	if (m_Connector.proxy_opts_.edge_triggered || hasPendingInput(strm))
+		return 1;
+	return 0;
+}
+
+template<class BUFFER, class Stream>
+bool
+ProxyEpollNetProvider<BUFFER, Stream>::hasPendingInput(Stream_t &strm)
+{
+#ifdef TNTCXX_ENABLE_ZLIB
+	if constexpr (is_zlib_stream_v<Stream_t>)
+		return strm.has_pending();
+#endif
+#ifdef TNTCXX_ENABLE_SSL
+	if constexpr (std::is_base_of_v<UnixSSLStream, Stream_t>)
+		return strm.has_pending();
+#endif
+	(void) strm;
+	return false;
+}
+
+template<class BUFFER, class Stream>
+bool
+ProxyEpollNetProvider<BUFFER, Stream>::isPlain(Stream_t &strm)
+{
+#ifdef TNTCXX_ENABLE_ZLIB
+	if constexpr (is_zlib_stream_v<Stream_t>) {
+		if (strm.is_compressed())
+			return false;
+	}
+#endif
+#ifdef TNTCXX_ENABLE_SSL
+	if constexpr (std::is_base_of_v<UnixSSLStream, Stream_t>)
+		return !strm.is_ssl();
+#endif
+	(void) strm;
+	return true;
+}
+
+template<class BUFFER, class Stream>
+bool
+ProxyEpollNetProvider<BUFFER, Stream>::isPaused(Conn_t &conn, Stream_t &strm)
+{
+	return &strm == &conn.get_client_strm() &&
+	       paused_clients_.count(&conn) != 0;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::pauseClient(Conn_t &conn)
+{
+	if (!paused_clients_.insert(&conn).second)
+		return;
+	m_Connector.memory_.pause_count++;
+	setEvents(conn, conn.get_client_strm(), 0);
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::pauseAccept()
+{
+	LOG_WARNING("Memory hard limit is reached, stop accepting clients");
+	m_Connector.memory_.reject_count++;
+	for (auto &strm : server_strms_)
+		epoll_ctl(m_AllEpollFd, EPOLL_CTL_DEL, strm.get_fd(), nullptr);
+	accept_paused_ = true;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::resumeAll()
+{
+	/* Re-arming reports data which arrived while paused. */
+	std::set<Conn_t *> paused;
+	paused.swap(paused_clients_);
+	for (Conn_t *conn : paused) {
+		Stream_t *strm = &conn->get_client_strm();
+		setEvents(*conn, *strm, EPOLLIN);
+		/* Socket may have no data to report, but the buffer has. */
+		if (conn->getImpl()->throttled &&
+		    std::find(ready_strms_.begin(), ready_strms_.end(),
+			      strm) == ready_strms_.end())
+			ready_strms_.push_back(strm);
+	}
+	if (!accept_paused_)
+		return;
+	uint32_t accept_events = EPOLLIN;
+	if (m_Connector.proxy_opts_.exclusive_accept)
+		accept_events |= EPOLLEXCLUSIVE;
+	for (auto &strm : server_strms_)
+		addToEpoll(nullptr, strm, accept_events);
+	accept_paused_ = false;
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::resumeHeld(Conn_t &conn)
+{
+	auto *impl = conn.getImpl();
+	impl->held = false;
+	/* Buffered requests are processed without receiving more. */
+	impl->throttled = true;
+	Stream_t *strm = &conn.get_client_strm();
+	if (std::find(ready_strms_.begin(), ready_strms_.end(), strm) ==
+	    ready_strms_.end())
+		ready_strms_.push_back(strm);
+}
+
+template<class BUFFER, class Stream>
+void
+ProxyEpollNetProvider<BUFFER, Stream>::flushPaused()
+{
+	for (Conn_t *conn : paused_clients_) {
+		if (hasEncodedDataToSend(*conn))
+			sendEnc(*conn, conn->get_client_strm());
+		if (hasEncodedDataToSend(*conn))
+			continue;
+		conn->getImpl()->releaseIdleBuffers();
 	}
+	if (m_Connector.memory_.canResume())
+		resumeAll();
 }
@@ -0,0 +1,628 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "ProxyPipeline.hpp"
+#include "../Utils/Logger.hpp"
+
+/**
+ * Stages sending a request to several instances at once.
+ *
+ * Map-reduce CALL: FanOutStage sends a CALL of a function marked as
+ * fan-out to every instance, feeds IPROTO_DATA of the responses to a
+ * reducer and replies to the client once with the reduced data.
+ *
+ * Reducer is a default constructible class, a fresh one is created for
+ * each request:
+ *
+ * template<class BUFFER>
+ * bool add(Data<BUFFER> &data);   // DATA of one instance, false if malformed
+ * auto result();                  // anything mpp can encode as DATA
+ *
+ * Replicated writes: QuorumWriteStage sends a write request to N
+ * instances and replies to the client after W of them acknowledge it.
+ */
+
+namespace internal {
+/** Append MsgPack header of array of @a size elements to @a out. */
+inline void
+appendArrayHeader(std::string &out, uint32_t size)
+{
+	if (size < 16) {
+		out.push_back(static_cast<char>(0x90 | size));
+	} else if (size <= UINT16_MAX) {
+		out.push_back('\xdc');
+		out.push_back(static_cast<char>(size >> 8));
+		out.push_back(static_cast<char>(size));
+	} else {
+		out.push_back('\xdd');
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back(static_cast<char>(size >> shift));
+	}
+}
+
+/** Append raw bytes of range [@a begin, @a end) of a buffer to @a out. */
+template<class IT>
+void
+appendRaw(std::string &out, IT &begin, IT &end)
+{
+	size_t len = end - begin;
+	size_t old_size = out.size();
+	out.resize(old_size + len);
+	IT itr = begin;
+	itr.get({out.data() + old_size, len});
+}
+
+/**
+ * Send copy of the current message to instances [0, @a count) and
+ * skip it. Return number of instances the message is sent to.
+ */
+template<class Proxy, class BUFFER>
+size_t
+copyToInstances(Proxy &proxy, Message<BUFFER> &msg, size_t count)
+{
+	size_t sent = 0;
+	for (size_t i = 0; i < count; ++i) {
+		auto &strm = proxy.connect(i);
+		if (strm.get_fd() < 0 ||
+		    proxy.copyDecodedToStream(strm, msg.size) != 0) {
+			LOG_ERROR("Failed to send request ", msg.header.sync,
+				  " to instance ", i);
+			continue;
+		}
+		sent++;
+	}
+	proxy.skipLastDecodedMessage(msg.size);
+	return sent;
+}
+
+/** Reply to the client's request @a msg with error @a errmsg. */
+template<class Proxy, class BUFFER>
+void
+replyError(Proxy &proxy, Message<BUFFER> &msg, const char *errmsg)
+{
+	int size = proxy.createError(msg.header.sync,
+				     msg.header.schema_id.value_or(0),
+				     PIPELINE_ERRCODE, errmsg);
+	proxy.sendEncodedToClient(size);
+}
+} // namespace internal
+
+/** Concatenates arrays returned by all instances. */
+class ConcatReducer {
+public:
+	template<class BUFFER>
+	bool add(Data<BUFFER> &data);
+	auto result();
+
+private:
+	/** Encoded elements of all arrays. */
+	std::string m_Elems;
+	uint32_t m_Count = 0;
+	std::string m_Result;
+};
+
+/** Sum of all numbers returned by all instances, as [sum]. */
+template<class T>
+class SumReducer {
+public:
+	template<class BUFFER>
+	bool add(Data<BUFFER> &data);
+	std::vector<T> result() const { return {m_Sum}; }
+
+private:
+	T m_Sum{};
+};
+
+/**
+ * Minimum (or maximum if @a MAX is true) of all numbers returned by all
+ * instances, as [value] or [] if no instance returned a number.
+ */
+template<class T, bool MAX = false>
+class ExtremumReducer {
+public:
+	template<class BUFFER>
+	bool add(Data<BUFFER> &data);
+	std::vector<T> result() const;
+
+private:
+	std::optional<T> m_Value;
+};
+
+template<class T>
+using MinReducer = ExtremumReducer<T, false>;
+template<class T>
+using MaxReducer = ExtremumReducer<T, true>;
+
+/**
+ * Top @a N tuples of all instances ordered by @a FIELD (member pointer of
+ * @a Tuple), descending unless @a DESC is false. Instances are expected to
+ * return arrays of tuples; tuples are decoded into @a Tuple only to get
+ * the field and are sent to client as is.
+ */
+template<class Tuple, auto FIELD, size_t N, bool DESC = true>
+class TopNReducer {
+public:
+	static_assert(N > 0, "Top of zero tuples is always empty");
+	using Key_t = std::remove_cv_t<std::remove_reference_t<
+		decltype(std::declval<Tuple &>().*FIELD)>>;
+
+	template<class BUFFER>
+	bool add(Data<BUFFER> &data);
+	auto result();
+
+private:
+	static bool before(const std::pair<Key_t, std::string> &a,
+			   const std::pair<Key_t, std::string> &b);
+
+	std::vector<std::pair<Key_t, std::string>> m_Top;
+	std::string m_Result;
+};
+
+/**
+ * Stage implementing map-reduce CALL. Spec must provide:
+ *
+ * using Reducer = ...;
+ * static bool isFanOut(const std::string &function_name);
+ *
+ * Requests are matched to responses by client and sync, so each client
+ * may have several fan-out calls in flight. If an instance responds with
+ * an error (or with DATA the reducer can't handle), that response is
+ * sent to the client instead of the reduced one, responses of other
+ * instances are dropped. The same applies to responses streamed to the
+ * client (see ProxyOptions::cut_through_size). A call no instance can
+ * be reached for is answered with an error. Several stages with
+ * different specs may be chained to use different reducers for
+ * different functions.
+ */
+template<class Spec>
+class FanOutStage {
+public:
+	using Reducer = typename Spec::Reducer;
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/** Number of fan-out calls waiting for responses. */
+	size_t pendingCount() const { return m_Pending.size(); }
+	/** Forget requests of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	/** Number of calls sent to instances. */
+	size_t call_count = 0;
+	/** Number of calls failed on any instance. */
+	size_t error_count = 0;
+
+private:
+	struct Pending {
+		explicit Pending(size_t count) : expected(count) {}
+
+		size_t expected;
+		size_t received = 0;
+		bool failed = false;
+		int schema_id = 0;
+		Reducer reducer;
+	};
+
+	template<class Proxy, class BUFFER>
+	StageStatus send(Proxy &proxy, Message<BUFFER> &msg);
+	template<class Proxy, class BUFFER>
+	StageStatus reduce(Proxy &proxy, Message<BUFFER> &msg);
+
+	/** Calls in flight by (client fd, sync). */
+	std::map<std::pair<int, int>, Pending> m_Pending;
+};
+
+/**
+ * Stage replicating writes (INSERT, REPLACE, UPDATE, DELETE, UPSERT):
+ * a write is sent to the first N instances in parallel and the first
+ * successful response is forwarded to the client as soon as W instances
+ * acknowledge the write. Responses arriving after that are swallowed.
+ * If the quorum can't be reached anymore, the error response that made
+ * it impossible is forwarded instead; if the write can't even be sent to
+ * W instances, the client gets an error at once. A write applied on some
+ * instances but failed on (or not sent to) others is counted as
+ * divergence: such replicas need repair. By default N is the number of
+ * instances and W is majority.
+ */
+class QuorumWriteStage {
+public:
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/**
+	 * Wait for @a write_quorum acknowledgements out of @a replica_count
+	 * instances (0 means all instances). Return -1 if W is greater
+	 * than N or zero.
+	 */
+	int setQuorum(size_t write_quorum, size_t replica_count = 0);
+	/** Number of writes waiting for responses. */
+	size_t pendingCount() const { return m_Pending.size(); }
+	/** Forget requests of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	/** Number of replicated writes. */
+	size_t write_count = 0;
+	/** Number of writes failed to reach the quorum. */
+	size_t quorum_failures = 0;
+	/** Number of writes applied on some replicas only. */
+	size_t divergence_count = 0;
+	/** Number of responses received after the client got its reply. */
+	size_t late_responses = 0;
+
+private:
+	struct Pending {
+		size_t expected;
+		/* Zero if the write is not sent to enough replicas. */
+		size_t quorum;
+		/* Replicas the write failed to be sent to. */
+		size_t unsent;
+		size_t acks = 0;
+		size_t errors = 0;
+		bool replied = false;
+	};
+
+	static bool isWrite(int code);
+	template<class Proxy, class BUFFER>
+	StageStatus send(Proxy &proxy, Message<BUFFER> &msg);
+	template<class Proxy, class BUFFER>
+	StageStatus collect(Proxy &proxy, Message<BUFFER> &msg);
+
+	/* Zero means default, see setQuorum(). */
+	size_t m_Quorum = 0;
+	size_t m_Replicas = 0;
+	/** Writes in flight by (client fd, sync). */
+	std::map<std::pair<int, int>, Pending> m_Pending;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+template<class BUFFER>
+bool
+ConcatReducer::add(Data<BUFFER> &data)
+{
+	/* Elements are not decoded, only their bounds. */
+	std::vector<Data<BUFFER>> elems;
+	if (!data.decode(elems))
+		return false;
+	for (auto &elem : elems)
+		internal::appendRaw(m_Elems, elem.iters.first, elem.iters.second);
+	m_Count += elems.size();
+	return true;
+}
+
+inline auto
+ConcatReducer::result()
+{
+	m_Result.clear();
+	internal::appendArrayHeader(m_Result, m_Count);
+	m_Result += m_Elems;
+	return mpp::as_raw(m_Result);
+}
+
+template<class T>
+template<class BUFFER>
+bool
+SumReducer<T>::add(Data<BUFFER> &data)
+{
+	std::vector<T> values;
+	if (!data.decode(values))
+		return false;
+	for (const T &value : values)
+		m_Sum += value;
+	return true;
+}
+
+template<class T, bool MAX>
+template<class BUFFER>
+bool
+ExtremumReducer<T, MAX>::add(Data<BUFFER> &data)
+{
+	std::vector<T> values;
+	if (!data.decode(values))
+		return false;
+	for (const T &value : values) {
+		if (!m_Value.has_value() ||
+		    (MAX ? *m_Value < value : value < *m_Value))
+			m_Value = value;
+	}
+	return true;
+}
+
+template<class T, bool MAX>
+std::vector<T>
+ExtremumReducer<T, MAX>::result() const
+{
+	if (!m_Value.has_value())
+		return {};
+	return {*m_Value};
+}
+
+template<class Tuple, auto FIELD, size_t N, bool DESC>
+bool
+TopNReducer<Tuple, FIELD, N, DESC>::before(const std::pair<Key_t, std::string> &a,
+					   const std::pair<Key_t, std::string> &b)
+{
+	return DESC ? b.first < a.first : a.first < b.first;
+}
+
+template<class Tuple, auto FIELD, size_t N, bool DESC>
+template<class BUFFER>
+bool
+TopNReducer<Tuple, FIELD, N, DESC>::add(Data<BUFFER> &data)
+{
+	std::vector<Data<BUFFER>> elems;
+	if (!data.decode(elems))
+		return false;
+	for (auto &elem : elems) {
+		Tuple tuple;
+		if (!elem.decode(tuple))
+			return false;
+		std::string raw;
+		internal::appendRaw(raw, elem.iters.first, elem.iters.second);
+		m_Top.emplace_back(tuple.*FIELD, std::move(raw));
+	}
+	/* Keep at most N tuples between responses. */
+	if (m_Top.size() > N) {
+		std::partial_sort(m_Top.begin(), m_Top.begin() + N,
+				  m_Top.end(), before);
+		m_Top.resize(N);
+	}
+	return true;
+}
+
+template<class Tuple, auto FIELD, size_t N, bool DESC>
+auto
+TopNReducer<Tuple, FIELD, N, DESC>::result()
+{
+	std::sort(m_Top.begin(), m_Top.end(), before);
+	m_Result.clear();
+	internal::appendArrayHeader(m_Result, m_Top.size());
+	for (auto &tuple : m_Top)
+		m_Result += tuple.second;
+	return mpp::as_raw(m_Result);
+}
+
+template<class Spec>
+void
+FanOutStage<Spec>::disconnected(int client_fd)
+{
+	internal::eraseClient(m_Pending, client_fd);
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+FanOutStage<Spec>::handle(Proxy &proxy, Message<BUFFER> &msg,
+			  PipelineContext &ctx)
+{
+	if (!ctx.from_client)
+		return reduce(proxy, msg);
+	if (msg.header.code != Iproto::CALL || !msg.body.function_name ||
+	    !Spec::isFanOut(*msg.body.function_name))
+		return STAGE_NEXT;
+	return send(proxy, msg);
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+FanOutStage<Spec>::send(Proxy &proxy, Message<BUFFER> &msg)
+{
+	size_t instance_count = proxy.opts_.size();
+	if (instance_count == 0) {
+		LOG_ERROR("Can't fan out call: no instances");
+		return STAGE_ERR;
+	}
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (m_Pending.count(key) != 0) {
+		LOG_ERROR("Fan-out call with sync ", msg.header.sync,
+			  " is already in flight");
+		return STAGE_ERR;
+	}
+	size_t sent = internal::copyToInstances(proxy, msg, instance_count);
+	if (sent == 0) {
+		error_count++;
+		internal::replyError(proxy, msg, "No instance is reachable");
+		return STAGE_DONE;
+	}
+	/* Instances that failed to receive the call don't take part. */
+	m_Pending.emplace(key, Pending(sent));
+	call_count++;
+	return STAGE_DONE;
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+FanOutStage<Spec>::reduce(Proxy &proxy, Message<BUFFER> &msg)
+{
+	auto it = m_Pending.find(std::make_pair(proxy.getClientFd(),
+						msg.header.sync));
+	if (it == m_Pending.end())
+		return STAGE_NEXT;
+	Pending &pending = it->second;
+	pending.received++;
+	if (pending.failed) {
+		proxy.skipLastDecodedMessage(msg.size);
+	} else if (msg.streamed || msg.header.code != Iproto::OK ||
+		   (msg.body.data && !pending.reducer.add(*msg.body.data))) {
+		/* Streamed response is too large to be reduced. */
+		LOG_ERROR("Fan-out call with sync ", msg.header.sync,
+			  " failed on one of instances");
+		pending.failed = true;
+		error_count++;
+		proxy.sendDecodedToClient(msg.size);
+	} else {
+		pending.schema_id = msg.header.schema_id.value_or(0);
+		proxy.skipLastDecodedMessage(msg.size);
+	}
+	if (pending.received < pending.expected)
+		return STAGE_DONE;
+	if (!pending.failed) {
+		auto data = pending.reducer.result();
+		int size = proxy.createMessage(msg.header.sync,
+					       pending.schema_id, &data);
+		proxy.sendEncodedToClient(size);
+	}
+	m_Pending.erase(it);
+	return STAGE_DONE;
+}
+
+inline int
+QuorumWriteStage::setQuorum(size_t write_quorum, size_t replica_count)
+{
+	if (write_quorum == 0 ||
+	    (replica_count != 0 && write_quorum > replica_count)) {
+		LOG_ERROR("Invalid write quorum ", write_quorum, " of ",
+			  replica_count);
+		return -1;
+	}
+	m_Quorum = write_quorum;
+	m_Replicas = replica_count;
+	return 0;
+}
+
+inline bool
+QuorumWriteStage::isWrite(int code)
+{
+	return code == Iproto::INSERT || code == Iproto::REPLACE ||
+	       code == Iproto::UPDATE || code == Iproto::DELETE ||
+	       code == Iproto::UPSERT;
+}
+
+inline void
+QuorumWriteStage::disconnected(int client_fd)
+{
+	internal::eraseClient(m_Pending, client_fd);
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+QuorumWriteStage::handle(Proxy &proxy, Message<BUFFER> &msg,
+			 PipelineContext &ctx)
+{
+	if (!ctx.from_client)
+		return collect(proxy, msg);
+	if (!isWrite(msg.header.code))
+		return STAGE_NEXT;
+	return send(proxy, msg);
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+QuorumWriteStage::send(Proxy &proxy, Message<BUFFER> &msg)
+{
+	size_t replicas = m_Replicas != 0 ? m_Replicas : proxy.opts_.size();
+	size_t quorum = m_Quorum != 0 ? m_Quorum : replicas / 2 + 1;
+	if (replicas > proxy.opts_.size() || quorum > replicas) {
+		LOG_ERROR("Can't replicate write: ", replicas,
+			  " replicas are required, ", proxy.opts_.size(),
+			  " instances are configured");
+		return STAGE_ERR;
+	}
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (m_Pending.count(key) != 0) {
+		LOG_ERROR("Write with sync ", msg.header.sync,
+			  " is already in flight");
+		return STAGE_ERR;
+	}
+	size_t sent = internal::copyToInstances(proxy, msg, replicas);
+	write_count++;
+	Pending pending{sent, quorum, replicas - sent};
+	if (sent < quorum) {
+		LOG_ERROR("Write with sync ", msg.header.sync, " is sent to ",
+			  sent, " replicas, quorum is ", quorum);
+		quorum_failures++;
+		internal::replyError(proxy, msg, "Write quorum is not reachable");
+		/* Client is answered, responses are only counted. */
+		pending.quorum = 0;
+		pending.replied = true;
+	}
+	if (sent != 0)
+		m_Pending.emplace(key, pending);
+	return STAGE_DONE;
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+QuorumWriteStage::collect(Proxy &proxy, Message<BUFFER> &msg)
+{
+	auto it = m_Pending.find(std::make_pair(proxy.getClientFd(),
+						msg.header.sync));
+	if (it == m_Pending.end())
+		return STAGE_NEXT;
+	Pending &pending = it->second;
+	bool is_ok = msg.header.code == Iproto::OK;
+	if (is_ok)
+		pending.acks++;
+	else
+		pending.errors++;
+	bool reply = false;
+	if (pending.replied) {
+		if (pending.quorum != 0)
+			late_responses++;
+	} else if (is_ok) {
+		reply = pending.acks == pending.quorum;
+	} else if (pending.errors > pending.expected - pending.quorum) {
+		/* Quorum can't be reached anymore. */
+		reply = true;
+		quorum_failures++;
+	}
+	if (reply) {
+		pending.replied = true;
+		proxy.sendDecodedToClient(msg.size);
+	} else {
+		proxy.skipLastDecodedMessage(msg.size);
+	}
+	if (pending.acks + pending.errors < pending.expected)
+		return STAGE_DONE;
+	if (pending.acks != 0 && pending.errors + pending.unsent != 0) {
+		LOG_WARNING("Write with sync ", msg.header.sync,
+			    " diverged: applied on ", pending.acks, " of ",
+			    pending.expected + pending.unsent, " replicas");
+		divergence_count++;
+	}
+	m_Pending.erase(it);
+	return STAGE_DONE;
+}
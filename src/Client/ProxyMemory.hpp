@@ -0,0 +1,152 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include "../Buffer/Buffer.hpp"
+
+/**
+ * Accounts bytes held by decode and encode buffers of all proxy
+ * connections and decides when reading from clients must be throttled.
+ * Past the soft limit clients holding more than average are paused
+ * after their next read, past the hard limit every client is paused
+ * and new clients are not accepted. Reading is resumed once usage
+ * drops below 3/4 of the soft (or hard, if it is the only) limit.
+ * Zero limit means no limit.
+ */
+class ProxyMemoryGovernor {
+public:
+	void setLimits(size_t soft_limit, size_t hard_limit);
+	void add(size_t bytes) { m_Used += bytes; }
+	void sub(size_t bytes)
+	{
+		assert(bytes <= m_Used);
+		m_Used -= bytes;
+	}
+	/** Bytes held by all buffers. */
+	size_t used() const { return m_Used; }
+
+	/**
+	 * Return true if reading from client which holds @a conn_bytes
+	 * must be paused, @a conn_count is the number of connections.
+	 */
+	bool shouldPause(size_t conn_bytes, size_t conn_count) const;
+	bool overHardLimit() const;
+	/** Return true if paused clients may be resumed. */
+	bool canResume() const;
+
+	/** Number of times a client was paused. */
+	size_t pause_count = 0;
+	/** Number of times accepting clients was stopped. */
+	size_t reject_count = 0;
+	/** Number of slabs returned to the system. */
+	size_t trimmed_slabs = 0;
+
+private:
+	size_t m_Used = 0;
+	size_t m_SoftLimit = 0;
+	size_t m_HardLimit = 0;
+};
+
+namespace internal {
+template<class BUFFER>
+struct BufferAllocator;
+
+template<size_t N, class allocator>
+struct BufferAllocator<tnt::Buffer<N, allocator>> {
+	using type = allocator;
+};
+
+template<class T, class _ = void>
+struct has_trim : std::false_type {};
+
+template<class T>
+struct has_trim<T, std::void_t<decltype(std::declval<T &>().trim())>>
+	: std::true_type {};
+} // namespace internal
+
+/**
+ * Return free slabs of default allocator of @a BUFFER to the system.
+ * Return the number of released slabs, 0 if allocator can't do it.
+ */
+template<class BUFFER>
+size_t
+trimBufferPool()
+{
+	using Allocator_t = typename internal::BufferAllocator<BUFFER>::type;
+	if constexpr (internal::has_trim<Allocator_t>::value) {
+		Allocator_t allocator;
+		return allocator.trim();
+	} else {
+		return 0;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline void
+ProxyMemoryGovernor::setLimits(size_t soft_limit, size_t hard_limit)
+{
+	assert(hard_limit == 0 || soft_limit <= hard_limit);
+	m_SoftLimit = soft_limit;
+	m_HardLimit = hard_limit;
+}
+
+inline bool
+ProxyMemoryGovernor::shouldPause(size_t conn_bytes, size_t conn_count) const
+{
+	if (overHardLimit())
+		return true;
+	if (m_SoftLimit == 0 || m_Used < m_SoftLimit)
+		return false;
+	/* Pause the heaviest readers only. */
+	return conn_count == 0 || conn_bytes >= m_Used / conn_count;
+}
+
+inline bool
+ProxyMemoryGovernor::overHardLimit() const
+{
+	return m_HardLimit != 0 && m_Used >= m_HardLimit;
+}
+
+inline bool
+ProxyMemoryGovernor::canResume() const
+{
+	size_t limit = m_SoftLimit != 0 ? m_SoftLimit : m_HardLimit;
+	if (limit == 0)
+		return true;
+	return m_Used < limit - limit / 4;
+}
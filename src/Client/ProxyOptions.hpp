@@ -0,0 +1,148 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class TrafficCapture;
+
+/**
+ * Tuning of the proxy server. Defaults are suitable for a single event loop.
+ */
+struct ProxyOptions {
+	static constexpr int DEFAULT_LISTEN_BACKLOG = 1024;
+	static constexpr size_t DEFAULT_ACCEPT_BATCH = 64;
+	static constexpr size_t DEFAULT_READ_BUDGET = 16;
+	static constexpr int DEFAULT_IDLE_TRIM_TIMEOUT = 1000;
+	static constexpr uint64_t DEFAULT_SLOW_REQUEST_USEC = 10000;
+	static constexpr size_t DEFAULT_SLOW_LOG_SIZE = 1024;
+
+	/** Length of pending connections queue of listening sockets. */
+	int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+	/**
+	 * Max number of clients accepted per listener wakeup. The rest
+	 * are accepted on the next loop iteration, so that established
+	 * connections are not starved during reconnect storms.
+	 */
+	size_t accept_batch = DEFAULT_ACCEPT_BATCH;
+	/**
+	 * Register listeners with EPOLLEXCLUSIVE. Set it when several
+	 * event loops share the same listening socket (see addListenerFd()),
+	 * so a new client wakes up only one of them.
+	 */
+	bool exclusive_accept = false;
+	/**
+	 * Register client and backend sockets with EPOLLET. A socket is
+	 * read until EAGAIN, but no more than read_budget times per
+	 * wakeup; then it is put on ready list and served after other
+	 * sockets without waiting for a new event.
+	 */
+	bool edge_triggered = false;
+	size_t read_budget = DEFAULT_READ_BUDGET;
+	/**
+	 * Limits of memory held by buffers of all connections, in bytes
+	 * (see ProxyMemoryGovernor). Zero means no limit.
+	 */
+	size_t memory_soft_limit = 0;
+	size_t memory_hard_limit = 0;
+	/**
+	 * Return free slabs of buffer pool to the system after the proxy
+	 * has been idle for this number of milliseconds. Zero disables it.
+	 */
+	int idle_trim_timeout = DEFAULT_IDLE_TRIM_TIMEOUT;
+	/**
+	 * Responses of at least this size are not buffered whole: once
+	 * the header is received, the message is passed to the handler
+	 * with only header decoded, and the body is forwarded to client
+	 * (or dropped if the message is skipped) as it arrives. Zero
+	 * disables it. Requests of clients are always buffered.
+	 */
+	size_t cut_through_size = 0;
+	/**
+	 * Settings of listeners terminating TLS (see addListener()): the
+	 * record layer is handed over to the kernel (kTLS) after the
+	 * handshake if kernel and OpenSSL support it, and up to
+	 * tls_session_cache_size sessions are kept for resumption (zero
+	 * means OpenSSL default).
+	 */
+	bool ktls = false;
+	size_t tls_session_cache_size = 0;
+	/**
+	 * Deficit round-robin over clients: on its turn a client may
+	 * process fair_quantum requests (or bytes of requests if
+	 * fair_by_bytes is set) multiplied by its weight. Requests left
+	 * are processed after other ready clients had their turns, so a
+	 * client pipelining thousands of requests doesn't stall the rest.
+	 * Zero disables it: all received requests are processed at once.
+	 */
+	size_t fair_quantum = 0;
+	bool fair_by_bytes = false;
+	/**
+	 * Weights of clients authenticated as these users. Weight of other
+	 * clients is 1 unless it is set by handler (see setClientWeight()).
+	 */
+	std::map<std::string, unsigned> user_weights;
+	/**
+	 * Record all bytes received from and sent to clients (see
+	 * TrafficCapture). The capture is owned by the caller and may be
+	 * shared by proxies running in different threads.
+	 */
+	TrafficCapture *capture = nullptr;
+	/**
+	 * Trace one of trace_sample_rate client requests: timestamp it on
+	 * receipt, decoding, routing, sending to instance, receipt of the
+	 * response and reply. The last slow_log_size traced requests which
+	 * took at least slow_request_usec are kept (see ProxyTracer). Zero
+	 * rate disables tracing.
+	 */
+	size_t trace_sample_rate = 0;
+	uint64_t slow_request_usec = DEFAULT_SLOW_REQUEST_USEC;
+	size_t slow_log_size = DEFAULT_SLOW_LOG_SIZE;
+	/**
+	 * Priority classes of requests (see ProxyQos). A request of class
+	 * N is held while qos_in_flight[N] requests of this class await
+	 * responses from the same instance, so that bulk requests can't
+	 * occupy an instance ahead of pings and selects. Zero (or a class
+	 * beyond the vector) means no limit, an empty vector disables QoS.
+	 * The class of a request is given by its function name, space,
+	 * type, class of its client (by user name or set by handler with
+	 * setClientClass()), or qos_default_class, in that order.
+	 */
+	std::vector<size_t> qos_in_flight;
+	std::map<std::string, unsigned> qos_function_class;
+	std::map<uint32_t, unsigned> qos_space_class;
+	std::map<int, unsigned> qos_type_class;
+	std::map<std::string, unsigned> qos_user_class;
+	unsigned qos_default_class = 0;
+};
@@ -0,0 +1,667 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "../Utils/Logger.hpp"
+
+/**
+ * Result of a single pipeline stage.
+ */
+enum StageStatus {
+	/* Message is left untouched, pass it to the next stage. */
+	STAGE_NEXT = 0,
+	/* Message is consumed (sent or skipped), stop the pipeline. */
+	STAGE_DONE = 1,
+	/*
+	 * Stage failed to handle the message, it is dropped. Client gets
+	 * an error response to the request (see PIPELINE_ERRCODE).
+	 */
+	STAGE_ERR = -1,
+};
+
+/** Code of error replied to requests stages failed (ER_NO_CONNECTION). */
+static constexpr uint32_t PIPELINE_ERRCODE = 77;
+
+/**
+ * Per-stage counters gathered by the pipeline.
+ */
+struct StageStats {
+	/** Number of messages passed to the stage. */
+	size_t calls = 0;
+	/** Number of messages consumed by the stage (early exits). */
+	size_t done = 0;
+	/** Number of messages dropped because of stage errors. */
+	size_t errors = 0;
+};
+
+/**
+ * State shared by stages while a single message goes through the pipeline.
+ */
+struct PipelineContext {
+	/** True if the message is received from client. */
+	bool from_client = false;
+	/** Index of instance the message is routed to, -1 if not routed yet. */
+	int instance = -1;
+};
+
+/**
+ * Handler composed of stages at compile time. Each decoded message is
+ * passed through stages in order until one of them consumes it.
+ * A stage is any default constructible class providing the method:
+ *
+ * template<class Proxy, class BUFFER>
+ * StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+ *                    PipelineContext &ctx);
+ *
+ * Stages are stored by value, so they may keep their own state (caches,
+ * routing tables etc). Dispatch is static, so the whole pipeline is inlined
+ * into the network provider loop. Message that is not consumed by any
+ * stage is skipped. A stage may also provide
+ *
+ * template<class Proxy>
+ * void flush(Proxy &proxy);
+ *
+ * which is invoked once all decoded messages of the current receiver are
+ * handled, e.g. to send requests it has been accumulating, and
+ *
+ * void disconnected(int client_fd);
+ *
+ * which is invoked once connection of client @a client_fd is closed, to
+ * drop state kept for its requests: the descriptor may be reused by a
+ * new client.
+ * Usage:
+ * Pipeline<AuthStage, ShardRouter<Spec>, ForwardStage> router;
+ * proxy.start(router);
+ */
+template<class... Stages>
+class Pipeline
+{
+public:
+	static constexpr size_t STAGE_COUNT = sizeof...(Stages);
+
+	/** Process all decoded messages of the current receiver. */
+	template<class Proxy>
+	void operator()(Proxy &proxy);
+	/** Let stages forget client @a client_fd, see above. */
+	void disconnected(int client_fd);
+
+	/** Access to stage instances. */
+	template<size_t I>
+	auto &stage() { return std::get<I>(m_Stages); }
+	template<class Stage>
+	Stage &stage() { return std::get<Stage>(m_Stages); }
+
+	/** Counters of @a i-th stage. */
+	const StageStats &stats(size_t i) const { return m_Stats[i]; }
+	/** Number of messages none of stages consumed. */
+	size_t unhandledCount() const { return m_Unhandled; }
+
+private:
+	template<size_t I, class Proxy, class BUFFER>
+	StageStatus runFrom(Proxy &proxy, Message<BUFFER> &msg,
+			    PipelineContext &ctx);
+	template<size_t I, class Proxy>
+	void flushFrom(Proxy &proxy);
+	template<size_t I>
+	void disconnectedFrom(int client_fd);
+
+	std::tuple<Stages...> m_Stages;
+	std::array<StageStats, STAGE_COUNT> m_Stats;
+	size_t m_Unhandled = 0;
+};
+
+/**
+ * Terminal stage: sends client requests to the routed instance (the first
+ * one if the message was not routed) and backend responses to the client.
+ */
+struct ForwardStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+};
+
+/**
+ * Stage routing client requests by shard key. Spec must provide:
+ *
+ * static constexpr size_t BUCKET_COUNT;
+ * template<class BUFFER>
+ * static std::optional<uint64_t> shardKey(Message<BUFFER> &msg);
+ *
+ * Key is hashed to a bucket, bucket is mapped to instance. By default
+ * buckets are spread evenly among all instances proxy is configured with.
+ * Requests without shard key are not routed.
+ *
+ * Buckets are moved online: while data of a bucket is copied to another
+ * instance (by external means), the bucket is in migration. Writes
+ * (INSERT, REPLACE, UPDATE, DELETE, UPSERT) of a bucket in migration are
+ * sent to both instances and the client gets the response of the source,
+ * which still has all data; failures on the destination are counted.
+ * SELECTs go to the destination, and are sent again to the source if the
+ * destination returns no tuples. Other requests go to the source. Once the
+ * data is copied, finishMoves() switches all buckets in migration to their
+ * destinations at once, between two requests. Requests in flight are
+ * completed as they were routed.
+ */
+template<class Spec>
+class ShardRouter {
+public:
+	static constexpr size_t BUCKET_COUNT = Spec::BUCKET_COUNT;
+	static_assert(BUCKET_COUNT > 0, "There must be at least one bucket");
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/** Bucket the given key belongs to. */
+	static size_t bucketOf(uint64_t key);
+	/** Move @a bucket to instance with index @a instance. */
+	void setBucketInstance(size_t bucket, int instance);
+	/** Instance @a bucket is stored on, -1 if table is not filled yet. */
+	int getBucketInstance(size_t bucket) const;
+
+	/**
+	 * Start migration of @a bucket to @a instance. Return -1 if the
+	 * table is not filled yet, the bucket is already there or in
+	 * migration.
+	 */
+	int startMove(size_t bucket, int instance);
+	/** Switch @a bucket to its destination. Return -1 if not moving. */
+	int finishMove(size_t bucket);
+	/** Switch all buckets in migration to their destinations. */
+	void finishMoves();
+	/** Leave @a bucket on its source. Return -1 if not moving. */
+	int abortMove(size_t bucket);
+	/** Destination of @a bucket, -1 if it is not in migration. */
+	int getMoveDestination(size_t bucket) const;
+	/** Number of buckets in migration. */
+	size_t movingCount() const { return m_Moves.size(); }
+	/** Number of requests waiting for responses of both instances. */
+	size_t pendingCount() const { return m_Pending.size(); }
+	/** Forget requests of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	/** Number of buckets switched to their destinations. */
+	size_t moved_count = 0;
+	/** Number of writes sent to both instances. */
+	size_t dual_write_count = 0;
+	/** Number of writes failed on destination. */
+	size_t dual_write_errors = 0;
+	/** Number of reads sent to destination. */
+	size_t moving_read_count = 0;
+	/** Number of reads sent again to source. */
+	size_t fallback_count = 0;
+
+protected:
+	/** Route client request @a msg with shard key @a key. */
+	template<class Proxy, class BUFFER>
+	StageStatus route(Proxy &proxy, Message<BUFFER> &msg,
+			  PipelineContext &ctx, uint64_t key);
+
+private:
+	struct Pending {
+		int source;
+		int destination;
+		/** Read to repeat on source, empty for writes. */
+		std::string read;
+		bool awaiting_source;
+		bool awaiting_destination;
+	};
+
+	void fillDefault(size_t instance_count);
+	static bool isWrite(int code);
+	/** True if @a msg is a successful response without tuples. */
+	template<class BUFFER>
+	static bool isEmpty(Message<BUFFER> &msg);
+	template<class Proxy, class BUFFER>
+	StageStatus sendMoving(Proxy &proxy, Message<BUFFER> &msg,
+			       int source, int destination);
+	template<class Proxy, class BUFFER>
+	StageStatus collect(Proxy &proxy, Message<BUFFER> &msg);
+
+	std::vector<int> m_Buckets;
+	/** Destinations of buckets in migration. */
+	std::map<size_t, int> m_Moves;
+	/** Requests to buckets in migration by (client fd, sync). */
+	std::map<std::pair<int, int>, Pending> m_Pending;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+namespace internal {
+template<class Stage, class Proxy, class = void>
+struct has_flush : std::false_type {};
+
+template<class Stage, class Proxy>
+struct has_flush<Stage, Proxy, std::void_t<decltype(
+	std::declval<Stage &>().flush(std::declval<Proxy &>()))>>
+	: std::true_type {};
+
+template<class Handler, class = void>
+struct has_disconnected : std::false_type {};
+
+template<class Handler>
+struct has_disconnected<Handler, std::void_t<decltype(
+	std::declval<Handler &>().disconnected(0))>>
+	: std::true_type {};
+
+/** Erase entries of client @a client_fd from @a map by (client fd, sync). */
+template<class Map>
+void
+eraseClient(Map &map, int client_fd)
+{
+	map.erase(map.lower_bound(std::make_pair(client_fd, INT_MIN)),
+		  map.upper_bound(std::make_pair(client_fd, INT_MAX)));
+}
+} // namespace internal
+
+template<class... Stages>
+template<class Proxy>
+void
+Pipeline<Stages...>::operator()(Proxy &proxy)
+{
+	if (proxy.isGreetingExpected())
+		proxy.deliverDecodedGreeting();
+	while (auto iter = proxy.getNextDecodedMessage()) {
+		auto &message = iter.value();
+		PipelineContext ctx;
+		ctx.from_client = proxy.isRecvFromClient();
+		StageStatus rc = runFrom<0>(proxy, message, ctx);
+		if (rc == STAGE_NEXT) {
+			LOG_WARNING("Message ", message.header.code,
+				    " is not handled by any stage, skip it");
+			m_Unhandled++;
+			proxy.skipLastDecodedMessage(message.size);
+		} else if (rc == STAGE_ERR) {
+			/* The client must not wait for a response forever. */
+			if (ctx.from_client) {
+				int size = proxy.createError(
+					message.header.sync,
+					message.header.schema_id.value_or(0),
+					PIPELINE_ERRCODE,
+					"Request is not handled by proxy");
+				proxy.sendEncodedToClient(size);
+			}
+			proxy.skipLastDecodedMessage(message.size);
+		}
+	}
+	flushFrom<0>(proxy);
+}
+
+template<class... Stages>
+template<size_t I, class Proxy>
+void
+Pipeline<Stages...>::flushFrom(Proxy &proxy)
+{
+	if constexpr (I < STAGE_COUNT) {
+		using Stage = std::tuple_element_t<I, std::tuple<Stages...>>;
+		if constexpr (internal::has_flush<Stage, Proxy>::value)
+			std::get<I>(m_Stages).flush(proxy);
+		flushFrom<I + 1>(proxy);
+	}
+}
+
+template<class... Stages>
+void
+Pipeline<Stages...>::disconnected(int client_fd)
+{
+	disconnectedFrom<0>(client_fd);
+}
+
+template<class... Stages>
+template<size_t I>
+void
+Pipeline<Stages...>::disconnectedFrom(int client_fd)
+{
+	if constexpr (I < STAGE_COUNT) {
+		using Stage = std::tuple_element_t<I, std::tuple<Stages...>>;
+		if constexpr (internal::has_disconnected<Stage>::value)
+			std::get<I>(m_Stages).disconnected(client_fd);
+		disconnectedFrom<I + 1>(client_fd);
+	}
+}
+
+template<class... Stages>
+template<size_t I, class Proxy, class BUFFER>
+StageStatus
+Pipeline<Stages...>::runFrom(Proxy &proxy, Message<BUFFER> &msg,
+			     PipelineContext &ctx)
+{
+	if constexpr (I == STAGE_COUNT) {
+		return STAGE_NEXT;
+	} else {
+		m_Stats[I].calls++;
+		StageStatus rc = std::get<I>(m_Stages).handle(proxy, msg, ctx);
+		if (rc == STAGE_DONE) {
+			m_Stats[I].done++;
+			return rc;
+		}
+		if (rc == STAGE_ERR) {
+			m_Stats[I].errors++;
+			return rc;
+		}
+		return runFrom<I + 1>(proxy, msg, ctx);
+	}
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+ForwardStage::handle(Proxy &proxy, Message<BUFFER> &msg, PipelineContext &ctx)
+{
+	int rc;
+	if (ctx.from_client) {
+		auto &strm = proxy.connect(ctx.instance < 0 ? 0 : ctx.instance);
+		rc = proxy.sendDecodedToStream(strm, msg.size);
+	} else {
+		rc = proxy.sendDecodedToClient(msg.size);
+	}
+	return rc < 0 ? STAGE_ERR : STAGE_DONE;
+}
+
+template<class Spec>
+size_t
+ShardRouter<Spec>::bucketOf(uint64_t key)
+{
+	/* Finalizer of MurmurHash3: keys are often sequential ids. */
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key % BUCKET_COUNT;
+}
+
+template<class Spec>
+void
+ShardRouter<Spec>::fillDefault(size_t instance_count)
+{
+	assert(instance_count > 0);
+	m_Buckets.resize(BUCKET_COUNT);
+	for (size_t i = 0; i < BUCKET_COUNT; ++i)
+		m_Buckets[i] = i % instance_count;
+}
+
+template<class Spec>
+void
+ShardRouter<Spec>::setBucketInstance(size_t bucket, int instance)
+{
+	assert(bucket < BUCKET_COUNT);
+	assert(!m_Buckets.empty());
+	m_Buckets[bucket] = instance;
+}
+
+template<class Spec>
+int
+ShardRouter<Spec>::getBucketInstance(size_t bucket) const
+{
+	assert(bucket < BUCKET_COUNT);
+	if (m_Buckets.empty())
+		return -1;
+	return m_Buckets[bucket];
+}
+
+template<class Spec>
+int
+ShardRouter<Spec>::startMove(size_t bucket, int instance)
+{
+	assert(bucket < BUCKET_COUNT);
+	if (m_Buckets.empty() || m_Buckets[bucket] == instance ||
+	    m_Moves.count(bucket) != 0) {
+		LOG_ERROR("Can't move bucket ", bucket, " to instance ",
+			  instance);
+		return -1;
+	}
+	m_Moves.emplace(bucket, instance);
+	return 0;
+}
+
+template<class Spec>
+int
+ShardRouter<Spec>::finishMove(size_t bucket)
+{
+	auto it = m_Moves.find(bucket);
+	if (it == m_Moves.end())
+		return -1;
+	m_Buckets[bucket] = it->second;
+	m_Moves.erase(it);
+	moved_count++;
+	return 0;
+}
+
+template<class Spec>
+void
+ShardRouter<Spec>::finishMoves()
+{
+	for (auto &move : m_Moves)
+		m_Buckets[move.first] = move.second;
+	moved_count += m_Moves.size();
+	m_Moves.clear();
+}
+
+template<class Spec>
+int
+ShardRouter<Spec>::abortMove(size_t bucket)
+{
+	return m_Moves.erase(bucket) != 0 ? 0 : -1;
+}
+
+template<class Spec>
+int
+ShardRouter<Spec>::getMoveDestination(size_t bucket) const
+{
+	auto it = m_Moves.find(bucket);
+	return it == m_Moves.end() ? -1 : it->second;
+}
+
+template<class Spec>
+bool
+ShardRouter<Spec>::isWrite(int code)
+{
+	return code == Iproto::INSERT || code == Iproto::REPLACE ||
+	       code == Iproto::UPDATE || code == Iproto::DELETE ||
+	       code == Iproto::UPSERT;
+}
+
+template<class Spec>
+void
+ShardRouter<Spec>::disconnected(int client_fd)
+{
+	internal::eraseClient(m_Pending, client_fd);
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+ShardRouter<Spec>::handle(Proxy &proxy, Message<BUFFER> &msg,
+			  PipelineContext &ctx)
+{
+	if (!ctx.from_client) {
+		if (m_Pending.empty())
+			return STAGE_NEXT;
+		return collect(proxy, msg);
+	}
+	if (ctx.instance >= 0)
+		return STAGE_NEXT;
+	std::optional<uint64_t> key = Spec::shardKey(msg);
+	if (!key.has_value())
+		return STAGE_NEXT;
+	return route(proxy, msg, ctx, *key);
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+ShardRouter<Spec>::route(Proxy &proxy, Message<BUFFER> &msg,
+			 PipelineContext &ctx, uint64_t key)
+{
+	if (m_Buckets.empty()) {
+		if (proxy.opts_.empty()) {
+			LOG_ERROR("Can't route request: no instances");
+			return STAGE_ERR;
+		}
+		fillDefault(proxy.opts_.size());
+	}
+	size_t bucket = bucketOf(key);
+	ctx.instance = m_Buckets[bucket];
+	if (m_Moves.empty())
+		return STAGE_NEXT;
+	auto move = m_Moves.find(bucket);
+	if (move == m_Moves.end())
+		return STAGE_NEXT;
+	return sendMoving(proxy, msg, ctx.instance, move->second);
+}
+
+template<class Spec>
+template<class BUFFER>
+bool
+ShardRouter<Spec>::isEmpty(Message<BUFFER> &msg)
+{
+	if (msg.streamed || !msg.body.data.has_value())
+		return false;
+	/* Tuples are not decoded, only their bounds. */
+	std::vector<Data<BUFFER>> tuples;
+	return msg.body.data->decode(tuples) && tuples.empty();
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+ShardRouter<Spec>::sendMoving(Proxy &proxy, Message<BUFFER> &msg,
+			      int source, int destination)
+{
+	bool is_write = isWrite(msg.header.code);
+	if (!is_write && msg.header.code != Iproto::SELECT)
+		return STAGE_NEXT;
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (m_Pending.count(key) != 0) {
+		LOG_ERROR("Request with sync ", msg.header.sync,
+			  " is already in flight");
+		return STAGE_ERR;
+	}
+	Pending pending{source, destination, {}, false, false};
+	auto &dst = proxy.connect(destination);
+	/* Sent as copies, as fan-out stages do, then skipped. */
+	if (is_write) {
+		if (dst.get_fd() < 0 ||
+		    proxy.copyDecodedToStream(dst, msg.size) != 0) {
+			LOG_ERROR("Failed to send write ", msg.header.sync,
+				  " to instance ", destination);
+			dual_write_errors++;
+		} else {
+			pending.awaiting_destination = true;
+		}
+		auto &src = proxy.connect(source);
+		if (src.get_fd() < 0 ||
+		    proxy.copyDecodedToStream(src, msg.size) != 0) {
+			LOG_ERROR("Failed to send write ", msg.header.sync,
+				  " to instance ", source);
+			/* Response of destination must not be forwarded. */
+			if (pending.awaiting_destination)
+				m_Pending.emplace(key, std::move(pending));
+			return STAGE_ERR;
+		}
+		dual_write_count++;
+		pending.awaiting_source = true;
+	} else {
+		proxy.copyDecodedMessage(pending.read, msg.size);
+		if (dst.get_fd() < 0 ||
+		    proxy.copyDecodedToStream(dst, msg.size) != 0) {
+			LOG_ERROR("Failed to send read ", msg.header.sync,
+				  " to instance ", destination);
+			return STAGE_ERR;
+		}
+		moving_read_count++;
+		pending.awaiting_destination = true;
+	}
+	proxy.skipLastDecodedMessage(msg.size);
+	m_Pending.emplace(key, std::move(pending));
+	return STAGE_DONE;
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+ShardRouter<Spec>::collect(Proxy &proxy, Message<BUFFER> &msg)
+{
+	auto it = m_Pending.find(std::make_pair(proxy.getClientFd(),
+						msg.header.sync));
+	if (it == m_Pending.end())
+		return STAGE_NEXT;
+	Pending &pending = it->second;
+	int instance = proxy.getRecvInstance();
+	if (instance == pending.source && pending.awaiting_source) {
+		/* Source has the whole bucket: its response is the reply. */
+		pending.awaiting_source = false;
+		proxy.sendDecodedToClient(msg.size);
+	} else if (instance == pending.destination &&
+		   pending.awaiting_destination) {
+		pending.awaiting_destination = false;
+		if (pending.read.empty()) {
+			if (msg.header.code != Iproto::OK)
+				dual_write_errors++;
+			proxy.skipLastDecodedMessage(msg.size);
+		} else if (msg.header.code == Iproto::OK && isEmpty(msg)) {
+			/* The tuple may be not copied yet: ask the source. */
+			typename Proxy::Buffer_t buf;
+			buf.write({pending.read.data(), pending.read.size()});
+			auto &src = proxy.connect(pending.source);
+			if (src.get_fd() >= 0 &&
+			    proxy.sendBufferToStream(src, buf) == 0) {
+				fallback_count++;
+				pending.awaiting_source = true;
+				proxy.skipLastDecodedMessage(msg.size);
+			} else {
+				LOG_ERROR("Failed to send read ",
+					  msg.header.sync, " to instance ",
+					  pending.source);
+				proxy.sendDecodedToClient(msg.size);
+			}
+		} else {
+			proxy.sendDecodedToClient(msg.size);
+		}
+	} else {
+		return STAGE_NEXT;
+	}
+	if (!pending.awaiting_source && !pending.awaiting_destination)
+		m_Pending.erase(it);
+	return STAGE_DONE;
+}
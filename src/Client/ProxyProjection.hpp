@@ -0,0 +1,261 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "ProxyFanOut.hpp"
+#include "ProxyPipeline.hpp"
+#include "../Utils/Logger.hpp"
+
+/**
+ * Rule of ProjectionStage. Unset criteria match any request; a rule with
+ * space matches SELECTs from it, with function - CALLs of it, with
+ * neither - both.
+ */
+struct ProjectionRule {
+	std::optional<uint32_t> space_id;
+	std::optional<std::string> function_name;
+	/** User the client is authenticated as. */
+	std::optional<std::string> user;
+	/** Zero-based numbers of fields returned to client, in this order. */
+	std::vector<uint32_t> fields;
+};
+
+/**
+ * Stage cutting tuples of responses down to the fields clients need:
+ * the response to a SELECT or CALL matching a rule is re-encoded with
+ * only the fields of the rule, fields missing in a tuple become nil.
+ * Rules are checked in order, the first matching one is applied.
+ *
+ * Each value returned by a function is projected if it is a tuple (an
+ * array), or each of its tuples if it is an array of tuples, as returned
+ * by space:select(). Other values are left as is. Errors and streamed
+ * responses are forwarded untouched.
+ *
+ * The stage should go right before ForwardStage: only requests forwarded
+ * as is are projected, responses to requests consumed by stages before
+ * it (fan-out, range scans etc) are sent by those stages themselves.
+ */
+class ProjectionStage {
+public:
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/** Append @a rule, return -1 if it has both space and function. */
+	int addRule(ProjectionRule rule);
+	void clearRules() { m_Rules.clear(); }
+	/** Forget requests of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	/** Number of responses projected. */
+	size_t projected_count = 0;
+	/** Number of response bytes not sent to clients thanks to that. */
+	size_t saved_bytes = 0;
+
+private:
+	static constexpr size_t NO_RULE = SIZE_MAX;
+
+	/** The first rule matching the current request, NO_RULE if none. */
+	template<class Proxy, class BUFFER>
+	size_t match(Proxy &proxy, Message<BUFFER> &msg);
+	template<class BUFFER>
+	static bool isArray(Data<BUFFER> &data);
+	/** Append @a tuple with @a fields only to m_Result. */
+	template<class BUFFER>
+	bool projectTuple(Data<BUFFER> &tuple,
+			  const std::vector<uint32_t> &fields);
+	/** Append a value returned by function to m_Result. */
+	template<class BUFFER>
+	bool projectValue(Data<BUFFER> &value,
+			  const std::vector<uint32_t> &fields);
+
+	std::vector<ProjectionRule> m_Rules;
+	/** Request code and rule by (client fd, sync). */
+	std::map<std::pair<int, int>, std::pair<int, size_t>> m_Pending;
+	/** Projected DATA, kept to reuse its memory. */
+	std::string m_Result;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline int
+ProjectionStage::addRule(ProjectionRule rule)
+{
+	if (rule.space_id.has_value() && rule.function_name.has_value()) {
+		LOG_ERROR("Projection rule can't have both space and function");
+		return -1;
+	}
+	m_Rules.push_back(std::move(rule));
+	return 0;
+}
+
+template<class Proxy, class BUFFER>
+size_t
+ProjectionStage::match(Proxy &proxy, Message<BUFFER> &msg)
+{
+	bool is_select = msg.header.code == Iproto::SELECT;
+	if (!is_select && msg.header.code != Iproto::CALL)
+		return NO_RULE;
+	for (size_t i = 0; i < m_Rules.size(); ++i) {
+		const ProjectionRule &rule = m_Rules[i];
+		if (rule.space_id.has_value() &&
+		    (!is_select || msg.body.space_id != rule.space_id))
+			continue;
+		if (rule.function_name.has_value() &&
+		    (is_select || msg.body.function_name != rule.function_name))
+			continue;
+		if (rule.user.has_value() &&
+		    proxy.getClientUser() != *rule.user)
+			continue;
+		return i;
+	}
+	return NO_RULE;
+}
+
+template<class BUFFER>
+bool
+ProjectionStage::isArray(Data<BUFFER> &data)
+{
+	if (data.iters.first == data.iters.second)
+		return false;
+	uint8_t type;
+	auto itr = data.iters.first;
+	itr.get(type);
+	return (type & 0xf0) == 0x90 || type == 0xdc || type == 0xdd;
+}
+
+template<class BUFFER>
+bool
+ProjectionStage::projectTuple(Data<BUFFER> &tuple,
+			      const std::vector<uint32_t> &fields)
+{
+	std::vector<Data<BUFFER>> values;
+	if (!tuple.decode(values))
+		return false;
+	internal::appendArrayHeader(m_Result, fields.size());
+	for (uint32_t field : fields) {
+		if (field < values.size())
+			internal::appendRaw(m_Result, values[field].iters.first,
+					    values[field].iters.second);
+		else
+			m_Result.push_back('\xc0');
+	}
+	return true;
+}
+
+template<class BUFFER>
+bool
+ProjectionStage::projectValue(Data<BUFFER> &value,
+			      const std::vector<uint32_t> &fields)
+{
+	if (!isArray(value)) {
+		internal::appendRaw(m_Result, value.iters.first,
+				    value.iters.second);
+		return true;
+	}
+	std::vector<Data<BUFFER>> elems;
+	if (!value.decode(elems))
+		return false;
+	if (elems.empty() || !isArray(elems[0]))
+		return projectTuple(value, fields);
+	internal::appendArrayHeader(m_Result, elems.size());
+	for (auto &elem : elems) {
+		bool ok = isArray(elem) ? projectTuple(elem, fields) :
+			  projectValue(elem, fields);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+inline void
+ProjectionStage::disconnected(int client_fd)
+{
+	internal::eraseClient(m_Pending, client_fd);
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+ProjectionStage::handle(Proxy &proxy, Message<BUFFER> &msg,
+			PipelineContext &ctx)
+{
+	if (m_Rules.empty() && m_Pending.empty())
+		return STAGE_NEXT;
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (ctx.from_client) {
+		size_t rule = match(proxy, msg);
+		if (rule != NO_RULE)
+			m_Pending[key] = std::make_pair(msg.header.code, rule);
+		return STAGE_NEXT;
+	}
+	auto it = m_Pending.find(key);
+	if (it == m_Pending.end())
+		return STAGE_NEXT;
+	int code = it->second.first;
+	size_t rule = it->second.second;
+	m_Pending.erase(it);
+	if (msg.streamed || msg.header.code != Iproto::OK ||
+	    !msg.body.data.has_value() || rule >= m_Rules.size())
+		return STAGE_NEXT;
+	const std::vector<uint32_t> &fields = m_Rules[rule].fields;
+	std::vector<Data<BUFFER>> values;
+	if (!msg.body.data->decode(values))
+		return STAGE_NEXT;
+	m_Result.clear();
+	internal::appendArrayHeader(m_Result, values.size());
+	for (auto &value : values) {
+		bool ok = code == Iproto::SELECT ?
+			  projectTuple(value, fields) :
+			  projectValue(value, fields);
+		if (!ok) {
+			LOG_ERROR("Failed to project response ", msg.header.sync);
+			return STAGE_NEXT;
+		}
+	}
+	auto data = mpp::as_raw(m_Result);
+	int size = proxy.createMessage(msg.header.sync,
+				       msg.header.schema_id.value_or(0), &data);
+	if (size < msg.size)
+		saved_bytes += msg.size - size;
+	proxy.sendEncodedToClient(size);
+	proxy.skipLastDecodedMessage(msg.size);
+	projected_count++;
+	return STAGE_DONE;
+}
@@ -0,0 +1,167 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ProxyOptions.hpp"
+
+/**
+ * Priority classes of client requests (see ProxyOptions::qos_in_flight).
+ * Counts requests of each class awaiting responses from each instance;
+ * a request which would exceed the limit of its class is held by the
+ * connector until a request of the same class and instance completes.
+ */
+class ProxyQos {
+public:
+	void configure(const ProxyOptions &opts);
+	bool enabled() const { return !m_Limits.empty(); }
+
+	/**
+	 * Class of request: the first match of function name, space,
+	 * request type and class of client (set by its user name or by
+	 * handler), the default class otherwise.
+	 */
+	unsigned classify(int code, const std::optional<uint32_t> &space_id,
+			  const std::optional<std::string> &function_name,
+			  const std::optional<unsigned> &client_class) const;
+	/** Class of clients authenticated as @a user, if configured. */
+	std::optional<unsigned> classOfUser(const std::string &user) const;
+
+	/**
+	 * Account a request of class @a cls sent to @a instance. Return
+	 * false if the class has reached its limit on the instance.
+	 */
+	bool tryAcquire(int instance, unsigned cls);
+	/** A request accounted by tryAcquire() is completed. */
+	void release(int instance, unsigned cls);
+	/** Requests of @a cls awaiting responses from @a instance. */
+	size_t inFlight(int instance, unsigned cls) const;
+
+	/** Number of times a request was held. */
+	size_t held_count = 0;
+
+private:
+	/** Limit of @a cls, zero if it is unlimited. */
+	size_t limitOf(unsigned cls) const;
+
+	std::vector<size_t> m_Limits;
+	std::map<std::string, unsigned> m_FunctionClass;
+	std::map<uint32_t, unsigned> m_SpaceClass;
+	std::map<int, unsigned> m_TypeClass;
+	std::map<std::string, unsigned> m_UserClass;
+	unsigned m_DefaultClass = 0;
+	/** Requests in flight by (instance, class). */
+	std::map<std::pair<int, unsigned>, size_t> m_InFlight;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline void
+ProxyQos::configure(const ProxyOptions &opts)
+{
+	m_Limits = opts.qos_in_flight;
+	m_FunctionClass = opts.qos_function_class;
+	m_SpaceClass = opts.qos_space_class;
+	m_TypeClass = opts.qos_type_class;
+	m_UserClass = opts.qos_user_class;
+	m_DefaultClass = opts.qos_default_class;
+}
+
+inline unsigned
+ProxyQos::classify(int code, const std::optional<uint32_t> &space_id,
+		   const std::optional<std::string> &function_name,
+		   const std::optional<unsigned> &client_class) const
+{
+	if (function_name.has_value()) {
+		auto it = m_FunctionClass.find(*function_name);
+		if (it != m_FunctionClass.end())
+			return it->second;
+	}
+	if (space_id.has_value()) {
+		auto it = m_SpaceClass.find(*space_id);
+		if (it != m_SpaceClass.end())
+			return it->second;
+	}
+	auto it = m_TypeClass.find(code);
+	if (it != m_TypeClass.end())
+		return it->second;
+	return client_class.value_or(m_DefaultClass);
+}
+
+inline std::optional<unsigned>
+ProxyQos::classOfUser(const std::string &user) const
+{
+	auto it = m_UserClass.find(user);
+	if (it == m_UserClass.end())
+		return std::nullopt;
+	return it->second;
+}
+
+inline size_t
+ProxyQos::limitOf(unsigned cls) const
+{
+	return cls < m_Limits.size() ? m_Limits[cls] : 0;
+}
+
+inline bool
+ProxyQos::tryAcquire(int instance, unsigned cls)
+{
+	size_t &in_flight = m_InFlight[std::make_pair(instance, cls)];
+	size_t limit = limitOf(cls);
+	if (limit != 0 && in_flight >= limit)
+		return false;
+	in_flight++;
+	return true;
+}
+
+inline void
+ProxyQos::release(int instance, unsigned cls)
+{
+	auto it = m_InFlight.find(std::make_pair(instance, cls));
+	assert(it != m_InFlight.end() && it->second > 0);
+	it->second--;
+}
+
+inline size_t
+ProxyQos::inFlight(int instance, unsigned cls) const
+{
+	auto it = m_InFlight.find(std::make_pair(instance, cls));
+	return it == m_InFlight.end() ? 0 : it->second;
+}
@@ -0,0 +1,379 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "ProxyFanOut.hpp"
+#include "ProxyPipeline.hpp"
+#include "RequestEncoder.hpp"
+#include "../Utils/Logger.hpp"
+
+/**
+ * Stage routing SELECTs of range-partitioned spaces. The primary key of
+ * such a space is split by sorted integer split points s[0] < ... <
+ * s[n-1] into n + 1 partitions: (-inf, s[0]), [s[0], s[1]), ...,
+ * [s[n-1], +inf), each stored on its instance. Partitions are matched by
+ * the first key part, which is the key_field of tuples.
+ *
+ * SELECTs by the primary index go only to partitions the key and iterator
+ * can match: EQ and REQ with a key are routed to one partition like any
+ * other request, GE, GT and ALL scan partitions upwards from the key, LE
+ * and LT downwards. A scan over several partitions is sent to them one by
+ * one in split order until LIMIT (and OFFSET) is satisfied; tuples are
+ * collected by the proxy and the client gets one response. Tuples of
+ * other partitions stored on the same instance are filtered out.
+ *
+ * Other requests are left to next stages, so the stage usually precedes a
+ * hash router or ForwardStage.
+ */
+class RangeRouter {
+public:
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/**
+	 * Partition @a space_id by @a splits, partition i is stored on
+	 * instance @a instances[i]. Return -1 if splits are not sorted or
+	 * the number of instances is not one more than of splits.
+	 */
+	int setRanges(uint32_t space_id, std::vector<int64_t> splits,
+		      std::vector<int> instances, uint32_t key_field = 0);
+	void removeRanges(uint32_t space_id) { m_Spaces.erase(space_id); }
+	/** Number of scans waiting for responses. */
+	size_t pendingCount() const { return m_Pending.size(); }
+	/** Forget requests of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	/** Number of SELECTs routed to a single partition. */
+	size_t routed_count = 0;
+	/** Number of SELECTs scanning several partitions. */
+	size_t scan_count = 0;
+	/** Number of requests sent to partitions following the first one. */
+	size_t continuation_count = 0;
+	/** Number of partitions skipped by scans thanks to their key. */
+	size_t pruned_count = 0;
+
+private:
+	struct Ranges {
+		std::vector<int64_t> splits;
+		std::vector<int> instances;
+		uint32_t key_field;
+	};
+
+	struct Scan {
+		const Ranges *ranges;
+		uint32_t space_id;
+		/* Original key and iterator, for the first partition. */
+		std::string key;
+		IteratorType iterator;
+		bool ascending;
+		/* Partitions left, in order of scan; the first is queried. */
+		std::vector<size_t> partitions;
+		bool is_first = true;
+		uint32_t limit = UINT32_MAX;
+		uint32_t offset = 0;
+		std::string tuples;
+		uint32_t count = 0;
+	};
+
+	/** Partition of @a key: the number of splits not greater than it. */
+	static size_t partitionOf(const Ranges &ranges, int64_t key);
+	/** Send request of @a scan to its current partition. */
+	template<class Proxy>
+	int sendScan(Proxy &proxy, int sync, Scan &scan);
+	template<class Proxy, class BUFFER>
+	StageStatus startScan(Proxy &proxy, Message<BUFFER> &msg,
+			      PipelineContext &ctx, const Ranges &ranges);
+	template<class Proxy, class BUFFER>
+	StageStatus collect(Proxy &proxy, Message<BUFFER> &msg);
+	/** Add tuples of @a data in the current partition to @a scan. */
+	template<class BUFFER>
+	bool addTuples(Scan &scan, Data<BUFFER> &data);
+
+	std::map<uint32_t, Ranges> m_Spaces;
+	/** Scans in flight by (client fd, sync). */
+	std::map<std::pair<int, int>, Scan> m_Pending;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline int
+RangeRouter::setRanges(uint32_t space_id, std::vector<int64_t> splits,
+		       std::vector<int> instances, uint32_t key_field)
+{
+	if (instances.size() != splits.size() + 1 ||
+	    std::adjacent_find(splits.begin(), splits.end(),
+			       std::greater_equal<int64_t>()) != splits.end()) {
+		LOG_ERROR("Invalid ranges of space ", space_id);
+		return -1;
+	}
+	/* Scans in flight keep pointers to ranges. */
+	if (!m_Pending.empty()) {
+		LOG_ERROR("Can't change ranges of space ", space_id,
+			  " while scans are in flight");
+		return -1;
+	}
+	m_Spaces[space_id] = Ranges{std::move(splits), std::move(instances),
+				    key_field};
+	return 0;
+}
+
+inline size_t
+RangeRouter::partitionOf(const Ranges &ranges, int64_t key)
+{
+	return std::upper_bound(ranges.splits.begin(), ranges.splits.end(),
+				key) - ranges.splits.begin();
+}
+
+inline void
+RangeRouter::disconnected(int client_fd)
+{
+	internal::eraseClient(m_Pending, client_fd);
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+RangeRouter::handle(Proxy &proxy, Message<BUFFER> &msg, PipelineContext &ctx)
+{
+	if (!ctx.from_client) {
+		if (m_Pending.empty())
+			return STAGE_NEXT;
+		return collect(proxy, msg);
+	}
+	if (ctx.instance >= 0 || msg.header.code != Iproto::SELECT ||
+	    !msg.body.space_id.has_value() ||
+	    msg.body.index_id.value_or(0) != 0)
+		return STAGE_NEXT;
+	auto space = m_Spaces.find(*msg.body.space_id);
+	if (space == m_Spaces.end())
+		return STAGE_NEXT;
+	return startScan(proxy, msg, ctx, space->second);
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+RangeRouter::startScan(Proxy &proxy, Message<BUFFER> &msg,
+		       PipelineContext &ctx, const Ranges &ranges)
+{
+	std::optional<int64_t> first_part;
+	if (msg.body.keys.has_value()) {
+		/* Key parts are not decoded, only their bounds. */
+		std::vector<Data<BUFFER>> parts;
+		int64_t part;
+		if (!msg.body.keys->decode(parts))
+			return STAGE_ERR;
+		if (!parts.empty()) {
+			if (!parts[0].decode(part))
+				return STAGE_ERR;
+			first_part = part;
+		}
+	}
+	auto iterator = static_cast<IteratorType>(msg.body.iterator.value_or(EQ));
+	bool ascending;
+	if (iterator == EQ || iterator == REQ) {
+		if (first_part.has_value()) {
+			ctx.instance = ranges.instances[partitionOf(ranges,
+								    *first_part)];
+			routed_count++;
+			return STAGE_NEXT;
+		}
+		/* Empty key matches everything. */
+		ascending = iterator == EQ;
+	} else if (iterator == ALL || iterator == GE || iterator == GT) {
+		ascending = true;
+	} else if (iterator == LE || iterator == LT) {
+		ascending = false;
+	} else {
+		return STAGE_NEXT;
+	}
+	size_t total = ranges.instances.size();
+	size_t from = first_part.has_value() && iterator != ALL ?
+		      partitionOf(ranges, *first_part) :
+		      (ascending ? 0 : total - 1);
+	Scan scan;
+	scan.ranges = &ranges;
+	scan.space_id = *msg.body.space_id;
+	scan.iterator = iterator;
+	scan.ascending = ascending;
+	if (ascending) {
+		for (size_t i = from; i < total; ++i)
+			scan.partitions.push_back(i);
+	} else {
+		for (size_t i = from + 1; i-- > 0;)
+			scan.partitions.push_back(i);
+	}
+	if (scan.partitions.size() == 1) {
+		/* The instance has no tuples of other partitions to skip. */
+		ctx.instance = ranges.instances[from];
+		routed_count++;
+		pruned_count += total - 1;
+		return STAGE_NEXT;
+	}
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (m_Pending.count(key) != 0) {
+		LOG_ERROR("Scan with sync ", msg.header.sync,
+			  " is already in flight");
+		return STAGE_ERR;
+	}
+	if (msg.body.keys.has_value())
+		internal::appendRaw(scan.key, msg.body.keys->iters.first,
+				    msg.body.keys->iters.second);
+	else
+		internal::appendArrayHeader(scan.key, 0);
+	scan.limit = msg.body.limit.value_or(UINT32_MAX);
+	scan.offset = msg.body.offset.value_or(0);
+	proxy.skipLastDecodedMessage(msg.size);
+	if (sendScan(proxy, msg.header.sync, scan) != 0)
+		return STAGE_DONE;
+	scan_count++;
+	pruned_count += total - scan.partitions.size();
+	m_Pending.emplace(key, std::move(scan));
+	return STAGE_DONE;
+}
+
+template<class Proxy>
+int
+RangeRouter::sendScan(Proxy &proxy, int sync, Scan &scan)
+{
+	const Ranges &ranges = *scan.ranges;
+	size_t partition = scan.partitions.front();
+	int instance = ranges.instances[partition];
+	/* Offset is applied by proxy: tuples of other partitions may go first. */
+	uint32_t limit = scan.limit > UINT32_MAX - scan.offset ?
+			 UINT32_MAX : scan.limit + scan.offset;
+	typename Proxy::Buffer_t buf;
+	{
+		RequestEncoder<typename Proxy::Buffer_t> enc(buf);
+		if (scan.is_first) {
+			enc.encodeSelect(sync, mpp::as_raw(scan.key),
+					 scan.space_id, 0, limit, 0,
+					 scan.iterator);
+		} else if (scan.ascending) {
+			/* Partition starts at the split point. */
+			enc.encodeSelect(sync,
+					 std::make_tuple(ranges.splits[partition - 1]),
+					 scan.space_id, 0, limit, 0, GE);
+		} else {
+			enc.encodeSelect(sync,
+					 std::make_tuple(ranges.splits[partition]),
+					 scan.space_id, 0, limit, 0, LT);
+		}
+	}
+	auto &strm = proxy.connect(instance);
+	if (strm.get_fd() < 0 || proxy.sendBufferToStream(strm, buf) != 0) {
+		LOG_ERROR("Failed to send scan ", sync, " to instance ",
+			  instance);
+		return -1;
+	}
+	return 0;
+}
+
+template<class BUFFER>
+bool
+RangeRouter::addTuples(Scan &scan, Data<BUFFER> &data)
+{
+	const Ranges &ranges = *scan.ranges;
+	size_t partition = scan.partitions.front();
+	std::vector<Data<BUFFER>> tuples;
+	if (!data.decode(tuples))
+		return false;
+	for (auto &tuple : tuples) {
+		if (scan.limit == 0)
+			break;
+		std::vector<Data<BUFFER>> fields;
+		int64_t key;
+		if (!tuple.decode(fields) || fields.size() <= ranges.key_field ||
+		    !fields[ranges.key_field].decode(key))
+			return false;
+		if (partitionOf(ranges, key) != partition)
+			continue;
+		if (scan.offset > 0) {
+			scan.offset--;
+			continue;
+		}
+		internal::appendRaw(scan.tuples, tuple.iters.first,
+				    tuple.iters.second);
+		scan.count++;
+		scan.limit--;
+	}
+	return true;
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+RangeRouter::collect(Proxy &proxy, Message<BUFFER> &msg)
+{
+	auto it = m_Pending.find(std::make_pair(proxy.getClientFd(),
+						msg.header.sync));
+	if (it == m_Pending.end())
+		return STAGE_NEXT;
+	Scan &scan = it->second;
+	if (proxy.getRecvInstance() !=
+	    scan.ranges->instances[scan.partitions.front()])
+		return STAGE_NEXT;
+	if (msg.streamed || msg.header.code != Iproto::OK ||
+	    !msg.body.data.has_value() || !addTuples(scan, *msg.body.data)) {
+		/* Streamed response is too large to be merged. */
+		LOG_ERROR("Scan with sync ", msg.header.sync,
+			  " failed on instance ", proxy.getRecvInstance());
+		proxy.sendDecodedToClient(msg.size);
+		m_Pending.erase(it);
+		return STAGE_DONE;
+	}
+	int schema_id = msg.header.schema_id.value_or(0);
+	proxy.skipLastDecodedMessage(msg.size);
+	scan.partitions.erase(scan.partitions.begin());
+	scan.is_first = false;
+	if (scan.limit != 0 && !scan.partitions.empty()) {
+		if (sendScan(proxy, msg.header.sync, scan) == 0) {
+			continuation_count++;
+			return STAGE_DONE;
+		}
+		/* The client gets what is collected so far. */
+	}
+	std::string result;
+	internal::appendArrayHeader(result, scan.count);
+	result += scan.tuples;
+	auto data = mpp::as_raw(result);
+	int size = proxy.createMessage(msg.header.sync, schema_id, &data);
+	proxy.sendEncodedToClient(size);
+	m_Pending.erase(it);
+	return STAGE_DONE;
+}
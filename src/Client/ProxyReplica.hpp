@@ -0,0 +1,443 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <climits>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "MessageReader.hpp"
+#include "ProxyPipeline.hpp"
+#include "ProxyTrace.hpp"
+#include "RequestEncoder.hpp"
+#include "../Utils/Logger.hpp"
+
+/** Vector clock of an instance: LSN by replica id. */
+using Vclock = std::map<uint32_t, uint64_t>;
+
+/**
+ * Stage spreading SELECTs over replicas without breaking read-your-writes
+ * consistency of client sessions. Other requests go to the master.
+ *
+ * Once a write of a client is acknowledged, the master is asked for its
+ * vclock, which is the position the session has to see. From the moment
+ * the write is sent until the answer comes, reads of the session go to the
+ * master, so are reads pipelined after the write; after that, to replicas
+ * which have caught up with the position. Vclocks of replicas are probed
+ * with client traffic, no more often than once per probe interval; a
+ * replica that hasn't answered for the stale interval gets no reads.
+ * Sessions are forgotten once all replicas have caught up with them, so
+ * that only lagging sessions take memory.
+ *
+ * Vclocks are read with EVAL of "return box.info.vclock", so the proxy
+ * user needs the execute privilege on universe. Probes use syncs starting
+ * at PROBE_SYNC_MIN, which clients are not expected to reach.
+ */
+class ReplicaReadRouter {
+public:
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/**
+	 * Route writes to instance @a master, reads to @a replicas.
+	 * Return -1 if the master is among replicas.
+	 */
+	int setReplicas(int master, std::vector<int> replicas);
+	/**
+	 * Probe replicas every @a interval_usec, stop reading from those
+	 * silent for @a stale_usec.
+	 */
+	void setProbeInterval(uint64_t interval_usec, uint64_t stale_usec);
+	/** Number of sessions some replica hasn't caught up with. */
+	size_t sessionCount() const { return m_Sessions.size(); }
+	/** Vclock of replica @a instance known to the proxy, if any. */
+	const Vclock *replicaVclock(int instance) const;
+	/** Forget session of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd);
+
+	static constexpr int PROBE_SYNC_MIN = 0x70000000;
+	static constexpr const char *PROBE_EXPR = "return box.info.vclock";
+
+	/** Number of reads routed to replicas. */
+	size_t replica_read_count = 0;
+	/** Number of reads kept on master since no replica has caught up. */
+	size_t master_read_count = 0;
+	/** Number of vclock probes sent. */
+	size_t probe_count = 0;
+	/** Number of probes failed or answered with garbage. */
+	size_t probe_errors = 0;
+
+private:
+	struct Replica {
+		int instance;
+		Vclock vclock;
+		bool known = false;
+		bool in_flight = false;
+		uint64_t probed_at = 0;
+		uint64_t answered_at = 0;
+	};
+
+	struct Session {
+		Vclock position;
+		/* False while the position after the last write is probed. */
+		bool known = false;
+		bool probing = false;
+		/* A write was acknowledged while the probe was in flight. */
+		bool reprobe = false;
+		/* Writes sent to the master and not acknowledged yet. */
+		size_t writes = 0;
+	};
+
+	static bool isWrite(int code);
+	/** True if @a vclock has every LSN of @a position. */
+	static bool covers(const Vclock &vclock, const Vclock &position);
+	template<class BUFFER>
+	static bool decodeVclock(Message<BUFFER> &msg, Vclock &vclock);
+	/** Send probe to @a instance, return its sync or -1. */
+	template<class Proxy>
+	int sendProbe(Proxy &proxy, int instance);
+	template<class Proxy>
+	void probeReplicas(Proxy &proxy, uint64_t now);
+	template<class Proxy>
+	void probeMaster(Proxy &proxy, Session &session);
+	/** Replica to read @a session from (may be null), -1 if none. */
+	int pickReplica(const Session *session, uint64_t now);
+	/** Forget sessions all replicas have caught up with. */
+	void dropCaughtUp();
+	template<class Proxy, class BUFFER>
+	StageStatus handleProbe(Proxy &proxy, Message<BUFFER> &msg,
+				int instance);
+
+	int m_Master = -1;
+	std::vector<Replica> m_Replicas;
+	size_t m_Next = 0;
+	uint64_t m_IntervalNsec = 100 * 1000 * 1000;
+	uint64_t m_StaleNsec = 5000ull * 1000 * 1000;
+	int m_ProbeSync = PROBE_SYNC_MIN;
+	/** Sessions by client fd. */
+	std::unordered_map<int, Session> m_Sessions;
+	/** Writes waiting for acknowledgement by (client fd, sync). */
+	std::set<std::pair<int, int>> m_Writes;
+	/** Instances of probes in flight by (client fd, sync). */
+	std::map<std::pair<int, int>, int> m_Probes;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline int
+ReplicaReadRouter::setReplicas(int master, std::vector<int> replicas)
+{
+	for (int replica : replicas) {
+		if (replica == master) {
+			LOG_ERROR("Master ", master, " can't be a replica");
+			return -1;
+		}
+	}
+	m_Master = master;
+	m_Replicas.clear();
+	for (int replica : replicas)
+		m_Replicas.push_back(Replica{replica, {}});
+	m_Next = 0;
+	m_Probes.clear();
+	return 0;
+}
+
+inline void
+ReplicaReadRouter::setProbeInterval(uint64_t interval_usec,
+				    uint64_t stale_usec)
+{
+	m_IntervalNsec = interval_usec * 1000;
+	m_StaleNsec = stale_usec * 1000;
+}
+
+inline const Vclock *
+ReplicaReadRouter::replicaVclock(int instance) const
+{
+	for (const Replica &replica : m_Replicas) {
+		if (replica.instance == instance)
+			return replica.known ? &replica.vclock : nullptr;
+	}
+	return nullptr;
+}
+
+inline void
+ReplicaReadRouter::disconnected(int client_fd)
+{
+	m_Sessions.erase(client_fd);
+	internal::eraseClient(m_Writes, client_fd);
+	internal::eraseClient(m_Probes, client_fd);
+}
+
+inline bool
+ReplicaReadRouter::isWrite(int code)
+{
+	switch (code) {
+	case Iproto::INSERT:
+	case Iproto::REPLACE:
+	case Iproto::UPDATE:
+	case Iproto::DELETE:
+	case Iproto::UPSERT:
+	case Iproto::CALL_16:
+	case Iproto::CALL:
+	case Iproto::EVAL:
+	case Iproto::EXECUTE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+inline bool
+ReplicaReadRouter::covers(const Vclock &vclock, const Vclock &position)
+{
+	for (const auto &lsn : position) {
+		/* Component 0 counts local writes, which are not replicated. */
+		if (lsn.first == 0)
+			continue;
+		auto it = vclock.find(lsn.first);
+		if (it == vclock.end() || it->second < lsn.second)
+			return false;
+	}
+	return true;
+}
+
+template<class BUFFER>
+bool
+ReplicaReadRouter::decodeVclock(Message<BUFFER> &msg, Vclock &vclock)
+{
+	if (msg.streamed || msg.header.code != Iproto::OK ||
+	    !msg.body.data.has_value())
+		return false;
+	/* Sparse vclock is encoded as map, otherwise as array from id 1. */
+	std::tuple<Vclock> as_map;
+	if (msg.body.data->decode(as_map)) {
+		vclock = std::move(std::get<0>(as_map));
+		return true;
+	}
+	std::tuple<std::vector<uint64_t>> as_array;
+	if (!msg.body.data->decode(as_array))
+		return false;
+	vclock.clear();
+	const auto &lsns = std::get<0>(as_array);
+	for (size_t i = 0; i < lsns.size(); ++i)
+		vclock[i + 1] = lsns[i];
+	return true;
+}
+
+template<class Proxy>
+int
+ReplicaReadRouter::sendProbe(Proxy &proxy, int instance)
+{
+	int sync = m_ProbeSync;
+	m_ProbeSync = m_ProbeSync == INT_MAX ? PROBE_SYNC_MIN : m_ProbeSync + 1;
+	typename Proxy::Buffer_t buf;
+	{
+		RequestEncoder<typename Proxy::Buffer_t> enc(buf);
+		enc.encodeEval(sync, PROBE_EXPR, std::make_tuple());
+	}
+	auto &strm = proxy.connect(instance);
+	if (strm.get_fd() < 0 || proxy.sendBufferToStream(strm, buf) != 0) {
+		LOG_ERROR("Failed to probe vclock of instance ", instance);
+		probe_errors++;
+		return -1;
+	}
+	probe_count++;
+	m_Probes[std::make_pair(proxy.getClientFd(), sync)] = instance;
+	return sync;
+}
+
+template<class Proxy>
+void
+ReplicaReadRouter::probeReplicas(Proxy &proxy, uint64_t now)
+{
+	for (Replica &replica : m_Replicas) {
+		/* Probe is lost if the client it was sent with is gone. */
+		uint64_t wait = replica.in_flight ? m_StaleNsec : m_IntervalNsec;
+		if (replica.probed_at != 0 && now - replica.probed_at < wait)
+			continue;
+		replica.probed_at = now;
+		replica.in_flight = sendProbe(proxy, replica.instance) >= 0;
+	}
+}
+
+template<class Proxy>
+void
+ReplicaReadRouter::probeMaster(Proxy &proxy, Session &session)
+{
+	session.known = false;
+	if (session.probing) {
+		session.reprobe = true;
+		return;
+	}
+	/* If the master is unreachable, reads of the session stay on it. */
+	session.probing = sendProbe(proxy, m_Master) >= 0;
+	session.reprobe = false;
+}
+
+inline int
+ReplicaReadRouter::pickReplica(const Session *session, uint64_t now)
+{
+	if (session != nullptr && !session->known)
+		return -1;
+	for (size_t i = 0; i < m_Replicas.size(); ++i) {
+		const Replica &replica =
+			m_Replicas[(m_Next + i) % m_Replicas.size()];
+		if (!replica.known || now - replica.answered_at >= m_StaleNsec)
+			continue;
+		if (session != nullptr &&
+		    !covers(replica.vclock, session->position))
+			continue;
+		m_Next = (m_Next + i + 1) % m_Replicas.size();
+		return replica.instance;
+	}
+	return -1;
+}
+
+inline void
+ReplicaReadRouter::dropCaughtUp()
+{
+	for (auto it = m_Sessions.begin(); it != m_Sessions.end();) {
+		bool caught_up = it->second.known;
+		for (const Replica &replica : m_Replicas) {
+			if (!caught_up)
+				break;
+			caught_up = replica.known &&
+				    covers(replica.vclock, it->second.position);
+		}
+		if (caught_up)
+			it = m_Sessions.erase(it);
+		else
+			++it;
+	}
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+ReplicaReadRouter::handleProbe(Proxy &proxy, Message<BUFFER> &msg,
+			       int instance)
+{
+	Vclock vclock;
+	bool ok = decodeVclock(msg, vclock);
+	if (!ok) {
+		LOG_ERROR("Failed to read vclock of instance ", instance);
+		probe_errors++;
+	}
+	if (instance == m_Master) {
+		auto it = m_Sessions.find(proxy.getClientFd());
+		if (it != m_Sessions.end()) {
+			Session &session = it->second;
+			session.probing = false;
+			if (session.reprobe) {
+				probeMaster(proxy, session);
+			} else if (ok) {
+				session.position = std::move(vclock);
+				/* Writes sent since will probe it again. */
+				session.known = session.writes == 0;
+			}
+		}
+	} else {
+		for (Replica &replica : m_Replicas) {
+			if (replica.instance != instance)
+				continue;
+			replica.in_flight = false;
+			if (ok) {
+				replica.vclock = std::move(vclock);
+				replica.known = true;
+				replica.answered_at = ProxyTracer::now();
+				dropCaughtUp();
+			}
+			break;
+		}
+	}
+	proxy.skipLastDecodedMessage(msg.size);
+	return STAGE_DONE;
+}
+
+template<class Proxy, class BUFFER>
+StageStatus
+ReplicaReadRouter::handle(Proxy &proxy, Message<BUFFER> &msg,
+			  PipelineContext &ctx)
+{
+	if (m_Master < 0)
+		return STAGE_NEXT;
+	auto key = std::make_pair(proxy.getClientFd(), msg.header.sync);
+	if (!ctx.from_client) {
+		auto probe = m_Probes.find(key);
+		if (probe != m_Probes.end() &&
+		    probe->second == proxy.getRecvInstance()) {
+			int instance = probe->second;
+			m_Probes.erase(probe);
+			return handleProbe(proxy, msg, instance);
+		}
+		auto write = m_Writes.find(key);
+		if (write != m_Writes.end() &&
+		    proxy.getRecvInstance() == m_Master) {
+			m_Writes.erase(write);
+			Session &session = m_Sessions[key.first];
+			session.writes--;
+			/* Even a failed CALL may have written something. */
+			probeMaster(proxy, session);
+		}
+		return STAGE_NEXT;
+	}
+	if (ctx.instance >= 0)
+		return STAGE_NEXT;
+	uint64_t now = ProxyTracer::now();
+	probeReplicas(proxy, now);
+	if (msg.header.code != Iproto::SELECT) {
+		ctx.instance = m_Master;
+		if (isWrite(msg.header.code) && m_Writes.insert(key).second) {
+			/* Reads pipelined after the write must see it. */
+			Session &session = m_Sessions[key.first];
+			session.known = false;
+			session.writes++;
+		}
+		return STAGE_NEXT;
+	}
+	auto session = m_Sessions.find(key.first);
+	int replica = pickReplica(session != m_Sessions.end() ?
+				  &session->second : nullptr, now);
+	if (replica >= 0) {
+		ctx.instance = replica;
+		replica_read_count++;
+	} else {
+		ctx.instance = m_Master;
+		master_read_count++;
+	}
+	return STAGE_NEXT;
+}
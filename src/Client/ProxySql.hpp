@@ -0,0 +1,539 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "IprotoConstants.hpp"
+#include "MessageReader.hpp"
+#include "ProxyPipeline.hpp"
+
+/**
+ * Routing of SQL EXECUTE requests by shard key. Only the prefix of SQL
+ * text needed to find the table and the predicate on its shard column is
+ * parsed, so that single-shard statements can be routed as other requests:
+ *
+ * SELECT ... FROM table [alias] WHERE ... col = value [AND ...]
+ * SELECT ... FROM table [alias] WHERE ... col IN (value, ...) [AND ...]
+ * UPDATE table SET ... WHERE <the same>
+ * DELETE FROM table WHERE <the same>
+ * INSERT | REPLACE INTO table (..., col, ...) VALUES (..., value, ...)
+ *
+ * Value is an integer or string literal or a positional parameter (?)
+ * bound by IPROTO_SQL_BIND. Statements with OR at the top level of WHERE,
+ * joins, several rows of values, named parameters etc are not routed.
+ */
+
+/** Value of shard column found in SQL text. */
+struct SqlValue {
+	enum Kind { SQL_INT, SQL_STR, SQL_PARAM };
+
+	Kind kind = SQL_INT;
+	/** Integer literal or index of positional parameter. */
+	int64_t num = 0;
+	std::string str;
+};
+
+/** Result of parsing SQL text. */
+struct SqlStatement {
+	/** Table name, as it is stored (unquoted names are upper-cased). */
+	std::string table;
+	/**
+	 * Shard column equals one of these values, empty if statement
+	 * can't be routed to a single shard.
+	 */
+	std::vector<SqlValue> values;
+};
+
+class SqlParser {
+public:
+	/**
+	 * Parse @a sql, the shard column of a table is given by
+	 * @a column_of(table), if any. Return false if the kind of
+	 * statement is unknown.
+	 */
+	template<class ColumnOf>
+	static bool parse(std::string_view sql, ColumnOf &&column_of,
+			  SqlStatement &out);
+
+private:
+	enum TokenType {
+		TOKEN_END,
+		/* Identifier or keyword, upper-cased unless quoted. */
+		TOKEN_IDENT,
+		TOKEN_QUOTED,
+		TOKEN_STR,
+		TOKEN_NUM,
+		TOKEN_PARAM,
+		TOKEN_NAMED,
+		TOKEN_PUNCT,
+	};
+
+	struct Token {
+		TokenType type = TOKEN_END;
+		std::string text;
+		/* Index of positional parameter. */
+		int64_t param = 0;
+		bool is(const char *keyword) const
+		{
+			return type == TOKEN_IDENT && text == keyword;
+		}
+		bool is(char punct) const
+		{
+			return type == TOKEN_PUNCT && text[0] == punct;
+		}
+		bool isName() const
+		{
+			return type == TOKEN_IDENT || type == TOKEN_QUOTED;
+		}
+	};
+
+	explicit SqlParser(std::string_view sql) : m_Sql(sql) {}
+
+	void next();
+	void skipSpace();
+	/** Parse the rest of WHERE clause for predicate on @a column. */
+	void parseWhere(const std::string &column, SqlStatement &out);
+	/** Parse literal or parameter the current token starts. */
+	bool parseValue(SqlValue &value);
+	/** End of a clause WHERE can't be part of. */
+	bool isClauseEnd() const;
+
+	std::string_view m_Sql;
+	size_t m_Pos = 0;
+	Token m_Tok;
+	int64_t m_Params = 0;
+	int m_Depth = 0;
+};
+
+/**
+ * ShardRouter routing SQL EXECUTE requests as well. Spec must provide
+ * in addition to ShardRouter's requirements:
+ *
+ * static std::optional<std::string> shardColumn(const std::string &table);
+ *
+ * Integer keys are routed as they are, strings are hashed with std::hash.
+ * Results of parsing are cached by SQL text (i.e. by its hash), up to
+ * CACHE_MAX statements. If IN list values are in different buckets, the
+ * request is not routed.
+ */
+template<class Spec>
+class SqlShardRouter : public ShardRouter<Spec> {
+public:
+	static constexpr size_t CACHE_MAX = 1024;
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+
+	/** Number of statements parsed, i.e. cache misses. */
+	size_t sql_parsed = 0;
+	/** Number of EXECUTEs routed by shard key. */
+	size_t sql_routed = 0;
+	/** Number of EXECUTEs which can't be routed to a single shard. */
+	size_t sql_unrouted = 0;
+
+private:
+	const SqlStatement &statementOf(const std::string &sql);
+	template<class BUFFER>
+	std::optional<uint64_t> keyOf(const SqlValue &value,
+				      std::vector<Data<BUFFER>> &params);
+
+	std::unordered_map<std::string, SqlStatement> m_Cache;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline void
+SqlParser::skipSpace()
+{
+	while (m_Pos < m_Sql.size()) {
+		char c = m_Sql[m_Pos];
+		if (isspace((unsigned char) c)) {
+			m_Pos++;
+		} else if (m_Sql.compare(m_Pos, 2, "--") == 0) {
+			size_t eol = m_Sql.find('\n', m_Pos);
+			m_Pos = eol == std::string_view::npos ? m_Sql.size() : eol;
+		} else if (m_Sql.compare(m_Pos, 2, "/*") == 0) {
+			size_t end = m_Sql.find("*/", m_Pos + 2);
+			m_Pos = end == std::string_view::npos ? m_Sql.size() :
+				end + 2;
+		} else {
+			return;
+		}
+	}
+}
+
+inline void
+SqlParser::next()
+{
+	skipSpace();
+	m_Tok = Token{};
+	if (m_Pos >= m_Sql.size())
+		return;
+	char c = m_Sql[m_Pos];
+	auto is_ident = [](char ch) {
+		return isalnum((unsigned char) ch) || ch == '_';
+	};
+	if (isalpha((unsigned char) c) || c == '_') {
+		m_Tok.type = TOKEN_IDENT;
+		while (m_Pos < m_Sql.size() && is_ident(m_Sql[m_Pos]))
+			m_Tok.text.push_back(toupper(m_Sql[m_Pos++]));
+	} else if (c == '"' || c == '\'') {
+		/* Quote is escaped by doubling it. */
+		m_Tok.type = c == '"' ? TOKEN_QUOTED : TOKEN_STR;
+		for (m_Pos++; m_Pos < m_Sql.size(); m_Pos++) {
+			if (m_Sql[m_Pos] == c) {
+				if (m_Pos + 1 >= m_Sql.size() ||
+				    m_Sql[m_Pos + 1] != c)
+					break;
+				m_Pos++;
+			}
+			m_Tok.text.push_back(m_Sql[m_Pos]);
+		}
+		m_Pos++;
+	} else if (isdigit((unsigned char) c)) {
+		m_Tok.type = TOKEN_NUM;
+		while (m_Pos < m_Sql.size() &&
+		       (is_ident(m_Sql[m_Pos]) || m_Sql[m_Pos] == '.'))
+			m_Tok.text.push_back(m_Sql[m_Pos++]);
+	} else if (c == '?') {
+		m_Tok.type = TOKEN_PARAM;
+		m_Tok.param = m_Params++;
+		m_Pos++;
+	} else if ((c == ':' || c == '@' || c == '$') &&
+		   m_Pos + 1 < m_Sql.size() && is_ident(m_Sql[m_Pos + 1])) {
+		m_Tok.type = TOKEN_NAMED;
+		for (m_Pos++; m_Pos < m_Sql.size() && is_ident(m_Sql[m_Pos]);)
+			m_Tok.text.push_back(m_Sql[m_Pos++]);
+	} else {
+		m_Tok.type = TOKEN_PUNCT;
+		m_Tok.text.push_back(c);
+		m_Pos++;
+		if (c == '(')
+			m_Depth++;
+		else if (c == ')')
+			m_Depth--;
+	}
+}
+
+inline bool
+SqlParser::parseValue(SqlValue &value)
+{
+	bool negative = m_Tok.is('-');
+	if (negative)
+		next();
+	if (m_Tok.type == TOKEN_NUM) {
+		char *end;
+		errno = 0;
+		long long num = strtoll(m_Tok.text.c_str(), &end, 10);
+		if (*end != '\0' || errno != 0)
+			return false;
+		value.kind = SqlValue::SQL_INT;
+		value.num = negative ? -num : num;
+	} else if (negative) {
+		return false;
+	} else if (m_Tok.type == TOKEN_STR) {
+		value.kind = SqlValue::SQL_STR;
+		value.str = m_Tok.text;
+	} else if (m_Tok.type == TOKEN_PARAM) {
+		value.kind = SqlValue::SQL_PARAM;
+		value.num = m_Tok.param;
+	} else {
+		return false;
+	}
+	next();
+	return true;
+}
+
+inline bool
+SqlParser::isClauseEnd() const
+{
+	return m_Tok.type == TOKEN_END || m_Tok.is(';') ||
+	       (m_Depth == 0 && (m_Tok.is("ORDER") || m_Tok.is("GROUP") ||
+				 m_Tok.is("LIMIT") || m_Tok.is("HAVING")));
+}
+
+inline void
+SqlParser::parseWhere(const std::string &column, SqlStatement &out)
+{
+	std::vector<SqlValue> values;
+	bool conjunct_start = true;
+	bool found = false;
+	while (!isClauseEnd()) {
+		if (m_Depth == 0 && m_Tok.is("OR"))
+			return;
+		if (m_Depth == 0 && m_Tok.is("AND")) {
+			conjunct_start = true;
+			next();
+			continue;
+		}
+		if (!conjunct_start || found || !m_Tok.isName()) {
+			conjunct_start = false;
+			next();
+			continue;
+		}
+		conjunct_start = false;
+		/* Column may be qualified by table name or alias. */
+		std::string name = m_Tok.text;
+		next();
+		if (m_Tok.is('.')) {
+			next();
+			if (!m_Tok.isName())
+				continue;
+			name = m_Tok.text;
+			next();
+		}
+		if (name != column)
+			continue;
+		if (m_Tok.is('=')) {
+			next();
+			if (m_Tok.is('='))
+				next();
+			SqlValue value;
+			/* The value must not be a part of expression. */
+			if (!parseValue(value) ||
+			    !(isClauseEnd() || (m_Depth == 0 &&
+						(m_Tok.is("AND") || m_Tok.is("OR")))))
+				continue;
+			values.push_back(std::move(value));
+			found = true;
+		} else if (m_Tok.is("IN")) {
+			next();
+			if (!m_Tok.is('('))
+				continue;
+			int depth = m_Depth;
+			next();
+			std::vector<SqlValue> list;
+			SqlValue value;
+			while (parseValue(value)) {
+				list.push_back(std::move(value));
+				if (!m_Tok.is(','))
+					break;
+				next();
+			}
+			if (m_Tok.is(')') && m_Depth == depth - 1) {
+				values = std::move(list);
+				found = !values.empty();
+				next();
+			}
+		}
+	}
+	out.values = std::move(values);
+}
+
+template<class ColumnOf>
+bool
+SqlParser::parse(std::string_view sql, ColumnOf &&column_of,
+		 SqlStatement &out)
+{
+	SqlParser p(sql);
+	out = SqlStatement{};
+	p.next();
+	bool is_insert = false;
+	if (p.m_Tok.is("SELECT")) {
+		while (!(p.m_Depth == 0 && p.m_Tok.is("FROM"))) {
+			if (p.m_Tok.type == TOKEN_END)
+				return false;
+			p.next();
+		}
+		p.next();
+	} else if (p.m_Tok.is("DELETE")) {
+		p.next();
+		if (!p.m_Tok.is("FROM"))
+			return false;
+		p.next();
+	} else if (p.m_Tok.is("UPDATE")) {
+		p.next();
+	} else if (p.m_Tok.is("INSERT") || p.m_Tok.is("REPLACE")) {
+		p.next();
+		if (!p.m_Tok.is("INTO"))
+			return false;
+		p.next();
+		is_insert = true;
+	} else {
+		return false;
+	}
+	if (!p.m_Tok.isName())
+		return false;
+	out.table = p.m_Tok.text;
+	p.next();
+	std::optional<std::string> column = column_of(out.table);
+	if (!column.has_value())
+		return true;
+	if (is_insert) {
+		if (!p.m_Tok.is('('))
+			return true;
+		/* Position of the shard column in the column list. */
+		std::optional<size_t> pos;
+		size_t count = 0;
+		p.next();
+		while (p.m_Tok.isName()) {
+			if (p.m_Tok.text == *column)
+				pos = count;
+			count++;
+			p.next();
+			if (!p.m_Tok.is(','))
+				break;
+			p.next();
+		}
+		if (!p.m_Tok.is(')') || !pos.has_value())
+			return true;
+		p.next();
+		if (!p.m_Tok.is("VALUES"))
+			return true;
+		p.next();
+		if (!p.m_Tok.is('('))
+			return true;
+		p.next();
+		SqlValue key;
+		for (size_t i = 0; i < count; ++i) {
+			if (i == *pos) {
+				if (!p.parseValue(key))
+					return true;
+			} else {
+				/* Other columns may be set to expressions. */
+				while (!(p.m_Depth == 1 && p.m_Tok.is(',')) &&
+				       p.m_Depth > 0 && p.m_Tok.type != TOKEN_END)
+					p.next();
+			}
+			bool is_last = i + 1 == count;
+			if (is_last ? !(p.m_Depth == 0 && p.m_Tok.is(')')) :
+				      !(p.m_Depth == 1 && p.m_Tok.is(',')))
+				return true;
+			p.next();
+		}
+		/* Several rows go to different shards. */
+		if (p.m_Tok.type != TOKEN_END && !p.m_Tok.is(';'))
+			return true;
+		out.values.push_back(std::move(key));
+		return true;
+	}
+	/* Alias of the table. */
+	if (p.m_Tok.is("AS"))
+		p.next();
+	if (p.m_Tok.isName() && !p.m_Tok.is("WHERE") && !p.m_Tok.is("SET"))
+		p.next();
+	if (p.m_Tok.is("SET")) {
+		while (!(p.m_Depth == 0 && p.m_Tok.is("WHERE"))) {
+			if (p.m_Tok.type == TOKEN_END)
+				return true;
+			p.next();
+		}
+	}
+	/* Joins, several tables etc. */
+	if (!p.m_Tok.is("WHERE"))
+		return true;
+	p.next();
+	p.parseWhere(*column, out);
+	return true;
+}
+
+template<class Spec>
+const SqlStatement &
+SqlShardRouter<Spec>::statementOf(const std::string &sql)
+{
+	auto it = m_Cache.find(sql);
+	if (it != m_Cache.end())
+		return it->second;
+	if (m_Cache.size() >= CACHE_MAX)
+		m_Cache.clear();
+	SqlStatement statement;
+	SqlParser::parse(sql, Spec::shardColumn, statement);
+	sql_parsed++;
+	return m_Cache.emplace(sql, std::move(statement)).first->second;
+}
+
+template<class Spec>
+template<class BUFFER>
+std::optional<uint64_t>
+SqlShardRouter<Spec>::keyOf(const SqlValue &value,
+			    std::vector<Data<BUFFER>> &params)
+{
+	if (value.kind == SqlValue::SQL_INT)
+		return value.num;
+	if (value.kind == SqlValue::SQL_STR)
+		return std::hash<std::string>{}(value.str);
+	if (value.num >= (int64_t) params.size())
+		return std::nullopt;
+	Data<BUFFER> &param = params[value.num];
+	int64_t num;
+	if (param.decode(num))
+		return num;
+	std::string str;
+	if (param.decode(str))
+		return std::hash<std::string>{}(str);
+	return std::nullopt;
+}
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+SqlShardRouter<Spec>::handle(Proxy &proxy, Message<BUFFER> &msg,
+			     PipelineContext &ctx)
+{
+	if (!ctx.from_client || ctx.instance >= 0 ||
+	    msg.header.code != Iproto::EXECUTE || !msg.body.sql_text)
+		return ShardRouter<Spec>::handle(proxy, msg, ctx);
+	const SqlStatement &statement = statementOf(*msg.body.sql_text);
+	if (statement.values.empty()) {
+		sql_unrouted++;
+		return STAGE_NEXT;
+	}
+	/* Parameters are not decoded, only their bounds. */
+	std::vector<Data<BUFFER>> params;
+	if (msg.body.sql_bind.has_value())
+		msg.body.sql_bind->decode(params);
+	std::optional<uint64_t> first;
+	for (const SqlValue &value : statement.values) {
+		std::optional<uint64_t> key = keyOf(value, params);
+		if (!key.has_value() ||
+		    (first.has_value() && ShardRouter<Spec>::bucketOf(*key) !=
+					  ShardRouter<Spec>::bucketOf(*first))) {
+			sql_unrouted++;
+			return STAGE_NEXT;
+		}
+		if (!first.has_value())
+			first = key;
+	}
+	sql_routed++;
+	return ShardRouter<Spec>::route(proxy, msg, ctx, *first);
+}
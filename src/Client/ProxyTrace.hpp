@@ -0,0 +1,214 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <vector>
+
+/**
+ * Points a traced request passes in the proxy, in order. Some may be
+ * missing: e.g. requests answered by the proxy itself are never sent to
+ * backend.
+ */
+enum TracePoint {
+	/* The last part of request is received from client. */
+	TRACE_RECV = 0,
+	/* Request is decoded. */
+	TRACE_DECODED,
+	/* Instance is chosen (see ProxyConnector::connect()). */
+	TRACE_ROUTED,
+	/* Request is passed to the socket of instance. */
+	TRACE_SENT,
+	/* The last part of response is received from instance. */
+	TRACE_RESPONSE,
+	/* Response is passed to the socket of client. */
+	TRACE_REPLIED,
+	TRACE_POINT_COUNT
+};
+
+/** Timestamps of a single request, see ProxyOptions::trace_sample_rate. */
+struct RequestTrace {
+	int code = 0;
+	uint32_t sync = 0;
+	std::optional<uint32_t> space_id;
+	/** Index of instance the request is sent to, -1 if it is not. */
+	int instance = -1;
+	/** Nanoseconds of monotonic clock, zero if point is not passed. */
+	std::array<uint64_t, TRACE_POINT_COUNT> at{};
+
+	/** Microseconds from receipt of request to reply. */
+	uint64_t totalUsec() const;
+	/** Print one line with time spent between passed points. */
+	void print(std::ostream &out) const;
+};
+
+/**
+ * Samples requests and keeps the last slow ones in a ring buffer.
+ */
+class ProxyTracer {
+public:
+	/**
+	 * Trace one of @a sample_rate requests (none if zero), remember up
+	 * to @a log_size of those which took at least @a threshold_usec.
+	 */
+	void configure(size_t sample_rate, uint64_t threshold_usec,
+		       size_t log_size);
+	bool enabled() const { return m_SampleRate != 0; }
+	/** Return true if the next request must be traced. */
+	bool sample();
+	/** Request is replied, remember it if it is slow. */
+	void finish(const RequestTrace &trace);
+
+	/** Slow requests remembered, from the oldest to the newest. */
+	std::vector<RequestTrace> slowRequests() const;
+	/** Print slow requests, one per line. */
+	void dump(std::ostream &out) const;
+
+	static uint64_t now();
+
+	/** Number of traced requests replied. */
+	size_t traced_count = 0;
+	/** Number of them which were slow, including overwritten ones. */
+	size_t slow_count = 0;
+
+private:
+	size_t m_SampleRate = 0;
+	size_t m_Counter = 0;
+	uint64_t m_ThresholdUsec = 0;
+	size_t m_LogSize = 0;
+	std::vector<RequestTrace> m_Log;
+	/** Position of the next slow request in m_Log. */
+	size_t m_Head = 0;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline uint64_t
+RequestTrace::totalUsec() const
+{
+	if (at[TRACE_RECV] == 0 || at[TRACE_REPLIED] < at[TRACE_RECV])
+		return 0;
+	return (at[TRACE_REPLIED] - at[TRACE_RECV]) / 1000;
+}
+
+inline void
+RequestTrace::print(std::ostream &out) const
+{
+	static const char *intervals[TRACE_POINT_COUNT - 1] = {
+		"decode", "route", "send", "backend", "reply",
+	};
+	out << "sync=" << sync << " type=" << code << " space=";
+	if (space_id.has_value())
+		out << *space_id;
+	else
+		out << '-';
+	out << " instance=" << instance << " total_us=" << totalUsec();
+	/* Interval ends at a passed point and starts at the previous one. */
+	size_t prev = TRACE_RECV;
+	for (size_t i = TRACE_RECV + 1; i < TRACE_POINT_COUNT; ++i) {
+		out << ' ' << intervals[i - 1] << "_us=";
+		if (at[i] == 0 || at[prev] == 0 || at[i] < at[prev]) {
+			out << '-';
+			continue;
+		}
+		out << (at[i] - at[prev]) / 1000;
+		prev = i;
+	}
+}
+
+inline void
+ProxyTracer::configure(size_t sample_rate, uint64_t threshold_usec,
+		       size_t log_size)
+{
+	m_SampleRate = log_size == 0 ? 0 : sample_rate;
+	m_ThresholdUsec = threshold_usec;
+	m_LogSize = log_size;
+	m_Log.clear();
+	m_Log.reserve(log_size);
+	m_Head = 0;
+}
+
+inline bool
+ProxyTracer::sample()
+{
+	if (m_SampleRate == 0)
+		return false;
+	return ++m_Counter % m_SampleRate == 0;
+}
+
+inline void
+ProxyTracer::finish(const RequestTrace &trace)
+{
+	traced_count++;
+	if (trace.totalUsec() < m_ThresholdUsec)
+		return;
+	slow_count++;
+	if (m_Log.size() < m_LogSize) {
+		m_Log.push_back(trace);
+		return;
+	}
+	m_Log[m_Head] = trace;
+	m_Head = (m_Head + 1) % m_Log.size();
+}
+
+inline std::vector<RequestTrace>
+ProxyTracer::slowRequests() const
+{
+	std::vector<RequestTrace> res;
+	res.reserve(m_Log.size());
+	for (size_t i = 0; i < m_Log.size(); ++i)
+		res.push_back(m_Log[(m_Head + i) % m_Log.size()]);
+	return res;
+}
+
+inline void
+ProxyTracer::dump(std::ostream &out) const
+{
+	for (size_t i = 0; i < m_Log.size(); ++i) {
+		m_Log[(m_Head + i) % m_Log.size()].print(out);
+		out << '\n';
+	}
+	out.flush();
+}
+
+inline uint64_t
+ProxyTracer::now()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(
+		steady_clock::now().time_since_epoch()).count();
+}
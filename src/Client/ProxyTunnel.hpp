@@ -0,0 +1,105 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+#include "IprotoConstants.hpp"
+#include "MessageReader.hpp"
+#include "ProxyPipeline.hpp"
+
+/**
+ * Stage switching clients of bulk users (loaders, exports) to tunnels,
+ * see ProxyConnector::startTunnel(): once such a client is authenticated
+ * by the instance, its traffic is passed by the kernel with splice(2)
+ * without copies to the proxy, decoding and routing. Spec must provide:
+ *
+ * static constexpr int INSTANCE;
+ * static bool isTunneled(const std::string &user);
+ *
+ * AUTH of a tunneled user is sent to instance INSTANCE and the tunnel is
+ * started when the instance accepts it. Requests received before that
+ * are routed by next stages, as are all messages of clients whose AUTH
+ * failed. Other messages are left to next stages too.
+ */
+template<class Spec>
+class TunnelStage {
+public:
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &msg,
+			   PipelineContext &ctx);
+	/** Number of clients switched to tunnels. */
+	size_t tunneledCount() const { return m_Tunneled; }
+	/** Forget AUTH of client @a client_fd, its connection is closed. */
+	void disconnected(int client_fd) { m_Pending.erase(client_fd); }
+
+private:
+	/** Sync of AUTH sent to the instance by client descriptor. */
+	std::unordered_map<int, int> m_Pending;
+	size_t m_Tunneled = 0;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+template<class Spec>
+template<class Proxy, class BUFFER>
+StageStatus
+TunnelStage<Spec>::handle(Proxy &proxy, Message<BUFFER> &msg,
+			  PipelineContext &ctx)
+{
+	if (ctx.from_client) {
+		if (msg.header.code != Iproto::AUTH ||
+		    !msg.body.user_name.has_value() ||
+		    !Spec::isTunneled(*msg.body.user_name))
+			return STAGE_NEXT;
+		auto &strm = proxy.connect(Spec::INSTANCE);
+		if (proxy.sendDecodedToStream(strm, msg.size) < 0)
+			return STAGE_ERR;
+		m_Pending[proxy.getClientFd()] = msg.header.sync;
+		return STAGE_DONE;
+	}
+	auto pending = m_Pending.find(proxy.getClientFd());
+	/* The descriptor may be reused by a client of another user. */
+	if (pending == m_Pending.end() || pending->second != msg.header.sync ||
+	    proxy.getRecvInstance() != Spec::INSTANCE ||
+	    !Spec::isTunneled(proxy.getClientUser()))
+		return STAGE_NEXT;
+	m_Pending.erase(pending);
+	if (proxy.sendDecodedToClient(msg.size) < 0)
+		return STAGE_ERR;
+	if (msg.header.code == Iproto::OK &&
+	    proxy.startTunnel(proxy.connect(Spec::INSTANCE)) == 0)
+		m_Tunneled++;
+	return STAGE_DONE;
+}
@@ -84,6 +84,11 @@ public:
 			    uint32_t index_id = 0,
 			    uint32_t limit = UINT32_MAX, uint32_t offset = 0,
 			    IteratorType iterator = EQ);
+	/** The same, but request has the given sync (e.g. in proxy). */
+	template <class T>
+	size_t encodeSelect(int request_sync, const T &key, uint32_t space_id,
+			    uint32_t index_id, uint32_t limit, uint32_t offset,
+			    IteratorType iterator);
 	template <class T>
 	size_t encodeExecute(const std::string& statement, const T& parameters);
 	template <class T>
@@ -91,20 +96,42 @@ public:
 	size_t encodePrepare(const std::string& statement);
 	template <class T>
 	size_t encodeCall(const std::string &func, const T &args);
+	/** The same, but request has the given sync (e.g. in proxy). */
+	template <class T>
+	size_t encodeCall(int request_sync, const std::string &func,
+			  const T &args);
+	template <class T>
+	size_t encodeEval(const std::string &expr, const T &args);
+	/** The same, but request has the given sync (e.g. in proxy). */
+	template <class T>
+	size_t encodeEval(int request_sync, const std::string &expr,
+			  const T &args);
 	size_t encodeAuth(std::string_view user, std::string_view passwd,
 			  const Greeting &greet);
 	void reencodeAuth(std::string_view user, std::string_view passwd,
 			  const Greeting &greet);
+	/* Requests of a replica, vclock is a map of LSNs by replica id. */
+	size_t encodeFetchSnapshot();
+	template <class V>
+	size_t encodeSubscribe(std::string_view instance_uuid, const V &vclock,
+			       bool is_anon);
+	/** Acknowledge rows up to @a vclock to the master. */
+	template <class V>
+	size_t encodeVclock(const V &vclock);
 	
 	size_t encodeOk(int sync, int schema_id);
 	template <class T>
 	size_t encodeOk(int sync, int schema_id, const T *data = nullptr);
+	/** Encode error response of ClientError @a errcode. */
+	size_t encodeError(int sync, int schema_id, uint32_t errcode,
+			   const std::string &msg);
 
 	/** Sync value is used as request id. */
 	static size_t getSync() { return sync; }
 	static constexpr size_t PREHEADER_SIZE = 5;
 private:
 	void encodeHeader(int request);
+	void encodeHeader(int request, int request_sync);
 	void encodeResponseHeader(int request, int current_sync, int schema_id);
 	BUFFER &m_Buf;
 	inline static ssize_t sync = 0;
@@ -113,10 +140,17 @@ private:
 template<class BUFFER>
 void
 RequestEncoder<BUFFER>::encodeHeader(int request)
+{
+	encodeHeader(request, ++RequestEncoder::sync);
+}
+
+template<class BUFFER>
+void
+RequestEncoder<BUFFER>::encodeHeader(int request, int request_sync)
 {
 	//TODO: add schema version.
 	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
-			MPP_AS_CONST(Iproto::SYNC), ++RequestEncoder::sync,
+			MPP_AS_CONST(Iproto::SYNC), request_sync,
 			MPP_AS_CONST(Iproto::REQUEST_TYPE), request)));
 }
 
@@ -250,11 +284,23 @@ RequestEncoder<BUFFER>::encodeSelect(const T &key,
 				     uint32_t space_id, uint32_t index_id,
 				     uint32_t limit, uint32_t offset,
 				     IteratorType iterator)
+{
+	return encodeSelect(++RequestEncoder::sync, key, space_id, index_id,
+			    limit, offset, iterator);
+}
+
+template<class BUFFER>
+template <class T>
+size_t
+RequestEncoder<BUFFER>::encodeSelect(int request_sync, const T &key,
+				     uint32_t space_id, uint32_t index_id,
+				     uint32_t limit, uint32_t offset,
+				     IteratorType iterator)
 {
 	iterator_t<BUFFER> request_start = m_Buf.end();
 	m_Buf.write('\xce');
 	m_Buf.write(uint32_t{0});
-	encodeHeader(Iproto::SELECT);
+	encodeHeader(Iproto::SELECT, request_sync);
 	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
 		MPP_AS_CONST(Iproto::SPACE_ID), space_id,
 		MPP_AS_CONST(Iproto::INDEX_ID), index_id,
@@ -326,11 +372,20 @@ template<class BUFFER>
 template <class T>
 size_t
 RequestEncoder<BUFFER>::encodeCall(const std::string &func, const T &args)
+{
+	return encodeCall(++RequestEncoder::sync, func, args);
+}
+
+template<class BUFFER>
+template <class T>
+size_t
+RequestEncoder<BUFFER>::encodeCall(int request_sync, const std::string &func,
+				   const T &args)
 {
 	iterator_t<BUFFER> request_start = m_Buf.end();
 	m_Buf.write('\xce');
 	m_Buf.write(uint32_t{0});
-	encodeHeader(Iproto::CALL);
+	encodeHeader(Iproto::CALL, request_sync);
 	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
 		MPP_AS_CONST(Iproto::FUNCTION_NAME), func,
 		MPP_AS_CONST(Iproto::TUPLE), mpp::as_arr(args))));
@@ -340,6 +395,33 @@ RequestEncoder<BUFFER>::encodeCall(const std::string &func, const T &args)
 	return request_size + PREHEADER_SIZE;
 }
 
+template<class BUFFER>
+template <class T>
+size_t
+RequestEncoder<BUFFER>::encodeEval(const std::string &expr, const T &args)
+{
+	return encodeEval(++RequestEncoder::sync, expr, args);
+}
+
+template<class BUFFER>
+template <class T>
+size_t
+RequestEncoder<BUFFER>::encodeEval(int request_sync, const std::string &expr,
+				   const T &args)
+{
+	iterator_t<BUFFER> request_start = m_Buf.end();
+	m_Buf.write('\xce');
+	m_Buf.write(uint32_t{0});
+	encodeHeader(Iproto::EVAL, request_sync);
+	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::EXPR), expr,
+		MPP_AS_CONST(Iproto::TUPLE), mpp::as_arr(args))));
+	uint32_t request_size = (m_Buf.end() - request_start) - PREHEADER_SIZE;
+	++request_start;
+	request_start.set(__builtin_bswap32(request_size));
+	return request_size + PREHEADER_SIZE;
+}
+
 template<class BUFFER>
 size_t
 RequestEncoder<BUFFER>::encodeAuth(std::string_view user,
@@ -381,6 +463,59 @@ RequestEncoder<BUFFER>::reencodeAuth(std::string_view user,
 		std::make_tuple("chap-sha1", scram_str))));
 }
 
+template<class BUFFER>
+size_t
+RequestEncoder<BUFFER>::encodeFetchSnapshot()
+{
+	iterator_t<BUFFER> request_start = m_Buf.end();
+	m_Buf.write('\xce');
+	m_Buf.write(uint32_t{0});
+	encodeHeader(Iproto::FETCH_SNAPSHOT);
+	mpp::encode(m_Buf, mpp::as_map(std::make_tuple()));
+	uint32_t request_size = (m_Buf.end() - request_start) - PREHEADER_SIZE;
+	++request_start;
+	request_start.set(__builtin_bswap32(request_size));
+	return request_size + PREHEADER_SIZE;
+}
+
+template<class BUFFER>
+template <class V>
+size_t
+RequestEncoder<BUFFER>::encodeSubscribe(std::string_view instance_uuid,
+					const V &vclock, bool is_anon)
+{
+	iterator_t<BUFFER> request_start = m_Buf.end();
+	m_Buf.write('\xce');
+	m_Buf.write(uint32_t{0});
+	encodeHeader(Iproto::SUBSCRIBE);
+	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::INSTANCE_UUID), instance_uuid,
+		MPP_AS_CONST(Iproto::VCLOCK), vclock,
+		MPP_AS_CONST(Iproto::REPLICA_ANON), is_anon)));
+	uint32_t request_size = (m_Buf.end() - request_start) - PREHEADER_SIZE;
+	++request_start;
+	request_start.set(__builtin_bswap32(request_size));
+	return request_size + PREHEADER_SIZE;
+}
+
+template<class BUFFER>
+template <class V>
+size_t
+RequestEncoder<BUFFER>::encodeVclock(const V &vclock)
+{
+	iterator_t<BUFFER> request_start = m_Buf.end();
+	m_Buf.write('\xce');
+	m_Buf.write(uint32_t{0});
+	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::REQUEST_TYPE), MPP_AS_CONST(Iproto::OK))));
+	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::VCLOCK), vclock)));
+	uint32_t request_size = (m_Buf.end() - request_start) - PREHEADER_SIZE;
+	++request_start;
+	request_start.set(__builtin_bswap32(request_size));
+	return request_size + PREHEADER_SIZE;
+}
+
 template<class BUFFER>
 template<class T>
 size_t
@@ -413,4 +548,33 @@ RequestEncoder<BUFFER>::encodeOk(int sync, int schema_id)
 	++request_start;
 	request_start.set(__builtin_bswap32(request_size));
 	return request_size + PREHEADER_SIZE;
-}
\ No newline at end of file
+}
+
+template<class BUFFER>
+size_t
+RequestEncoder<BUFFER>::encodeError(int sync, int schema_id, uint32_t errcode,
+				    const std::string &msg)
+{
+	iterator_t<BUFFER> request_start = m_Buf.end();
+	m_Buf.write('\xce');
+	m_Buf.write(uint32_t{0});
+	encodeResponseHeader(Iproto::TYPE_ERROR | errcode, sync, schema_id);
+	/* Both formats: old clients read only IPROTO_ERROR_24. */
+	mpp::encode(m_Buf, mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::ERROR_24), msg,
+		MPP_AS_CONST(Iproto::ERROR), mpp::as_map(std::forward_as_tuple(
+			MPP_AS_CONST(Iproto::ERROR_STACK),
+			mpp::as_arr(std::forward_as_tuple(
+				mpp::as_map(std::forward_as_tuple(
+					MPP_AS_CONST(Iproto::ERROR_TYPE), "ClientError",
+					MPP_AS_CONST(Iproto::ERROR_FILE), "proxy",
+					MPP_AS_CONST(Iproto::ERROR_LINE), 0,
+					MPP_AS_CONST(Iproto::ERROR_MESSAGE), msg,
+					MPP_AS_CONST(Iproto::ERROR_ERRNO), 0,
+					MPP_AS_CONST(Iproto::ERROR_CODE), errcode)))))))));
+
+	uint32_t request_size = (m_Buf.end() - request_start) - PREHEADER_SIZE;
+	++request_start;
+	request_start.set(__builtin_bswap32(request_size));
+	return request_size + PREHEADER_SIZE;
+}
@@ -97,6 +97,12 @@ struct ConnectOptions {
 	StreamTransport transport = STREAM_PLAIN;
 	/** Time span limit for connection establishment. */
 	size_t connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+	/**
+	 * Compress traffic with zlib of this level (-1 is zlib default),
+	 * 0 disables compression. Actual stream can reject it. The peer
+	 * must compress the connection as well (e.g. proxy listener).
+	 */
+	int compress_level = 0;
 
 	/** Connection to tarantool instance */
 	bool is_tnt = true;
@@ -203,6 +209,8 @@ operator<<(std::ostream &strm, const ConnectOptions &opts)
 		strm << ':' << opts.service;
 	if (opts.transport != STREAM_PLAIN)
 		strm << '(' << opts.transport << ')';
+	if (opts.compress_level != 0)
+		strm << "(zlib)";
 	return strm;
 }
 
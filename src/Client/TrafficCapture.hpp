@@ -0,0 +1,342 @@
+#pragma once
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "../Utils/Logger.hpp"
+
+/**
+ * Traffic of proxy clients recorded by TrafficCapture, replayed by
+ * examples/replay.cpp. File layout (host byte order):
+ *
+ * CaptureFileHeader
+ * CaptureRecordHeader, <size> bytes of frame, padding to 8 bytes
+ * CaptureRecordHeader, ...
+ *
+ * File is truncated to the used size on close. If the writer has
+ * crashed, records end with zero record header.
+ */
+enum CaptureDirection {
+	/* Bytes received from client. */
+	CAPTURE_FROM_CLIENT = 0,
+	/* Bytes sent to client. */
+	CAPTURE_TO_CLIENT = 1,
+};
+
+struct CaptureFileHeader {
+	static constexpr char MAGIC[8] = {'T', 'N', 'T', 'C', 'A', 'P', '0', '1'};
+
+	char magic[8];
+	/** Wall clock time of capture start, nanoseconds since epoch. */
+	uint64_t start_time;
+	/** Bytes used including this header, zero until file is closed. */
+	uint64_t size;
+	/** Frames which didn't fit into the file. */
+	uint64_t dropped;
+};
+
+struct CaptureRecordHeader {
+	static constexpr uint32_t DIRECTION_BIT = 1u << 31;
+	/** Records start at offsets aligned to this. */
+	static constexpr size_t ALIGN = 8;
+
+	/** Nanoseconds since capture start. */
+	uint64_t timestamp;
+	/** Id of client connection, unique within the capture. */
+	uint32_t conn_id;
+	/**
+	 * Frame size with CaptureDirection in DIRECTION_BIT. Written last,
+	 * so zero means the record is not complete.
+	 */
+	uint32_t size;
+};
+
+/** Frame read from capture file, data points into the mapped file. */
+struct CaptureFrame {
+	uint64_t timestamp;
+	uint32_t conn_id;
+	CaptureDirection direction;
+	const char *data;
+	size_t size;
+};
+
+/**
+ * Appends frames to a file of fixed capacity mapped into memory. Space
+ * for a frame is reserved with a CAS on the tail, so the capture may be
+ * shared by proxies running in several threads. Recording never blocks
+ * on I/O or locks: frames that don't fit are dropped and counted.
+ */
+class TrafficCapture {
+public:
+	TrafficCapture() = default;
+	~TrafficCapture() { close(); }
+	TrafficCapture(const TrafficCapture &) = delete;
+	TrafficCapture &operator=(const TrafficCapture &) = delete;
+
+	/**
+	 * Create (or truncate) file @a path with room for @a capacity
+	 * bytes and map it. Return 0 on success, -1 on error.
+	 */
+	int open(const std::string &path, size_t capacity);
+	/** Unmap the file and truncate it to the used size. */
+	void close();
+	bool isOpen() const { return base_ != nullptr; }
+
+	/** Append first @a size bytes of @a iov as a frame. */
+	void record(CaptureDirection direction, uint32_t conn_id,
+		    const struct iovec *iov, size_t iov_cnt, size_t size);
+
+	/** Bytes used including file header. */
+	size_t used() const { return tail_.load(std::memory_order_relaxed); }
+	size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+	/** Max size of a frame, larger ones are dropped. */
+	static constexpr size_t FRAME_MAX = CaptureRecordHeader::DIRECTION_BIT - 1;
+
+private:
+	char *base_ = nullptr;
+	size_t capacity_ = 0;
+	int fd_ = -1;
+	std::chrono::steady_clock::time_point start_;
+	std::atomic<size_t> tail_{0};
+	std::atomic<size_t> dropped_{0};
+};
+
+/** Sequential reader of a capture file. */
+class CaptureReader {
+public:
+	CaptureReader() = default;
+	~CaptureReader() { close(); }
+	CaptureReader(const CaptureReader &) = delete;
+	CaptureReader &operator=(const CaptureReader &) = delete;
+
+	/** Map file @a path. Return 0 on success, -1 on error. */
+	int open(const std::string &path);
+	void close();
+
+	/** Read the next frame. Return false at the end of capture. */
+	bool next(CaptureFrame &frame);
+
+	const CaptureFileHeader &header() const
+	{
+		return *(const CaptureFileHeader *) base_;
+	}
+
+private:
+	const char *base_ = nullptr;
+	size_t size_ = 0;
+	size_t pos_ = 0;
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline int
+TrafficCapture::open(const std::string &path, size_t capacity)
+{
+	assert(!isOpen());
+	if (capacity < sizeof(CaptureFileHeader)) {
+		LOG_ERROR("Capture capacity is too small: ", capacity);
+		return -1;
+	}
+	fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd_ < 0) {
+		LOG_ERROR("Failed to open capture file ", path, ": ",
+			  strerror(errno));
+		return -1;
+	}
+	/* Sparse file: blocks are allocated as frames are written. */
+	if (ftruncate(fd_, capacity) != 0) {
+		LOG_ERROR("Failed to resize capture file: ", strerror(errno));
+		::close(fd_);
+		fd_ = -1;
+		return -1;
+	}
+	void *base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd_, 0);
+	if (base == MAP_FAILED) {
+		LOG_ERROR("Failed to map capture file: ", strerror(errno));
+		::close(fd_);
+		fd_ = -1;
+		return -1;
+	}
+	base_ = (char *) base;
+	capacity_ = capacity;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	CaptureFileHeader header{};
+	memcpy(header.magic, CaptureFileHeader::MAGIC, sizeof(header.magic));
+	header.start_time = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+	memcpy(base_, &header, sizeof(header));
+	start_ = std::chrono::steady_clock::now();
+	tail_.store(sizeof(header), std::memory_order_relaxed);
+	dropped_.store(0, std::memory_order_relaxed);
+	return 0;
+}
+
+inline void
+TrafficCapture::close()
+{
+	if (!isOpen())
+		return;
+	size_t used = tail_.load(std::memory_order_acquire);
+	auto *header = (CaptureFileHeader *) base_;
+	header->size = used;
+	header->dropped = dropped_.load(std::memory_order_relaxed);
+	munmap(base_, capacity_);
+	base_ = nullptr;
+	if (ftruncate(fd_, used) != 0)
+		LOG_ERROR("Failed to truncate capture file: ", strerror(errno));
+	::close(fd_);
+	fd_ = -1;
+}
+
+inline void
+TrafficCapture::record(CaptureDirection direction, uint32_t conn_id,
+		       const struct iovec *iov, size_t iov_cnt, size_t size)
+{
+	if (size == 0 || !isOpen())
+		return;
+	size_t record_size = sizeof(CaptureRecordHeader) + size;
+	record_size = (record_size + CaptureRecordHeader::ALIGN - 1) & ~(CaptureRecordHeader::ALIGN - 1);
+	size_t pos = tail_.load(std::memory_order_relaxed);
+	do {
+		if (size > FRAME_MAX || capacity_ - pos < record_size) {
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	} while (!tail_.compare_exchange_weak(pos, pos + record_size,
+					      std::memory_order_relaxed));
+
+	auto *header = (CaptureRecordHeader *) (base_ + pos);
+	std::chrono::nanoseconds since_start =
+		std::chrono::steady_clock::now() - start_;
+	header->timestamp = since_start.count();
+	header->conn_id = conn_id;
+	char *data = (char *) (header + 1);
+	size_t left = size;
+	for (size_t i = 0; i < iov_cnt && left > 0; ++i) {
+		size_t part = std::min(left, iov[i].iov_len);
+		memcpy(data, iov[i].iov_base, part);
+		data += part;
+		left -= part;
+	}
+	assert(left == 0);
+	uint32_t size_field = size;
+	if (direction == CAPTURE_TO_CLIENT)
+		size_field |= CaptureRecordHeader::DIRECTION_BIT;
+	/* Readers of a live file see the record only once it is complete. */
+	__atomic_store_n(&header->size, size_field, __ATOMIC_RELEASE);
+}
+
+inline int
+CaptureReader::open(const std::string &path)
+{
+	assert(base_ == nullptr);
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open capture file ", path, ": ",
+			  strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t) st.st_size < sizeof(CaptureFileHeader)) {
+		LOG_ERROR("Not a capture file: ", path);
+		::close(fd);
+		return -1;
+	}
+	void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED) {
+		LOG_ERROR("Failed to map capture file: ", strerror(errno));
+		return -1;
+	}
+	base_ = (const char *) base;
+	size_ = st.st_size;
+	if (memcmp(header().magic, CaptureFileHeader::MAGIC,
+		   sizeof(CaptureFileHeader::MAGIC)) != 0) {
+		LOG_ERROR("Not a capture file: ", path);
+		close();
+		return -1;
+	}
+	if (header().size != 0 && header().size < size_)
+		size_ = header().size;
+	pos_ = sizeof(CaptureFileHeader);
+	return 0;
+}
+
+inline void
+CaptureReader::close()
+{
+	if (base_ == nullptr)
+		return;
+	munmap((void *) base_, size_);
+	base_ = nullptr;
+}
+
+inline bool
+CaptureReader::next(CaptureFrame &frame)
+{
+	if (size_ - pos_ < sizeof(CaptureRecordHeader))
+		return false;
+	auto *header = (const CaptureRecordHeader *) (base_ + pos_);
+	uint32_t size_field = __atomic_load_n(&header->size, __ATOMIC_ACQUIRE);
+	if (size_field == 0)
+		return false;
+	size_t size = size_field & ~CaptureRecordHeader::DIRECTION_BIT;
+	if (size_ - pos_ - sizeof(*header) < size)
+		return false;
+	frame.timestamp = header->timestamp;
+	frame.conn_id = header->conn_id;
+	frame.direction = (size_field & CaptureRecordHeader::DIRECTION_BIT) ?
+			  CAPTURE_TO_CLIENT : CAPTURE_FROM_CLIENT;
+	frame.data = (const char *) (header + 1);
+	frame.size = size;
+	size_t record_size = sizeof(*header) + size;
+	pos_ += (record_size + CaptureRecordHeader::ALIGN - 1) & ~(CaptureRecordHeader::ALIGN - 1);
+	return true;
+}
@@ -62,6 +62,16 @@ public:
 	 * See get_last_error() in case of error.
 	 */
 	inline int create(const ConnectOptions &opts);
+	/**
+	 * Create context of TLS server (e.g. listener of proxy) with
+	 * certificate and key from @a opts. Sessions are cached for
+	 * resumption, @a session_cache_size of zero means library default.
+	 * If @a ktls is set, record layer is offloaded to the kernel after
+	 * the handshake when the kernel supports it.
+	 * Return 0 on success, -1 on error.
+	 */
+	inline int create_server(const ConnectOptions &opts, bool ktls = false,
+				 size_t session_cache_size = 0);
 	/** Cast to ssl context pointer. */
 	operator SSL_CTX *() const { return ssl_ctx; }
 	/** Get last error that happend upon creation. */
@@ -87,6 +97,9 @@ private:
 	 */
 	inline int
 	load_private_key(const ConnectOptions &opts);
+	/** Load certificate, key, CA and ciphers common for both sides. */
+	inline int
+	load_credentials(const ConnectOptions &opts);
 
 	Resource<SSL_CTX *, nullptr> ssl_ctx;
 	const char *last_error = nullptr;
@@ -111,9 +124,17 @@ public:
 	 */
 	int connect(const ConnectOptions &opts);
 	/**
-	 * Receive data to connection.
-	 * Return positive number - number of bytes was received.
-	 * Return 0 if nothing was received but there's no error.
+	 * Take accepted socket @a fd and start server side of handshake
+	 * with @a ctx (see SSLContext::create_server()). The handshake is
+	 * driven by subsequent recv() calls. Return 0 on success, -1 on error.
+	 */
+	int accept(int fd, SSL_CTX *ctx);
+	/**
+	 * Send data to connection. Small iovecs are coalesced so that
+	 * every TLS record carries up to TLS_RECORD_MAX bytes. With kernel
+	 * TLS enabled data is passed to sendmsg() as is.
+	 * Return positive number - number of bytes was sent.
+	 * Return 0 if nothing was sent but there's no error.
 	 * Return -1 on error.
 	 * One must check the stream status to understand what happens.
 	 */
@@ -126,10 +147,37 @@ public:
 	 * One must check the stream status to understand what happens.
 	 */
 	ssize_t recv(struct iovec *iov, size_t iov_count);
+	/** True if records are encrypted by the kernel. */
+	bool is_ktls_send() const;
+	/** True if traffic is encrypted, i.e. the stream is not plain. */
+	bool is_ssl() const { return ssl != nullptr; }
+	/**
+	 * True if received data is left in OpenSSL buffers: the socket
+	 * won't report it as readable.
+	 */
+	bool has_pending() const;
+
+	/** Max size of plain text in one TLS record. */
+	static constexpr size_t TLS_RECORD_MAX = 16384;
 
 private:
+	/** Set up SSL object over the socket. Return 0 or -1 (dead stream). */
+	int init_ssl(SSL_CTX *ctx);
+	/**
+	 * Write one record of @a size bytes from @a data. Return 1 if it
+	 * is written, 0 if socket is blocked, -1 on error.
+	 */
+	int write_record(const char *data, size_t size);
+	/** Handle failed SSL_read_ex() returned @a ret. Return 0 or -1. */
+	int read_failed(int ret);
+
 	SSLContext ssl_context;
 	Resource<SSL *, nullptr> ssl;
+	/**
+	 * Size of record which write is blocked. OpenSSL requires the
+	 * next write to start with the same data of at least this size.
+	 */
+	size_t write_pending = 0;
 };
 
 /////////////////////////////////////////////////////////////////////
@@ -185,15 +233,6 @@ int SSLContext::create(const ConnectOptions &opts)
 {
 	SSLInit::instance();
 
-	const char *cert_file = opts.ssl_cert_file.empty() ?
-				nullptr : opts.ssl_cert_file.c_str();
-	const char *key_file = opts.ssl_key_file.empty() ?
-			       nullptr : opts.ssl_key_file.c_str();
-	const char *ca_file = opts.ssl_ca_file.empty() ?
-			      nullptr : opts.ssl_ca_file.c_str();
-	const char *ciphers = opts.ssl_ciphers.empty() ?
-			      nullptr : opts.ssl_ciphers.c_str();
-
 	if (ssl_ctx != nullptr)
 		SSL_CTX_free(ssl_ctx);
 	const SSL_METHOD *method = TLS_client_method();
@@ -216,6 +255,66 @@ int SSLContext::create(const ConnectOptions &opts)
 		last_error = "Error setting SSL protocol version";
 		return -1;
 	}
+	return load_credentials(opts);
+}
+
+int SSLContext::create_server(const ConnectOptions &opts, bool ktls,
+			      size_t session_cache_size)
+{
+	SSLInit::instance();
+
+	if (opts.ssl_cert_file.empty() || opts.ssl_key_file.empty()) {
+		last_error = "SSL certificate and key are required";
+		return -1;
+	}
+	if (ssl_ctx != nullptr)
+		SSL_CTX_free(ssl_ctx);
+	ssl_ctx = SSL_CTX_new(TLS_server_method());
+	if (ssl_ctx == NULL) {
+		last_error = "SSL_CTX_new failed";
+		return -1;
+	}
+	/* Clients may use any version starting from TLSv1.2. */
+	if (SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION) != 1) {
+		last_error = "Error setting SSL protocol version";
+		return -1;
+	}
+	if (load_credentials(opts) != 0)
+		return -1;
+	/*
+	 * Resumption skips the full handshake for reconnecting clients:
+	 * TLSv1.2 clients use either session ids (server cache) or tickets,
+	 * TLSv1.3 ones get tickets issued after the handshake.
+	 */
+	static const unsigned char sid_ctx[] = "tntcxx";
+	SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+	if (SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx,
+					   sizeof(sid_ctx) - 1) != 1) {
+		last_error = "Error setting SSL session id context";
+		return -1;
+	}
+	if (session_cache_size != 0)
+		SSL_CTX_sess_set_cache_size(ssl_ctx, session_cache_size);
+#ifdef SSL_OP_ENABLE_KTLS
+	if (ktls)
+		SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+	(void)ktls;
+#endif
+	return 0;
+}
+
+int SSLContext::load_credentials(const ConnectOptions &opts)
+{
+	const char *cert_file = opts.ssl_cert_file.empty() ?
+				nullptr : opts.ssl_cert_file.c_str();
+	const char *key_file = opts.ssl_key_file.empty() ?
+			       nullptr : opts.ssl_key_file.c_str();
+	const char *ca_file = opts.ssl_ca_file.empty() ?
+			      nullptr : opts.ssl_ca_file.c_str();
+	const char *ciphers = opts.ssl_ciphers.empty() ?
+			      nullptr : opts.ssl_ciphers.c_str();
+
 	if (cert_file != NULL &&
 	    SSL_CTX_use_certificate_file(ssl_ctx, cert_file,
 					 SSL_FILETYPE_PEM) != 1) {
@@ -341,6 +440,23 @@ UnixSSLStream::~UnixSSLStream()
 		SSL_free(ssl);
 }
 
+int UnixSSLStream::init_ssl(SSL_CTX *ctx)
+{
+	if ((ssl = SSL_new(ctx)) == NULL)
+		return US_DIE("SSL_new failed");
+
+	if (SSL_set_fd(ssl, get_fd()) != 1)
+		return US_DIE("SSL_set_fd failed");
+
+	/*
+	 * Records are coalesced on stack in send(), so a blocked record
+	 * is retried from another address.
+	 */
+	SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	write_pending = 0;
+	return 0;
+}
+
 int UnixSSLStream::connect(const ConnectOptions &opts_arg)
 {
 	if (ssl != nullptr) {
@@ -367,11 +483,8 @@ int UnixSSLStream::connect(const ConnectOptions &opts_arg)
 		return US_DIE("SSL_context create failed",
 			      ssl_context.get_last_error());
 
-	if ((ssl = SSL_new(ssl_context)) == NULL)
-		return US_DIE("SSL_new failed");
-
-	if (SSL_set_fd(ssl, get_fd()) != 1)
-		return US_DIE("SSL_set_fd failed");
+	if (init_ssl(ssl_context) != 0)
+		return -1;
 
 	SSL_set_connect_state(ssl);
 
@@ -382,32 +495,53 @@ int UnixSSLStream::connect(const ConnectOptions &opts_arg)
 	return 0;
 }
 
-ssize_t UnixSSLStream::send(struct iovec *iov, size_t iov_count)
+int UnixSSLStream::accept(int fd, SSL_CTX *ctx)
 {
-	if (opts.transport == STREAM_PLAIN)
-		return UnixPlainStream::send(iov, iov_count);
-	assert(opts.transport == STREAM_SSL);
-
-	if (!(has_status(SS_ESTABLISHED))) {
-		if (has_status(SS_DEAD))
-			return US_DIE("Send to dead stream");
-		if (check_pending() != 0)
-			return -1;
-		if (iov_count == 0)
-			return 0;
+	if (ssl != nullptr) {
+		SSL_free(ssl);
+		ssl = nullptr;
 	}
 
-	remove_status(SS_NEED_EVENT_FOR_WRITE);
+	set_fd(fd);
+	opts.transport = STREAM_SSL;
+	if (init_ssl(ctx) != 0)
+		return -1;
+	/* Server hello is sent once client hello is read by recv(). */
+	SSL_set_accept_state(ssl);
+	return 0;
+}
+
+bool UnixSSLStream::is_ktls_send() const
+{
+#ifdef BIO_get_ktls_send
+	return ssl != nullptr && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+	return false;
+#endif
+}
+
+bool UnixSSLStream::has_pending() const
+{
+	return ssl != nullptr && SSL_pending(ssl) > 0;
+}
+
+int UnixSSLStream::write_record(const char *data, size_t size)
+{
 	size_t sent;
-	int ret = SSL_write_ex(ssl, iov->iov_base, iov->iov_len, &sent);
-	if (ret == 1)
-		return sent;
+	int ret = SSL_write_ex(ssl, data, size, &sent);
+	if (ret == 1) {
+		assert(sent == size);
+		write_pending = 0;
+		return 1;
+	}
 
 	int err = SSL_get_error(ssl, ret);
 	switch (err) {
 	case SSL_ERROR_WANT_READ:
+		write_pending = size;
 		return set_status(SS_NEED_READ_EVENT_FOR_WRITE);
 	case SSL_ERROR_WANT_WRITE:
+		write_pending = size;
 		return set_status(SS_NEED_WRITE_EVENT_FOR_WRITE);
 	case SSL_ERROR_SSL:
 		return US_DIE("SSL send failed");
@@ -426,30 +560,78 @@ ssize_t UnixSSLStream::send(struct iovec *iov, size_t iov_count)
 	}
 }
 
-ssize_t UnixSSLStream::recv(struct iovec *iov, size_t iov_count)
+ssize_t UnixSSLStream::send(struct iovec *iov, size_t iov_count)
 {
 	if (opts.transport == STREAM_PLAIN)
-		return UnixPlainStream::recv(iov, iov_count);
+		return UnixPlainStream::send(iov, iov_count);
 	assert(opts.transport == STREAM_SSL);
 
 	if (!(has_status(SS_ESTABLISHED))) {
 		if (has_status(SS_DEAD))
-			return US_DIE("Recv from dead stream");
-		else
-			return US_DIE("Recv from pending stream");
+			return US_DIE("Send to dead stream");
+		if (check_pending() != 0)
+			return -1;
+		if (iov_count == 0)
+			return 0;
 	}
 
-	remove_status(SS_NEED_EVENT_FOR_READ);
-	errno = 0;
-	size_t rcvd;
-	int ret = SSL_read_ex(ssl, iov->iov_base, iov->iov_len, &rcvd);
-	if (ret == 1)
-		return rcvd;
+	remove_status(SS_NEED_EVENT_FOR_WRITE);
+	/* Blocked record must be finished by OpenSSL itself. */
+	if (write_pending == 0 && is_ktls_send())
+		return UnixPlainStream::send(iov, iov_count);
+
+	/*
+	 * Buffer blocks are smaller than a record: sending them one by one
+	 * would cost a record (i.e. header, MAC and a cipher call) each.
+	 */
+	char record[TLS_RECORD_MAX];
+	size_t record_size = 0;
+	size_t sent = 0;
+	int rc = 1;
+	for (size_t i = 0; i < iov_count && rc == 1; ++i) {
+		const char *data = (const char *) iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0 && rc == 1) {
+			if (record_size == 0 && left >= TLS_RECORD_MAX) {
+				/* Full record is encrypted right from iovec. */
+				rc = write_record(data, TLS_RECORD_MAX);
+				if (rc == 1) {
+					data += TLS_RECORD_MAX;
+					left -= TLS_RECORD_MAX;
+					sent += TLS_RECORD_MAX;
+				}
+				continue;
+			}
+			size_t size = std::min(left, TLS_RECORD_MAX - record_size);
+			memcpy(record + record_size, data, size);
+			record_size += size;
+			data += size;
+			left -= size;
+			if (record_size < TLS_RECORD_MAX)
+				continue;
+			rc = write_record(record, record_size);
+			if (rc == 1)
+				sent += record_size;
+			record_size = 0;
+		}
+	}
+	if (rc == 1 && record_size > 0) {
+		rc = write_record(record, record_size);
+		if (rc == 1)
+			sent += record_size;
+	}
+	/* Records written before the error are lost anyway. */
+	if (rc < 0)
+		return -1;
+	return sent;
+}
 
+int UnixSSLStream::read_failed(int ret)
+{
 	int err = SSL_get_error(ssl, ret);
 	switch (err) {
 	case SSL_ERROR_ZERO_RETURN:
-		return 0;
+		return US_DIE("Peer shutdown");
 	case SSL_ERROR_WANT_READ:
 		return set_status(SS_NEED_READ_EVENT_FOR_READ);
 	case SSL_ERROR_WANT_WRITE:
@@ -462,10 +644,47 @@ ssize_t UnixSSLStream::recv(struct iovec *iov, size_t iov_count)
 			/*
 			 * The remote end closed the socket for writing.
 			 * The OpenSSL library treats this situation as
-			 * a system error with errno = 0. We ignore it.
+			 * a system error with errno = 0.
 			 */
-			return 0;
+			return US_DIE("Peer shutdown");
+		}
+		return US_DIE("Recv failed", strerror(errno));
+	}
+}
+
+ssize_t UnixSSLStream::recv(struct iovec *iov, size_t iov_count)
+{
+	if (opts.transport == STREAM_PLAIN)
+		return UnixPlainStream::recv(iov, iov_count);
+	assert(opts.transport == STREAM_SSL);
+
+	if (!(has_status(SS_ESTABLISHED))) {
+		if (has_status(SS_DEAD))
+			return US_DIE("Recv from dead stream");
+		else
+			return US_DIE("Recv from pending stream");
+	}
+
+	remove_status(SS_NEED_EVENT_FOR_READ);
+	/* SSL_read_ex() returns no more than one record at once. */
+	size_t total = 0;
+	for (size_t i = 0; i < iov_count; ++i) {
+		char *data = (char *) iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while (left > 0) {
+			errno = 0;
+			size_t rcvd;
+			int ret = SSL_read_ex(ssl, data, left, &rcvd);
+			if (ret != 1) {
+				/* The error is reported by the next call. */
+				if (total > 0)
+					return total;
+				return read_failed(ret);
+			}
+			data += rcvd;
+			left -= rcvd;
+			total += rcvd;
 		}
-		return US_DIE("Send failed", strerror(errno));
 	}
+	return total;
 }
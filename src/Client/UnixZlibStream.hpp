@@ -0,0 +1,367 @@
+/*
+ Copyright 2010-2022 Tarantool AUTHORS: please see AUTHORS file.
+
+ Redistribution and use in source and binary forms, with or
+ without modification, are permitted provided that the following
+ conditions are met:
+
+ 1. Redistributions of source code must retain the above
+    copyright notice, this list of conditions and the
+    following disclaimer.
+
+ 2. Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following
+    disclaimer in the documentation and/or other materials
+    provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY AUTHORS ``AS IS'' AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ AUTHORS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ SUCH DAMAGE.
+*/
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "UnixPlainStream.hpp"
+#ifdef TNTCXX_ENABLE_SSL
+#include "UnixSSLStream.hpp"
+#endif
+
+/**
+ * Unix stream compressing traffic with zlib on top of BASE stream
+ * (UnixPlainStream or UnixSSLStream). Compression is enabled by
+ * ConnectOptions::compress_level on connect() or by compress() on
+ * accepted socket, both sides must enable it. Otherwise it is BASE.
+ *
+ * The stream is one deflate stream per direction, so the dictionary
+ * is shared by all messages. Data passed to send() is only compressed,
+ * it is written by flush() completing the batch with a sync flush: the
+ * peer can decompress it right away. Thus all messages sent between two
+ * flushes make one batch (ProxyEpollNetProvider flushes once per loop
+ * iteration, so batches grow with load). Large output is written by
+ * send() as well, send() rejects data while ZLIB_BACKLOG bytes can't
+ * be written.
+ */
+template<class BASE>
+class UnixZlibStream : public BASE {
+public:
+	UnixZlibStream() noexcept = default;
+	~UnixZlibStream() noexcept = default;
+	UnixZlibStream(const UnixZlibStream&) = delete;
+	UnixZlibStream &operator=(const UnixZlibStream&) = delete;
+	UnixZlibStream(UnixZlibStream &&a) noexcept = default;
+	UnixZlibStream &operator=(UnixZlibStream &&a) noexcept = default;
+
+	/**
+	 * Connect to address. Return 0 on success, -1 on error.
+	 * Pending (inprogress) connection has a successfull result.
+	 */
+	int connect(const ConnectOptions &opts);
+	/** Close the socket and drop compression state. */
+	void close();
+	/**
+	 * Compress the established stream (e.g. accepted socket) with
+	 * @a level. Return 0 on success, -1 on error (dead stream).
+	 */
+	int compress(int level);
+	/**
+	 * Send data to connection. Data is buffered till flush().
+	 * Return positive number - number of bytes was sent.
+	 * Return 0 if nothing was sent but there's no error.
+	 * Return -1 on error.
+	 * One must check the stream status to understand what happens.
+	 */
+	ssize_t send(struct iovec *iov, size_t iov_count);
+	/**
+	 * Write data buffered by send(). Return 1 if all is written, 0 if
+	 * the socket is blocked (flush() must be called again once it is
+	 * writable), -1 on error.
+	 */
+	int flush();
+	/** True if send() buffered data which is not written yet. */
+	bool has_unflushed() const;
+	/**
+	 * Receive data to connection.
+	 * Return positive number - number of bytes was received.
+	 * Return 0 if nothing was received but there's no error.
+	 * Return -1 on error.
+	 * One must check the stream status to understand what happens.
+	 */
+	ssize_t recv(struct iovec *iov, size_t iov_count);
+	/**
+	 * True if received data is left in zlib (or OpenSSL) buffers:
+	 * the socket won't report it as readable.
+	 */
+	bool has_pending() const;
+	/** True if traffic is compressed. */
+	bool is_compressed() const { return zlib != nullptr; }
+	/** Bytes passed to send() and put to the socket after compression. */
+	size_t raw_sent() const { return zlib ? zlib->raw_sent : 0; }
+	size_t wire_sent() const { return zlib ? zlib->wire_sent : 0; }
+	/** Bytes taken from the socket and returned by recv(). */
+	size_t wire_received() const { return zlib ? zlib->wire_received : 0; }
+	size_t raw_received() const { return zlib ? zlib->raw_received : 0; }
+
+	/** Compressed data written by send() without flush(). */
+	static constexpr size_t ZLIB_CHUNK = 65536;
+	/** Max compressed data waiting for the socket. */
+	static constexpr size_t ZLIB_BACKLOG = 4 * ZLIB_CHUNK;
+	/** Size of buffer for compressed data read from the socket. */
+	static constexpr size_t ZLIB_READ = 16384;
+
+protected:
+	using BASE::die;
+
+private:
+	struct State {
+		State() = default;
+		~State();
+		State(const State&) = delete;
+		State &operator=(const State&) = delete;
+
+		z_stream deflater{};
+		z_stream inflater{};
+		bool deflater_ready = false;
+		bool inflater_ready = false;
+		/** Compressed data not written to the socket yet. */
+		std::vector<char> out;
+		size_t out_begin = 0;
+		size_t out_end = 0;
+		/** Deflater holds data which is not flushed. */
+		bool unflushed = false;
+		/** Last inflate() filled the output: more can be left. */
+		bool inflate_full = false;
+		char in[ZLIB_READ];
+		size_t raw_sent = 0;
+		size_t wire_sent = 0;
+		size_t wire_received = 0;
+		size_t raw_received = 0;
+	};
+
+	/** Feed @a size bytes of @a data to deflater with @a flush. */
+	void deflate_data(const char *data, size_t size, int flush);
+	/** Write compressed data. Return 1, 0 or -1 as flush(). */
+	int flush_output();
+
+	/* State is pinned: zlib keeps a pointer to its z_stream. */
+	std::unique_ptr<State> zlib;
+};
+
+/** Check if stream is UnixZlibStream. */
+template<class T>
+struct is_zlib_stream : std::false_type {};
+
+template<class BASE>
+struct is_zlib_stream<UnixZlibStream<BASE>> : std::true_type {};
+
+template<class T>
+constexpr bool is_zlib_stream_v = is_zlib_stream<T>::value;
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+template<class BASE>
+UnixZlibStream<BASE>::State::~State()
+{
+	if (deflater_ready)
+		deflateEnd(&deflater);
+	if (inflater_ready)
+		inflateEnd(&inflater);
+}
+
+template<class BASE>
+int
+UnixZlibStream<BASE>::connect(const ConnectOptions &opts_arg)
+{
+	zlib.reset();
+	if (BASE::connect(opts_arg) != 0)
+		return -1;
+	if (opts_arg.compress_level == 0)
+		return 0;
+	return compress(opts_arg.compress_level);
+}
+
+template<class BASE>
+void
+UnixZlibStream<BASE>::close()
+{
+	zlib.reset();
+	BASE::close();
+}
+
+template<class BASE>
+int
+UnixZlibStream<BASE>::compress(int level)
+{
+	zlib = std::make_unique<State>();
+	if (deflateInit(&zlib->deflater, level) != Z_OK)
+		return US_DIE("deflateInit failed");
+	zlib->deflater_ready = true;
+	if (inflateInit(&zlib->inflater) != Z_OK)
+		return US_DIE("inflateInit failed");
+	zlib->inflater_ready = true;
+	this->opts.compress_level = level;
+	return 0;
+}
+
+template<class BASE>
+bool
+UnixZlibStream<BASE>::has_pending() const
+{
+	if (zlib != nullptr &&
+	    (zlib->inflater.avail_in > 0 || zlib->inflate_full))
+		return true;
+#ifdef TNTCXX_ENABLE_SSL
+	if constexpr (std::is_base_of_v<UnixSSLStream, BASE>)
+		return BASE::has_pending();
+#endif
+	return false;
+}
+
+template<class BASE>
+void
+UnixZlibStream<BASE>::deflate_data(const char *data, size_t size, int flush)
+{
+	z_stream &z = zlib->deflater;
+	z.next_in = (Bytef *) data;
+	z.avail_in = size;
+	do {
+		/* Enough for a chunk of incompressible data at once. */
+		if (zlib->out.size() - zlib->out_end < ZLIB_CHUNK / 4)
+			zlib->out.resize(zlib->out_end + ZLIB_CHUNK);
+		z.next_out = (Bytef *) zlib->out.data() + zlib->out_end;
+		z.avail_out = zlib->out.size() - zlib->out_end;
+		int rc = ::deflate(&z, flush);
+		/* Nothing else fails with valid arguments. */
+		assert(rc == Z_OK || rc == Z_BUF_ERROR);
+		(void) rc;
+		zlib->out_end = zlib->out.size() - z.avail_out;
+	} while (z.avail_in > 0 || z.avail_out == 0);
+	zlib->raw_sent += size;
+}
+
+template<class BASE>
+int
+UnixZlibStream<BASE>::flush_output()
+{
+	while (zlib->out_begin < zlib->out_end) {
+		struct iovec iov = {zlib->out.data() + zlib->out_begin,
+				    zlib->out_end - zlib->out_begin};
+		ssize_t sent = BASE::send(&iov, 1);
+		if (sent < 0)
+			return -1;
+		if (sent == 0)
+			return 0;
+		zlib->out_begin += sent;
+		zlib->wire_sent += sent;
+	}
+	zlib->out_begin = zlib->out_end = 0;
+	return 1;
+}
+
+template<class BASE>
+ssize_t
+UnixZlibStream<BASE>::send(struct iovec *iov, size_t iov_count)
+{
+	if (zlib == nullptr)
+		return BASE::send(iov, iov_count);
+
+	/* The peer doesn't keep up: don't buffer more. */
+	if (zlib->out_end - zlib->out_begin >= ZLIB_BACKLOG) {
+		int rc = flush_output();
+		if (rc <= 0)
+			return rc;
+	}
+	size_t sent = 0;
+	for (size_t i = 0; i < iov_count; ++i) {
+		if (iov[i].iov_len == 0)
+			continue;
+		deflate_data((const char *) iov[i].iov_base, iov[i].iov_len,
+			     Z_NO_FLUSH);
+		sent += iov[i].iov_len;
+	}
+	if (sent > 0)
+		zlib->unflushed = true;
+	/* Blocked socket is reported by the status. */
+	if (zlib->out_end - zlib->out_begin >= ZLIB_CHUNK &&
+	    flush_output() < 0)
+		return -1;
+	return sent;
+}
+
+template<class BASE>
+int
+UnixZlibStream<BASE>::flush()
+{
+	if (zlib == nullptr)
+		return 1;
+	if (zlib->unflushed) {
+		deflate_data(nullptr, 0, Z_SYNC_FLUSH);
+		zlib->unflushed = false;
+	}
+	return flush_output();
+}
+
+template<class BASE>
+bool
+UnixZlibStream<BASE>::has_unflushed() const
+{
+	return zlib != nullptr &&
+	       (zlib->unflushed || zlib->out_begin < zlib->out_end);
+}
+
+template<class BASE>
+ssize_t
+UnixZlibStream<BASE>::recv(struct iovec *iov, size_t iov_count)
+{
+	if (zlib == nullptr)
+		return BASE::recv(iov, iov_count);
+
+	z_stream &z = zlib->inflater;
+	size_t total = 0;
+	for (size_t i = 0; i < iov_count; ++i) {
+		z.next_out = (Bytef *) iov[i].iov_base;
+		z.avail_out = iov[i].iov_len;
+		while (z.avail_out > 0) {
+			if (z.avail_in == 0 && !zlib->inflate_full) {
+				struct iovec in = {zlib->in, sizeof(zlib->in)};
+				ssize_t rcvd = BASE::recv(&in, 1);
+				/* The error is reported by the next call. */
+				if (rcvd <= 0)
+					return total > 0 ? (ssize_t) total : rcvd;
+				zlib->wire_received += rcvd;
+				z.next_in = (Bytef *) zlib->in;
+				z.avail_in = rcvd;
+			}
+			size_t before = z.avail_out;
+			int rc = ::inflate(&z, Z_SYNC_FLUSH);
+			size_t produced = before - z.avail_out;
+			total += produced;
+			zlib->raw_received += produced;
+			zlib->inflate_full = z.avail_out == 0;
+			if (rc == Z_OK ||
+			    (rc == Z_BUF_ERROR && z.avail_in == 0))
+				continue;
+			/* The peer never finishes the stream. */
+			return US_DIE("Corrupted compressed stream",
+				      z.msg != nullptr ? z.msg : "");
+		}
+	}
+	return total;
+}
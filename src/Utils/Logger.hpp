@@ -30,10 +30,24 @@
  * SUCH DAMAGE.
  */
 
-#include <time.h>
-
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 enum LogLevel {
 	DEBUG = 0,
@@ -42,6 +56,15 @@ enum LogLevel {
 	ERROR = 3
 };
 
+/**
+ * Messages below this level are not compiled in at all, so that their
+ * arguments are not even evaluated. Define it as INFO, WARNING or ERROR
+ * to strip the hot path of debug logging.
+ */
+#ifndef TNTCXX_LOG_LEVEL
+#define TNTCXX_LOG_LEVEL DEBUG
+#endif
+
 static inline const char*
 logLevelToStr(LogLevel lvl)
 {
@@ -61,9 +84,36 @@ inline std::ostream& operator<<(std::ostream& strm, LogLevel lvl)
 	return strm << logLevelToStr(lvl);
 }
 
+/**
+ * Single-producer single-consumer ring of log records of one thread.
+ * A record is pushed whole or not at all.
+ */
+class LogRing {
+public:
+	static constexpr size_t SIZE = 64 * 1024;
+
+	bool push(const char *data, size_t size);
+	/** Append all records to @a out, return false if there were none. */
+	bool pop(std::string &out);
+	bool empty() const { return m_Head.load() == m_Tail.load(); }
+
+	/** Number of records which didn't fit into the ring. */
+	std::atomic<size_t> dropped{0};
+	/** A thread is writing to the ring. */
+	std::atomic<bool> owned{false};
+
+private:
+	static_assert((SIZE & (SIZE - 1)) == 0, "Size must be a power of 2");
+	char m_Data[SIZE];
+	/* Positions grow forever and are wrapped on access. */
+	alignas(64) std::atomic<size_t> m_Head{0};
+	alignas(64) std::atomic<size_t> m_Tail{0};
+};
+
 class Logger {
 public:
 	Logger(LogLevel lvl) : m_LogLvl(lvl) {};
+	~Logger() { stopAsync(); }
 
 	template <class... ARGS>
 	void log(std::ostream& strm, LogLevel log_lvl,
@@ -71,16 +121,15 @@ public:
 	{
 		if (!isLogPossible(log_lvl))
 			return;
-		time_t rawTime;
-		time(&rawTime);
-		struct tm *timeInfo = localtime(&rawTime);
-		char timeString[10];
-		strftime(timeString, sizeof(timeString), "%H:%M:%S", timeInfo);
-		// The line below is commented for compatibility with previous
-		// version. I'm not sure it was bug or feature, but the time,
-		// filename and line was not printed.
+		// The time, filename and line are not printed for
+		// compatibility with previous version.
 		(void)file; (void)line;
-		//strm << timeString << " " << file << ':' << line << ' ';
+		if (m_IsAsync.load(std::memory_order_relaxed) &&
+		    (&strm == &std::cout || &strm == &std::cerr)) {
+			push(&strm == &std::cerr, log_lvl,
+			     std::forward<ARGS>(args)...);
+			return;
+		}
 		strm << log_lvl << ": ";
 		(strm << ... << std::forward<ARGS>(args)) << '\n';
 	}
@@ -88,14 +137,356 @@ public:
 	{
 		m_LogLvl = lvl;
 	}
+	/**
+	 * Write messages to std::cout and std::cerr by a background thread.
+	 * Calling threads only put arguments to their rings, messages which
+	 * don't fit are dropped and counted. Must be called after fork(),
+	 * since the thread is not inherited by the child.
+	 */
+	void startAsync();
+	/** Write all pending messages and return to synchronous logging. */
+	void stopAsync();
+	/** Wait until messages logged before the call are written. */
+	void flush();
+
+	/** Wake up the writer at least this often to collect messages. */
+	static constexpr std::chrono::milliseconds WRITE_INTERVAL{10};
+
 private:
+	/** Tags of arguments in a record. */
+	enum ArgType : char {
+		ARG_INT = 'i',
+		ARG_UINT = 'u',
+		ARG_DOUBLE = 'd',
+		ARG_CHAR = 'c',
+		ARG_STR = 's'
+	};
+
 	bool isLogPossible(LogLevel lvl) const
 	{
 		return lvl >= m_LogLvl;
 	};
+	template <class T>
+	static void encodeRaw(std::string &rec, const T &value);
+	static void encodeStr(std::string &rec, std::string_view str);
+	/**
+	 * Numbers and strings are copied to the record as is, they are
+	 * formatted by the writer. Other types are formatted right away.
+	 */
+	template <class T>
+	static void encodeArg(std::string &rec, T &&arg);
+	/** Format the records of @a data and append them to outputs. */
+	static void format(const std::string &data, std::string &out,
+			   std::string &err);
+	template <class... ARGS>
+	void push(bool is_err, LogLevel log_lvl, ARGS&& ...args);
+	LogRing &threadRing();
+	/** Move messages of all rings to outputs, false if there were none. */
+	bool collect();
+	void writerLoop();
+
 	LogLevel m_LogLvl;
+	std::atomic<bool> m_IsAsync{false};
+	std::mutex m_Mutex;
+	std::condition_variable m_Cond;
+	bool m_Stop = false;
+	/* Number of finished passes of the writer over the rings. */
+	uint64_t m_Passes = 0;
+	bool m_InPass = false;
+	std::vector<std::unique_ptr<LogRing>> m_Rings;
+	std::thread m_Writer;
+	/* Used by the writer only. */
+	std::string m_Records;
+	std::string m_Out;
+	std::string m_Err;
 };
 
+/**
+ * Releases the ring of the thread once it exits, so that the ring can be
+ * used by another thread.
+ */
+struct LogRingOwner {
+	LogRing *ring = nullptr;
+	~LogRingOwner()
+	{
+		if (ring != nullptr)
+			ring->owned.store(false, std::memory_order_release);
+	}
+};
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// Implementation  //////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+inline bool
+LogRing::push(const char *data, size_t size)
+{
+	size_t head = m_Head.load(std::memory_order_relaxed);
+	size_t tail = m_Tail.load(std::memory_order_acquire);
+	if (SIZE - (head - tail) < size)
+		return false;
+	size_t pos = head & (SIZE - 1);
+	size_t first = std::min(size, SIZE - pos);
+	memcpy(m_Data + pos, data, first);
+	memcpy(m_Data, data + first, size - first);
+	m_Head.store(head + size, std::memory_order_release);
+	return true;
+}
+
+inline bool
+LogRing::pop(std::string &out)
+{
+	size_t tail = m_Tail.load(std::memory_order_relaxed);
+	size_t head = m_Head.load(std::memory_order_acquire);
+	if (head == tail)
+		return false;
+	size_t size = head - tail;
+	size_t pos = tail & (SIZE - 1);
+	size_t first = std::min(size, SIZE - pos);
+	out.append(m_Data + pos, first);
+	out.append(m_Data, size - first);
+	m_Tail.store(head, std::memory_order_release);
+	return true;
+}
+
+template <class T>
+void
+Logger::encodeRaw(std::string &rec, const T &value)
+{
+	rec.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline void
+Logger::encodeStr(std::string &rec, std::string_view str)
+{
+	/* Long strings are cut, so that the record fits into a ring. */
+	uint32_t len = std::min<size_t>(str.size(), LogRing::SIZE / 4);
+	rec.push_back(ARG_STR);
+	encodeRaw(rec, len);
+	rec.append(str.data(), len);
+}
+
+template <class T>
+void
+Logger::encodeArg(std::string &rec, T &&arg)
+{
+	using U = std::decay_t<T>;
+	/* Arrays are not decayed: they are never null. */
+	using P = std::remove_cv_t<std::remove_reference_t<T>>;
+	if constexpr (std::is_same_v<U, char> || std::is_same_v<U, signed char> ||
+		      std::is_same_v<U, unsigned char>) {
+		rec.push_back(ARG_CHAR);
+		rec.push_back(static_cast<char>(arg));
+	} else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+		rec.push_back(ARG_INT);
+		encodeRaw(rec, static_cast<int64_t>(arg));
+	} else if constexpr (std::is_integral_v<U>) {
+		rec.push_back(ARG_UINT);
+		encodeRaw(rec, static_cast<uint64_t>(arg));
+	} else if constexpr (std::is_floating_point_v<U>) {
+		rec.push_back(ARG_DOUBLE);
+		encodeRaw(rec, static_cast<double>(arg));
+	} else if constexpr (std::is_same_v<P, const char *> ||
+			     std::is_same_v<P, char *>) {
+		encodeStr(rec, arg != nullptr ? std::string_view(arg) : "");
+	} else if constexpr (std::is_convertible_v<const U &, std::string_view>) {
+		encodeStr(rec, std::string_view(arg));
+	} else {
+		std::ostringstream strm;
+		strm << std::forward<T>(arg);
+		encodeStr(rec, strm.str());
+	}
+}
+
+template <class... ARGS>
+void
+Logger::push(bool is_err, LogLevel log_lvl, ARGS&& ...args)
+{
+	/* Record: size, output, level and tagged arguments. */
+	thread_local std::string rec;
+	rec.assign(sizeof(uint32_t), '\0');
+	rec.push_back(is_err);
+	rec.push_back(static_cast<char>(log_lvl));
+	(encodeArg(rec, std::forward<ARGS>(args)), ...);
+	uint32_t size = rec.size();
+	memcpy(rec.data(), &size, sizeof(size));
+	LogRing &ring = threadRing();
+	if (!ring.push(rec.data(), rec.size()))
+		ring.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline LogRing &
+Logger::threadRing()
+{
+	thread_local LogRingOwner owner;
+	if (owner.ring != nullptr)
+		return *owner.ring;
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	/* Left rings are reused once the writer empties them. */
+	for (auto &ring : m_Rings) {
+		if (!ring->owned.load(std::memory_order_acquire) &&
+		    ring->empty()) {
+			owner.ring = ring.get();
+			break;
+		}
+	}
+	if (owner.ring == nullptr) {
+		m_Rings.push_back(std::make_unique<LogRing>());
+		owner.ring = m_Rings.back().get();
+	}
+	owner.ring->owned.store(true, std::memory_order_relaxed);
+	return *owner.ring;
+}
+
+inline void
+Logger::format(const std::string &data, std::string &out, std::string &err)
+{
+	char num[32];
+	for (size_t pos = 0; pos < data.size();) {
+		uint32_t size;
+		memcpy(&size, data.data() + pos, sizeof(size));
+		const char *p = data.data() + pos + sizeof(size);
+		const char *end = data.data() + pos + size;
+		pos += size;
+		std::string &strm = *p++ ? err : out;
+		strm += logLevelToStr(static_cast<LogLevel>(*p++));
+		strm += ": ";
+		while (p < end) {
+			char type = *p++;
+			switch (type) {
+			case ARG_INT: {
+				int64_t value;
+				memcpy(&value, p, sizeof(value));
+				p += sizeof(value);
+				strm.append(num, std::to_chars(num, num + sizeof(num),
+							       value).ptr);
+				break;
+			}
+			case ARG_UINT: {
+				uint64_t value;
+				memcpy(&value, p, sizeof(value));
+				p += sizeof(value);
+				strm.append(num, std::to_chars(num, num + sizeof(num),
+							       value).ptr);
+				break;
+			}
+			case ARG_DOUBLE: {
+				/* As std::ostream does with default flags. */
+				double value;
+				memcpy(&value, p, sizeof(value));
+				p += sizeof(value);
+				int len = snprintf(num, sizeof(num), "%g", value);
+				strm.append(num, len);
+				break;
+			}
+			case ARG_CHAR:
+				strm += *p++;
+				break;
+			case ARG_STR: {
+				uint32_t len;
+				memcpy(&len, p, sizeof(len));
+				p += sizeof(len);
+				strm.append(p, len);
+				p += len;
+				break;
+			}
+			default:
+				assert(0 && "Unknown log argument");
+				p = end;
+			}
+		}
+		strm += '\n';
+	}
+}
+
+inline bool
+Logger::collect()
+{
+	m_Records.clear();
+	m_Out.clear();
+	m_Err.clear();
+	std::vector<LogRing *> rings;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		for (auto &ring : m_Rings)
+			rings.push_back(ring.get());
+	}
+	for (LogRing *ring : rings) {
+		ring->pop(m_Records);
+		size_t dropped = ring->dropped.exchange(0);
+		if (dropped != 0) {
+			m_Err += logLevelToStr(WARNING);
+			m_Err += ": " + std::to_string(dropped) +
+				 " log messages are dropped\n";
+		}
+	}
+	format(m_Records, m_Out, m_Err);
+	if (!m_Out.empty())
+		std::cout.write(m_Out.data(), m_Out.size()).flush();
+	if (!m_Err.empty())
+		std::cerr.write(m_Err.data(), m_Err.size()).flush();
+	return !m_Out.empty() || !m_Err.empty();
+}
+
+inline void
+Logger::writerLoop()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	while (true) {
+		bool stop = m_Stop;
+		m_InPass = true;
+		lock.unlock();
+		/* Records pushed before the stop are collected. */
+		while (collect()) {}
+		lock.lock();
+		m_InPass = false;
+		m_Passes++;
+		m_Cond.notify_all();
+		if (stop)
+			return;
+		m_Cond.wait_for(lock, WRITE_INTERVAL);
+	}
+}
+
+inline void
+Logger::startAsync()
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if (m_IsAsync.load())
+		return;
+	m_Stop = false;
+	m_Writer = std::thread(&Logger::writerLoop, this);
+	m_IsAsync.store(true);
+}
+
+inline void
+Logger::stopAsync()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (!m_IsAsync.load())
+			return;
+		m_IsAsync.store(false);
+		m_Stop = true;
+		m_Cond.notify_all();
+	}
+	m_Writer.join();
+	/* Records of threads which haven't seen the stop yet. */
+	collect();
+}
+
+inline void
+Logger::flush()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	if (!m_IsAsync.load())
+		return;
+	/* The pass in progress may have missed the latest records. */
+	uint64_t target = m_Passes + (m_InPass ? 2 : 1);
+	m_Cond.notify_all();
+	m_Cond.wait(lock, [&] { return m_Passes >= target || m_Stop; });
+}
+
 #ifndef NDEBUG
 inline Logger gLogger(DEBUG);
 #else
@@ -110,7 +501,12 @@ log(LogLevel level, const char *file, int line, ARGS&& ...args)
 		    level, file, line, std::forward<ARGS>(args)...);
 }
 
-#define LOG_DEBUG(...) log(DEBUG, __FILE__, __LINE__,  __VA_ARGS__)
-#define LOG_INFO(...) log(INFO, __FILE__, __LINE__,  __VA_ARGS__)
-#define LOG_WARNING(...) log(WARNING, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_ERROR(...) log(ERROR, __FILE__, __LINE__, __VA_ARGS__)
+#define LOG_AT(level, ...) do {						\
+	if constexpr ((level) >= (TNTCXX_LOG_LEVEL))			\
+		log(level, __FILE__, __LINE__, __VA_ARGS__);		\
+} while (0)
+
+#define LOG_DEBUG(...) LOG_AT(DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(INFO, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(WARNING, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(ERROR, __VA_ARGS__)
@@ -30,10 +30,12 @@
  * SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <vector>
 
 namespace tnt {
 
@@ -41,6 +43,7 @@ template <bool ENABLE_STATS>
 class MempoolStats {
 protected:
 	void statAddSlab() { ++m_SlabCount; }
+	void statDelSlab() { --m_SlabCount; }
 	void statAddBlock() { ++m_BlockCount; }
 	void statDelBlock() { --m_BlockCount; }
 public:
@@ -57,6 +60,7 @@ template <>
 class MempoolStats<false> {
 protected:
 	void statAddSlab() { }
+	void statDelSlab() { }
 	void statAddBlock() { }
 	void statDelBlock() { }
 public:
@@ -161,6 +165,74 @@ public:
 		Stats_t::statDelBlock();
 	}
 
+	/**
+	 * Return slabs all blocks of which are free to the system.
+	 * Takes time linear in number of free blocks, so it is meant to be
+	 * called when the owner is idle, not on the hot path.
+	 * Return the number of released slabs.
+	 */
+	size_t trim()
+	{
+		std::vector<Slab *> slabs;
+		for (Slab *s = m_SlabList; s != nullptr; s = s->next)
+			slabs.push_back(s);
+		if (slabs.empty())
+			return 0;
+		std::sort(slabs.begin(), slabs.end());
+		auto slabOf = [&slabs](const char *ptr) -> size_t {
+			auto it = std::upper_bound(slabs.begin(), slabs.end(),
+						   ptr, [](const char *p, Slab *s) {
+				return p < reinterpret_cast<const char *>(s);
+			});
+			return it - slabs.begin() - 1;
+		};
+
+		std::vector<size_t> free_count(slabs.size(), 0);
+		for (char *f = m_FreeList; f != nullptr; memcpy(&f, f, sizeof(f)))
+			free_count[slabOf(f)]++;
+		/* Not yet used tail of the last allocated slab is free too. */
+		if (m_SlabDataBeg != m_SlabDataEnd)
+			free_count[slabOf(m_SlabDataBeg)] +=
+				(m_SlabDataEnd - m_SlabDataBeg) / B;
+
+		size_t released = 0;
+		for (size_t i = 0; i < slabs.size(); i++) {
+			if (free_count[i] == M - 1)
+				released++;
+		}
+		if (released == 0)
+			return 0;
+
+		/* Unlink free blocks of released slabs keeping the order. */
+		char *list = nullptr;
+		char **tail = &list;
+		for (char *f = m_FreeList, *next; f != nullptr; f = next) {
+			memcpy(&next, f, sizeof(next));
+			if (free_count[slabOf(f)] == M - 1)
+				continue;
+			memcpy(tail, &f, sizeof(f));
+			tail = reinterpret_cast<char **>(f);
+		}
+		char *end = nullptr;
+		memcpy(tail, &end, sizeof(end));
+		m_FreeList = list;
+
+		if (free_count[slabOf(m_SlabList->data)] == M - 1)
+			m_SlabDataBeg = m_SlabDataEnd = nullptr;
+		Slab **link = &m_SlabList;
+		while (*link != nullptr) {
+			Slab *s = *link;
+			if (free_count[slabOf(s->data)] != M - 1) {
+				link = &s->next;
+				continue;
+			}
+			*link = s->next;
+			delete s;
+			Stats_t::statDelSlab();
+		}
+		return released;
+	}
+
 	/**
 	 * Debug selfcheck
 	 * Return 0 if there's no problems. Otherwise see the code below.
@@ -224,6 +296,7 @@ public:
 	explicit MempoolHolder(Base_t &instance) : m_Instance(&instance) {}
 	char *allocate() { return m_Instance->allocate(); }
 	void deallocate(char *ptr) noexcept { m_Instance->deallocate(ptr); }
+	size_t trim() { return m_Instance->trim(); }
 	int selfcheck() const { return m_Instance->selfcheck(); }
 
 	static constexpr size_t REAL_SIZE = Base_t::REAL_SIZE;
@@ -253,6 +326,7 @@ private:
 public:
 	static char *allocate() { return instance().allocate(); }
 	static void deallocate(char *ptr) noexcept { instance().deallocate(ptr); }
+	static size_t trim() { return instance().trim(); }
 	int selfcheck() const { return instance().selfcheck(); } 
 
 	static constexpr size_t REAL_SIZE = Base_t::REAL_SIZE;
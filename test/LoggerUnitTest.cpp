@@ -0,0 +1,173 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Debug messages are not compiled in. */
+#define TNTCXX_LOG_LEVEL INFO
+#include "../src/Utils/Logger.hpp"
+
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utils/Helpers.hpp"
+
+/** Capture std::cout and std::cerr while alive. */
+struct Captured {
+	Captured()
+	{
+		out_buf = std::cout.rdbuf(out.rdbuf());
+		err_buf = std::cerr.rdbuf(err.rdbuf());
+	}
+	~Captured()
+	{
+		std::cout.rdbuf(out_buf);
+		std::cerr.rdbuf(err_buf);
+	}
+	std::ostringstream out;
+	std::ostringstream err;
+	std::streambuf *out_buf;
+	std::streambuf *err_buf;
+};
+
+/** Log a message with arguments of all kinds. */
+void
+logAll()
+{
+	std::string str = "str";
+	std::string_view view = "view";
+	char buf[] = "buf";
+	LOG_INFO("int ", -42, " uint ", 42u, " big ", UINT64_MAX);
+	LOG_WARNING("double ", 3.5, ' ', 1e20, " char ", 'c', " bool ", true);
+	LOG_ERROR(str, ' ', view, ' ', buf, ' ', WARNING, ' ', (short) -1);
+}
+
+void
+test_sync()
+{
+	TEST_INIT(0);
+	Captured captured;
+	logAll();
+	fail_unless(captured.out.str() ==
+		    "INFO : int -42 uint 42 big 18446744073709551615\n"
+		    "WARN : double 3.5 1e+20 char c bool 1\n");
+	fail_unless(captured.err.str() == "ERROR: str view buf WARN  -1\n");
+}
+
+void
+test_async()
+{
+	TEST_INIT(0);
+	Captured captured;
+	gLogger.startAsync();
+	logAll();
+	gLogger.flush();
+	fail_unless(captured.out.str() ==
+		    "INFO : int -42 uint 42 big 18446744073709551615\n"
+		    "WARN : double 3.5 1e+20 char c bool 1\n");
+	fail_unless(captured.err.str() == "ERROR: str view buf WARN  -1\n");
+	/* Messages logged after the stop are written right away. */
+	gLogger.stopAsync();
+	LOG_INFO("sync");
+	fail_unless(captured.out.str().size() > 5 &&
+		    captured.out.str().substr(captured.out.str().size() - 12) ==
+		    "INFO : sync\n");
+}
+
+void
+test_compile_level()
+{
+	TEST_INIT(0);
+	Captured captured;
+	int evaluated = 0;
+	LOG_DEBUG("not compiled in ", ++evaluated);
+	fail_unless(evaluated == 0);
+	fail_unless(captured.out.str().empty());
+	gLogger.setLogLevel(WARNING);
+	LOG_INFO("filtered at runtime ", ++evaluated);
+	fail_unless(evaluated == 1);
+	fail_unless(captured.out.str().empty());
+	gLogger.setLogLevel(DEBUG);
+}
+
+void
+test_threads()
+{
+	TEST_INIT(0);
+	constexpr int NUM_THREADS = 4;
+	constexpr int NUM_MESSAGES = 1000;
+	Captured captured;
+	gLogger.startAsync();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < NUM_THREADS; ++t) {
+		threads.emplace_back([t] {
+			for (int i = 0; i < NUM_MESSAGES; ++i)
+				LOG_INFO(t, ' ', i);
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+	gLogger.flush();
+	/* Rings of the finished threads are reused. */
+	std::thread([] { LOG_INFO("reused"); }).join();
+	gLogger.stopAsync();
+	std::istringstream lines(captured.out.str());
+	std::vector<int> next(NUM_THREADS, 0);
+	std::string line;
+	int count = 0;
+	while (std::getline(lines, line)) {
+		if (line == "INFO : reused")
+			continue;
+		int t, i;
+		fail_unless(sscanf(line.c_str(), "INFO : %d %d", &t, &i) == 2);
+		fail_unless(t >= 0 && t < NUM_THREADS);
+		/* Messages of a thread keep their order unless dropped. */
+		fail_unless(i >= next[t]);
+		next[t] = i + 1;
+		count++;
+	}
+	size_t dropped = 0;
+	std::string err = captured.err.str();
+	for (size_t pos = 0; (pos = err.find("WARN : ", pos)) != std::string::npos;
+	     pos += 7)
+		dropped += std::stoul(err.substr(pos + 7));
+	fail_unless(count + dropped == NUM_THREADS * NUM_MESSAGES);
+	fail_unless(captured.out.str().find("INFO : reused\n") !=
+		    std::string::npos);
+}
+
+int main()
+{
+	test_sync();
+	test_async();
+	test_compile_level();
+	test_threads();
+}
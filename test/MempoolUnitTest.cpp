@@ -161,6 +161,62 @@ test_instance()
 	}
 }
 
+template<size_t S, size_t M>
+void
+test_trim()
+{
+	TEST_INIT(2, S, M);
+	using mp_t = tnt::MempoolInstance<S, M, true>;
+	constexpr size_t EXPECT_BLOCKS_IN_SLAB =
+		mp_t::SLAB_SIZE / mp_t::BLOCK_SIZE - 1;
+	mp_t mp;
+	Allocations<S, EXPECT_BLOCKS_IN_SLAB * 3> all;
+	fail_unless(mp.trim() == 0);
+
+	for (size_t i = 0; i < EXPECT_BLOCKS_IN_SLAB * 3; i++)
+		all.add(mp.allocate());
+	fail_unless(mp.statSlabCount() == 3);
+	fail_unless(mp.trim() == 0);
+
+	/* Free the whole second slab and a part of the first one. */
+	for (size_t i = 0; i < EXPECT_BLOCKS_IN_SLAB; i++) {
+		mp.deallocate(all[EXPECT_BLOCKS_IN_SLAB].ptr);
+		all.del(EXPECT_BLOCKS_IN_SLAB);
+	}
+	mp.deallocate(all[0].ptr);
+	all.del(0);
+	fail_unless(mp.trim() == 1);
+	fail_unless(mp.statSlabCount() == 2);
+	fail_unless(mp.statBlockCount() == EXPECT_BLOCKS_IN_SLAB * 2 - 1);
+	fail_unless(mp.selfcheck() == 0);
+	fail_unless(all.are_valid());
+
+	/* The only free block is reused, then a new slab is allocated. */
+	all.add(mp.allocate());
+	fail_unless(mp.statSlabCount() == 2);
+	all.add(mp.allocate());
+	fail_unless(mp.statSlabCount() == 3);
+	fail_unless(mp.selfcheck() == 0);
+	fail_unless(all.are_valid());
+
+	/* Free everything, including the partially used last slab. */
+	while (all.count > 0) {
+		mp.deallocate(all[0].ptr);
+		all.del(0);
+	}
+	fail_unless(mp.trim() == 3);
+	fail_unless(mp.statSlabCount() == 0);
+	fail_unless(mp.statBlockCount() == 0);
+	fail_unless(mp.selfcheck() == 0);
+
+	all.add(mp.allocate());
+	fail_unless(mp.statSlabCount() == 1);
+	fail_unless(mp.selfcheck() == 0);
+	fail_unless(all.are_valid());
+	mp.deallocate(all[0].ptr);
+	all.del(0);
+}
+
 template<size_t S, size_t M>
 void
 test_holder()
@@ -263,6 +319,11 @@ int main()
 	test_instance<65, 32>();
 	test_instance<80, 8>();
 
+	test_trim<8, 256>();
+	test_trim<14, 64>();
+	test_trim<64, 32>();
+	test_trim<80, 8>();
+
 	test_holder<16, 256>();
 
 	test_static<16, 256>();
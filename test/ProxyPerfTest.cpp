@@ -0,0 +1,354 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "Utils/Helpers.hpp"
+#include "Utils/ProxyHelpers.hpp"
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+
+/** Number of idle client connections held by the proxy. */
+static constexpr size_t NUM_CONN = 10000;
+/** Bound of memory held by the proxy for an idle connection. */
+static constexpr size_t MAX_CONN_FOOTPRINT = 2048;
+/** Requests pipelined by a batch client at once. */
+static constexpr size_t BATCH_SIZE = 50000;
+/** Round trips measured by an interactive client. */
+static constexpr size_t NUM_PINGS = 1000;
+/** Round trips measured while a batch client is served. */
+static constexpr size_t NUM_FAIR_PINGS = 100;
+
+/** Pipeline batches of PINGs to the proxy until killed. */
+pid_t
+launchBatchClient()
+{
+	pid_t ppid_before_fork = getpid();
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+	set_parent_death_signal(ppid_before_fork, "batch client");
+	int fd = connectProxy();
+	if (fd < 0)
+		exit(EXIT_FAILURE);
+	std::vector<char> batch;
+	for (size_t i = 0; i < BATCH_SIZE; ++i)
+		batch.insert(batch.end(), PING_REQ, PING_REQ + sizeof(PING_REQ));
+	std::vector<char> resp(1024 * 1024);
+	while (true) {
+		size_t sent = 0;
+		while (sent < batch.size()) {
+			ssize_t rc = send(fd, batch.data() + sent,
+					  batch.size() - sent, MSG_DONTWAIT);
+			if (rc > 0)
+				sent += rc;
+			/* Take responses, so that the proxy is not blocked. */
+			recv(fd, resp.data(), resp.size(), MSG_DONTWAIT);
+		}
+		recv(fd, resp.data(), resp.size(), MSG_DONTWAIT);
+	}
+}
+
+void
+printRSS(const char *stage, size_t rss, size_t base)
+{
+	std::cout << "+  " << stage << std::endl;
+	std::cout << "+          RSS, KB              " << rss / 1024 << std::endl;
+	std::cout << "+          PER CONNECTION, B    "
+		  << (rss - base) / NUM_CONN << std::endl;
+}
+
+void
+testIdleConnectionFootprint()
+{
+	TEST_INIT(0);
+	ProxyOptions proxy_opts;
+	proxy_opts.listen_backlog = NUM_CONN;
+	pid_t pid = launchProxy(proxy_opts);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+	size_t base = getRSS(pid);
+
+	std::vector<int> fds;
+	for (size_t i = 0; i < NUM_CONN; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		fail_unless(fd >= 0);
+		struct sockaddr_in addr{};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = inet_addr(localhost);
+		fail_unless(connect(fd, (struct sockaddr *) &addr,
+				    sizeof(addr)) == 0);
+		fds.push_back(fd);
+	}
+	usleep(SETTLE_USEC);
+	size_t connected = getRSS(pid);
+
+	/* Each connection materializes its buffers once. */
+	for (size_t i = 0; i < NUM_CONN; ++i)
+		fail_unless(ping(fds[i], i));
+	usleep(SETTLE_USEC);
+	size_t served = getRSS(pid);
+
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	std::cout << "+          " << NUM_CONN << " CONNECTIONS       " << std::endl;
+	printRSS("EMPTY", base, base);
+	printRSS("CONNECTED", connected, base);
+	printRSS("IDLE AFTER PING", served, base);
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	fail_unless(connected < base + MAX_CONN_FOOTPRINT * NUM_CONN);
+	fail_unless(served < base + MAX_CONN_FOOTPRINT * NUM_CONN);
+
+	for (int fd : fds)
+		close(fd);
+	stopProcess(pid);
+}
+
+/**
+ * Sorted round trips of interactive client while a batch client is
+ * served, both are routed to an instance.
+ */
+std::vector<double>
+measureRoundTrips(size_t fair_quantum)
+{
+	uint16_t backend_port = port + 1;
+	ProxyOptions proxy_opts;
+	proxy_opts.fair_quantum = fair_quantum;
+	/* The instance serves its clients in turns too. */
+	pid_t backend_pid = launchPipeline<Pipeline<PingStage>>(
+		proxy_opts, backend_port, {});
+	fail_unless(backend_pid > 0);
+	std::vector<ConnectOptions> instances = {{
+		.address = localhost,
+		.service = std::to_string(backend_port),
+		.is_tnt = false,
+	}};
+	pid_t pid = launchPipeline<Pipeline<ForwardStage>>(proxy_opts, port,
+							   instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+	pid_t batch_pid = launchBatchClient();
+	fail_unless(batch_pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	std::vector<double> rtt;
+	for (size_t i = 0; i < NUM_FAIR_PINGS; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		fail_unless(ping(fd, i));
+		std::chrono::duration<double, std::micro> spent =
+			std::chrono::steady_clock::now() - start;
+		rtt.push_back(spent.count());
+	}
+	std::sort(rtt.begin(), rtt.end());
+
+	close(fd);
+	stopProcess(batch_pid);
+	stopProcess(pid);
+	stopProcess(backend_pid);
+	return rtt;
+}
+
+/** Batch client doesn't make others wait for its whole batch. */
+void
+testFairScheduling()
+{
+	TEST_INIT(0);
+	constexpr size_t FAIR_QUANTUM = 64;
+	std::vector<double> unfair = measureRoundTrips(0);
+	std::vector<double> fair = measureRoundTrips(FAIR_QUANTUM);
+
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	for (auto *rtt : {&unfair, &fair}) {
+		std::cout << "+  FAIR QUANTUM " << (rtt == &fair ? FAIR_QUANTUM : 0)
+			  << std::endl;
+		std::cout << "+          P50 RTT, US          " << (*rtt)[NUM_FAIR_PINGS / 2] << std::endl;
+		std::cout << "+          P99 RTT, US          " << (*rtt)[NUM_FAIR_PINGS * 99 / 100] << std::endl;
+	}
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	fail_unless(fair[NUM_FAIR_PINGS / 2] * 4 < unfair[NUM_FAIR_PINGS / 2]);
+}
+
+/** Instance spending SLOW_CALL_USEC on each CALL, PINGs are instant. */
+struct SlowCallStage {
+	static constexpr unsigned SLOW_CALL_USEC = 2000;
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		if (message.header.code == Iproto::CALL)
+			usleep(SLOW_CALL_USEC);
+		int size = proxy.createMessage(message.header.sync, 0);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Round trip of PING while another client pipelines slow CALLs, with
+ * CALLs in a class limited to @a call_in_flight (zero disables QoS).
+ */
+void
+testQos(size_t call_in_flight)
+{
+	TEST_INIT(1, (int) call_in_flight);
+	constexpr uint8_t NUM_CALLS = 200;
+	uint16_t backend_port = port + 1;
+	pid_t backend_pid = launchPipeline<Pipeline<SlowCallStage>>(
+		ProxyOptions{}, backend_port, {});
+	fail_unless(backend_pid > 0);
+	std::vector<ConnectOptions> instances = {{
+		.address = localhost,
+		.service = std::to_string(backend_port),
+		.is_tnt = false,
+	}};
+	ProxyOptions proxy_opts;
+	if (call_in_flight != 0) {
+		proxy_opts.qos_in_flight = {0, call_in_flight};
+		proxy_opts.qos_function_class = {{"bulk", 1}};
+	}
+	pid_t pid = launchPipeline<Pipeline<ForwardStage>>(proxy_opts, port,
+							   instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	/* CALL bulk() with sync id. */
+	std::string reqs;
+	for (uint8_t id = 1; id <= NUM_CALLS; ++id) {
+		const char req[] = {'\xce', 0, 0, 0, 18,
+				    '\x82', 0x00, 0x0a, 0x01, '\xce', 0, 0, 0,
+				    (char) id,
+				    '\x82', 0x22, '\xa4', 'b', 'u', 'l', 'k',
+				    0x21, '\x90'};
+		reqs.append(req, sizeof(req));
+	}
+	int bulk_fd = connectProxy();
+	fail_unless(bulk_fd >= 0);
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	/* Connect the client to the instance before it gets busy. */
+	fail_unless(ping(fd, 0));
+	fail_unless(send(bulk_fd, reqs.data(), reqs.size(), 0) ==
+		    (ssize_t) reqs.size());
+	usleep(10 * SlowCallStage::SLOW_CALL_USEC);
+
+	auto start = std::chrono::steady_clock::now();
+	fail_unless(ping(fd, 1));
+	std::chrono::duration<double, std::micro> rtt =
+		std::chrono::steady_clock::now() - start;
+	/* Held CALLs are sent eventually, each is answered once. */
+	std::string resps = recvResponses(bulk_fd, NUM_CALLS);
+	Buf_t buf;
+	buf.write({resps.data(), resps.size()});
+	MessageDecoder<Buf_t> dec(buf);
+	std::vector<bool> replied(NUM_CALLS + 1);
+	for (size_t i = 0; i < NUM_CALLS; ++i) {
+		fail_unless(dec.decodeMessageSize() > 0);
+		Message<Buf_t> resp;
+		fail_unless(dec.decodeMessage(resp) == 0);
+		fail_unless(resp.header.code == Iproto::OK);
+		int id = resp.header.sync;
+		fail_unless(id >= 1 && id <= NUM_CALLS && !replied[id]);
+		replied[id] = true;
+	}
+
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	std::cout << "+  CALLS IN FLIGHT " << call_in_flight << std::endl;
+	std::cout << "+          PING RTT, US         " << rtt.count() << std::endl;
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	/* Otherwise PING waits for most of CALLs. */
+	if (call_in_flight != 0)
+		fail_unless(rtt.count() < NUM_CALLS / 2 *
+					  SlowCallStage::SLOW_CALL_USEC);
+
+	close(fd);
+	close(bulk_fd);
+	stopProcess(pid);
+	stopProcess(backend_pid);
+}
+
+/** Round trip of interactive client when each request is traced. */
+void
+testTracing(size_t sample_rate)
+{
+	TEST_INIT(1, (int) sample_rate);
+	ProxyOptions proxy_opts;
+	proxy_opts.trace_sample_rate = sample_rate;
+	/* Every traced request goes to the slow log. */
+	proxy_opts.slow_request_usec = 0;
+	pid_t pid = launchProxy(proxy_opts);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	std::vector<double> rtt;
+	for (size_t i = 0; i < NUM_PINGS; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		fail_unless(ping(fd, i));
+		std::chrono::duration<double, std::micro> spent =
+			std::chrono::steady_clock::now() - start;
+		rtt.push_back(spent.count());
+	}
+	std::sort(rtt.begin(), rtt.end());
+
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	std::cout << "+  TRACE SAMPLE RATE " << sample_rate << std::endl;
+	std::cout << "+          P50 RTT, US          " << rtt[NUM_PINGS / 2] << std::endl;
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+
+	close(fd);
+	stopProcess(pid);
+}
+
+int main()
+{
+	/* Both ends of each connection need a descriptor. */
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur < NUM_CONN + 128) {
+		std::cerr << "Too low limit of open files: " << rl.rlim_cur
+			  << std::endl;
+		return -1;
+	}
+	testIdleConnectionFootprint();
+	testFairScheduling();
+	testTracing(0);
+	testTracing(1);
+	testQos(0);
+	testQos(4);
+	return 0;
+}
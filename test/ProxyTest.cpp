@@ -0,0 +1,1980 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "Utils/Helpers.hpp"
+#include "Utils/ProxyHelpers.hpp"
+
+#include "../src/Client/TrafficCapture.hpp"
+
+#include <netinet/tcp.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <sstream>
+
+/** Requests sent by a client whose traffic is checked. */
+static constexpr size_t NUM_PINGS = 1000;
+
+/** Stage failing every request which reaches it. */
+struct FailStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &, Message<BUFFER> &, PipelineContext &)
+	{
+		return STAGE_ERR;
+	}
+};
+
+/** Request a stage failed is answered with an error. */
+void
+testStageError()
+{
+	TEST_INIT(0);
+	pid_t pid = launchPipeline<Pipeline<PingStage, FailStage>>(
+		ProxyOptions{}, port, {});
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+
+	/* CALL f() with sync 7. */
+	const char req[] = {'\xce', 0, 0, 0, 15,
+			    '\x82', 0x00, 0x0a, 0x01, '\xce', 0, 0, 0, 7,
+			    '\x82', 0x22, '\xa1', 'f', 0x21, '\x90'};
+	fail_unless(send(fd, req, sizeof(req), 0) == (ssize_t) sizeof(req));
+	std::string resp = recvResponses(fd, 1);
+	Buf_t buf;
+	buf.write({resp.data(), resp.size()});
+	MessageDecoder<Buf_t> dec(buf);
+	fail_unless(dec.decodeMessageSize() > 0);
+	Message<Buf_t> msg;
+	fail_unless(dec.decodeMessage(msg) == 0);
+	fail_unless(msg.header.sync == 7);
+	fail_unless(msg.header.code == (Iproto::TYPE_ERROR | PIPELINE_ERRCODE));
+	fail_unless(msg.body.error_stack.has_value());
+	/* The connection is still served. */
+	fail_unless(ping(fd, 8));
+
+	close(fd);
+	stopProcess(pid);
+}
+
+/**
+ * Instance implementing batch_apply(space_id, op, tuples): returns
+ * {id, batch size} for each tuple {id}, error for ids divisible by 10.
+ */
+struct BatchApplyStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		std::tuple<uint32_t, std::string, std::vector<std::vector<int>>> args;
+		if (message.header.code != Iproto::CALL ||
+		    message.body.function_name != "batch_apply" ||
+		    !message.body.tuple || !message.body.tuple->decode(args))
+			return STAGE_ERR;
+		auto &tuples = std::get<2>(args);
+		/* [[result, ...]], all numbers are less than 128. */
+		std::string results = "\x91";
+		internal::appendArrayHeader(results, tuples.size());
+		for (auto &tuple : tuples) {
+			if (tuple[0] % 10 == 0) {
+				results += "\xa3" "dup";
+				continue;
+			}
+			results.push_back('\x92');
+			results.push_back(tuple[0]);
+			results.push_back(tuples.size());
+		}
+		auto data = mpp::as_raw(results);
+		int size = proxy.createMessage(message.header.sync, 0, &data);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+struct TestBatchSpec {
+	static constexpr size_t BATCH_MAX = 16;
+	static constexpr const char *FUNCTION = "batch_apply";
+	static bool isBatched(uint32_t space_id) { return space_id == 512; }
+};
+
+/** Pipelined REPLACEs are applied in batches and replied one by one. */
+void
+testBatchWrites()
+{
+	TEST_INIT(0);
+	constexpr uint8_t NUM_WRITES = 100;
+	uint16_t backend_port = port + 1;
+	pid_t backend_pid = launchPipeline<Pipeline<BatchApplyStage>>(
+		ProxyOptions{}, backend_port, {});
+	fail_unless(backend_pid > 0);
+	std::vector<ConnectOptions> instances = {{
+		.address = localhost,
+		.service = std::to_string(backend_port),
+		.is_tnt = false,
+	}};
+	using Router_t = Pipeline<BatchWriteStage<TestBatchSpec>, ForwardStage>;
+	pid_t pid = launchPipeline<Router_t>(ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	/* REPLACE {id} into space 512 with sync id. */
+	std::string reqs;
+	for (uint8_t id = 1; id <= NUM_WRITES; ++id) {
+		const char req[] = {'\xce', 0, 0, 0, 17,
+				    '\x82', 0x00, 0x03, 0x01, '\xce', 0, 0, 0,
+				    (char) id,
+				    '\x82', 0x10, '\xcd', 0x02, 0x00, 0x21,
+				    '\x91', (char) id};
+		reqs.append(req, sizeof(req));
+	}
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	fail_unless(send(fd, reqs.data(), reqs.size(), 0) ==
+		    (ssize_t) reqs.size());
+	std::string resps = recvResponses(fd, NUM_WRITES);
+	close(fd);
+
+	Buf_t buf;
+	buf.write({resps.data(), resps.size()});
+	MessageDecoder<Buf_t> dec(buf);
+	std::vector<bool> replied(NUM_WRITES + 1);
+	size_t max_batch = 0;
+	for (size_t i = 0; i < NUM_WRITES; ++i) {
+		fail_unless(dec.decodeMessageSize() > 0);
+		Message<Buf_t> resp;
+		fail_unless(dec.decodeMessage(resp) == 0);
+		int id = resp.header.sync;
+		fail_unless(id >= 1 && id <= NUM_WRITES && !replied[id]);
+		replied[id] = true;
+		if (id % 10 == 0) {
+			fail_unless(resp.header.code ==
+				    (Iproto::TYPE_ERROR | 32));
+			fail_unless(resp.body.error_stack.has_value());
+			fail_unless((*resp.body.error_stack)[0].msg == "dup");
+			continue;
+		}
+		fail_unless(resp.header.code == Iproto::OK);
+		std::vector<std::vector<int>> data;
+		fail_unless(resp.body.data && resp.body.data->decode(data));
+		fail_unless(data.size() == 1 && data[0].size() == 2);
+		fail_unless(data[0][0] == id);
+		fail_unless(data[0][1] <= (int) TestBatchSpec::BATCH_MAX);
+		max_batch = std::max(max_batch, (size_t) data[0][1]);
+	}
+	/* All requests are received at once, so batches are full. */
+	fail_unless(max_batch == TestBatchSpec::BATCH_MAX);
+
+	stopProcess(pid);
+	stopProcess(backend_pid);
+}
+
+/** Index of an instance launched by the test, set before it is forked. */
+static int instance_index = 0;
+/** Size of the string returned by big functions. */
+static constexpr size_t BIG_DATA_SIZE = 256 * 1024;
+
+/**
+ * Instance of fan-out calls: functions containing "scores" return tuples
+ * {index, 100 - index} and {index + 10, index}, functions containing
+ * "big" return a large string, functions containing "fail" fail on
+ * instance 1, others return numbers {index * 10, index * 10 + 5}.
+ */
+struct FanOutInstanceStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		if (message.header.code != Iproto::CALL ||
+		    !message.body.function_name)
+			return STAGE_ERR;
+		const std::string &name = *message.body.function_name;
+		int sync = message.header.sync;
+		int size;
+		if (name.find("fail") != std::string::npos &&
+		    instance_index == 1) {
+			size = proxy.createError(sync, 0, 3, "fail");
+		} else if (name.find("scores") != std::string::npos) {
+			std::vector<std::tuple<int, int>> scores = {
+				{instance_index, 100 - instance_index},
+				{instance_index + 10, instance_index}};
+			size = proxy.createMessage(sync, 0, &scores);
+		} else if (name.find("big") != std::string::npos) {
+			std::vector<std::string> big = {
+				std::string(BIG_DATA_SIZE, 'b')};
+			size = proxy.createMessage(sync, 0, &big);
+		} else {
+			std::vector<int> numbers = {instance_index * 10,
+						    instance_index * 10 + 5};
+			size = proxy.createMessage(sync, 0, &numbers);
+		}
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+struct ScoreTuple {
+	int id = 0;
+	int score = 0;
+
+	static constexpr auto mpp = std::make_tuple(&ScoreTuple::id,
+						    &ScoreTuple::score);
+};
+
+/** Functions starting with @a PREFIX are reduced by @a R. */
+template<class R, const char *PREFIX>
+struct TestFanOutSpec {
+	using Reducer = R;
+	static bool isFanOut(const std::string &function_name)
+	{
+		return function_name.rfind(PREFIX, 0) == 0;
+	}
+};
+
+static constexpr char CONCAT_PREFIX[] = "concat";
+static constexpr char SUM_PREFIX[] = "sum";
+static constexpr char MIN_PREFIX[] = "min";
+static constexpr char MAX_PREFIX[] = "max";
+static constexpr char TOP_PREFIX[] = "top";
+
+using TestFanOut_t = Pipeline<
+	FanOutStage<TestFanOutSpec<ConcatReducer, CONCAT_PREFIX>>,
+	FanOutStage<TestFanOutSpec<SumReducer<int>, SUM_PREFIX>>,
+	FanOutStage<TestFanOutSpec<MinReducer<int>, MIN_PREFIX>>,
+	FanOutStage<TestFanOutSpec<MaxReducer<int>, MAX_PREFIX>>,
+	FanOutStage<TestFanOutSpec<TopNReducer<ScoreTuple, &ScoreTuple::score,
+					       2>, TOP_PREFIX>>>;
+
+/**
+ * CALL is sent to every instance and the client gets one reduced
+ * response; an error or a streamed response of an instance is sent to
+ * the client instead, a call no instance is reachable for fails.
+ */
+void
+testFanOut()
+{
+	TEST_INIT(0);
+	std::vector<ConnectOptions> instances;
+	std::vector<pid_t> backend_pids;
+	for (uint16_t i = 1; i <= 3; ++i) {
+		uint16_t backend_port = port + i;
+		instance_index = i - 1;
+		pid_t backend_pid =
+			launchPipeline<Pipeline<FanOutInstanceStage>>(
+				ProxyOptions{}, backend_port, {});
+		fail_unless(backend_pid > 0);
+		backend_pids.push_back(backend_pid);
+		instances.push_back({.address = localhost,
+				     .service = std::to_string(backend_port),
+				     .is_tnt = false});
+	}
+	ProxyOptions proxy_opts;
+	proxy_opts.cut_through_size = 16 * 1024;
+	pid_t pid = launchPipeline<TestFanOut_t>(proxy_opts, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	uint32_t sync = 0;
+	auto call = [&](const std::string &func) {
+		sync++;
+		return sendRequest<std::vector<int>>(
+			fd, encodeCallRequest(sync, func), sync);
+	};
+	std::vector<int> numbers = call("concat");
+	std::sort(numbers.begin(), numbers.end());
+	fail_unless(numbers == std::vector<int>({0, 5, 10, 15, 20, 25}));
+	fail_unless(call("sum") == std::vector<int>{75});
+	fail_unless(call("min") == std::vector<int>{0});
+	fail_unless(call("max") == std::vector<int>{25});
+	sync++;
+	auto top = sendRequest<std::vector<std::tuple<int, int>>>(
+		fd, encodeCallRequest(sync, "top_scores"), sync);
+	fail_unless(top == (std::vector<std::tuple<int, int>>{{0, 100},
+							       {1, 99}}));
+
+	/* Error of one instance is the response, the others are dropped. */
+	sync++;
+	std::string req = encodeCallRequest(sync, "concat_fail");
+	fail_unless(send(fd, req.data(), req.size(), 0) ==
+		    (ssize_t) req.size());
+	expectResponse(fd, sync, Iproto::TYPE_ERROR | 3);
+	fail_unless(call("sum") == std::vector<int>{75});
+
+	/* Streamed response is sent as is, the others are skipped. */
+	sync++;
+	auto big = sendRequest<std::vector<std::string>>(
+		fd, encodeCallRequest(sync, "concat_big"), sync);
+	fail_unless(big.size() == 1 &&
+		    big[0] == std::string(BIG_DATA_SIZE, 'b'));
+	fail_unless(call("sum") == std::vector<int>{75});
+	close(fd);
+	stopProcess(pid);
+	for (pid_t backend_pid : backend_pids)
+		stopProcess(backend_pid);
+
+	/* Instances are down. */
+	pid = launchPipeline<TestFanOut_t>(proxy_opts, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+	fd = connectProxy();
+	fail_unless(fd >= 0);
+	req = encodeCallRequest(1, "sum");
+	fail_unless(send(fd, req.data(), req.size(), 0) ==
+		    (ssize_t) req.size());
+	expectResponse(fd, 1, Iproto::TYPE_ERROR | PIPELINE_ERRCODE);
+	close(fd);
+	stopProcess(pid);
+}
+
+/**
+ * Replicates writes to 3 instances with quorum 2, answers CALL of
+ * quorum_stats with its counters and the number of writes in flight.
+ */
+struct TestQuorumStage : QuorumWriteStage {
+	TestQuorumStage() { setQuorum(2, 3); }
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &ctx)
+	{
+		if (!ctx.from_client || message.header.code != Iproto::CALL ||
+		    message.body.function_name != "quorum_stats")
+			return QuorumWriteStage::handle(proxy, message, ctx);
+		std::vector<size_t> stats = {write_count, quorum_failures,
+					     divergence_count, late_responses,
+					     pendingCount()};
+		int size = proxy.createMessage(message.header.sync, 0, &stats);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Write is acknowledged once 2 of 3 instances apply it, the third
+ * response is swallowed. Writes applied on some instances only are
+ * counted as divergent, writes which can't be sent to 2 instances fail.
+ */
+void
+testQuorumWrites()
+{
+	TEST_INIT(0);
+	constexpr size_t NUM_INSTANCES = 3;
+	std::vector<ConnectOptions> instances;
+	for (uint16_t i = 1; i <= NUM_INSTANCES; ++i) {
+		instances.push_back({.address = localhost,
+				     .service = std::to_string(port + i),
+				     .is_tnt = false});
+	}
+	pid_t pid = launchPipeline<Pipeline<TestQuorumStage>>(
+		ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	/*
+	 * The test plays the instances, it listens after the fork so that
+	 * closed listeners are not kept open by the proxy.
+	 */
+	std::vector<int> servers;
+	for (uint16_t i = 1; i <= NUM_INSTANCES; ++i)
+		servers.push_back(listenOn(port + i));
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	/* REPLACE {id} into space 512, return sync of the request. */
+	auto write = [&](uint32_t id) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		std::string req(enc.encodeReplace(std::make_tuple(id), 512),
+				'\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), req.size()});
+		/* Encoder numbers requests itself. */
+		MessageDecoder<Buf_t> dec(buf);
+		Message<Buf_t> msg;
+		fail_unless(dec.decodeMessageSize() > 0);
+		fail_unless(dec.decodeMessage(msg) == 0);
+		fail_unless(send(fd, req.data(), req.size(), 0) ==
+			    (ssize_t) req.size());
+		return (uint32_t) msg.header.sync;
+	};
+	std::vector<int> conns(NUM_INSTANCES, -1);
+	auto answer = [&](size_t instance, uint32_t sync, bool ok) {
+		recvResponses(conns[instance], 1);
+		std::string resp;
+		if (ok) {
+			resp = encodePacket(mpp::as_map(std::forward_as_tuple(
+				MPP_AS_CONST(Iproto::REQUEST_TYPE), 0,
+				MPP_AS_CONST(Iproto::SYNC), sync)),
+				mpp::as_map(std::make_tuple()));
+		} else {
+			resp = encodePacket(mpp::as_map(std::forward_as_tuple(
+				MPP_AS_CONST(Iproto::REQUEST_TYPE),
+				Iproto::TYPE_ERROR | 3,
+				MPP_AS_CONST(Iproto::SYNC), sync)),
+				mpp::as_map(std::forward_as_tuple(
+				MPP_AS_CONST(Iproto::ERROR_24), "fail")));
+		}
+		fail_unless(send(conns[instance], resp.data(), resp.size(),
+				 0) == (ssize_t) resp.size());
+	};
+
+	/* Acknowledged by 2 instances, the late one is swallowed. */
+	uint32_t sync = write(0);
+	for (size_t i = 0; i < NUM_INSTANCES; ++i) {
+		conns[i] = accept(servers[i], nullptr, nullptr);
+		fail_unless(conns[i] >= 0);
+	}
+	answer(0, sync, true);
+	answer(1, sync, true);
+	expectResponse(fd, sync, Iproto::OK);
+	answer(2, sync, true);
+
+	/* Failed on 2 instances, the second error is the response. */
+	sync = write(1);
+	answer(0, sync, true);
+	answer(1, sync, false);
+	answer(2, sync, false);
+	expectResponse(fd, sync, Iproto::TYPE_ERROR | 3);
+
+	/* Acknowledged, but failed on the late instance. */
+	sync = write(2);
+	answer(0, sync, true);
+	answer(1, sync, true);
+	expectResponse(fd, sync, Iproto::OK);
+	answer(2, sync, false);
+	usleep(SETTLE_USEC);
+	/* Write in flight is forgotten once its client is gone. */
+	write(3);
+
+	/* Only the first instance is reachable. */
+	for (size_t i = 1; i < NUM_INSTANCES; ++i)
+		close(servers[i]);
+	close(fd);
+	for (int conn : conns)
+		close(conn);
+	usleep(SETTLE_USEC);
+	fd = connectProxy();
+	fail_unless(fd >= 0);
+	sync = write(4);
+	expectResponse(fd, sync, Iproto::TYPE_ERROR | PIPELINE_ERRCODE);
+	conns[0] = accept(servers[0], nullptr, nullptr);
+	fail_unless(conns[0] >= 0);
+	answer(0, sync, true);
+	usleep(SETTLE_USEC);
+
+	/*
+	 * 5 writes, 2 quorum failures, 3 divergent writes, 2 late
+	 * responses, no writes in flight.
+	 */
+	auto stats = sendRequest<std::vector<size_t>>(
+		fd, encodeCallRequest(0, "quorum_stats"), 0);
+	fail_unless(stats == std::vector<size_t>({5, 2, 3, 2, 0}));
+	close(conns[0]);
+	close(servers[0]);
+	close(fd);
+	stopProcess(pid);
+}
+
+/** Instance storing tuples {key, value} of REPLACEs, SELECTed by key. */
+struct KeyValueStage {
+	std::map<int, int> m_Tuples;
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		std::vector<std::vector<int>> result;
+		std::vector<int> tuple;
+		if (message.header.code == Iproto::REPLACE &&
+		    message.body.tuple && message.body.tuple->decode(tuple) &&
+		    tuple.size() == 2) {
+			m_Tuples[tuple[0]] = tuple[1];
+			result.push_back(tuple);
+		} else if (message.header.code == Iproto::SELECT &&
+			   message.body.keys &&
+			   message.body.keys->decode(tuple) &&
+			   tuple.size() == 1) {
+			auto it = m_Tuples.find(tuple[0]);
+			if (it != m_Tuples.end())
+				result.push_back({it->first, it->second});
+		} else {
+			return STAGE_ERR;
+		}
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/** All keys are in one bucket. */
+struct TestReshardSpec {
+	static constexpr size_t BUCKET_COUNT = 1;
+
+	template<class BUFFER>
+	static std::optional<uint64_t> shardKey(Message<BUFFER> &)
+	{
+		return 0;
+	}
+};
+
+/** Router moving the bucket to instance 1 on CALL move() or finish(). */
+struct TestReshardRouter : ShardRouter<TestReshardSpec> {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &ctx)
+	{
+		if (!ctx.from_client || message.header.code != Iproto::CALL)
+			return ShardRouter::handle(proxy, message, ctx);
+		std::vector<size_t> result;
+		if (message.body.function_name == "move")
+			result.push_back(startMove(0, 1));
+		else if (message.body.function_name == "finish")
+			finishMoves();
+		result.insert(result.end(), {movingCount(), moved_count,
+					     dual_write_count,
+					     moving_read_count,
+					     fallback_count});
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Writes to a bucket in migration are applied on both instances, reads
+ * missing on the destination are served by the source.
+ */
+void
+testResharding()
+{
+	TEST_INIT(0);
+	std::vector<ConnectOptions> instances;
+	std::vector<pid_t> backend_pids;
+	for (uint16_t i = 1; i <= 2; ++i) {
+		uint16_t backend_port = port + i;
+		pid_t backend_pid = launchPipeline<Pipeline<KeyValueStage>>(
+			ProxyOptions{}, backend_port, {});
+		fail_unless(backend_pid > 0);
+		backend_pids.push_back(backend_pid);
+		instances.push_back({.address = localhost,
+				     .service = std::to_string(backend_port),
+				     .is_tnt = false});
+	}
+	using Router_t = Pipeline<TestReshardRouter, ForwardStage>;
+	pid_t pid = launchPipeline<Router_t>(ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	/* Header {TYPE: type, SYNC: 0} of request of @a size. */
+	auto header = [](char type, char size) {
+		return std::string{'\xce', 0, 0, 0, size, '\x82', 0x00, type,
+				   0x01, '\xce', 0, 0, 0, 0};
+	};
+	/* REPLACE {key, key * 10} into space 512. */
+	auto replace = [&](char key) {
+		return header(0x03, 19) +
+		       std::string{'\x82', 0x10, '\xcd', 0x02, 0x00, 0x21,
+				   '\x92', key, '\xcc', (char) (key * 10)};
+	};
+	/* SELECT from space 512 by key. */
+	auto select = [&](char key) {
+		return header(0x01, 17) +
+		       std::string{'\x82', 0x10, '\xcd', 0x02, 0x00, 0x20,
+				   '\x91', key};
+	};
+	/* CALL of admin function without arguments. */
+	auto call = [&](const char *func) {
+		std::string name(func);
+		return header(0x0a, (char) (14 + name.size())) +
+		       std::string{'\x82', 0x22, (char) (0xa0 | name.size())} +
+		       name + std::string{0x21, '\x90'};
+	};
+	using Tuples_t = std::vector<std::vector<int>>;
+	using Stats_t = std::vector<size_t>;
+	const Tuples_t key1 = {{1, 10}}, key2 = {{2, 20}}, none;
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	uint32_t sync = 0;
+	fail_unless(request<Tuples_t>(fd, replace(1), ++sync) == key1);
+	Stats_t stats = request<Stats_t>(fd, call("move"), ++sync);
+	fail_unless((stats == Stats_t{0, 1, 0, 0, 0, 0}));
+	fail_unless(request<Tuples_t>(fd, replace(2), ++sync) == key2);
+	/* Key 1 is on source only, key 2 is on both. */
+	fail_unless(request<Tuples_t>(fd, select(1), ++sync) == key1);
+	fail_unless(request<Tuples_t>(fd, select(2), ++sync) == key2);
+	fail_unless(request<Tuples_t>(fd, select(3), ++sync) == none);
+	stats = request<Stats_t>(fd, call("stats"), ++sync);
+	fail_unless((stats == Stats_t{1, 0, 1, 3, 2}));
+	stats = request<Stats_t>(fd, call("finish"), ++sync);
+	fail_unless((stats == Stats_t{0, 1, 1, 3, 2}));
+	/* Only the destination is read: key 1 was not copied to it. */
+	fail_unless(request<Tuples_t>(fd, select(1), ++sync) == none);
+	fail_unless(request<Tuples_t>(fd, select(2), ++sync) == key2);
+	close(fd);
+
+	stopProcess(pid);
+	for (pid_t backend_pid : backend_pids) {
+		stopProcess(backend_pid);
+	}
+}
+
+/** Tables T and "t" are sharded by column ID. */
+struct TestSqlSpec {
+	static constexpr size_t BUCKET_COUNT = 2;
+
+	template<class BUFFER>
+	static std::optional<uint64_t> shardKey(Message<BUFFER> &)
+	{
+		return std::nullopt;
+	}
+	static std::optional<std::string> shardColumn(const std::string &table)
+	{
+		if (table == "T" || table == "t")
+			return "ID";
+		return std::nullopt;
+	}
+};
+
+/** Shard key of @a sql, nullopt if it is not routed. */
+std::optional<int64_t>
+sqlKey(const std::string &sql)
+{
+	SqlStatement statement;
+	SqlParser::parse(sql, TestSqlSpec::shardColumn, statement);
+	if (statement.values.size() != 1)
+		return std::nullopt;
+	const SqlValue &value = statement.values[0];
+	/* Parameters are reported as negative keys. */
+	if (value.kind == SqlValue::SQL_PARAM)
+		return -1 - value.num;
+	if (value.kind == SqlValue::SQL_STR)
+		return value.str.size();
+	return value.num;
+}
+
+/** Predicates on shard column are found in various statements. */
+void
+testSqlParser()
+{
+	TEST_INIT(0);
+	fail_unless(sqlKey("SELECT * FROM t WHERE id = 1") == 1);
+	fail_unless(sqlKey("select a, b from T x where x.id=-5 and a > 1") == -5);
+	fail_unless(sqlKey("SELECT * FROM \"t\" WHERE \"ID\" == 'abc'") == 3);
+	fail_unless(sqlKey("SELECT (1, 2) FROM t WHERE a = ? AND id = ? LIMIT ?")
+		    == -2);
+	fail_unless(sqlKey("UPDATE t SET a = ?, b = 'x' WHERE id = ?") == -2);
+	fail_unless(sqlKey("DELETE FROM t -- comment\n WHERE id = 7;") == 7);
+	fail_unless(sqlKey("INSERT INTO t (a, id) VALUES (f(1, 2), 42)") == 42);
+	fail_unless(sqlKey("REPLACE INTO t (id, a) VALUES (?, ?)") == -1);
+	SqlStatement in;
+	SqlParser::parse("SELECT * FROM t WHERE id IN (1, ?, 'x') ORDER BY id",
+			 TestSqlSpec::shardColumn, in);
+	fail_unless(in.table == "T" && in.values.size() == 3);
+	/* Not routed to a single shard. */
+	fail_unless(!sqlKey("SELECT * FROM t WHERE id = 1 OR a = 2"));
+	fail_unless(!sqlKey("SELECT * FROM t WHERE id = 1 + 1"));
+	fail_unless(!sqlKey("SELECT * FROM t WHERE id > 1"));
+	fail_unless(!sqlKey("SELECT * FROM t, u WHERE id = 1"));
+	fail_unless(!sqlKey("SELECT * FROM t JOIN u ON a = b WHERE id = 1"));
+	fail_unless(!sqlKey("SELECT * FROM u WHERE id = 1"));
+	fail_unless(!sqlKey("SELECT * FROM t WHERE id = :id"));
+	fail_unless(!sqlKey("INSERT INTO t VALUES (1, 2)"));
+	fail_unless(!sqlKey("INSERT INTO t (id) VALUES (1), (2)"));
+	fail_unless(!sqlKey("SELECT * FROM t WHERE id IN (SELECT id FROM u)"));
+	fail_unless(!sqlKey("CREATE TABLE t (id INT PRIMARY KEY)"));
+}
+
+/** Instance replying to any request with its pid. */
+struct PidStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		std::vector<int> result = {getpid()};
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/** EXECUTE is sent to the instance owning its shard key. */
+void
+testSqlRouting()
+{
+	TEST_INIT(0);
+	std::vector<ConnectOptions> instances;
+	std::vector<pid_t> backend_pids;
+	for (uint16_t i = 1; i <= 2; ++i) {
+		uint16_t backend_port = port + i;
+		pid_t backend_pid = launchPipeline<Pipeline<PidStage>>(
+			ProxyOptions{}, backend_port, {});
+		fail_unless(backend_pid > 0);
+		backend_pids.push_back(backend_pid);
+		instances.push_back({.address = localhost,
+				     .service = std::to_string(backend_port),
+				     .is_tnt = false});
+	}
+	using Router_t = SqlShardRouter<TestSqlSpec>;
+	pid_t pid = launchPipeline<Pipeline<Router_t, ForwardStage>>(
+		ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	auto execute = [&](const std::string &sql, auto params) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		size_t size = enc.encodeExecute(sql, params);
+		std::string req(size, '\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), size});
+		MessageDecoder<Buf_t> dec(buf);
+		Message<Buf_t> msg;
+		fail_unless(dec.decodeMessageSize() > 0);
+		fail_unless(dec.decodeMessage(msg) == 0);
+		auto data = sendRequest<std::vector<int>>(fd, req,
+							  msg.header.sync);
+		fail_unless(data.size() == 1);
+		return data[0];
+	};
+	/* Buckets are spread evenly: bucket N is on instance N. */
+	auto owner = [&](uint64_t key) {
+		return backend_pids[Router_t::bucketOf(key)];
+	};
+	for (int key = 0; key < 10; ++key) {
+		fail_unless(execute("SELECT * FROM t WHERE id = " +
+				    std::to_string(key), std::make_tuple()) ==
+			    owner(key));
+		fail_unless(execute("UPDATE t SET a = ? WHERE id = ?",
+				    std::make_tuple(1, key)) == owner(key));
+	}
+	std::string name = "name";
+	fail_unless(execute("DELETE FROM t WHERE id = ?",
+			    std::make_tuple(name)) ==
+		    owner(std::hash<std::string>{}(name)));
+	/* Requests which are not routed go to the first instance. */
+	fail_unless(execute("SELECT * FROM t", std::make_tuple()) ==
+		    backend_pids[0]);
+	close(fd);
+
+	stopProcess(pid);
+	for (pid_t backend_pid : backend_pids) {
+		stopProcess(backend_pid);
+	}
+}
+
+/** Instance storing tuples {key, pid} for keys [0, 30) in an ordered index. */
+struct OrderedStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		std::vector<int> key;
+		if (message.header.code != Iproto::SELECT ||
+		    (message.body.keys && !message.body.keys->decode(key)))
+			return STAGE_ERR;
+		auto iterator = static_cast<IteratorType>(
+			message.body.iterator.value_or(EQ));
+		bool ascending = iterator != LT && iterator != LE &&
+				 iterator != REQ;
+		std::vector<std::vector<int>> result;
+		uint32_t offset = message.body.offset.value_or(0);
+		uint32_t limit = message.body.limit.value_or(UINT32_MAX);
+		for (int i = 0; i < 30 && result.size() < limit; ++i) {
+			int k = ascending ? i : 29 - i;
+			bool match = key.empty() || iterator == ALL ||
+				     (iterator == EQ && k == key[0]) ||
+				     (iterator == REQ && k == key[0]) ||
+				     (iterator == GE && k >= key[0]) ||
+				     (iterator == GT && k > key[0]) ||
+				     (iterator == LE && k <= key[0]) ||
+				     (iterator == LT && k < key[0]);
+			if (!match)
+				continue;
+			if (offset > 0)
+				offset--;
+			else
+				result.push_back({k, getpid()});
+		}
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Space 512 is split at 10 and 20 between instances 0, 1 and 0 again.
+ * Replies to CALL with the counters.
+ */
+struct TestRangeRouter : RangeRouter {
+	TestRangeRouter()
+	{
+		fail_unless(setRanges(512, {20, 10}, {0, 1, 0}) != 0);
+		fail_unless(setRanges(512, {10, 20}, {0, 1}) != 0);
+		fail_unless(setRanges(512, {10, 20}, {0, 1, 0}) == 0);
+	}
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &ctx)
+	{
+		if (!ctx.from_client || message.header.code != Iproto::CALL)
+			return RangeRouter::handle(proxy, message, ctx);
+		std::vector<size_t> result = {routed_count, scan_count,
+					      continuation_count,
+					      pruned_count, pendingCount()};
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Point SELECTs go to the owner of the key, scans visit only partitions
+ * following the key, in order, until LIMIT is reached.
+ */
+void
+testRangeRouting()
+{
+	TEST_INIT(0);
+	std::vector<ConnectOptions> instances;
+	std::vector<pid_t> backend_pids;
+	for (uint16_t i = 1; i <= 2; ++i) {
+		uint16_t backend_port = port + i;
+		pid_t backend_pid = launchPipeline<Pipeline<OrderedStage>>(
+			ProxyOptions{}, backend_port, {});
+		fail_unless(backend_pid > 0);
+		backend_pids.push_back(backend_pid);
+		instances.push_back({.address = localhost,
+				     .service = std::to_string(backend_port),
+				     .is_tnt = false});
+	}
+	using Router_t = Pipeline<TestRangeRouter, ForwardStage>;
+	pid_t pid = launchPipeline<Router_t>(ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	using Tuples_t = std::vector<std::vector<int>>;
+	uint32_t sync = 0;
+	auto select = [&](auto key, IteratorType iterator, uint32_t limit,
+			  uint32_t offset = 0) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		size_t size = enc.encodeSelect(++sync, key, 512, 0, limit,
+					       offset, iterator);
+		std::string req(size, '\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), size});
+		return sendRequest<Tuples_t>(fd, req, sync);
+	};
+	/* Tuples [from, to) in order of @a step and their owners. */
+	auto expected = [&](int from, int to, int step) {
+		Tuples_t tuples;
+		for (int k = from; k != to; k += step)
+			tuples.push_back({k, backend_pids[k / 10 == 1]});
+		return tuples;
+	};
+	fail_unless(select(std::make_tuple(15), EQ, 1) == expected(15, 16, 1));
+	fail_unless(select(std::make_tuple(25), REQ, 1) == expected(25, 26, 1));
+	fail_unless(select(std::make_tuple(), ALL, 100) == expected(0, 30, 1));
+	fail_unless(select(std::make_tuple(5), GE, 10) == expected(5, 15, 1));
+	fail_unless(select(std::make_tuple(15), LT, 8, 2) ==
+		    expected(12, 4, -1));
+	fail_unless(select(std::make_tuple(5), GT, 3, 10) ==
+		    expected(16, 19, 1));
+	/* Single partition is routed as is. */
+	fail_unless(select(std::make_tuple(25), GT, 10) == expected(26, 30, 1));
+	fail_unless(select(std::make_tuple(5), LE, 3, 1) == expected(4, 1, -1));
+	/* Scan is cut short as soon as LIMIT is reached. */
+	fail_unless(select(std::make_tuple(), EQ, 5) == expected(0, 5, 1));
+	fail_unless(select(std::make_tuple(), REQ, 12) ==
+		    expected(29, 17, -1));
+	auto stats = request<std::vector<size_t>>(
+		fd, std::string{'\xce', 0, 0, 0, 15, '\x82', 0x00, 0x0a, 0x01,
+				'\xce', 0, 0, 0, 0, '\x82', 0x22, '\xa1', 's',
+				0x21, '\x90'}, ++sync);
+	fail_unless((stats == std::vector<size_t>{4, 6, 6, 5, 0}));
+	close(fd);
+
+	stopProcess(pid);
+	for (pid_t backend_pid : backend_pids) {
+		stopProcess(backend_pid);
+	}
+}
+
+/**
+ * Instance with vclock {1: lsn}: REPLACE bumps the LSN, CALL sets it,
+ * EVAL returns the vclock and SELECT returns pid.
+ */
+struct VclockStage {
+	uint64_t m_Lsn = 0;
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		int size;
+		std::tuple<uint64_t> lsn;
+		if (message.header.code == Iproto::EVAL) {
+			std::vector<Vclock> result = {{{1, m_Lsn}}};
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		} else if (message.header.code == Iproto::REPLACE) {
+			std::vector<uint64_t> result = {++m_Lsn};
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		} else if (message.header.code == Iproto::CALL &&
+			   message.body.tuple &&
+			   message.body.tuple->decode(lsn)) {
+			m_Lsn = std::get<0>(lsn);
+			std::vector<uint64_t> result = {m_Lsn};
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		} else {
+			std::vector<int> result = {getpid()};
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		}
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/** Instance 0 is master, 1 is replica probed on every request. */
+struct TestReplicaRouter : ReplicaReadRouter {
+	TestReplicaRouter()
+	{
+		fail_unless(setReplicas(0, {0, 1}) != 0);
+		fail_unless(setReplicas(0, {1}) == 0);
+		setProbeInterval(0, 60 * 1000 * 1000);
+	}
+
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &ctx)
+	{
+		if (!ctx.from_client || message.header.code != Iproto::CALL)
+			return ReplicaReadRouter::handle(proxy, message, ctx);
+		std::vector<size_t> result = {replica_read_count,
+					      master_read_count,
+					      sessionCount()};
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Reads of a session go to the replica only once it has caught up with
+ * the last write of the session, reads of other sessions are not delayed.
+ */
+void
+testReadYourWrites()
+{
+	TEST_INIT(0);
+	std::vector<ConnectOptions> instances;
+	std::vector<pid_t> backend_pids;
+	for (uint16_t i = 1; i <= 2; ++i) {
+		uint16_t backend_port = port + i;
+		pid_t backend_pid = launchPipeline<Pipeline<VclockStage>>(
+			ProxyOptions{}, backend_port, {});
+		fail_unless(backend_pid > 0);
+		backend_pids.push_back(backend_pid);
+		instances.push_back({.address = localhost,
+				     .service = std::to_string(backend_port),
+				     .is_tnt = false});
+	}
+	using Router_t = Pipeline<TestReplicaRouter, ForwardStage>;
+	pid_t pid = launchPipeline<Router_t>(ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	int other_fd = connectProxy();
+	int replica_fd = connectProxy(port + 2);
+	fail_unless(fd >= 0 && other_fd >= 0 && replica_fd >= 0);
+	/* Send request made by @a encoder, return DATA of the response. */
+	auto send = [&](int client_fd, auto encoder) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		size_t size = encoder(enc);
+		std::string req(size, '\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), size});
+		MessageDecoder<Buf_t> dec(buf);
+		Message<Buf_t> msg;
+		fail_unless(dec.decodeMessageSize() > 0);
+		fail_unless(dec.decodeMessage(msg) == 0);
+		return sendRequest<std::vector<uint64_t>>(client_fd, req,
+							  msg.header.sync);
+	};
+	/* Return pid of the instance the read is served by. */
+	auto read = [&](int client_fd) {
+		auto data = send(client_fd, [](RequestEncoder<Buf_t> &enc) {
+			return enc.encodeSelect(std::make_tuple(1), 512);
+		});
+		fail_unless(data.size() == 1);
+		return (pid_t) data[0];
+	};
+	auto write = [&]() {
+		return send(fd, [](RequestEncoder<Buf_t> &enc) {
+			return enc.encodeReplace(std::make_tuple(1), 512);
+		});
+	};
+	auto setReplicaLsn = [&](uint64_t lsn) {
+		send(replica_fd, [&](RequestEncoder<Buf_t> &enc) {
+			return enc.encodeCall("lsn", std::make_tuple(lsn));
+		});
+	};
+	auto stats = [&]() {
+		return send(fd, [](RequestEncoder<Buf_t> &enc) {
+			return enc.encodeCall("stats", std::make_tuple());
+		});
+	};
+	pid_t master = backend_pids[0], replica = backend_pids[1];
+	/* Vclock of the replica is not known yet. */
+	fail_unless(read(fd) == master);
+	usleep(SETTLE_USEC / 10);
+	fail_unless(read(fd) == replica);
+	fail_unless(write() == std::vector<uint64_t>{1});
+	/* Replica is behind LSN 1 of the master. */
+	fail_unless(read(fd) == master);
+	usleep(SETTLE_USEC / 10);
+	fail_unless(read(fd) == master);
+	fail_unless(read(other_fd) == replica);
+	fail_unless((stats() == std::vector<uint64_t>{2, 3, 1}));
+	setReplicaLsn(1);
+	/* The change is seen by the next probe. */
+	fail_unless(read(fd) == master);
+	usleep(SETTLE_USEC / 10);
+	fail_unless(read(fd) == replica);
+	fail_unless((stats() == std::vector<uint64_t>{3, 4, 0}));
+	/* A read pipelined after a write is not served by the replica. */
+	Buf_t buf;
+	RequestEncoder<Buf_t> enc(buf);
+	size_t size = enc.encodeReplace(std::make_tuple(1), 512);
+	size += enc.encodeSelect(std::make_tuple(1), 512);
+	std::string reqs(size, '\0');
+	auto itr = buf.begin();
+	itr.get({reqs.data(), size});
+	fail_unless(::send(fd, reqs.data(), size, 0) == (ssize_t) size);
+	std::string resps = recvResponses(fd, 2);
+	Buf_t resp_buf;
+	resp_buf.write({resps.data(), resps.size()});
+	MessageDecoder<Buf_t> dec(resp_buf);
+	std::set<uint64_t> results;
+	for (size_t i = 0; i < 2; ++i) {
+		fail_unless(dec.decodeMessageSize() > 0);
+		Message<Buf_t> resp;
+		fail_unless(dec.decodeMessage(resp) == 0);
+		fail_unless(resp.header.code == Iproto::OK);
+		std::vector<uint64_t> data;
+		fail_unless(resp.body.data && resp.body.data->decode(data));
+		fail_unless(data.size() == 1);
+		results.insert(data[0]);
+	}
+	fail_unless((results == std::set<uint64_t>{2, (uint64_t) master}));
+	fail_unless((stats() == std::vector<uint64_t>{3, 5, 1}));
+	close(fd);
+	close(other_fd);
+	close(replica_fd);
+
+	stopProcess(pid);
+	for (pid_t backend_pid : backend_pids) {
+		stopProcess(backend_pid);
+	}
+}
+
+/**
+ * Instance returning tuples {k, "name k", k * 10, "blob"} for k in [1, 3]:
+ * SELECT returns all of them, CALL "rows" returns them as one value and
+ * CALL "one" returns the first tuple and a number. AUTH always succeeds.
+ */
+struct WideTupleStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		using Tuple_t = std::tuple<int, std::string, int, std::string>;
+		std::vector<Tuple_t> rows;
+		for (int k = 1; k <= 3; ++k)
+			rows.emplace_back(k, "name " + std::to_string(k),
+					  k * 10, std::string(1000, 'x'));
+		int size;
+		if (message.header.code == Iproto::SELECT) {
+			size = proxy.createMessage(message.header.sync, 0,
+						   &rows);
+		} else if (message.body.function_name == "rows") {
+			auto result = std::make_tuple(rows);
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		} else if (message.body.function_name == "one") {
+			auto result = std::make_tuple(rows[0], 42);
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		} else {
+			std::vector<int> result;
+			size = proxy.createMessage(message.header.sync, 0,
+						   &result);
+		}
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Space 512 is cut to fields 0 and 2, space 513 - to field 3 for user
+ * "mobile" only, results of function "rows" - to fields 1 and 7 (which
+ * doesn't exist), of function "one" - to field 0.
+ */
+struct TestProjectionStage : ProjectionStage {
+	TestProjectionStage()
+	{
+		ProjectionRule both;
+		both.space_id = 512;
+		both.function_name = "rows";
+		fail_unless(addRule(both) != 0);
+		fail_unless(addRule({512, std::nullopt, std::nullopt,
+				     {0, 2}}) == 0);
+		fail_unless(addRule({513, std::nullopt, "mobile", {3}}) == 0);
+		fail_unless(addRule({std::nullopt, "rows", std::nullopt,
+				     {1, 7}}) == 0);
+		fail_unless(addRule({std::nullopt, "one", std::nullopt,
+				     {0}}) == 0);
+	}
+};
+
+/** Responses to SELECTs and CALLs matching rules carry selected fields. */
+void
+testProjection()
+{
+	TEST_INIT(0);
+	uint16_t backend_port = port + 1;
+	pid_t backend_pid = launchPipeline<Pipeline<WideTupleStage>>(
+		ProxyOptions{}, backend_port, {});
+	fail_unless(backend_pid > 0);
+	std::vector<ConnectOptions> instances = {{
+		.address = localhost, .service = std::to_string(backend_port),
+		.is_tnt = false}};
+	using Router_t = Pipeline<TestProjectionStage, ForwardStage>;
+	pid_t pid = launchPipeline<Router_t>(ProxyOptions{}, port, instances);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	/* Send request made by @a encoder, return DATA of the response. */
+	auto exchange = [&](auto encoder, auto data) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		size_t size = encoder(enc);
+		std::string req(size, '\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), size});
+		MessageDecoder<Buf_t> dec(buf);
+		Message<Buf_t> msg;
+		fail_unless(dec.decodeMessageSize() > 0);
+		fail_unless(dec.decodeMessage(msg) == 0);
+		return sendRequest<decltype(data)>(fd, req, msg.header.sync);
+	};
+	auto select = [&](uint32_t space_id, auto data) {
+		return exchange([&](RequestEncoder<Buf_t> &enc) {
+			return enc.encodeSelect(std::make_tuple(), space_id,
+						0, UINT32_MAX, 0, ALL);
+		}, data);
+	};
+	auto call = [&](const char *func, auto data) {
+		return exchange([&](RequestEncoder<Buf_t> &enc) {
+			return enc.encodeCall(func, std::make_tuple());
+		}, data);
+	};
+	using Pairs_t = std::vector<std::tuple<int, int>>;
+	fail_unless((select(512, Pairs_t{}) ==
+		     Pairs_t{{1, 10}, {2, 20}, {3, 30}}));
+	/* Rule of space 513 is for another user. */
+	using Wide_t = std::vector<std::tuple<int, std::string, int,
+					      std::string>>;
+	fail_unless(select(513, Wide_t{}).size() == 3);
+	using Names_t = std::vector<std::tuple<std::string,
+					       std::optional<int>>>;
+	auto names = call("rows", std::tuple<Names_t>{});
+	fail_unless((std::get<0>(names) ==
+		     Names_t{{"name 1", std::nullopt}, {"name 2", std::nullopt},
+			     {"name 3", std::nullopt}}));
+	auto one = call("one", std::tuple<std::tuple<int>, int>{});
+	fail_unless(std::get<0>(std::get<0>(one)) == 1);
+	fail_unless(std::get<1>(one) == 42);
+	/* Greeting is not checked by the instance, AUTH has no sync. */
+	Greeting greeting{};
+	Buf_t auth_buf;
+	RequestEncoder<Buf_t> auth_enc(auth_buf);
+	std::string auth(auth_enc.encodeAuth("mobile", "secret", greeting),
+			 '\0');
+	auto auth_itr = auth_buf.begin();
+	auth_itr.get({auth.data(), auth.size()});
+	fail_unless(send(fd, auth.data(), auth.size(), 0) ==
+		    (ssize_t) auth.size());
+	recvResponses(fd, 1);
+	auto blobs = select(513, std::vector<std::tuple<std::string>>{});
+	fail_unless(blobs.size() == 3);
+	fail_unless(std::get<0>(blobs[0]) == std::string(1000, 'x'));
+	close(fd);
+
+	stopProcess(pid);
+	stopProcess(backend_pid);
+}
+
+/** Stage stopping the proxy on CALL, after replying to it. */
+struct StopStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		if (message.header.code != Iproto::CALL)
+			return STAGE_NEXT;
+		std::vector<int> result;
+		int size = proxy.createMessage(message.header.sync, 0, &result);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		proxy.stop();
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * Proxy polled by an outer epoll loop serves clients and leaves the loop
+ * once it is stopped.
+ */
+void
+testEmbeddedLoop()
+{
+	TEST_INIT(0);
+	pid_t ppid_before_fork = getpid();
+	pid_t pid = fork();
+	fail_unless(pid >= 0);
+	if (pid == 0) {
+		set_parent_death_signal(ppid_before_fork, "embedded proxy");
+		std::string addr = localhost;
+		ProxyConnector<Buf_t> proxy({}, addr, port);
+		Pipeline<StopStage, PingStage> handler;
+		if (proxy.listen() != 0)
+			exit(EXIT_FAILURE);
+		int loop_fd = epoll_create1(0);
+		struct epoll_event event{};
+		event.events = EPOLLIN;
+		epoll_ctl(loop_fd, EPOLL_CTL_ADD, proxy.getPollFd(), &event);
+		size_t polls = 0;
+		do {
+			epoll_wait(loop_fd, &event, 1, proxy.getPollTimeout());
+			polls++;
+		} while (proxy.poll(handler) >= 0);
+		/* Stopped proxy is not polled any more. */
+		if (!proxy.isStopped() || proxy.poll(handler, -1) != -1 ||
+		    polls < 2)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	for (size_t i = 0; i < 10; ++i) {
+		fail_unless(send(fd, PING_REQ, sizeof(PING_REQ), 0) ==
+			    (ssize_t) sizeof(PING_REQ));
+		recvResponses(fd, 1);
+	}
+	Buf_t buf;
+	RequestEncoder<Buf_t> enc(buf);
+	std::string stop(enc.encodeCall("stop", std::make_tuple()), '\0');
+	auto itr = buf.begin();
+	itr.get({stop.data(), stop.size()});
+	fail_unless(send(fd, stop.data(), stop.size(), 0) ==
+		    (ssize_t) stop.size());
+	recvResponses(fd, 1);
+	int status;
+	fail_unless(waitpid(pid, &status, 0) == pid);
+	fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+	close(fd);
+}
+
+/** Master of the cache, replicator authenticates with a password. */
+static constexpr uint16_t MASTER_PORT_OFFSET = 1;
+
+/** SELECTs of spaces 512 (key {0}) and 513 (key {1, 0}) are cached. */
+struct TestReplicaCache : ReplicaCache {
+	TestReplicaCache()
+	{
+		setMaster({.address = localhost,
+			   .service = std::to_string(port + MASTER_PORT_OFFSET),
+			   .user = "replicator",
+			   .passwd = "secret"});
+		addSpace(512);
+		addSpace(513, {1, 0});
+		setIntervals(0, 5000 * 1000, 0);
+	}
+};
+
+/** Answer SELECTs with tuple {0, "backend"} and PINGs with OK. */
+struct MarkerStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &)
+	{
+		int size;
+		if (message.header.code == Iproto::SELECT) {
+			std::vector<std::tuple<int, std::string>> marker = {
+				{0, "backend"}};
+			size = proxy.createMessage(message.header.sync, 0,
+						   &marker);
+		} else {
+			size = proxy.createMessage(message.header.sync, 0);
+		}
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * The test plays master of the proxy: SELECTs by primary key are answered
+ * from the snapshot and the rows streamed after it, others go to the
+ * backend. Broken subscription is resumed from the vclock of the cache.
+ */
+void
+testReplicaCache()
+{
+	TEST_INIT(0);
+	using Tuples_t = std::vector<std::tuple<int, std::string>>;
+	const Tuples_t marker = {{0, "backend"}};
+	int server = listenOn(port + MASTER_PORT_OFFSET);
+	using Cache_t = Pipeline<TestReplicaCache, MarkerStage>;
+	pid_t pid = launchPipeline<Cache_t>(ProxyOptions{}, port, {});
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+
+	uint32_t sync = 0;
+	auto select = [&](uint32_t space_id, auto key,
+			  IteratorType iterator = EQ) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		std::string req(enc.encodeSelect(++sync, key, space_id, 0,
+						 UINT32_MAX, 0, iterator),
+				'\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), req.size()});
+		return sendRequest<Tuples_t>(fd, req, sync);
+	};
+	auto poll = [&]() { fail_unless(ping(fd, ++sync)); };
+	/* Master reads requests of the cache one by one. */
+	int master = -1;
+	std::string input;
+	auto recvRequest = [&](Vclock *vclock = nullptr) {
+		while (true) {
+			if (input.size() >= MP_RESPONSE_SIZE) {
+				uint32_t size;
+				memcpy(&size, input.data() + 1, sizeof(size));
+				size = MP_RESPONSE_SIZE + ntohl(size);
+				if (input.size() >= size)
+					break;
+			}
+			char chunk[4096];
+			ssize_t rc = recv(master, chunk, sizeof(chunk), 0);
+			fail_unless(rc > 0);
+			input.append(chunk, rc);
+		}
+		Buf_t buf;
+		buf.write({input.data(), input.size()});
+		MessageDecoder<Buf_t> dec(buf);
+		int size = dec.decodeMessageSize();
+		fail_unless(size > 0);
+		Message<Buf_t> msg;
+		fail_unless(dec.decodeMessage(msg) == 0);
+		input.erase(0, MP_RESPONSE_SIZE + size);
+		if (vclock != nullptr) {
+			fail_unless(msg.body.vclock.has_value());
+			fail_unless(msg.body.vclock->decode(*vclock));
+		}
+		return msg.header.code;
+	};
+	auto send = [&](const std::string &packet) {
+		fail_unless(::send(master, packet.data(), packet.size(), 0) ==
+			    (ssize_t) packet.size());
+	};
+	auto ok = [&](const Vclock *vclock = nullptr) {
+		if (vclock == nullptr)
+			return encodePacket(mpp::as_map(std::forward_as_tuple(
+				MPP_AS_CONST(Iproto::REQUEST_TYPE), 0,
+				MPP_AS_CONST(Iproto::SYNC), 0)),
+				mpp::as_map(std::make_tuple()));
+		return encodePacket(mpp::as_map(std::forward_as_tuple(
+			MPP_AS_CONST(Iproto::REQUEST_TYPE), 0,
+			MPP_AS_CONST(Iproto::SYNC), 0)),
+			mpp::as_map(std::forward_as_tuple(
+			MPP_AS_CONST(Iproto::VCLOCK), *vclock)));
+	};
+	/*
+	 * Row of replica 1 with @a lsn changing @a value (tuple or key) of
+	 * @a space_id, the transaction ends unless @a tsn is set.
+	 */
+	auto row = [&](int code, uint64_t lsn, uint32_t space_id, auto value,
+		       uint64_t tsn = 0, uint32_t flags = 0) {
+		int field = code == Iproto::DELETE || code == Iproto::UPDATE ?
+			    Iproto::KEY : Iproto::TUPLE;
+		if (tsn == 0)
+			return encodePacket(mpp::as_map(std::forward_as_tuple(
+				MPP_AS_CONST(Iproto::REQUEST_TYPE), code,
+				MPP_AS_CONST(Iproto::REPLICA_ID), 1,
+				MPP_AS_CONST(Iproto::LSN), lsn)),
+				mpp::as_map(std::forward_as_tuple(
+				MPP_AS_CONST(Iproto::SPACE_ID), space_id,
+				field, value)));
+		return encodePacket(mpp::as_map(std::forward_as_tuple(
+			MPP_AS_CONST(Iproto::REQUEST_TYPE), code,
+			MPP_AS_CONST(Iproto::REPLICA_ID), 1,
+			MPP_AS_CONST(Iproto::LSN), lsn,
+			MPP_AS_CONST(Iproto::TSN), tsn,
+			MPP_AS_CONST(Iproto::FLAGS), flags)),
+			mpp::as_map(std::forward_as_tuple(
+			MPP_AS_CONST(Iproto::SPACE_ID), space_id,
+			field, value)));
+	};
+	/* Accept the cache, greet and authenticate it. */
+	auto accept = [&]() {
+		/* The cache connects with the next client traffic. */
+		poll();
+		master = ::accept(server, nullptr, nullptr);
+		fail_unless(master >= 0);
+		struct timeval timeout = {5, 0};
+		setsockopt(master, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		/* Rows are polled by the cache as soon as they are sent. */
+		int one = 1;
+		setsockopt(master, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		input.clear();
+		std::string line1 = "Tarantool 2.11.0 (Binary) "
+				    "8a5b3c29-2ff8-4d4b-9e3c-6d1f0ac8e3a1";
+		std::string line2(43, 'A');
+		line2 += '=';
+		line1.resize(Iproto::GREETING_LINE1_SIZE - 1, ' ');
+		line2.resize(Iproto::GREETING_LINE2_SIZE - 1, ' ');
+		send(line1 + "\n" + line2 + "\n");
+		poll();
+		fail_unless(recvRequest() == Iproto::AUTH);
+		send(ok());
+		poll();
+	};
+	/* Feed the cache until it acknowledges @a lsn. */
+	auto waitAck = [&](uint64_t lsn) {
+		Vclock vclock;
+		do {
+			poll();
+			fail_unless(recvRequest(&vclock) == Iproto::OK);
+		} while (vclock[1] < lsn);
+		fail_unless((vclock == Vclock{{1, lsn}}));
+	};
+
+	/* Reads go to the backend until the snapshot is fetched. */
+	fail_unless(select(512, std::make_tuple(1)) == marker);
+	accept();
+	fail_unless(recvRequest() == Iproto::FETCH_SNAPSHOT);
+	Vclock start = {{1, 10}};
+	/* Component 0 counts local writes of the master. */
+	Vclock end = {{0, 5}, {1, 10}};
+	send(ok(&start));
+	send(row(Iproto::INSERT, 0, 512, std::make_tuple(1, "one")));
+	send(row(Iproto::INSERT, 0, 512, std::make_tuple(2, "two")));
+	send(row(Iproto::INSERT, 0, 512, std::make_tuple(3, "three")));
+	send(row(Iproto::INSERT, 0, 513, std::make_tuple(1, "a")));
+	send(row(Iproto::INSERT, 0, 600, std::make_tuple(1, "x")));
+	send(ok(&end));
+	poll();
+	Vclock vclock;
+	fail_unless(recvRequest(&vclock) == Iproto::SUBSCRIBE);
+	fail_unless(vclock == start);
+	send(ok(&start));
+	waitAck(10);
+
+	fail_unless((select(512, std::make_tuple(1)) ==
+		     Tuples_t{{1, "one"}}));
+	fail_unless((select(512, std::make_tuple(3)) ==
+		     Tuples_t{{3, "three"}}));
+	fail_unless(select(512, std::make_tuple(7)).empty());
+	fail_unless((select(513, std::make_tuple("a", 1)) ==
+		     Tuples_t{{1, "a"}}));
+	fail_unless(select(513, std::make_tuple("a", 2)).empty());
+	fail_unless(select(513, std::make_tuple("a")) == marker);
+	fail_unless(select(600, std::make_tuple(1)) == marker);
+	fail_unless(select(512, std::make_tuple(1), GE) == marker);
+
+	/* Rows of a transaction are seen once it is committed. */
+	send(row(Iproto::REPLACE, 11, 512, std::make_tuple(2, "deux")));
+	send(row(Iproto::DELETE, 12, 512, std::make_tuple(3)));
+	send(row(Iproto::UPDATE, 13, 512, std::make_tuple(1)));
+	send(row(Iproto::REPLACE, 14, 512, std::make_tuple(4, "four"),
+		 14));
+	waitAck(14);
+	fail_unless((select(512, std::make_tuple(2)) ==
+		     Tuples_t{{2, "deux"}}));
+	fail_unless(select(512, std::make_tuple(3)).empty());
+	fail_unless(select(512, std::make_tuple(1)) == marker);
+	fail_unless(select(512, std::make_tuple(4)).empty());
+	send(row(Iproto::REPLACE, 15, 512, std::make_tuple(5, "five"),
+		 14, Iproto::FLAG_COMMIT));
+	waitAck(15);
+	fail_unless((select(512, std::make_tuple(4)) ==
+		     Tuples_t{{4, "four"}}));
+	fail_unless((select(512, std::make_tuple(5)) ==
+		     Tuples_t{{5, "five"}}));
+
+	/* Lost subscription is resumed from the vclock of the cache. */
+	close(master);
+	fail_unless(select(512, std::make_tuple(2)) == marker);
+	accept();
+	fail_unless(recvRequest(&vclock) == Iproto::SUBSCRIBE);
+	fail_unless((vclock == Vclock{{1, 15}}));
+	/* The master has no rows after it, the snapshot is fetched anew. */
+	send(encodePacket(mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::REQUEST_TYPE), Iproto::TYPE_ERROR | 1,
+		MPP_AS_CONST(Iproto::SYNC), 0)),
+		mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::ERROR_24), "Missing .xlog file"))));
+	fail_unless(select(512, std::make_tuple(2)) == marker);
+	close(master);
+	accept();
+	fail_unless(recvRequest() == Iproto::FETCH_SNAPSHOT);
+	close(master);
+	close(server);
+	close(fd);
+	stopProcess(pid);
+}
+
+#ifdef TNTCXX_ENABLE_ZLIB
+/**
+ * Edge proxy tunnels clients to core proxy over compressed streams:
+ * the tunnel carries less than clients send, and core proxy listening
+ * with compression serves clients of edge proxy as usual.
+ */
+void
+testCompressedTunnel()
+{
+	TEST_INIT(0);
+	constexpr size_t NUM_REQS = 200;
+	uint16_t core_port = port + 1;
+	std::vector<ConnectOptions> tunnel = {{
+		.address = localhost,
+		.service = std::to_string(core_port),
+		.compress_level = Z_BEST_SPEED,
+		.is_tnt = false,
+	}};
+	/* The test plays core proxy first. */
+	int server = listenOn(core_port);
+	pid_t pid = launchPipeline<Pipeline<ForwardStage>>(ProxyOptions{},
+							  port, tunnel);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	/* Requests are inflated by the core as they are sent by client. */
+	std::string reqs, resps;
+	for (uint32_t sync = 0; sync < NUM_REQS; ++sync) {
+		char req[sizeof(PING_REQ)];
+		memcpy(req, PING_REQ, sizeof(req));
+		uint32_t be_sync = htonl(sync);
+		memcpy(req + 10, &be_sync, sizeof(be_sync));
+		reqs.append(req, sizeof(req));
+		/* Response is the same but with IPROTO_OK type. */
+		req[7] = 0;
+		resps.append(req, sizeof(req));
+	}
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	fail_unless(send(fd, reqs.data(), reqs.size(), 0) ==
+		    (ssize_t) reqs.size());
+	int core = accept(server, nullptr, nullptr);
+	fail_unless(core >= 0);
+	close(server);
+	z_stream inflater{};
+	fail_unless(inflateInit(&inflater) == Z_OK);
+	std::string inflated(reqs.size(), '\0');
+	inflater.next_out = (Bytef *) inflated.data();
+	inflater.avail_out = inflated.size();
+	size_t wire = 0;
+	while (inflater.avail_out > 0) {
+		char chunk[4096];
+		ssize_t rc = recv(core, chunk, sizeof(chunk), 0);
+		fail_unless(rc > 0);
+		wire += rc;
+		inflater.next_in = (Bytef *) chunk;
+		inflater.avail_in = rc;
+		fail_unless(inflate(&inflater, Z_SYNC_FLUSH) == Z_OK);
+		fail_unless(inflater.avail_in == 0);
+	}
+	inflateEnd(&inflater);
+	fail_unless(inflated == reqs);
+	fail_unless(wire < reqs.size() / 2);
+
+	/* Responses are deflated by the core and inflated by the edge. */
+	z_stream deflater{};
+	fail_unless(deflateInit(&deflater, Z_BEST_SPEED) == Z_OK);
+	std::string deflated(deflateBound(&deflater, resps.size()) + 64, '\0');
+	deflater.next_in = (Bytef *) resps.data();
+	deflater.avail_in = resps.size();
+	deflater.next_out = (Bytef *) deflated.data();
+	deflater.avail_out = deflated.size();
+	fail_unless(deflate(&deflater, Z_SYNC_FLUSH) == Z_OK);
+	deflated.resize(deflated.size() - deflater.avail_out);
+	deflateEnd(&deflater);
+	fail_unless(send(core, deflated.data(), deflated.size(), 0) ==
+		    (ssize_t) deflated.size());
+	fail_unless(recvResponses(fd, NUM_REQS) == resps);
+	close(fd);
+	close(core);
+	stopProcess(pid);
+
+	/* Edge proxy to core proxy listening with compression. */
+	pid_t ppid_before_fork = getpid();
+	pid_t core_pid = fork();
+	fail_unless(core_pid >= 0);
+	if (core_pid == 0) {
+		set_parent_death_signal(ppid_before_fork, "core proxy");
+		ProxyConnector<Buf_t> proxy({});
+		proxy.addListener(tunnel[0]);
+		Pipeline<PingStage> handler;
+		proxy.start(handler);
+		exit(EXIT_FAILURE);
+	}
+	pid = launchPipeline<Pipeline<ForwardStage>>(ProxyOptions{}, port,
+						     tunnel);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+	int fds[2] = {connectProxy(), connectProxy()};
+	for (int client : fds) {
+		fail_unless(client >= 0);
+		fail_unless(send(client, reqs.data(), reqs.size(), 0) ==
+			    (ssize_t) reqs.size());
+	}
+	for (int client : fds) {
+		recvResponses(client, NUM_REQS);
+		for (uint32_t sync = 0; sync < NUM_REQS; ++sync)
+			fail_unless(ping(client, sync));
+		close(client);
+	}
+	stopProcess(pid);
+	stopProcess(core_pid);
+}
+#endif
+
+/** Clients of user "loader" are tunneled to the only instance. */
+struct TestTunnelSpec {
+	static constexpr int INSTANCE = 0;
+	static bool isTunneled(const std::string &user)
+	{
+		return user == "loader";
+	}
+};
+
+/** Answer CALL of tunnel_stats with bytes and messages tunneled. */
+struct TunnelStatsStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &ctx)
+	{
+		if (!ctx.from_client || message.header.code != Iproto::CALL ||
+		    message.body.function_name != "tunnel_stats")
+			return STAGE_NEXT;
+		std::vector<size_t> stats = {proxy.tunnel_bytes,
+					     proxy.tunnel_frames};
+		int size = proxy.createMessage(message.header.sync, 0, &stats);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/**
+ * After AUTH of a bulk user its traffic is spliced between the client
+ * and the instance as is. Throughput is compared with a client whose
+ * messages are decoded and routed.
+ */
+void
+testSpliceTunnel()
+{
+	TEST_INIT(0);
+	constexpr size_t NUM_REQS = 400;
+	constexpr size_t REQS_PER_WINDOW = 4;
+	static_assert(NUM_REQS % REQS_PER_WINDOW == 0);
+	uint16_t backend_port = port + 1;
+	std::vector<ConnectOptions> backend = {{
+		.address = localhost,
+		.service = std::to_string(backend_port),
+		.is_tnt = false,
+	}};
+	/* The test plays the instance. */
+	int server = listenOn(backend_port);
+	using Tunnel_t = Pipeline<TunnelStage<TestTunnelSpec>,
+				  TunnelStatsStage, ForwardStage>;
+	pid_t pid = launchPipeline<Tunnel_t>(ProxyOptions{}, port, backend);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	const uint32_t auth_sync = 7;
+	std::string auth = encodePacket(mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::REQUEST_TYPE), MPP_AS_CONST(Iproto::AUTH),
+		MPP_AS_CONST(Iproto::SYNC), auth_sync)),
+		mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::USER_NAME), "loader",
+		MPP_AS_CONST(Iproto::TUPLE),
+		std::make_tuple("chap-sha1", std::string(20, 'x')))));
+	std::string auth_ok = encodePacket(mpp::as_map(std::forward_as_tuple(
+		MPP_AS_CONST(Iproto::REQUEST_TYPE), 0,
+		MPP_AS_CONST(Iproto::SYNC), auth_sync)),
+		mpp::as_map(std::make_tuple()));
+	std::string reqs;
+	/* Offsets of windows of requests in reqs. */
+	std::vector<size_t> windows = {0};
+	const std::string payload(16 * 1024, 'p');
+	for (uint32_t sync = 0; sync < NUM_REQS; ++sync) {
+		Buf_t buf;
+		RequestEncoder<Buf_t> enc(buf);
+		std::string req(enc.encodeCall(sync, "load",
+					       std::make_tuple(payload)), '\0');
+		auto itr = buf.begin();
+		itr.get({req.data(), req.size()});
+		reqs += req;
+		if ((sync + 1) % REQS_PER_WINDOW == 0)
+			windows.push_back(reqs.size());
+	}
+	auto recvExactly = [](int fd, size_t size) {
+		std::string data(size, '\0');
+		size_t received = 0;
+		while (received < size) {
+			ssize_t rc = recv(fd, &data[received], size - received, 0);
+			fail_unless(rc > 0);
+			received += rc;
+		}
+		return data;
+	};
+	/*
+	 * Client sends requests in windows, the instance echoes them back
+	 * as its responses: a window fits socket buffers, so the routed
+	 * client is never blocked in the middle of a request. Return
+	 * seconds spent.
+	 */
+	auto echo = [&](int client, int instance) {
+		int one = 1;
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(instance, IPPROTO_TCP, TCP_NODELAY, &one,
+			   sizeof(one));
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 1; i < windows.size(); ++i) {
+			std::string part = reqs.substr(windows[i - 1],
+						       windows[i] - windows[i - 1]);
+			fail_unless(send(client, part.data(), part.size(), 0) ==
+				    (ssize_t) part.size());
+			fail_unless(recvExactly(instance, part.size()) == part);
+			fail_unless(send(instance, part.data(), part.size(),
+					 0) == (ssize_t) part.size());
+			fail_unless(recvExactly(client, part.size()) == part);
+		}
+		std::chrono::duration<double> spent =
+			std::chrono::steady_clock::now() - start;
+		return spent.count();
+	};
+
+	/* AUTH is routed as usual, the tunnel starts once it succeeds. */
+	int loader = connectProxy();
+	fail_unless(loader >= 0);
+	fail_unless(send(loader, auth.data(), auth.size(), 0) ==
+		    (ssize_t) auth.size());
+	int instance = accept(server, nullptr, nullptr);
+	fail_unless(instance >= 0);
+	fail_unless(recvExactly(instance, auth.size()) == auth);
+	fail_unless(send(instance, auth_ok.data(), auth_ok.size(), 0) ==
+		    (ssize_t) auth_ok.size());
+	fail_unless(recvExactly(loader, auth_ok.size()) == auth_ok);
+	double tunneled = echo(loader, instance);
+
+	/* Client of another user goes through the pipeline. */
+	int client = connectProxy();
+	fail_unless(client >= 0);
+	fail_unless(send(client, PING_REQ, sizeof(PING_REQ), 0) ==
+		    (ssize_t) sizeof(PING_REQ));
+	int routed_instance = accept(server, nullptr, nullptr);
+	fail_unless(routed_instance >= 0);
+	close(server);
+	std::string ping_req(PING_REQ, sizeof(PING_REQ));
+	fail_unless(recvExactly(routed_instance, ping_req.size()) == ping_req);
+	fail_unless(send(routed_instance, PING_REQ, sizeof(PING_REQ), 0) ==
+		    (ssize_t) sizeof(PING_REQ));
+	fail_unless(recvExactly(client, ping_req.size()) == ping_req);
+	double routed = echo(client, routed_instance);
+
+	/* Only the traffic after AUTH is tunneled. */
+	Buf_t buf;
+	RequestEncoder<Buf_t> enc(buf);
+	std::string stats_req(enc.encodeCall(1, "tunnel_stats",
+					     std::make_tuple()), '\0');
+	auto itr = buf.begin();
+	itr.get({stats_req.data(), stats_req.size()});
+	auto stats = sendRequest<std::vector<size_t>>(client, stats_req, 1);
+	fail_unless(stats.size() == 2);
+	fail_unless(stats[0] == 2 * reqs.size());
+	fail_unless(stats[1] == 2 * NUM_REQS);
+
+	double mb = 2.0 * reqs.size() / (1024 * 1024);
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+	std::cout << "+  SPLICE TUNNEL" << std::endl;
+	std::cout << "+          TUNNELED, MB/S       " << mb / tunneled << std::endl;
+	std::cout << "+          ROUTED, MB/S         " << mb / routed << std::endl;
+	std::cout << "++++++++++++++++++++++++++++++++++++++++++++++++++" << std::endl;
+
+	close(loader);
+	close(instance);
+	close(client);
+	close(routed_instance);
+	stopProcess(pid);
+}
+
+/** Slow log keeps the last slow requests in order. */
+void
+testSlowLog()
+{
+	TEST_INIT(0);
+	ProxyTracer tracer;
+	tracer.configure(1, 100, 4);
+	for (uint32_t i = 0; i < 10; ++i) {
+		fail_unless(tracer.sample());
+		RequestTrace trace;
+		trace.sync = i;
+		trace.at[TRACE_RECV] = 1000000;
+		/* Odd requests take 150 us, even ones 50 us. */
+		trace.at[TRACE_REPLIED] = 1000000 + (i % 2 ? 150000 : 50000);
+		tracer.finish(trace);
+	}
+	fail_unless(tracer.traced_count == 10);
+	fail_unless(tracer.slow_count == 5);
+	std::vector<RequestTrace> slow = tracer.slowRequests();
+	fail_unless(slow.size() == 4);
+	for (size_t i = 0; i < slow.size(); ++i) {
+		fail_unless(slow[i].sync == 3 + 2 * i);
+		fail_unless(slow[i].totalUsec() == 150);
+	}
+	std::ostringstream out;
+	slow[0].print(out);
+	fail_unless(out.str() == "sync=3 type=0 space=- instance=-1 "
+				 "total_us=150 decode_us=- route_us=- "
+				 "send_us=- backend_us=- reply_us=150");
+}
+
+/** Traffic of a client is recorded by the proxy as is. */
+void
+testTrafficCapture()
+{
+	TEST_INIT(0);
+	const char *path = "proxy_capture.bin";
+	TrafficCapture capture;
+	fail_unless(capture.open(path, 16 * 1024 * 1024) == 0);
+	ProxyOptions proxy_opts;
+	proxy_opts.capture = &capture;
+	/* The file is mapped shared, so the proxy records right into it. */
+	pid_t pid = launchProxy(proxy_opts);
+	fail_unless(pid > 0);
+	usleep(SETTLE_USEC);
+
+	int fd = connectProxy();
+	fail_unless(fd >= 0);
+	for (size_t i = 0; i < NUM_PINGS; ++i)
+		fail_unless(ping(fd, i));
+	close(fd);
+	usleep(SETTLE_USEC);
+	/* Frames recorded before the proxy is killed must be readable. */
+	stopProcess(pid);
+
+	CaptureReader reader;
+	fail_unless(reader.open(path) == 0);
+	size_t from_client = 0, to_client = 0;
+	std::string requests;
+	CaptureFrame frame;
+	while (reader.next(frame)) {
+		fail_unless(frame.conn_id == 1);
+		if (frame.direction == CAPTURE_FROM_CLIENT) {
+			from_client += frame.size;
+			requests.append(frame.data, frame.size);
+		} else {
+			to_client += frame.size;
+		}
+	}
+	fail_unless(from_client == NUM_PINGS * sizeof(PING_REQ));
+	fail_unless(to_client > 0);
+	fail_unless(memcmp(requests.data(), PING_REQ, sizeof(PING_REQ)) == 0);
+	reader.close();
+	unlink(path);
+}
+
+int main()
+{
+	testStageError();
+	testTrafficCapture();
+	testSlowLog();
+	testBatchWrites();
+	testFanOut();
+	testQuorumWrites();
+	testResharding();
+	testSqlParser();
+	testSqlRouting();
+	testRangeRouting();
+	testReadYourWrites();
+	testProjection();
+	testEmbeddedLoop();
+	testReplicaCache();
+	testSpliceTunnel();
+#ifdef TNTCXX_ENABLE_ZLIB
+	testCompressedTunnel();
+#endif
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2010-2020, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#pragma once
+
+#include "Helpers.hpp"
+#include "System.hpp"
+
+#include "../../src/Client/ProxyConnector.hpp"
+#include "../../src/Buffer/Buffer.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+static const char *localhost = "127.0.0.1";
+static uint16_t port = 3311;
+
+/** Pause to let the proxy process pending events. */
+static constexpr unsigned SETTLE_USEC = 500 * 1000;
+
+using Buf_t = tnt::Buffer<16 * 1024>;
+
+/** Answer PINGs in the proxy, so that no backend is needed. */
+struct PingStage {
+	template<class Proxy, class BUFFER>
+	StageStatus handle(Proxy &proxy, Message<BUFFER> &message,
+			   PipelineContext &ctx)
+	{
+		if (!ctx.from_client || message.header.code != Iproto::PING)
+			return STAGE_NEXT;
+		int size = proxy.createMessage(message.header.sync, 0);
+		proxy.sendEncodedToClient(size);
+		proxy.skipLastDecodedMessage(message.size);
+		return STAGE_DONE;
+	}
+};
+
+/** Resident set size of process @a pid in bytes. */
+inline size_t
+getRSS(pid_t pid)
+{
+	std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+	size_t total = 0, resident = 0;
+	statm >> total >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Run proxy listening on @a listen_port in a child process, messages are
+ * passed to Handler.
+ */
+template<class Handler>
+pid_t
+launchPipeline(const ProxyOptions &proxy_opts, uint16_t listen_port,
+	       const std::vector<ConnectOptions> &instances)
+{
+	pid_t ppid_before_fork = getpid();
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "Can't launch proxy: fork failed! %s",
+			strerror(errno));
+		return -1;
+	}
+	if (pid != 0)
+		return pid;
+	set_parent_death_signal(ppid_before_fork, "proxy");
+	std::string addr = localhost;
+	ProxyConnector<Buf_t> proxy(instances, addr, listen_port, proxy_opts);
+	Handler handler;
+	proxy.start(handler);
+	exit(EXIT_FAILURE);
+}
+
+inline pid_t
+launchProxy(const ProxyOptions &proxy_opts)
+{
+	return launchPipeline<Pipeline<PingStage>>(proxy_opts, port, {});
+}
+
+/* Size, header {IPROTO_REQUEST_TYPE: PING, IPROTO_SYNC: sync}, body {}. */
+static const char PING_REQ[] = {'\xce', 0, 0, 0, 10, '\x82', 0x00, 0x40, 0x01,
+				'\xce', 0, 0, 0, 0, '\x80'};
+
+/** Send PING request with @a sync, true if it is answered with OK. */
+inline bool
+ping(int fd, uint32_t sync)
+{
+	char req[sizeof(PING_REQ)];
+	memcpy(req, PING_REQ, sizeof(req));
+	uint32_t be_sync = htonl(sync);
+	memcpy(req + 10, &be_sync, sizeof(be_sync));
+	if (send(fd, req, sizeof(req), 0) != (ssize_t) sizeof(req))
+		return false;
+	char resp[256];
+	ssize_t size = recv(fd, resp, sizeof(resp), 0);
+	if (size <= 0)
+		return false;
+	Buf_t buf;
+	buf.write({resp, (size_t) size});
+	MessageDecoder<Buf_t> dec(buf);
+	Message<Buf_t> msg;
+	return dec.decodeMessageSize() + (ssize_t) MP_RESPONSE_SIZE == size &&
+	       dec.decodeMessage(msg) == 0 &&
+	       msg.header.code == Iproto::OK && msg.header.sync == (int) sync;
+}
+
+inline int
+connectProxy(uint16_t proxy_port = port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(proxy_port);
+	addr.sin_addr.s_addr = inet_addr(localhost);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Receive @a count whole responses, return them as is. */
+inline std::string
+recvResponses(int fd, size_t count)
+{
+	std::string resps;
+	size_t received = 0, pos = 0;
+	while (received < count) {
+		char chunk[4096];
+		ssize_t rc = recv(fd, chunk, sizeof(chunk), 0);
+		fail_unless(rc > 0);
+		resps.append(chunk, rc);
+		while (resps.size() - pos >= MP_RESPONSE_SIZE) {
+			uint32_t size;
+			memcpy(&size, resps.data() + pos + 1, sizeof(size));
+			size = MP_RESPONSE_SIZE + ntohl(size);
+			if (resps.size() - pos < size)
+				break;
+			pos += size;
+			received++;
+		}
+	}
+	fail_unless(pos == resps.size());
+	return resps;
+}
+
+/** Send encoded request @a req, return DATA of the response. */
+template<class T>
+T
+sendRequest(int fd, const std::string &req, uint32_t sync)
+{
+	fail_unless(send(fd, req.data(), req.size(), 0) ==
+		    (ssize_t) req.size());
+	std::string resp = recvResponses(fd, 1);
+	Buf_t buf;
+	buf.write({resp.data(), resp.size()});
+	MessageDecoder<Buf_t> dec(buf);
+	fail_unless(dec.decodeMessageSize() > 0);
+	Message<Buf_t> msg;
+	fail_unless(dec.decodeMessage(msg) == 0);
+	fail_unless(msg.header.sync == (int) sync);
+	fail_unless(msg.header.code == Iproto::OK);
+	T data;
+	fail_unless(msg.body.data && msg.body.data->decode(data));
+	return data;
+}
+
+/** Send request @a req with sync @a sync, return DATA of the response. */
+template<class T>
+T
+request(int fd, std::string req, uint32_t sync)
+{
+	uint32_t be_sync = htonl(sync);
+	memcpy(&req[10], &be_sync, sizeof(be_sync));
+	return sendRequest<T>(fd, req, sync);
+}
+
+/** Encode CALL of @a func without arguments with sync @a sync. */
+inline std::string
+encodeCallRequest(uint32_t sync, const std::string &func)
+{
+	Buf_t buf;
+	RequestEncoder<Buf_t> enc(buf);
+	std::string req(enc.encodeCall(sync, func, std::make_tuple()), '\0');
+	auto itr = buf.begin();
+	itr.get({req.data(), req.size()});
+	return req;
+}
+
+/** Receive one response, check that it has @a sync and @a code. */
+inline void
+expectResponse(int fd, uint32_t sync, uint32_t code)
+{
+	std::string resp = recvResponses(fd, 1);
+	Buf_t buf;
+	buf.write({resp.data(), resp.size()});
+	MessageDecoder<Buf_t> dec(buf);
+	fail_unless(dec.decodeMessageSize() > 0);
+	Message<Buf_t> msg;
+	fail_unless(dec.decodeMessage(msg) == 0);
+	fail_unless(msg.header.sync == (int) sync);
+	fail_unless(msg.header.code == (int) code);
+}
+
+/** Listen on @a listen_port, return the socket. */
+inline int
+listenOn(uint16_t listen_port)
+{
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	fail_unless(server >= 0);
+	int one = 1;
+	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(listen_port);
+	addr.sin_addr.s_addr = inet_addr(localhost);
+	fail_unless(bind(server, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+	fail_unless(listen(server, 1) == 0);
+	return server;
+}
+
+/** Encode iproto packet of @a header and @a body. */
+template<class H, class B>
+std::string
+encodePacket(const H &header, const B &body)
+{
+	Buf_t buf;
+	mpp::encode(buf, header);
+	mpp::encode(buf, body);
+	size_t size = buf.end() - buf.begin();
+	std::string packet(MP_RESPONSE_SIZE + size, '\0');
+	packet[0] = '\xce';
+	uint32_t be_size = htonl(size);
+	memcpy(&packet[1], &be_size, sizeof(be_size));
+	auto itr = buf.begin();
+	itr.get({&packet[MP_RESPONSE_SIZE], size});
+	return packet;
+}
+
+/** Terminate child process @a pid and reap it. */
+inline void
+stopProcess(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, nullptr, 0);
+}